@@ -0,0 +1,180 @@
+//
+//  MelissaAnalysisPipeline.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include "MelissaAnalysisCache.h"
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaDataSource.h"
+
+MelissaAnalysisPipeline MelissaAnalysisPipeline::instance_;
+
+namespace
+{
+// 128 KB per stereo part. A multiple of the frame sizes of the analyzers (256, 512).
+constexpr size_t kBlockLength = 1 << 14;
+constexpr int kMaxNumOfWorkers = 8;
+
+// Calls function(index) for [0, count), on this thread and the pool (if any), and waits for all of them
+void runInParallel(ThreadPool* threadPool, int count, const std::function<void(int)>& function)
+{
+    if (threadPool == nullptr || count <= 1)
+    {
+        for (int index = 0; index < count; ++index) function(index);
+        return;
+    }
+    
+    std::atomic<int> numOfRemainingJobs(count);
+    WaitableEvent finished;
+    auto job = [&](int index)
+    {
+        function(index);
+        if (--numOfRemainingJobs == 0) finished.signal();
+    };
+    
+    for (int index = 1; index < count; ++index) threadPool->addJob([&job, index]() { job(index); });
+    job(0);
+    finished.wait();
+}
+};
+
+MelissaAnalysisPipeline::MelissaAnalysisPipeline() :
+Thread("MelissaAnalysisPipelineThread")
+{
+}
+
+MelissaAnalysisPipeline::~MelissaAnalysisPipeline()
+{
+    // The analyzers poll their cancel flags, so the thread is waited for without a time out
+    cancel();
+    stopThread(-1);
+}
+
+void MelissaAnalysisPipeline::request(std::shared_ptr<MelissaAnalyzer> analyzer)
+{
+    const ScopedLock sl(lock_);
+    requestedAnalyzers_.emplace_back(analyzer);
+    triggerAsyncUpdate();
+}
+
+void MelissaAnalysisPipeline::cancel()
+{
+    const ScopedLock sl(lock_);
+    for (auto&& analyzer : requestedAnalyzers_) analyzer->cancel();
+    requestedAnalyzers_.clear();
+    for (auto&& analyzer : runningAnalyzers_) analyzer->cancel();
+}
+
+void MelissaAnalysisPipeline::removeAnalyzer(const std::shared_ptr<MelissaAnalyzer>& analyzer)
+{
+    analyzer->cancel();
+    {
+        const ScopedLock sl(lock_);
+        requestedAnalyzers_.erase(std::remove(requestedAnalyzers_.begin(), requestedAnalyzers_.end(), analyzer), requestedAnalyzers_.end());
+    }
+    
+    while (true)
+    {
+        {
+            const ScopedLock sl(lock_);
+            if (std::find(runningAnalyzers_.begin(), runningAnalyzers_.end(), analyzer.get()) == runningAnalyzers_.end()) return;
+        }
+        analyzerReleased_.wait(10);
+    }
+}
+
+void MelissaAnalysisPipeline::release(MelissaAnalyzer* analyzer)
+{
+    {
+        const ScopedLock sl(lock_);
+        runningAnalyzers_.erase(std::remove(runningAnalyzers_.begin(), runningAnalyzers_.end(), analyzer), runningAnalyzers_.end());
+    }
+    analyzerReleased_.signal();
+}
+
+void MelissaAnalysisPipeline::handleAsyncUpdate()
+{
+    if (!isThreadRunning()) startThread();
+    notify();
+}
+
+void MelissaAnalysisPipeline::run()
+{
+    while (!threadShouldExit())
+    {
+        std::vector<std::shared_ptr<MelissaAnalyzer>> analyzers;
+        {
+            const ScopedLock sl(lock_);
+            analyzers.swap(requestedAnalyzers_);
+            for (auto&& analyzer : analyzers) runningAnalyzers_.emplace_back(analyzer.get());
+        }
+        
+        if (analyzers.empty())
+        {
+            wait(-1);
+            continue;
+        }
+        
+        runPass(analyzers);
+        for (auto&& analyzer : analyzers) release(analyzer.get());
+    }
+}
+
+void MelissaAnalysisPipeline::runPass(std::vector<std::shared_ptr<MelissaAnalyzer>>& analyzers)
+{
+    auto dataSource = MelissaDataSource::getInstance();
+    const auto fingerprint = MelissaAnalysisCache::getInstance()->getFingerprint();
+    const double sampleRate = dataSource->getSampleRate();
+    const size_t bufferLength = dataSource->getBufferLength();
+    
+    // Only the analyzers which need the samples take part in the pass
+    analyzers.erase(std::remove_if(analyzers.begin(), analyzers.end(), [&](auto& analyzer) {
+        if (analyzer->isCancelled() || !analyzer->prepare(fingerprint, sampleRate, bufferLength))
+        {
+            release(analyzer.get());
+            return true;
+        }
+        return false;
+    }), analyzers.end());
+    if (analyzers.empty()) return;
+    
+    // Each part is read once for all the analyzers of the part
+    std::map<StemType, AudioSampleBuffer> blocks;
+    for (auto&& analyzer : analyzers)
+    {
+        if (blocks.find(analyzer->getPart()) == blocks.end()) blocks[analyzer->getPart()].setSize(2, static_cast<int>(kBlockLength));
+    }
+    
+    const int numOfAnalyzers = static_cast<int>(analyzers.size());
+    const int numOfWorkers = jlimit(1, kMaxNumOfWorkers, std::min(SystemStats::getNumCpus(), numOfAnalyzers));
+    std::unique_ptr<ThreadPool> threadPool;
+    if (1 < numOfWorkers) threadPool = std::make_unique<ThreadPool>(numOfWorkers - 1);
+    
+    // A cancelled analyzer is released as soon as its job has done with it, so that removeAnalyzer() waits only for it
+    auto isAllCancelled = [&]() { return std::all_of(analyzers.begin(), analyzers.end(), [](auto& analyzer) { return analyzer->isCancelled(); }); };
+    for (size_t startIndex = 0; startIndex < bufferLength; startIndex += kBlockLength)
+    {
+        if (threadShouldExit() || isAllCancelled()) return;
+        
+        const size_t length = std::min(kBlockLength, bufferLength - startIndex);
+        for (auto&& block : blocks) dataSource->readBufferBlock(block.second, startIndex, block.first);
+        
+        runInParallel(threadPool.get(), numOfAnalyzers, [&](int analyzerIndex) {
+            auto& analyzer = analyzers[analyzerIndex];
+            if (!analyzer->isCancelled()) analyzer->process(blocks.at(analyzer->getPart()), startIndex, length);
+            if (analyzer->isCancelled()) release(analyzer.get());
+        });
+    }
+    
+    runInParallel(threadPool.get(), numOfAnalyzers, [&](int analyzerIndex) {
+        auto& analyzer = analyzers[analyzerIndex];
+        if (!analyzer->isCancelled()) analyzer->finish();
+        release(analyzer.get());
+    });
+}
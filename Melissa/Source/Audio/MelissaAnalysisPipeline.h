@@ -0,0 +1,61 @@
+//
+//  MelissaAnalysisPipeline.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaAnalyzer.h"
+
+// Reads the loaded song once, in blocks small enough to stay in the CPU cache, and hands each block
+// to all the requested analyzers, which process it in parallel on a thread pool.
+// The analyzers requested until the message loop comes back are run in the same pass.
+// Those requested while a pass is running are run in the next one.
+// The thread is never stopped from outside: a cancelled analyzer is dropped from the pass at its next block.
+class MelissaAnalysisPipeline : public Thread,
+                                private AsyncUpdater
+{
+public:
+    void request(std::shared_ptr<MelissaAnalyzer> analyzer);
+    
+    // Cancels all the requested and running analyzers without waiting for them. Called when the song is changed.
+    void cancel();
+    
+    // Cancels the analyzer and waits until the pass doesn't use it any more, which is at most the rest of its block.
+    // The other analyzers go on.
+    void removeAnalyzer(const std::shared_ptr<MelissaAnalyzer>& analyzer);
+    
+    // Singleton
+    static MelissaAnalysisPipeline* getInstance() { return &instance_; }
+    MelissaAnalysisPipeline(const MelissaAnalysisPipeline&) = delete;
+    MelissaAnalysisPipeline& operator=(const MelissaAnalysisPipeline&) = delete;
+    MelissaAnalysisPipeline(MelissaAnalysisPipeline&&) = delete;
+    MelissaAnalysisPipeline& operator=(MelissaAnalysisPipeline&&) = delete;
+    
+private:
+    // Singleton
+    MelissaAnalysisPipeline();
+    ~MelissaAnalysisPipeline();
+    static MelissaAnalysisPipeline instance_;
+    
+    // AsyncUpdater
+    void handleAsyncUpdate() override;
+    
+    // Thread
+    void run() override;
+    
+    void runPass(std::vector<std::shared_ptr<MelissaAnalyzer>>& analyzers);
+    
+    // Called by the pass when it has done with a cancelled analyzer
+    void release(MelissaAnalyzer* analyzer);
+    
+    CriticalSection lock_;
+    std::vector<std::shared_ptr<MelissaAnalyzer>> requestedAnalyzers_;
+    std::vector<MelissaAnalyzer*> runningAnalyzers_;
+    WaitableEvent analyzerReleased_;
+};
@@ -0,0 +1,41 @@
+//
+//  MelissaAnalyzer.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <atomic>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaDefinitions.h"
+
+// An analysis of the whole song, run by MelissaAnalysisPipeline.
+// All the analyzers of a pass are fed with the same blocks, so the song is read only once for all of them.
+class MelissaAnalyzer
+{
+public:
+    MelissaAnalyzer() : isCancelled_(false) { }
+    virtual ~MelissaAnalyzer() { }
+    
+    // Part of the song to be fed
+    virtual StemType getPart() const { return kStemType_All; }
+    
+    // Called before the first block. Returns false if no block is needed,
+    // e.g. the result has been read from the analysis cache.
+    virtual bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) = 0;
+    
+    // Consecutive blocks from the beginning of the song. Never called concurrently for one analyzer.
+    virtual void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) = 0;
+    
+    // Called after the last block, unless the analyzer has been cancelled
+    virtual void finish() = 0;
+    
+    // Set from the message thread. A long process() or finish() polls it to return early.
+    void cancel() { isCancelled_ = true; }
+    bool isCancelled() const { return isCancelled_; }
+    
+private:
+    std::atomic<bool> isCancelled_;
+};
@@ -5,23 +5,36 @@
 //  Copyright(c) 2020 Masaki Ono
 //
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <iostream>
 #include <limits.h>
 #include <sstream>
 #include "MelissaAudioEngine.h"
 #include "MelissaDataSource.h"
+#include "MelissaLoudness.h"
 #include "MelissaModel.h"
 #include "MelissaUtility.h"
 
 using std::make_unique;
 
+namespace
+{
+// The normalization gain glides in when the loudness of the song is measured
+constexpr float kNormalizationRampMSec = 50.f;
+constexpr float kVolumeRampMSec = 20.f;
+};
+
 class MelissaAudioEngine::SampleIndexStretcher
 {
 public:
     SampleIndexStretcher() :
     readIndex_(0.f),
-    speed_(1.f)
+    speed_(1.f),
+    nextSpeed_(1.f),
+    speedChangeIndex_(0),
+    hasSpeedChange_(false)
     {
     }
     
@@ -30,6 +43,7 @@ public:
         std::lock_guard<std::mutex> lock(queMutex_);
         readIndex_ = 0;
         que_.clear();
+        hasSpeedChange_ = false;
     }
     
     void setSpeed(float speed)
@@ -38,6 +52,16 @@ public:
         speed_ = speed;
         readIndex_ = 0;
         que_.clear();
+        hasSpeedChange_ = false;
+    }
+    
+    // The indices in the queue keep the current speed, the ones put after this are read at the new speed
+    void changeSpeedAfterQueue(float speed)
+    {
+        std::lock_guard<std::mutex> lock(queMutex_);
+        nextSpeed_ = speed;
+        speedChangeIndex_ = que_.size();
+        hasSpeedChange_ = true;
     }
     
     void putSampleIndex(size_t sampleIndex)
@@ -56,7 +80,7 @@ public:
         return (readIndex_ + length * speed_) < que_.size();
     }
     
-    void getStretchedSampleIndices(size_t length, std::deque<float>& stretchedSampleIndex)
+    void getStretchedSampleIndices(size_t length, std::deque<size_t>& stretchedSampleIndex)
     {
         std::lock_guard<std::mutex> lock(queMutex_);
 
@@ -64,6 +88,11 @@ public:
         
         for (size_t index = 0; index < length; ++index)
         {
+            if (hasSpeedChange_ && speedChangeIndex_ <= readIndex_)
+            {
+                speed_ = nextSpeed_;
+                hasSpeedChange_ = false;
+            }
             stretchedSampleIndex.push_back(que_[static_cast<size_t>(readIndex_)]);
             readIndex_ += speed_;
         }
@@ -73,6 +102,7 @@ public:
         {
             que_.erase(que_.begin(), que_.begin() + numOfSamplesToDelete);
             readIndex_ -= numOfSamplesToDelete;
+            if (hasSpeedChange_) speedChangeIndex_ -= std::min(numOfSamplesToDelete, speedChangeIndex_);
         }
     }
     
@@ -81,6 +111,9 @@ private:
     std::deque<size_t> que_;
     float readIndex_;
     float speed_;
+    float nextSpeed_;
+    size_t speedChangeIndex_;
+    bool hasSpeedChange_;
 
     float prevReadIndex_;
     float prevSpeed_;
@@ -88,107 +121,352 @@ private:
     size_t prevQueSize_;
 };
 
-class MelissaAudioEngine::Equalizer
+// Cascade of RBJ biquads. The parameters are set from the message thread and picked up by the audio thread.
+// A parameter change glides in per sub-block, and the coefficients are only recomputed while gliding.
+class MelissaAudioEngine::Equalizer : public MelissaDSPNodeBase<Equalizer>
 {
 public:
     Equalizer() :
-    shouldUpdateCoefs_(true)
+    enabled_(false),
+    sampleRate_(48000.f),
+    shouldUpdate_(true),
+    currentSampleRate_(0.f)
     {
-        sampleRate_ = 48000;
-        freq_ = 500;
-        q_ = 7.f;
-        gainDb_ = 0.f;
+        for (size_t bandIndex = 0; bandIndex < kEqNumOfBands; ++bandIndex)
+        {
+            auto& target = targets_[bandIndex];
+            target.freq_ = kEqDefaultFreqs[bandIndex];
+            target.gainDb_ = 0.f;
+            target.q_ = 1.f;
+            target.type_ = kEqType_Peak;
+            
+            auto& band = bands_[bandIndex];
+            band.type_ = kEqType_Peak;
+            band.logFreq_ = band.targetLogFreq_ = std::log(kEqDefaultFreqs[bandIndex]);
+            band.gainDb_ = band.targetGainDb_ = 0.f;
+            band.q_ = band.targetQ_ = 1.f;
+            band.isActive_ = false;
+            band.isRamping_ = true;
+        }
         reset();
     }
     
     void reset()
     {
-        for (size_t chIndex = 0; chIndex < kNumOfChs; ++chIndex)
+        for (auto&& band : bands_)
         {
-            std::fill(z_[chIndex], z_[chIndex] + kNumOfZs_, 0.f);
+            for (size_t chIndex = 0; chIndex < kNumOfChs; ++chIndex) std::fill(band.z_[chIndex], band.z_[chIndex] + kNumOfZs, 0.f);
         }
     }
     
-    void updateCoefs()
-    {
-        const float gain = pow(10, abs(gainDb_) / 20.f) * ((gainDb_ > 0) ? 1 : -1);
-        const float omega = 2.f * M_PI *  freq_ / sampleRate_;
-        const float alpha = sin(omega) * sinh(log(2.f) / 2.f * q_ * omega / sin(omega));
-        const float A     = pow(10.f, (gain / 40.f) );
-         
-        a[0] =  1.0f + alpha / A;
-        a[1] = -2.0f * cos(omega);
-        a[2] =  1.0f - alpha / A ;
-        b[0] =  1.0f + alpha * A ;
-        b[1] = -2.0f * cos(omega);
-        b[2] =  1.0f - alpha * A ;
-        
-        shouldUpdateCoefs_ = false;
-    }
+    bool isActive() const override { return enabled_; }
     
-    void process(float* inBuffer, float* outBuffer)
+    template <size_t kNumOfChannels>
+    void processBlock(float* const channels[], size_t length)
     {
-        if (shouldUpdateCoefs_) updateCoefs();
+        if (shouldUpdate_.exchange(false)) pullTargets();
         
-        for (size_t chIndex = 0; chIndex < 2; ++chIndex)
+        for (auto&& band : bands_)
         {
-            const float signalIn = inBuffer[chIndex];
-            outBuffer[chIndex] = (b[0] / a[0]) * signalIn
-                               + (b[1] / a[0]) * z_[chIndex][0]
-                               + (b[2] / a[0]) * z_[chIndex][1]
-                               - (a[1] / a[0]) * z_[chIndex][2]
-                               - (a[2] / a[0]) * z_[chIndex][3];
+            if (!band.isActive_ && !band.isRamping_) continue;
             
-            z_[chIndex][1] = z_[chIndex][0];
-            z_[chIndex][0] = signalIn;
-            z_[chIndex][3] = z_[chIndex][2];
-            z_[chIndex][2] = outBuffer[chIndex];
+            for (size_t startIndex = 0; startIndex < length; startIndex += kSubBlockLength)
+            {
+                if (band.isRamping_) ramp(band);
+                if (!band.isActive_) break;
+                processBand<kNumOfChannels>(band, channels, startIndex, std::min(kSubBlockLength, length - startIndex));
+            }
         }
     }
     
+    void setEnabled(bool enabled) { enabled_ = enabled; }
+    
     void setSampleRate(float sampleRate)
     {
         sampleRate_ = sampleRate;
-        shouldUpdateCoefs_ = true;
+        shouldUpdate_ = true;
+    }
+    
+    void setFreq(size_t band, float freq)
+    {
+        if (kEqNumOfBands <= band) return;
+        targets_[band].freq_ = freq;
+        shouldUpdate_ = true;
     }
     
-    void setFreq(float freq)
+    void setGain(size_t band, float gainDb)
     {
-        freq_ = freq;
-        shouldUpdateCoefs_ = true;
+        if (kEqNumOfBands <= band) return;
+        targets_[band].gainDb_ = gainDb;
+        shouldUpdate_ = true;
     }
     
-    void setGain(float gain)
+    void setQ(size_t band, float q)
     {
-        gainDb_ = gain;
-        shouldUpdateCoefs_ = true;
+        if (kEqNumOfBands <= band) return;
+        targets_[band].q_ = q;
+        shouldUpdate_ = true;
     }
     
-    void setQ(float q)
+    void setType(size_t band, EqType type)
     {
-        q_ = q;
-        shouldUpdateCoefs_ = true;
+        if (kEqNumOfBands <= band) return;
+        targets_[band].type_ = type;
+        shouldUpdate_ = true;
     }
     
 private:
-    float a[3], b[3];
-    static constexpr size_t kNumOfZs_ = 4;
     static constexpr size_t kNumOfChs = 2;
-    float z_[kNumOfChs][kNumOfZs_];
-    float shouldUpdateCoefs_;
-    float sampleRate_, freq_, gainDb_, q_;
+    static constexpr size_t kNumOfZs = 2;
+    static constexpr size_t kSubBlockLength = 32;
+    
+    // Per sub-block, so that a change glides in for about 5 ms
+    static constexpr float kSmoothing = 0.15f;
+    static constexpr float kMinGainDb = 0.01f;
+    
+    struct Target
+    {
+        std::atomic<float> freq_;
+        std::atomic<float> gainDb_;
+        std::atomic<float> q_; // bandwidth in octaves
+        std::atomic<int> type_;
+    };
+    
+    struct Band
+    {
+        EqType type_;
+        float logFreq_, gainDb_, q_;
+        float targetLogFreq_, targetGainDb_, targetQ_;
+        bool isActive_;
+        bool isRamping_;
+        
+        // Normalized by a0
+        float b0_, b1_, b2_, a1_, a2_;
+        float z_[kNumOfChs][kNumOfZs];
+    };
+    
+    void pullTargets()
+    {
+        const bool sampleRateChanged = (currentSampleRate_ != sampleRate_);
+        currentSampleRate_ = sampleRate_;
+        
+        for (size_t bandIndex = 0; bandIndex < kEqNumOfBands; ++bandIndex)
+        {
+            const auto& target = targets_[bandIndex];
+            auto& band = bands_[bandIndex];
+            const auto type = static_cast<EqType>(target.type_.load());
+            const float logFreq = std::log(target.freq_.load());
+            const float gainDb = target.gainDb_;
+            const float q = target.q_;
+            
+            // A new type can't glide from the previous one
+            if (sampleRateChanged || type != band.type_ || logFreq != band.targetLogFreq_ || gainDb != band.targetGainDb_ || q != band.targetQ_) band.isRamping_ = true;
+            band.type_ = type;
+            band.targetLogFreq_ = logFreq;
+            band.targetGainDb_ = gainDb;
+            band.targetQ_ = q;
+        }
+    }
+    
+    void ramp(Band& band)
+    {
+        band.logFreq_ += (band.targetLogFreq_ - band.logFreq_) * kSmoothing;
+        band.gainDb_ += (band.targetGainDb_ - band.gainDb_) * kSmoothing;
+        band.q_ += (band.targetQ_ - band.q_) * kSmoothing;
+        if (std::abs(band.targetLogFreq_ - band.logFreq_) < 0.001f && std::abs(band.targetGainDb_ - band.gainDb_) < kMinGainDb && std::abs(band.targetQ_ - band.q_) < 0.001f)
+        {
+            band.logFreq_ = band.targetLogFreq_;
+            band.gainDb_ = band.targetGainDb_;
+            band.q_ = band.targetQ_;
+            band.isRamping_ = false;
+        }
+        
+        const bool wasActive = band.isActive_;
+        band.isActive_ = isAudible(band);
+        if (band.isActive_)
+        {
+            if (!wasActive) std::fill(&band.z_[0][0], &band.z_[0][0] + kNumOfChs * kNumOfZs, 0.f);
+            updateCoefs(band);
+        }
+    }
+    
+    // A flat band is skipped
+    bool isAudible(const Band& band) const
+    {
+        const float freq = std::exp(band.logFreq_);
+        switch (band.type_)
+        {
+            case kEqType_HighPass:
+                return kEqFreqMin < freq;
+            case kEqType_LowPass:
+                return freq < kEqFreqMax && freq < currentSampleRate_ * 0.45f;
+            default:
+                return kMinGainDb <= std::abs(band.gainDb_);
+        }
+    }
+    
+    void updateCoefs(Band& band)
+    {
+        const double freq = std::min<double>(std::exp(band.logFreq_), currentSampleRate_ * 0.45);
+        const double omega = 2.0 * M_PI * freq / currentSampleRate_;
+        const double cosOmega = std::cos(omega);
+        const double sinOmega = std::sin(omega);
+        const double alpha = sinOmega * std::sinh(std::log(2.0) / 2.0 * band.q_ * omega / sinOmega);
+        const double A = std::pow(10.0, band.gainDb_ / 40.0);
+        const double sqrtAAlpha = 2.0 * std::sqrt(A) * alpha;
+        
+        double b[3], a[3];
+        switch (band.type_)
+        {
+            case kEqType_LowShelf:
+                b[0] = A * ((A + 1.0) - (A - 1.0) * cosOmega + sqrtAAlpha);
+                b[1] = 2.0 * A * ((A - 1.0) - (A + 1.0) * cosOmega);
+                b[2] = A * ((A + 1.0) - (A - 1.0) * cosOmega - sqrtAAlpha);
+                a[0] = (A + 1.0) + (A - 1.0) * cosOmega + sqrtAAlpha;
+                a[1] = -2.0 * ((A - 1.0) + (A + 1.0) * cosOmega);
+                a[2] = (A + 1.0) + (A - 1.0) * cosOmega - sqrtAAlpha;
+                break;
+            case kEqType_HighShelf:
+                b[0] = A * ((A + 1.0) + (A - 1.0) * cosOmega + sqrtAAlpha);
+                b[1] = -2.0 * A * ((A - 1.0) + (A + 1.0) * cosOmega);
+                b[2] = A * ((A + 1.0) + (A - 1.0) * cosOmega - sqrtAAlpha);
+                a[0] = (A + 1.0) - (A - 1.0) * cosOmega + sqrtAAlpha;
+                a[1] = 2.0 * ((A - 1.0) - (A + 1.0) * cosOmega);
+                a[2] = (A + 1.0) - (A - 1.0) * cosOmega - sqrtAAlpha;
+                break;
+            case kEqType_HighPass:
+                b[0] = (1.0 + cosOmega) / 2.0;
+                b[1] = -(1.0 + cosOmega);
+                b[2] = (1.0 + cosOmega) / 2.0;
+                a[0] = 1.0 + alpha;
+                a[1] = -2.0 * cosOmega;
+                a[2] = 1.0 - alpha;
+                break;
+            case kEqType_LowPass:
+                b[0] = (1.0 - cosOmega) / 2.0;
+                b[1] = 1.0 - cosOmega;
+                b[2] = (1.0 - cosOmega) / 2.0;
+                a[0] = 1.0 + alpha;
+                a[1] = -2.0 * cosOmega;
+                a[2] = 1.0 - alpha;
+                break;
+            default:
+                b[0] = 1.0 + alpha * A;
+                b[1] = -2.0 * cosOmega;
+                b[2] = 1.0 - alpha * A;
+                a[0] = 1.0 + alpha / A;
+                a[1] = -2.0 * cosOmega;
+                a[2] = 1.0 - alpha / A;
+                break;
+        }
+        
+        band.b0_ = static_cast<float>(b[0] / a[0]);
+        band.b1_ = static_cast<float>(b[1] / a[0]);
+        band.b2_ = static_cast<float>(b[2] / a[0]);
+        band.a1_ = static_cast<float>(a[1] / a[0]);
+        band.a2_ = static_cast<float>(a[2] / a[0]);
+    }
+    
+    // Transposed direct form II. The recursion is sequential in time, so the channels are
+    // interleaved in one loop to keep the multipliers busy instead.
+    template <size_t kNumOfChannels>
+    static void processBand(Band& band, float* const channels[], size_t startIndex, size_t length)
+    {
+        const float b0 = band.b0_, b1 = band.b1_, b2 = band.b2_, a1 = band.a1_, a2 = band.a2_;
+        float z1[kNumOfChannels], z2[kNumOfChannels];
+        float* data[kNumOfChannels];
+        for (size_t chIndex = 0; chIndex < kNumOfChannels; ++chIndex)
+        {
+            z1[chIndex] = band.z_[chIndex][0];
+            z2[chIndex] = band.z_[chIndex][1];
+            data[chIndex] = channels[chIndex] + startIndex;
+        }
+        
+        for (size_t iSample = 0; iSample < length; ++iSample)
+        {
+            for (size_t chIndex = 0; chIndex < kNumOfChannels; ++chIndex)
+            {
+                const float in = data[chIndex][iSample];
+                const float out = b0 * in + z1[chIndex];
+                z1[chIndex] = b1 * in - a1 * out + z2[chIndex];
+                z2[chIndex] = b2 * in - a2 * out;
+                data[chIndex][iSample] = out;
+            }
+        }
+        
+        for (size_t chIndex = 0; chIndex < kNumOfChannels; ++chIndex)
+        {
+            band.z_[chIndex][0] = z1[chIndex];
+            band.z_[chIndex][1] = z2[chIndex];
+        }
+    }
+    
+    bool enabled_;
+    Target targets_[kEqNumOfBands];
+    std::atomic<float> sampleRate_;
+    std::atomic<bool> shouldUpdate_;
+    
+    // Audio thread
+    Band bands_[kEqNumOfBands];
+    float currentSampleRate_;
+};
+
+// LL, RR and center cancel of a stereo block. A mono output has nothing to swap.
+class MelissaAudioEngine::OutputModeNode : public MelissaDSPNodeBase<OutputModeNode>
+{
+public:
+    OutputModeNode() : outputMode_(kOutputMode_LR) { }
+    
+    bool isActive() const override { return outputMode_ != kOutputMode_LR; }
+    
+    template <size_t kNumOfChannels>
+    void processBlock(float* const channels[], size_t length)
+    {
+        if constexpr (kNumOfChannels == 2)
+        {
+            const int numOfSamples = static_cast<int>(length);
+            if (outputMode_ == kOutputMode_LL)
+            {
+                FloatVectorOperations::copy(channels[1], channels[0], numOfSamples);
+            }
+            else if (outputMode_ == kOutputMode_RR)
+            {
+                FloatVectorOperations::copy(channels[0], channels[1], numOfSamples);
+            }
+            else if (outputMode_ == kOutputMode_CenterCancel)
+            {
+                FloatVectorOperations::subtract(channels[0], channels[1], numOfSamples);
+                FloatVectorOperations::copy(channels[1], channels[0], numOfSamples);
+            }
+        }
+    }
+    
+    void setOutputMode(OutputMode outputMode) { outputMode_ = outputMode; }
+    
+private:
+    OutputMode outputMode_;
 };
 
 MelissaAudioEngine::MelissaAudioEngine() :
 model_(MelissaModel::getInstance()), dataSource_(MelissaDataSource::getInstance()), soundTouch_(make_unique<soundtouch::SoundTouch>()), playbackMode_(kPlaybackMode_LoopOneSong), originalSampleRate_(48000), originalBufferLength_(0), outputSampleRate_(48000),
-aIndex_(0), bIndex_(0), processStartIndex_(0), readIndex_(0), playingPosMSec_(0.f), speed_(100), processingSpeed_(1.f), semitone_(0), volume_(1.f), needToReset_(true), loop_(true), shouldProcess_(true),
+aIndex_(0), bIndex_(0), processStartIndex_(0), readIndex_(0), playingPosIndex_(0), playingPosMSec_(0.f), speed_(100), processingSpeed_(1.f), semitone_(0), volume_(1.f), crossfadeMSec_(0.f), needToReset_(true), loop_(true), shouldProcess_(true),
 #if defined(ENABLE_SPEED_TRAINING)
 count_(0), speedMode_(kSpeedMode_Basic), speedIncStart_(100), speedIncPer_(10), speedIncValue_(1), speedIncGoal_(100),
 #endif
-currentSpeed_(100), volumeBalance_(0.5f), eqSwitch_(false), playPart_(kStemType_All)
+currentSpeed_(100), volumeBalance_(0.5f), playPart_(kStemType_All), normalizationNode_(kNormalizationRampMSec), volumeNode_(kVolumeRampMSec)
 {
     sampleIndexStretcher_ = std::make_unique<SampleIndexStretcher>();
+    crossfadeBuffer_.setSize(2, static_cast<int>(processLength_));
     eq_ = std::make_unique<Equalizer>();
+    outputModeNode_ = std::make_unique<OutputModeNode>();
+    normalizationNode_.setSampleRate(outputSampleRate_);
+    volumeNode_.setSampleRate(outputSampleRate_);
+    
+    // All the gains are linear, so they are applied in one go after the channels are arranged
+    chain_.addNode(eq_.get());
+    chain_.addNode(outputModeNode_.get());
+    chain_.addNode(&normalizationNode_);
+    chain_.addNode(&volumeNode_);
 }
 
 MelissaAudioEngine::~MelissaAudioEngine() {}
@@ -209,12 +487,17 @@ void MelissaAudioEngine::updateBuffer()
     needToReset_ = true;
 }
 
-void MelissaAudioEngine::setOutputSampleRate(int32_t sampleRate)
+void MelissaAudioEngine::setOutputSampleRate(int32_t sampleRate, size_t maxBlockLength)
 {
+    // Sized here so that render() doesn't allocate on the audio thread
+    for (auto&& renderBuffer : renderBuffers_) renderBuffer.assign(maxBlockLength, 0.f);
+    
     if (outputSampleRate_ == sampleRate) return;
     
     outputSampleRate_ = sampleRate;
     eq_->setSampleRate(sampleRate);
+    normalizationNode_.setSampleRate(sampleRate);
+    volumeNode_.setSampleRate(sampleRate);
     needToReset_ = true;
 }
 
@@ -225,7 +508,8 @@ float MelissaAudioEngine::getPlayingPosMSec() const
 
 float MelissaAudioEngine::getPlayingPosRatio() const
 {
-    return static_cast<float>(getPlayingPosMSec()) / 1000.f / (static_cast<float>(originalBufferLength_) / originalSampleRate_);
+    if (originalBufferLength_ == 0) return 0.f;
+    return static_cast<float>(static_cast<double>(playingPosIndex_) / originalBufferLength_);
 }
 
 void MelissaAudioEngine::render(float* bufferToRender[], size_t numOfChannels, std::vector<float>& timeIndicesMSec, size_t bufferLength)
@@ -233,62 +517,65 @@ void MelissaAudioEngine::render(float* bufferToRender[], size_t numOfChannels, s
     if (status_ != kStatus_Playing) return;
     jassert(1 <= numOfChannels && numOfChannels <= 2);
     
+    // A block longer than the prepared one is rendered in slices
+    const size_t maxBlockLength = renderBuffers_[0].size();
+    if (maxBlockLength == 0) return;
+    
+    for (size_t offset = 0; offset < bufferLength; offset += maxBlockLength)
+    {
+        float* blockToRender[] = { bufferToRender[0] + offset, bufferToRender[numOfChannels - 1] + offset };
+        if (!renderBlock(blockToRender, numOfChannels, timeIndicesMSec.data() + offset, std::min(maxBlockLength, bufferLength - offset))) break;
+    }
+}
+
+bool MelissaAudioEngine::renderBlock(float* bufferToRender[], size_t numOfChannels, float* timeIndicesMSec, size_t bufferLength)
+{
+    float* left = renderBuffers_[0].data();
+    float* right = renderBuffers_[1].data();
+    
     mutex_.lock();
     if (processedBufferQue_.size() <= bufferLength || !sampleIndexStretcher_->isStretchedSampleIndicesPrepared(bufferLength))
     {
         if (!shouldProcess_) status_ = kStatus_RequestingForNextSong;
         mutex_.unlock();
-        return;
+        return false;
     }
     sampleIndexStretcher_->getStretchedSampleIndices(bufferLength, timeQue_);
+    
+    // The whole block is popped at once, so that the output stage processes it in one go
+    const size_t length = std::min({ bufferLength, processedBufferQue_.size() / 2, timeQue_.size() });
+    for (size_t iSample = 0; iSample < length; ++iSample)
+    {
+        left[iSample] = processedBufferQue_[iSample * 2];
+        right[iSample] = processedBufferQue_[iSample * 2 + 1];
+        timeIndicesMSec[iSample] = static_cast<float>(static_cast<double>(timeQue_[iSample]) / originalSampleRate_ * 1000.0);
+    }
+    if (0 < length)
+    {
+        processedBufferQue_.erase(processedBufferQue_.begin(), processedBufferQue_.begin() + length * 2);
+        playingPosIndex_ = timeQue_[length - 1];
+        playingPosMSec_ = timeIndicesMSec[length - 1];
+        timeQue_.erase(timeQue_.begin(), timeQue_.begin() + length);
+    }
     mutex_.unlock();
     
-    for (int iSample = 0; iSample < bufferLength; ++iSample)
+    normalizationNode_.setGain(MelissaLoudness::getInstance()->getNormalizationGain(playPart_));
+    volumeNode_.setGain(volume_ * volumeBalance_);
+    float* const channels[] = { left, right };
+    chain_.process(channels, 2, length);
+    
+    if (numOfChannels == 1)
     {
-        mutex_.lock();
-        if (processedBufferQue_.size() > 0 && timeQue_.size() > 0)
-        {
-            float buffer[] = { processedBufferQue_[0], processedBufferQue_[1] };
-            
-            if (eqSwitch_) eq_->process(buffer, buffer);
-            buffer[0] *= volume_;
-            buffer[1] *= volume_;
-            
-            if (outputMode_ == kOutputMode_LL)
-            {
-                buffer[1] = buffer[0];
-            }
-            else if (outputMode_ == kOutputMode_RR)
-            {
-                buffer[0] = buffer[1];
-            }
-            else if (outputMode_ == kOutputMode_CenterCancel)
-            {
-                const auto lrDiff = buffer[0] - buffer[1];
-                buffer[0] = buffer[1] = lrDiff;
-            }
-            
-            if (numOfChannels == 1)
-            {
-                // mono
-                bufferToRender[0][iSample] = (buffer[0] + buffer[1]) * volumeBalance_;
-            }
-            else
-            {
-                // stereo
-                bufferToRender[0][iSample] = buffer[0] * volumeBalance_;
-                bufferToRender[1][iSample] = buffer[1] * volumeBalance_;
-            }
-
-            processedBufferQue_.erase(processedBufferQue_.begin(), processedBufferQue_.begin() + 2);
-            
-            timeIndicesMSec[iSample] = playingPosMSec_ = static_cast<float>(timeQue_[0]) / originalSampleRate_ * 1000.f;
-            timeQue_.pop_front();
-        }
-        mutex_.unlock();
+        FloatVectorOperations::add(bufferToRender[0], left, right, static_cast<int>(length));
+    }
+    else
+    {
+        FloatVectorOperations::copy(bufferToRender[0], left, static_cast<int>(length));
+        FloatVectorOperations::copy(bufferToRender[1], right, static_cast<int>(length));
     }
     
     model_->updatePlayingPosMSecFromDsp(playingPosMSec_);
+    return true;
 }
 
 void MelissaAudioEngine::process()
@@ -299,8 +586,29 @@ void MelissaAudioEngine::process()
     uint32_t receivedSampleSize = soundTouch_->receiveSamples(bufferForSoundTouch_, processLength_);
     while (receivedSampleSize == 0)
     {
+        // Long files are streamed from the disk. Wait until the samples to process are resident.
+        if (!dataSource_->prepareBuffer(readIndex_, aIndex_, playPart_)) return;
+        
+        // The next song of the playlist is connected seamlessly if it has already been prefetched
+        bool nextSongPrepared = !loop_ && shouldProcess_ && dataSource_->isPrefetchedFileReady() && dataSource_->getPrefetchedSampleRate() == originalSampleRate_;
+        const size_t crossfadeLength = nextSongPrepared ? static_cast<size_t>(crossfadeMSec_ / 1000.f * originalSampleRate_) : 0;
+        
+        // The part of the next song crossfaded in this chunk is read in one go
+        size_t crossfadeStartIndex = 0;
+        if (nextSongPrepared && 0 < crossfadeLength && bIndex_ < readIndex_ + crossfadeLength + processLength_)
+        {
+            crossfadeStartIndex = (bIndex_ <= readIndex_ + crossfadeLength) ? readIndex_ + crossfadeLength - bIndex_ : 0;
+            dataSource_->readPrefetchedBlock(crossfadeBuffer_, crossfadeStartIndex);
+        }
+        
         for (size_t iSample = 0; iSample < processLength_; ++iSample)
         {
+            if (nextSongPrepared && bIndex_ <= readIndex_)
+            {
+                switchToNextSong(crossfadeLength);
+                nextSongPrepared = false;
+            }
+            
             if (readIndex_ > bIndex_)
             {
                 if (loop_)
@@ -328,6 +636,18 @@ void MelissaAudioEngine::process()
             mutex_.unlock();
             bufferForSoundTouch_[iSample * 2 + 0] = shouldProcess_ ? dataSource_->readBuffer(0, readIndex_, playPart_) : 0.f;
             bufferForSoundTouch_[iSample * 2 + 1] = shouldProcess_ ? dataSource_->readBuffer(1, readIndex_, playPart_) : 0.f;
+            
+            if (nextSongPrepared && 0 < crossfadeLength && bIndex_ <= readIndex_ + crossfadeLength)
+            {
+                // equal power crossfade into the beginning of the next song
+                const size_t nextSongIndex = readIndex_ + crossfadeLength - bIndex_;
+                const float ratio = static_cast<float>(nextSongIndex) / crossfadeLength;
+                const float fadeOut = cos(M_PI / 2.f * ratio);
+                const float fadeIn  = sin(M_PI / 2.f * ratio);
+                const int crossfadeBufferIndex = static_cast<int>(nextSongIndex - crossfadeStartIndex);
+                bufferForSoundTouch_[iSample * 2 + 0] = bufferForSoundTouch_[iSample * 2 + 0] * fadeOut + crossfadeBuffer_.getSample(0, crossfadeBufferIndex) * fadeIn;
+                bufferForSoundTouch_[iSample * 2 + 1] = bufferForSoundTouch_[iSample * 2 + 1] * fadeOut + crossfadeBuffer_.getSample(1, crossfadeBufferIndex) * fadeIn;
+            }
             ++readIndex_;
         }
         
@@ -375,7 +695,8 @@ void MelissaAudioEngine::resetProcessedBuffer()
     processedBufferQue_.clear();
     timeQue_.clear();
     
-    playingPosMSec_ = static_cast<float>(processStartIndex_) / originalSampleRate_ * 1000.f;
+    playingPosIndex_ = processStartIndex_;
+    playingPosMSec_ = static_cast<float>(static_cast<double>(processStartIndex_) / originalSampleRate_ * 1000.0);
     if (processStartIndex_ < aIndex_ || bIndex_ < processStartIndex_) processStartIndex_ = aIndex_;
     readIndex_ = processStartIndex_;
     needToReset_ = false;
@@ -440,7 +761,7 @@ void MelissaAudioEngine::playbackModeChanged(PlaybackMode mode)
     if (playbackMode_ == mode) return;
     playbackMode_ = mode;
     
-    processStartIndex_ =  playingPosMSec_ * originalSampleRate_ / 1000.f;
+    processStartIndex_ = playingPosIndex_;
     needToReset_ = true;
 }
 
@@ -451,20 +772,22 @@ void MelissaAudioEngine::musicVolumeChanged(float volume)
 
 void MelissaAudioEngine::pitchChanged(float semitone)
 {
+    if (semitone_ == semitone) return;
     semitone_ = semitone;
-    processStartIndex_ =  playingPosMSec_ * originalSampleRate_ / 1000.f;
+    processStartIndex_ = playingPosIndex_;
     needToReset_ = true;
 }
 
 void MelissaAudioEngine::speedChanged(int speed)
 {
+    if (speed_ == speed && currentSpeed_ == speed) return;
     speed_ = speed;
 #if defined(ENABLE_SPEED_TRAINING)
     if (speedMode_ == kSpeedMode_Basic) currentSpeed_ = speed_;
 #else
     currentSpeed_ = speed_;
 #endif
-    processStartIndex_ =  playingPosMSec_ * originalSampleRate_ / 1000.f;
+    processStartIndex_ = playingPosIndex_;
     needToReset_ = true;
 }
 
@@ -490,7 +813,7 @@ void MelissaAudioEngine::speedModeChanged(SpeedMode mode)
     
     speedMode_ = mode;
     count_ = 0;
-    processStartIndex_ =  playingPosMSec_ * originalSampleRate_ / 1000.f;
+    processStartIndex_ = playingPosIndex_;
     needToReset_ = true;
 }
 
@@ -527,8 +850,8 @@ void MelissaAudioEngine::loopPosChanged(float aTimeMSec, float aRatio, float bTi
 {
     if (!(0 <= aRatio && aRatio < bRatio && bRatio <= 1.f)) return;
     
-    aIndex_ = static_cast<int32_t>(aRatio * originalBufferLength_);
-    bIndex_ = static_cast<int32_t>(bRatio * originalBufferLength_);
+    aIndex_ = static_cast<size_t>(static_cast<double>(aRatio) * originalBufferLength_);
+    bIndex_ = static_cast<size_t>(static_cast<double>(bRatio) * originalBufferLength_);
     if (readIndex_ < aIndex_ || bIndex_ < readIndex_)
     {
         readIndex_ = aIndex_;
@@ -538,7 +861,7 @@ void MelissaAudioEngine::loopPosChanged(float aTimeMSec, float aRatio, float bTi
 
 void MelissaAudioEngine::playingPosChanged(float time, float ratio)
 {
-    processStartIndex_ = static_cast<size_t>((originalBufferLength_ - 1) * ratio);
+    processStartIndex_ = static_cast<size_t>((originalBufferLength_ - 1) * static_cast<double>(ratio));
     if (processStartIndex_ < aIndex_) processStartIndex_ = aIndex_;
     if (bIndex_ < processStartIndex_) processStartIndex_ = bIndex_;
     needToReset_ = true;
@@ -558,27 +881,32 @@ void MelissaAudioEngine::musicMetronomeBalanceChanged(float balance)
 
 void MelissaAudioEngine::outputModeChanged(OutputMode outputMode)
 {
-    outputMode_ = outputMode;
+    outputModeNode_->setOutputMode(outputMode);
 }
 
 void MelissaAudioEngine::eqSwitchChanged(bool on)
 {
-    eqSwitch_ = on;
+    eq_->setEnabled(on);
 }
 
 void MelissaAudioEngine::eqFreqChanged(size_t band, float freq)
 {
-    eq_->setFreq(freq);
+    eq_->setFreq(band, freq);
 }
 
 void MelissaAudioEngine::eqGainChanged(size_t band, float gain)
 {
-    eq_->setGain(gain);
+    eq_->setGain(band, gain);
 }
 
 void MelissaAudioEngine::eqQChanged(size_t band, float q)
 {
-    eq_->setQ(q);
+    eq_->setQ(band, q);
+}
+
+void MelissaAudioEngine::eqTypeChanged(size_t band, EqType type)
+{
+    eq_->setType(band, type);
 }
 
 void MelissaAudioEngine::updateLoopParameters()
@@ -598,3 +926,38 @@ void MelissaAudioEngine::playPartChanged(StemType playPart)
 {
     playPart_ = playPart;
 }
+
+void MelissaAudioEngine::switchToNextSong(size_t startIndex)
+{
+    float semitone = 0.f;
+    int speed = 100;
+    if (!dataSource_->switchToPrefetchedFile(semitone, speed)) return;
+    
+    // The pitch and the speed of the next song are applied here without a reset, which would drop the processed samples.
+    // The model is updated later from the message thread, and the engine ignores it as the values are the same.
+    if (semitone_ != semitone || speed_ != speed || currentSpeed_ != speed)
+    {
+        const auto fsConvPitch = static_cast<float>(originalSampleRate_) / outputSampleRate_;
+        semitone_ = semitone;
+        speed_ = speed;
+        currentSpeed_ = speed;
+        soundTouch_->setTempo(fsConvPitch * currentSpeed_ / 100.f);
+        soundTouch_->setPitch(fsConvPitch * exp(0.69314718056 * semitone_ / 12.f));
+        processingSpeed_ = static_cast<float>(originalSampleRate_) / outputSampleRate_ * (currentSpeed_ / 100.f);
+        
+        mutex_.lock();
+        sampleIndexStretcher_->changeSpeedAfterQueue(processingSpeed_);
+        mutex_.unlock();
+    }
+    
+    originalBufferLength_ = dataSource_->getBufferLength();
+    aIndex_ = 0;
+    bIndex_ = originalBufferLength_;
+    readIndex_ = std::min(startIndex, originalBufferLength_);
+    playPart_ = kStemType_All;
+    updateLoopParameters();
+    
+#if defined(ENABLE_SPEED_TRAINING)
+    count_ = 0;
+#endif
+}
@@ -10,6 +10,7 @@
 #include <deque>
 #include <mutex>
 #include <vector>
+#include "MelissaDSPNode.h"
 #include "MelissaModelListener.h"
 #include "SoundTouch.h"
 #include <memory>
@@ -24,7 +25,8 @@ public:
     ~MelissaAudioEngine();
     
     void updateBuffer();
-    void setOutputSampleRate(int32_t sampleRate);
+    void setOutputSampleRate(int32_t sampleRate, size_t maxBlockLength);
+    void setCrossfadeMSec(float crossfadeMSec) { crossfadeMSec_ = crossfadeMSec; }
     
     float getPlayingPosMSec() const;
     float getPlayingPosRatio() const;
@@ -66,7 +68,7 @@ private:
     size_t originalBufferLength_;
     
     std::deque<float> processedBufferQue_;
-    std::deque<float> timeQue_;
+    std::deque<size_t> timeQue_;
     int32_t outputSampleRate_;
     
     class SampleIndexStretcher;
@@ -74,14 +76,19 @@ private:
     
     size_t aIndex_, bIndex_, processStartIndex_;
     size_t readIndex_; // from buffer_
+    size_t playingPosIndex_;
     float playingPosMSec_;
     
     int32_t speed_;
     float   processingSpeed_;
     float   semitone_;
     float   volume_;
+    float   crossfadeMSec_;
     
     float bufferForSoundTouch_[2 * processLength_];
+    
+    // The beginning of the next song crossfaded into the current chunk
+    AudioSampleBuffer crossfadeBuffer_;
     bool needToReset_;
     bool loop_;
     bool shouldProcess_;
@@ -98,11 +105,17 @@ private:
     int32_t currentSpeed_;
     
     float volumeBalance_;
-    OutputMode outputMode_;
     
+    // Output stage
     class Equalizer;
-    bool eqSwitch_;
+    class OutputModeNode;
     std::unique_ptr<Equalizer> eq_;
+    std::unique_ptr<OutputModeNode> outputModeNode_;
+    MelissaGainNode normalizationNode_;
+    MelissaGainNode volumeNode_;
+    MelissaDSPChain chain_;
+    std::vector<float> renderBuffers_[2];
+    bool renderBlock(float* bufferToRender[], size_t numOfChannels, float* timeIndicesMSec, size_t bufferLength);
     
     StemType playPart_;
     
@@ -128,7 +141,9 @@ private:
     void eqFreqChanged(size_t band, float freq) override;
     void eqGainChanged(size_t band, float gain) override;
     void eqQChanged(size_t band, float q) override;
+    void eqTypeChanged(size_t band, EqType type) override;
     void playPartChanged(StemType playPart) override;
     
     void updateLoopParameters();
+    void switchToNextSong(size_t startIndex);
 };
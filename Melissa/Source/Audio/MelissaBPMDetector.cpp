@@ -5,53 +5,354 @@
 //  Copyright(c) 2020 Masaki Ono
 //
 
+#include <complex>
+#include <numeric>
+#include "PeakFinder.h"
+#include "MelissaAnalysisCache.h"
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaBeatTracker.h"
 #include "MelissaBPMDetector.h"
+#include "MelissaDefinitions.h"
+#include "MelissaStemProvider.h"
+
+namespace
+{
+constexpr size_t kOnsetFrameLength = 512;
+
+// The tempo is estimated on a signal decimated to about 1 kHz
+constexpr int kDecimatedSampleRate = 1000;
+constexpr int kMaxBpmRange = 200;
+
+// Autocorrelation segments (in decimated samples), Hann windowed and overlapped by half
+constexpr int kSegmentOrder = 12;
+constexpr int kSegmentLength = 1 << kSegmentOrder;
+constexpr int kMaxNumOfWorkers = 8;
+
+constexpr int kMovingAverageLength = 15;
+
+// Subtracts the linear trend in [first, last] so that the shorter lags are not favoured
+void removeBias(std::vector<float>& xcorr, int first, int last)
+{
+    const int numOfLags = last - first + 1;
+    double meanX = 0.0;
+    for (int lag = first; lag <= last; ++lag) meanX += xcorr[lag];
+    meanX /= numOfLags;
+    const double meanLag = (first + last) / 2.0;
+
+    double covariance = 0.0, variance = 0.0;
+    for (int lag = first; lag <= last; ++lag)
+    {
+        covariance += (xcorr[lag] - meanX) * (lag - meanLag);
+        variance += (lag - meanLag) * (lag - meanLag);
+    }
+    const double slope = covariance / variance;
+
+    for (int lag = first; lag <= last; ++lag) xcorr[lag] -= static_cast<float>(slope * lag);
+    const float minValue = *std::min_element(xcorr.begin() + first, xcorr.begin() + last + 1);
+    for (int lag = first; lag <= last; ++lag) xcorr[lag] -= minValue;
+}
+};
+
+// Streams one part of the song into its PartAnalysis. The last part to finish completes the session.
+class MelissaBPMDetector::PartAnalyzer : public MelissaAnalyzer
+{
+public:
+    PartAnalyzer(MelissaBPMDetector* detector, std::shared_ptr<Session> session, size_t analysisIndex) :
+    detector_(detector),
+    session_(session),
+    analysis_(session->analyses_[analysisIndex]),
+    decimateBy_(1),
+    lowPassCoef_(0.f)
+    {
+    }
+
+    StemType getPart() const override { return analysis_.part_; }
+
+    bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) override
+    {
+        session_->sampleRate_ = sampleRate;
+        decimateBy_ = std::max<size_t>(static_cast<size_t>(sampleRate) / kDecimatedSampleRate, 1);
+        lowPassCoef_ = std::exp(-2.f * MathConstants<float>::pi * 150.f / static_cast<float>(sampleRate));
+
+        analysis_.decimated_.reserve(bufferLength / decimateBy_ + 1);
+        analysis_.onset_.reserve(bufferLength / kOnsetFrameLength + 1);
+        analysis_.lowOnset_.reserve(bufferLength / kOnsetFrameLength + 1);
+        return true;
+    }
+
+    void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) override
+    {
+        mono_.resize(length);
+        FloatVectorOperations::add(mono_.data(), block.getReadPointer(0), block.getReadPointer(1), static_cast<int>(length));
+        FloatVectorOperations::multiply(mono_.data(), 0.5f, static_cast<int>(length));
+        const float* mono = mono_.data();
+
+        for (size_t frameIndex = 0; frameIndex < length; frameIndex += kOnsetFrameLength)
+        {
+            addOnset(analysis_, mono + frameIndex, std::min(kOnsetFrameLength, length - frameIndex), lowPassCoef_);
+        }
+
+        // Mean of every decimateBy samples, which may straddle the blocks
+        for (size_t sampleIndex = 0; sampleIndex < length;)
+        {
+            const size_t numOfSamples = std::min(decimateBy_ - analysis_.decimateCount_, length - sampleIndex);
+            analysis_.decimateSum_ = std::accumulate(mono + sampleIndex, mono + sampleIndex + numOfSamples, analysis_.decimateSum_);
+            analysis_.decimateCount_ += numOfSamples;
+            sampleIndex += numOfSamples;
+            if (analysis_.decimateCount_ == decimateBy_)
+            {
+                analysis_.decimated_.emplace_back(analysis_.decimateSum_ / decimateBy_);
+                analysis_.decimateSum_ = 0.f;
+                analysis_.decimateCount_ = 0;
+            }
+        }
+    }
+
+    void finish() override
+    {
+        const double sampleRate = session_->sampleRate_;
+        analysis_.bpm_ = std::round(estimateBpm(analysis_.decimated_, sampleRate / decimateBy_, [this]() { return isCancelled(); }));
+        if (isCancelled()) return;
+
+        // Confidence of a part is the mean confidence of its beats
+        analysis_.beats_ = MelissaBeatTracker::track(analysis_.onset_, analysis_.lowOnset_, kOnsetFrameLength * 1000.0 / sampleRate, analysis_.bpm_, session_->beatsPerBar_);
+        if (!analysis_.beats_.empty())
+        {
+            for (auto&& beat : analysis_.beats_) analysis_.confidence_ += beat.confidence_;
+            analysis_.confidence_ /= analysis_.beats_.size();
+        }
+
+        if (--session_->numOfRemainingParts_ == 0) detector_->sessionFinished(*session_);
+    }
+
+private:
+    MelissaBPMDetector* detector_;
+    std::shared_ptr<Session> session_;
+    PartAnalysis& analysis_;
+    size_t decimateBy_;
+    float lowPassCoef_;
+    std::vector<float> mono_;
+};
 
 MelissaBPMDetector::MelissaBPMDetector() :
-bpmDetect_(nullptr),
-dataSource_(MelissaDataSource::getInstance()),
-sampleRate_(0),
-bufferLength_(0),
-processStartIndex_(0)
+sessionId_(0),
+isFinished_(false),
+bpm_(0.f),
+analyzedPart_(kStemType_All)
 {
 }
 
-void MelissaBPMDetector::initialize(int sampleRate, size_t bufferLength)
+MelissaBPMDetector::~MelissaBPMDetector()
 {
-    sampleRate_   = sampleRate;
-    bufferLength_ = bufferLength;
-    
-    bpmDetect_ = std::make_unique<soundtouch::BPMDetect>(2, sampleRate);
-    processStartIndex_ = 0;
+    // The analyzers refer to this. The other analyses in the pipeline go on.
+    for (auto&& analyzer : analyzers_) MelissaAnalysisPipeline::getInstance()->removeAnalyzer(analyzer);
 }
 
-void MelissaBPMDetector::process(bool* processFinished, float* bpm)
+void MelissaBPMDetector::start(int beatsPerBar)
 {
-    *processFinished = false;
-    
-    constexpr size_t processLength = 512;
-    constexpr size_t processBufferLength = processLength * 2 /* Stereo */;
-    float buffer[processBufferLength];
-    
-    for (size_t bufferIndex = 0; bufferIndex < processBufferLength; bufferIndex += 2)
+    cancel();
+
+    // The abandoned analyzers are dropped by the pipeline at their next block
+    for (auto&& analyzer : analyzers_) analyzer->cancel();
+    analyzers_.clear();
+
+    auto session = std::make_shared<Session>();
+    {
+        const ScopedLock sl(lock_);
+        session->id_ = sessionId_;
+    }
+    session->fingerprint_ = MelissaAnalysisCache::getInstance()->getFingerprint();
+    session->beatsPerBar_ = beatsPerBar;
+    session->withStems_ = (MelissaStemProvider::getInstance()->getStemProviderStatus() == kStemProviderStatus_Available);
+    session->sampleRate_ = 0.0;
+
+    // A result analyzed under the same conditions is reused
+    MelissaAnalysisCache::Rhythm rhythm;
+    if (MelissaAnalysisCache::getInstance()->readRhythm(session->fingerprint_, rhythm) && rhythm.beatsPerBar_ == beatsPerBar && rhythm.withStems_ == session->withStems_)
+    {
+        setResult(session->id_, rhythm.bpm_, rhythm.beats_, rhythm.analyzedPart_);
+        return;
+    }
+
+    // The drums (or the bass) stem is usually a cleaner input than the full mix, in order of preference.
+    // The full mix is always the last one.
+    if (session->withStems_)
+    {
+        session->analyses_.emplace_back(kStemType_Drums);
+        session->analyses_.emplace_back(kStemType_Bass);
+    }
+    session->analyses_.emplace_back(kStemType_All);
+    session->numOfRemainingParts_ = static_cast<int>(session->analyses_.size());
+
+    for (size_t analysisIndex = 0; analysisIndex < session->analyses_.size(); ++analysisIndex)
     {
-        if (bufferLength_ * 2 <= processStartIndex_ + bufferIndex)
+        auto analyzer = std::make_shared<PartAnalyzer>(this, session, analysisIndex);
+        analyzers_.emplace_back(analyzer);
+        MelissaAnalysisPipeline::getInstance()->request(analyzer);
+    }
+}
+
+void MelissaBPMDetector::cancel()
+{
+    const ScopedLock sl(lock_);
+    ++sessionId_;
+    isFinished_   = false;
+    bpm_          = 0.f;
+    analyzedPart_ = kStemType_All;
+    beats_.clear();
+}
+
+float MelissaBPMDetector::getBpm() const
+{
+    const ScopedLock sl(lock_);
+    return bpm_;
+}
+
+std::vector<MelissaDataSource::Song::Beat> MelissaBPMDetector::getBeats() const
+{
+    const ScopedLock sl(lock_);
+    return beats_;
+}
+
+StemType MelissaBPMDetector::getAnalyzedPart() const
+{
+    const ScopedLock sl(lock_);
+    return analyzedPart_;
+}
+
+void MelissaBPMDetector::sessionFinished(Session& session)
+{
+    // Ties go to the preferred part
+    const PartAnalysis* bestAnalysis = nullptr;
+    for (auto&& analysis : session.analyses_)
+    {
+        if (analysis.bpm_ != 0.f && (bestAnalysis == nullptr || bestAnalysis->confidence_ < analysis.confidence_)) bestAnalysis = &analysis;
+    }
+
+    MelissaAnalysisCache::Rhythm rhythm;
+    rhythm.bpm_ = (bestAnalysis != nullptr) ? bestAnalysis->bpm_ : 0.f;
+    if (bestAnalysis != nullptr) rhythm.beats_ = bestAnalysis->beats_;
+    rhythm.beatsPerBar_ = session.beatsPerBar_;
+    rhythm.withStems_ = session.withStems_;
+    rhythm.analyzedPart_ = (bestAnalysis != nullptr) ? bestAnalysis->part_ : kStemType_All;
+    rhythm.onset_ = session.analyses_.back().onset_;
+    rhythm.onsetFrameMSec_ = static_cast<float>(kOnsetFrameLength * 1000.0 / session.sampleRate_);
+    MelissaAnalysisCache::getInstance()->writeRhythm(session.fingerprint_, rhythm);
+
+    setResult(session.id_, rhythm.bpm_, rhythm.beats_, rhythm.analyzedPart_);
+}
+
+void MelissaBPMDetector::setResult(int sessionId, float bpm, const std::vector<MelissaDataSource::Song::Beat>& beats, StemType analyzedPart)
+{
+    // The result of an abandoned session is only cached
+    const ScopedLock sl(lock_);
+    if (sessionId != sessionId_) return;
+
+    bpm_ = bpm;
+    beats_ = beats;
+    analyzedPart_ = analyzedPart;
+    isFinished_ = true;
+}
+
+void MelissaBPMDetector::addOnset(PartAnalysis& analysis, const float* mono, size_t numOfSamples, float lowPassCoef)
+{
+    // Rise of the log energy of the frame, for the whole band and below ~150 Hz
+    float energy = 0.f, lowEnergy = 0.f;
+    for (size_t sampleIndex = 0; sampleIndex < numOfSamples; ++sampleIndex)
+    {
+        analysis.lowPassState_ = mono[sampleIndex] + lowPassCoef * (analysis.lowPassState_ - mono[sampleIndex]);
+        energy += mono[sampleIndex] * mono[sampleIndex];
+        lowEnergy += analysis.lowPassState_ * analysis.lowPassState_;
+    }
+
+    energy = std::log1p(1000.f * energy);
+    lowEnergy = std::log1p(1000.f * lowEnergy);
+    analysis.onset_.emplace_back(std::max(energy - analysis.prevEnergy_, 0.f));
+    analysis.lowOnset_.emplace_back(std::max(lowEnergy - analysis.prevLowEnergy_, 0.f));
+    analysis.prevEnergy_ = energy;
+    analysis.prevLowEnergy_ = lowEnergy;
+}
+
+float MelissaBPMDetector::estimateBpm(const std::vector<float>& decimated, double decimatedSampleRate, const std::function<bool()>& shouldExit)
+{
+    // Lags (in decimated samples) of the BPM range
+    const int minLag = static_cast<int>(60.0 * decimatedSampleRate / kMaxBpmRange);
+    const int maxLag = static_cast<int>(60.0 * decimatedSampleRate / kBpmMin);
+    const int numOfDecimated = static_cast<int>(decimated.size());
+    if (minLag < 1 || numOfDecimated < maxLag * 2) return 0.f;
+
+    // Long enough that the correlation of a segment with the following maxLag samples does not wrap around
+    int fftOrder = kSegmentOrder;
+    while ((1 << fftOrder) < kSegmentLength + maxLag) ++fftOrder;
+    const int fftSize = 1 << fftOrder;
+
+    std::vector<float> window(kSegmentLength);
+    dsp::WindowingFunction<float>::fillWindowingTables(window.data(), kSegmentLength, dsp::WindowingFunction<float>::hann, false);
+
+    constexpr int hopLength = kSegmentLength / 2;
+    const int numOfSegments = (numOfDecimated + hopLength - 1) / hopLength;
+    const int numOfWorkers = jlimit(1, kMaxNumOfWorkers, std::min(SystemStats::getNumCpus(), numOfSegments));
+
+    // Each worker sums the segments it takes into its own correlation
+    std::vector<std::vector<float>> workerXcorrs(numOfWorkers, std::vector<float>(maxLag + 1, 0.f));
+    std::atomic<int> nextSegmentIndex(0);
+    std::atomic<int> numOfRemainingWorkers(numOfWorkers);
+    WaitableEvent finished;
+
+    auto correlate = [&](int workerIndex)
+    {
+        dsp::FFT fft(fftOrder);
+        std::vector<float> windowed(fftSize * 2), segment(fftSize * 2);
+        auto& xcorr = workerXcorrs[workerIndex];
+
+        for (int segmentIndex = nextSegmentIndex++; segmentIndex < numOfSegments && !shouldExit(); segmentIndex = nextSegmentIndex++)
         {
-            *processFinished = true;
-            break;
+            const int startIndex = segmentIndex * hopLength;
+            const int length = std::min(fftSize, numOfDecimated - startIndex);
+            std::fill(segment.begin(), segment.end(), 0.f);
+            std::fill(windowed.begin(), windowed.end(), 0.f);
+            std::copy(decimated.begin() + startIndex, decimated.begin() + startIndex + length, segment.begin());
+            FloatVectorOperations::multiply(windowed.data(), segment.data(), window.data(), std::min(length, kSegmentLength));
+
+            // sum(windowed[i] * segment[i + lag]) is the inverse transform of conj(W) * S
+            fft.performRealOnlyForwardTransform(windowed.data(), true);
+            fft.performRealOnlyForwardTransform(segment.data(), true);
+            auto w = reinterpret_cast<std::complex<float>*>(windowed.data());
+            auto s = reinterpret_cast<const std::complex<float>*>(segment.data());
+            for (int bin = 0; bin <= fftSize / 2; ++bin) w[bin] = std::conj(w[bin]) * s[bin];
+            fft.performRealOnlyInverseTransform(windowed.data());
+
+            for (int lag = minLag; lag <= maxLag; ++lag) xcorr[lag] += std::abs(windowed[lag]);
         }
-        buffer[bufferIndex + 0] = dataSource_->readBuffer(0, processStartIndex_ + bufferIndex, kStemType_All);
-        buffer[bufferIndex + 1] = dataSource_->readBuffer(1, processStartIndex_ + bufferIndex + 1, kStemType_All);
-    }
-    processStartIndex_ += processBufferLength;
-    bpmDetect_->inputSamples(buffer, processLength);
-    
-    if (!(*processFinished)) return;
-    
-    const auto beatsLength = bpmDetect_->getBeats(nullptr, nullptr, 0);
-    std::vector<float> beatPosition, strength;
-    beatPosition.resize(beatsLength);
-    strength.resize(beatsLength);
-    
-    *bpm = std::round(bpmDetect_->getBpm());
+
+        if (--numOfRemainingWorkers == 0) finished.signal();
+    };
+
+    ThreadPool threadPool(std::max(numOfWorkers - 1, 1));
+    for (int workerIndex = 1; workerIndex < numOfWorkers; ++workerIndex)
+    {
+        threadPool.addJob([&correlate, workerIndex]() { correlate(workerIndex); });
+    }
+    correlate(0);
+    finished.wait();
+    if (shouldExit()) return 0.f;
+
+    std::vector<float> xcorr(maxLag + 1, 0.f);
+    for (auto&& workerXcorr : workerXcorrs) FloatVectorOperations::add(xcorr.data(), workerXcorr.data(), maxLag + 1);
+    removeBias(xcorr, minLag, maxLag);
+
+    std::vector<float> smoothed(maxLag + 1, 0.f);
+    for (int lag = minLag; lag <= maxLag; ++lag)
+    {
+        const int first = std::max(lag - kMovingAverageLength / 2, minLag);
+        const int last = std::min(lag + kMovingAverageLength / 2, maxLag);
+        smoothed[lag] = std::accumulate(xcorr.begin() + first, xcorr.begin() + last + 1, 0.f) / (last - first + 1);
+    }
+
+    soundtouch::PeakFinder peakFinder;
+    const double peakLag = peakFinder.detectPeak(smoothed.data(), minLag, maxLag + 1);
+    if (peakLag < 1e-9) return 0.f;
+
+    const float bpm = static_cast<float>(60.0 * decimatedSampleRate / peakLag);
+    return (kBpmMin <= bpm && bpm <= kBpmMax) ? bpm : 0.f;
 }
@@ -7,22 +7,79 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
 #include "../JuceLibraryCode/JuceHeader.h"
-#include "BPMDetect_for_Melissa.h"
-#include "MelissaAudioEngine.h"
+#include "MelissaAnalyzer.h"
 #include "MelissaDataSource.h"
 
+// Estimates the BPM and the beat grid of the loaded song in the analysis pipeline.
+// The song is decimated while it is streamed, then the tempo is taken from the autocorrelation
+// of the decimated signal, computed by FFT over segments in parallel.
+// When stems are available, the drums and bass stems are analyzed in the same pass and
+// the most confident of them and the full mix is used.
 class MelissaBPMDetector
 {
 public:
     MelissaBPMDetector();
-    void initialize(int sampleRate, size_t bufferLength);
-    void process(bool* processFinished, float* bpm);
-    
-private:    
-    std::unique_ptr<soundtouch::BPMDetect> bpmDetect_;
-    MelissaDataSource* dataSource_;
-    int sampleRate_;
-    size_t bufferLength_;
-    size_t processStartIndex_;
+    ~MelissaBPMDetector();
+    
+    // Called on the message thread. Abandons the running analysis, if any, and starts a new one.
+    void start(int beatsPerBar);
+    void cancel();
+    bool isFinished() const { return isFinished_; }
+    
+    // Valid after isFinished() returned true. BPM is 0 if the detection failed.
+    float getBpm() const;
+    std::vector<MelissaDataSource::Song::Beat> getBeats() const;
+    StemType getAnalyzedPart() const;
+    
+private:
+    // Decimated signal and onsets of one part, accumulated while streamed
+    struct PartAnalysis
+    {
+        PartAnalysis(StemType part) : part_(part), decimateSum_(0.f), decimateCount_(0), prevEnergy_(0.f), prevLowEnergy_(0.f), lowPassState_(0.f), bpm_(0.f), confidence_(0.f) { }
+        StemType part_;
+        std::vector<float> decimated_;
+        float decimateSum_;
+        size_t decimateCount_;
+        std::vector<float> onset_, lowOnset_;
+        float prevEnergy_, prevLowEnergy_, lowPassState_;
+        
+        // Result
+        float bpm_;
+        std::vector<MelissaDataSource::Song::Beat> beats_;
+        float confidence_;
+    };
+    
+    // The parts analyzed together for one start()
+    struct Session
+    {
+        int id_;
+        String fingerprint_;
+        int beatsPerBar_;
+        bool withStems_;
+        double sampleRate_;
+        std::vector<PartAnalysis> analyses_;
+        std::atomic<int> numOfRemainingParts_;
+    };
+    
+    class PartAnalyzer;
+    void sessionFinished(Session& session);
+    void setResult(int sessionId, float bpm, const std::vector<MelissaDataSource::Song::Beat>& beats, StemType analyzedPart);
+    
+    static void addOnset(PartAnalysis& analysis, const float* mono, size_t numOfSamples, float lowPassCoef);
+    static float estimateBpm(const std::vector<float>& decimated, double decimatedSampleRate, const std::function<bool()>& shouldExit);
+    
+    CriticalSection lock_;
+    int sessionId_;
+    std::atomic<bool> isFinished_;
+    float bpm_;
+    StemType analyzedPart_;
+    std::vector<MelissaDataSource::Song::Beat> beats_;
+    
+    // The analyzers of the last start(), which refer to this
+    std::vector<std::shared_ptr<MelissaAnalyzer>> analyzers_;
 };
@@ -0,0 +1,100 @@
+//
+//  MelissaBeatTracker.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaBeatTracker.h"
+
+namespace
+{
+// The larger, the less the tempo can drift from the estimated BPM
+constexpr float kTightness = 400.f;
+
+float getLocalMax(const std::vector<float>& envelope, size_t frame)
+{
+    const size_t first = (frame < 2) ? 0 : frame - 2;
+    const size_t last = std::min(frame + 3, envelope.size());
+    return *std::max_element(envelope.begin() + first, envelope.begin() + last);
+}
+};
+
+std::vector<MelissaDataSource::Song::Beat> MelissaBeatTracker::track(const std::vector<float>& onset, const std::vector<float>& lowOnset,
+                                                                     double frameMSec, float bpm, int beatsPerBar)
+{
+    const size_t numOfFrames = onset.size();
+    const double period = 60000.0 / bpm / frameMSec;
+    if (bpm <= 0.f || period < 2.0 || numOfFrames < period * 2) return {};
+
+    double mean = 0.0, variance = 0.0;
+    for (auto&& o : onset) mean += o;
+    mean /= numOfFrames;
+    for (auto&& o : onset) variance += (o - mean) * (o - mean);
+    const float deviation = static_cast<float>(std::sqrt(variance / numOfFrames));
+    if (deviation <= 0.f) return {};
+
+    // score[t] : the best total onset strength of beat sequences ending at t
+    const int minLag = std::max(static_cast<int>(period / 2), 1);
+    const int maxLag = static_cast<int>(period * 2);
+    std::vector<float> lagPenalty(maxLag + 1, 0.f);
+    for (int lag = minLag; lag <= maxLag; ++lag)
+    {
+        const float l = std::log(lag / static_cast<float>(period));
+        lagPenalty[lag] = kTightness * l * l;
+    }
+
+    std::vector<float> score(numOfFrames);
+    std::vector<int> backlink(numOfFrames, -1);
+    for (size_t t = 0; t < numOfFrames; ++t)
+    {
+        float best = 0.f;
+        for (int lag = minLag; lag <= maxLag && lag <= static_cast<int>(t); ++lag)
+        {
+            const float s = score[t - lag] - lagPenalty[lag];
+            if (backlink[t] == -1 || best < s)
+            {
+                best = s;
+                backlink[t] = static_cast<int>(t) - lag;
+            }
+        }
+        score[t] = onset[t] / deviation + std::max(best, 0.f);
+        if (best <= 0.f) backlink[t] = -1;
+    }
+
+    // Trace back from the best end in the last period
+    int frame = static_cast<int>(numOfFrames) - 1;
+    for (int t = frame; 0 <= t && numOfFrames - t < period; --t)
+    {
+        if (score[frame] < score[t]) frame = t;
+    }
+    std::vector<int> beatFrames;
+    for (; 0 <= frame; frame = backlink[frame]) beatFrames.emplace_back(frame);
+    std::reverse(beatFrames.begin(), beatFrames.end());
+
+    // Downbeats are on the bar phase with the strongest low frequency onsets
+    int downbeatPhase = 0;
+    if (1 < beatsPerBar)
+    {
+        std::vector<float> phaseStrength(beatsPerBar, 0.f);
+        for (size_t beatIndex = 0; beatIndex < beatFrames.size(); ++beatIndex)
+        {
+            phaseStrength[beatIndex % beatsPerBar] += getLocalMax(lowOnset, beatFrames[beatIndex]);
+        }
+        downbeatPhase = static_cast<int>(std::max_element(phaseStrength.begin(), phaseStrength.end()) - phaseStrength.begin());
+    }
+
+    const float strongOnset = static_cast<float>(mean) + deviation * 2.f;
+    std::vector<MelissaDataSource::Song::Beat> beats;
+    beats.reserve(beatFrames.size());
+    for (size_t beatIndex = 0; beatIndex < beatFrames.size(); ++beatIndex)
+    {
+        MelissaDataSource::Song::Beat beat;
+        beat.positionMSec_ = static_cast<float>(beatFrames[beatIndex] * frameMSec);
+        beat.confidence_ = std::min(getLocalMax(onset, beatFrames[beatIndex]) / strongOnset, 1.f);
+        beat.isDownbeat_ = (1 < beatsPerBar) ? (static_cast<int>(beatIndex % beatsPerBar) == downbeatPhase) : true;
+        beats.emplace_back(beat);
+    }
+
+    return beats;
+}
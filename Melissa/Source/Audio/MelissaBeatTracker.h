@@ -0,0 +1,22 @@
+//
+//  MelissaBeatTracker.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <vector>
+#include "MelissaDataSource.h"
+
+// Places beats on an onset envelope by dynamic programming (D. Ellis, "Beat Tracking by Dynamic Programming").
+// Each beat may be placed anywhere between half and twice the period after the previous one at a cost,
+// so the grid can follow the tempo drift of recordings which are not played to a click.
+class MelissaBeatTracker
+{
+public:
+    // onset, lowOnset : one value per frame (lowOnset is used to choose the downbeats)
+    static std::vector<MelissaDataSource::Song::Beat> track(const std::vector<float>& onset, const std::vector<float>& lowOnset,
+                                                            double frameMSec, float bpm, int beatsPerBar);
+};
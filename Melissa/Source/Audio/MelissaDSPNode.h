@@ -0,0 +1,130 @@
+//
+//  MelissaDSPNode.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+
+// A processor of the output stage. It processes whole blocks in place.
+class MelissaDSPNode
+{
+public:
+    virtual ~MelissaDSPNode() { }
+    
+    // An inactive node is skipped, so that a bypassed processor costs nothing
+    virtual bool isActive() const { return true; }
+    
+    virtual void process(float* const channels[], size_t numOfChannels, size_t length) = 0;
+};
+
+// Calls Derived::processBlock<kNumOfChannels>(channels, length), so that the loops are compiled for mono and stereo
+template <class Derived>
+class MelissaDSPNodeBase : public MelissaDSPNode
+{
+public:
+    void process(float* const channels[], size_t numOfChannels, size_t length) override
+    {
+        auto derived = static_cast<Derived*>(this);
+        if (numOfChannels == 1)
+        {
+            derived->template processBlock<1>(channels, length);
+        }
+        else if (numOfChannels == 2)
+        {
+            derived->template processBlock<2>(channels, length);
+        }
+        else
+        {
+            jassertfalse;
+        }
+    }
+};
+
+// Runs the active nodes in the order they were added. The nodes are owned by the caller.
+class MelissaDSPChain
+{
+public:
+    void addNode(MelissaDSPNode* node) { nodes_.emplace_back(node); }
+    
+    void process(float* const channels[], size_t numOfChannels, size_t length)
+    {
+        for (auto&& node : nodes_)
+        {
+            if (node->isActive()) node->process(channels, numOfChannels, length);
+        }
+    }
+    
+private:
+    std::vector<MelissaDSPNode*> nodes_;
+};
+
+// Gain which ramps linearly to the target, across the blocks if the ramp is longer than a block.
+// The target is set on the audio thread before each block.
+class MelissaGainNode : public MelissaDSPNodeBase<MelissaGainNode>
+{
+public:
+    MelissaGainNode(float rampMSec) :
+    rampMSec_(rampMSec),
+    rampLength_(1),
+    gain_(1.f),
+    targetGain_(1.f),
+    step_(0.f),
+    numOfRemainingSamples_(0)
+    {
+    }
+    
+    void setSampleRate(double sampleRate)
+    {
+        rampLength_ = std::max<size_t>(static_cast<size_t>(rampMSec_ / 1000.0 * sampleRate), 1);
+    }
+    
+    void setGain(float gain)
+    {
+        if (gain == targetGain_) return;
+        
+        targetGain_ = gain;
+        numOfRemainingSamples_ = rampLength_;
+        step_ = (targetGain_ - gain_) / rampLength_;
+    }
+    
+    bool isActive() const override { return gain_ != 1.f || targetGain_ != 1.f; }
+    
+    template <size_t kNumOfChannels>
+    void processBlock(float* const channels[], size_t length)
+    {
+        // The gain of each sample is computed from its index, so that the loop has no dependency to vectorize
+        const size_t rampLength = std::min(numOfRemainingSamples_, length);
+        if (0 < rampLength)
+        {
+            const float gain = gain_;
+            const float step = step_;
+            for (size_t chIndex = 0; chIndex < kNumOfChannels; ++chIndex)
+            {
+                float* data = channels[chIndex];
+                for (size_t iSample = 0; iSample < rampLength; ++iSample) data[iSample] *= gain + step * static_cast<float>(iSample + 1);
+            }
+            
+            numOfRemainingSamples_ -= rampLength;
+            gain_ = (numOfRemainingSamples_ == 0) ? targetGain_ : gain + step * static_cast<float>(rampLength);
+        }
+        
+        if (rampLength < length && gain_ != 1.f)
+        {
+            for (size_t chIndex = 0; chIndex < kNumOfChannels; ++chIndex) FloatVectorOperations::multiply(channels[chIndex] + rampLength, gain_, static_cast<int>(length - rampLength));
+        }
+    }
+    
+private:
+    float rampMSec_;
+    size_t rampLength_;
+    float gain_;
+    float targetGain_;
+    float step_;
+    size_t numOfRemainingSamples_;
+};
@@ -0,0 +1,308 @@
+//
+//  MelissaHarmony.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include <atomic>
+#include <numeric>
+#include "MelissaAnalysisCache.h"
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaHarmony.h"
+
+namespace
+{
+const String kPitchClassNames[] = { "C", "C#", "D", "Eb", "E", "F", "F#", "G", "Ab", "A", "Bb", "B" };
+constexpr int kNumOfPitchClasses = 12;
+
+// The chroma is computed on a signal decimated to about 11 kHz, from 65 Hz (C2) to 2.1 kHz (C7)
+constexpr int kDecimatedSampleRate = 11025;
+constexpr int kFrameOrder = 12;
+constexpr int kFrameLength = 1 << kFrameOrder;
+constexpr int kHopLength = kFrameLength / 2;
+constexpr float kMinFrequency = 65.f;
+constexpr float kMaxFrequency = 2100.f;
+constexpr float kSilenceEnergy = 1.f;
+
+// Frames are shared between the workers by chunks
+constexpr int kChunkLength = 32;
+constexpr int kMaxNumOfWorkers = 8;
+
+// Krumhansl-Kessler key profiles
+constexpr float kMajorProfile[kNumOfPitchClasses] = { 6.35f, 2.23f, 3.48f, 2.33f, 4.38f, 4.09f, 2.52f, 5.19f, 2.39f, 3.66f, 2.29f, 2.88f };
+constexpr float kMinorProfile[kNumOfPitchClasses] = { 6.33f, 2.68f, 3.52f, 5.38f, 2.60f, 3.53f, 2.54f, 4.75f, 3.98f, 2.69f, 3.34f, 3.17f };
+
+// States of the chord timeline: 12 major triads, 12 minor triads and no chord.
+// A frame whose chroma is flat (e.g. noise, drums) matches any triad by about 0.5.
+constexpr int kNumOfChordStates = kNumOfPitchClasses * 2 + 1;
+constexpr int kNoChordState = kNumOfChordStates - 1;
+constexpr float kNoChordScore = 0.55f;
+constexpr float kChordChangePenalty = 0.25f;
+
+float correlate(const float* x, const float* y, int length)
+{
+    const float meanX = std::accumulate(x, x + length, 0.f) / length;
+    const float meanY = std::accumulate(y, y + length, 0.f) / length;
+    float covariance = 0.f, varianceX = 0.f, varianceY = 0.f;
+    for (int index = 0; index < length; ++index)
+    {
+        covariance += (x[index] - meanX) * (y[index] - meanY);
+        varianceX += (x[index] - meanX) * (x[index] - meanX);
+        varianceY += (y[index] - meanY) * (y[index] - meanY);
+    }
+    return (varianceX > 0.f && varianceY > 0.f) ? covariance / std::sqrt(varianceX * varianceY) : 0.f;
+}
+
+float getChordScore(const float* chroma, int state)
+{
+    if (state == kNoChordState) return kNoChordScore;
+    
+    // Dot product with the normalized triad
+    const int root = state % kNumOfPitchClasses;
+    const int third = root + ((state < kNumOfPitchClasses) ? 4 : 3);
+    const int fifth = root + 7;
+    return (chroma[root] + chroma[third % kNumOfPitchClasses] + chroma[fifth % kNumOfPitchClasses]) / std::sqrt(3.f);
+}
+};
+
+MelissaHarmony::Builder::Builder(const std::function<void(std::shared_ptr<MelissaHarmony>)>& onBuilt) :
+onBuilt_(onBuilt),
+lengthInSamples_(0),
+decimatedSampleRate_(0.0),
+decimateBy_(1),
+decimateSum_(0.f),
+decimateCount_(0)
+{
+}
+
+bool MelissaHarmony::Builder::prepare(const String& fingerprint, double sampleRate, size_t bufferLength)
+{
+    if (bufferLength == 0) return false;
+    
+    auto cachedHarmony = MelissaAnalysisCache::getInstance()->readHarmony(fingerprint);
+    if (cachedHarmony != nullptr)
+    {
+        onBuilt_(cachedHarmony);
+        return false;
+    }
+    
+    fingerprint_ = fingerprint;
+    lengthInSamples_ = bufferLength;
+    decimateBy_ = std::max<size_t>(static_cast<size_t>(std::round(sampleRate / kDecimatedSampleRate)), 1);
+    decimatedSampleRate_ = sampleRate / decimateBy_;
+    decimated_.reserve(bufferLength / decimateBy_ + 1);
+    return true;
+}
+
+void MelissaHarmony::Builder::process(const AudioSampleBuffer& block, size_t startIndex, size_t length)
+{
+    // Mean of every decimateBy samples of the mid signal, which may straddle the blocks
+    const float* l = block.getReadPointer(0);
+    const float* r = block.getReadPointer(1);
+    for (size_t sampleIndex = 0; sampleIndex < length; ++sampleIndex)
+    {
+        decimateSum_ += l[sampleIndex] + r[sampleIndex];
+        if (++decimateCount_ == decimateBy_)
+        {
+            decimated_.emplace_back(decimateSum_ / (2 * decimateBy_));
+            decimateSum_ = 0.f;
+            decimateCount_ = 0;
+        }
+    }
+}
+
+void MelissaHarmony::Builder::finish()
+{
+    const auto chroma = computeChroma();
+    if (isCancelled()) return;
+    
+    auto harmony = std::make_shared<MelissaHarmony>();
+    harmony->lengthInSamples_ = lengthInSamples_;
+    const int numOfFrames = static_cast<int>(chroma.size() / kNumOfPitchClasses);
+    
+    // Key: the profile which correlates best with the chroma of the whole song
+    float songChroma[kNumOfPitchClasses] = {};
+    for (int frameIndex = 0; frameIndex < numOfFrames; ++frameIndex)
+    {
+        FloatVectorOperations::add(songChroma, chroma.data() + frameIndex * kNumOfPitchClasses, kNumOfPitchClasses);
+    }
+    
+    float maxCorrelation = -1.f;
+    for (int root = 0; root < kNumOfPitchClasses; ++root)
+    {
+        float rotated[kNumOfPitchClasses];
+        for (int pitchClass = 0; pitchClass < kNumOfPitchClasses; ++pitchClass) rotated[pitchClass] = songChroma[(root + pitchClass) % kNumOfPitchClasses];
+        
+        const float majorCorrelation = correlate(rotated, kMajorProfile, kNumOfPitchClasses);
+        const float minorCorrelation = correlate(rotated, kMinorProfile, kNumOfPitchClasses);
+        if (maxCorrelation < std::max(majorCorrelation, minorCorrelation))
+        {
+            maxCorrelation = std::max(majorCorrelation, minorCorrelation);
+            harmony->keyRoot_ = root;
+            harmony->isKeyMinor_ = (majorCorrelation < minorCorrelation);
+        }
+    }
+    
+    // Chords: the most likely sequence of triads, where each change costs a penalty (Viterbi)
+    std::vector<float> scores(kNumOfChordStates, 0.f), prevScores(kNumOfChordStates, 0.f);
+    std::vector<uint8> fromStates(numOfFrames * kNumOfChordStates);
+    for (int frameIndex = 0; frameIndex < numOfFrames; ++frameIndex)
+    {
+        const int bestPrevState = static_cast<int>(std::max_element(prevScores.begin(), prevScores.end()) - prevScores.begin());
+        for (int state = 0; state < kNumOfChordStates; ++state)
+        {
+            const bool shouldStay = (prevScores[bestPrevState] - kChordChangePenalty <= prevScores[state]);
+            const int fromState = shouldStay ? state : bestPrevState;
+            fromStates[frameIndex * kNumOfChordStates + state] = static_cast<uint8>(fromState);
+            scores[state] = prevScores[fromState] - (shouldStay ? 0.f : kChordChangePenalty) + getChordScore(chroma.data() + frameIndex * kNumOfPitchClasses, state);
+        }
+        std::swap(scores, prevScores);
+    }
+    
+    std::vector<int> states(numOfFrames);
+    int state = static_cast<int>(std::max_element(prevScores.begin(), prevScores.end()) - prevScores.begin());
+    for (int frameIndex = numOfFrames - 1; 0 <= frameIndex; --frameIndex)
+    {
+        states[frameIndex] = state;
+        state = fromStates[frameIndex * kNumOfChordStates + state];
+    }
+    
+    // A chord starts half a hop before the center of its first frame
+    for (int frameIndex = 0; frameIndex < numOfFrames; ++frameIndex)
+    {
+        if (0 < frameIndex && states[frameIndex] == states[frameIndex - 1]) continue;
+        
+        const float startMSec = (frameIndex == 0) ? 0.f : static_cast<float>((frameIndex * kHopLength + (kFrameLength - kHopLength) / 2) * 1000.0 / decimatedSampleRate_);
+        if (states[frameIndex] == kNoChordState)
+        {
+            harmony->chords_.push_back({ startMSec, kNoChord, false });
+        }
+        else
+        {
+            harmony->chords_.push_back({ startMSec, states[frameIndex] % kNumOfPitchClasses, kNumOfPitchClasses <= states[frameIndex] });
+        }
+    }
+    
+    MelissaAnalysisCache::getInstance()->writeHarmony(fingerprint_, *harmony);
+    onBuilt_(harmony);
+}
+
+std::vector<float> MelissaHarmony::Builder::computeChroma() const
+{
+    const int numOfSamples = static_cast<int>(decimated_.size());
+    const int numOfFrames = (numOfSamples + kHopLength - 1) / kHopLength;
+    std::vector<float> chroma(numOfFrames * kNumOfPitchClasses, 0.f);
+    if (numOfFrames == 0) return chroma;
+    
+    // Pitch class of each FFT bin in the range
+    constexpr int numOfBins = kFrameLength / 2 + 1;
+    std::vector<int> pitchClasses(numOfBins, -1);
+    for (int bin = 1; bin < numOfBins; ++bin)
+    {
+        const double frequency = bin * decimatedSampleRate_ / kFrameLength;
+        if (frequency < kMinFrequency || kMaxFrequency < frequency) continue;
+        const int noteNumber = static_cast<int>(std::round(69.0 + 12.0 * std::log2(frequency / 440.0)));
+        pitchClasses[bin] = noteNumber % kNumOfPitchClasses;
+    }
+    
+    std::vector<float> window(kFrameLength);
+    dsp::WindowingFunction<float>::fillWindowingTables(window.data(), kFrameLength, dsp::WindowingFunction<float>::hann, false);
+    
+    const int numOfChunks = (numOfFrames + kChunkLength - 1) / kChunkLength;
+    const int numOfWorkers = jlimit(1, kMaxNumOfWorkers, std::min(SystemStats::getNumCpus(), numOfChunks));
+    std::atomic<int> nextChunkIndex(0);
+    std::atomic<int> numOfRemainingWorkers(numOfWorkers);
+    WaitableEvent finished;
+    
+    auto computeChunks = [&]()
+    {
+        dsp::FFT fft(kFrameOrder);
+        std::vector<float> buffer(kFrameLength * 2);
+        
+        for (int chunkIndex = nextChunkIndex++; chunkIndex < numOfChunks && !isCancelled(); chunkIndex = nextChunkIndex++)
+        {
+            const int lastFrameIndex = std::min((chunkIndex + 1) * kChunkLength, numOfFrames);
+            for (int frameIndex = chunkIndex * kChunkLength; frameIndex < lastFrameIndex; ++frameIndex)
+            {
+                const int startIndex = frameIndex * kHopLength;
+                const int length = std::min(kFrameLength, numOfSamples - startIndex);
+                std::fill(buffer.begin(), buffer.end(), 0.f);
+                FloatVectorOperations::multiply(buffer.data(), decimated_.data() + startIndex, window.data(), length);
+                fft.performFrequencyOnlyForwardTransform(buffer.data(), true);
+                
+                float* frameChroma = chroma.data() + frameIndex * kNumOfPitchClasses;
+                float energy = 0.f;
+                for (int bin = 1; bin < numOfBins; ++bin)
+                {
+                    if (pitchClasses[bin] < 0) continue;
+                    frameChroma[pitchClasses[bin]] += buffer[bin] * buffer[bin];
+                    energy += buffer[bin] * buffer[bin];
+                }
+                
+                // Amplitude of each pitch class, normalized so that the frames are compared regardless of the level
+                if (energy < kSilenceEnergy)
+                {
+                    std::fill(frameChroma, frameChroma + kNumOfPitchClasses, 0.f);
+                    continue;
+                }
+                for (int pitchClass = 0; pitchClass < kNumOfPitchClasses; ++pitchClass) frameChroma[pitchClass] = std::sqrt(frameChroma[pitchClass]);
+                const float norm = std::sqrt(std::inner_product(frameChroma, frameChroma + kNumOfPitchClasses, frameChroma, 0.f));
+                FloatVectorOperations::multiply(frameChroma, 1.f / norm, kNumOfPitchClasses);
+            }
+        }
+        
+        if (--numOfRemainingWorkers == 0) finished.signal();
+    };
+    
+    ThreadPool threadPool(std::max(numOfWorkers - 1, 1));
+    for (int workerIndex = 1; workerIndex < numOfWorkers; ++workerIndex) threadPool.addJob(computeChunks);
+    computeChunks();
+    finished.wait();
+    
+    return chroma;
+}
+
+String MelissaHarmony::getName(int root, bool isMinor, float semitone)
+{
+    if (root == kNoChord) return "N.C.";
+    
+    const int transposedRoot = ((root + static_cast<int>(std::round(semitone))) % kNumOfPitchClasses + kNumOfPitchClasses) % kNumOfPitchClasses;
+    return kPitchClassNames[transposedRoot] + (isMinor ? "m" : "");
+}
+
+void MelissaHarmony::write(OutputStream& output) const
+{
+    output.writeInt64(static_cast<int64>(lengthInSamples_));
+    output.writeInt(keyRoot_);
+    output.writeBool(isKeyMinor_);
+    output.writeInt(static_cast<int>(chords_.size()));
+    for (auto&& chord : chords_)
+    {
+        output.writeFloat(chord.startMSec_);
+        output.writeInt(chord.root_);
+        output.writeBool(chord.isMinor_);
+    }
+}
+
+std::shared_ptr<MelissaHarmony> MelissaHarmony::read(InputStream& input)
+{
+    auto harmony = std::make_shared<MelissaHarmony>();
+    harmony->lengthInSamples_ = static_cast<size_t>(input.readInt64());
+    harmony->keyRoot_ = input.readInt();
+    harmony->isKeyMinor_ = input.readBool();
+    if (harmony->keyRoot_ < 0 || kNumOfPitchClasses <= harmony->keyRoot_) return nullptr;
+    
+    const int numOfChords = input.readInt();
+    if (numOfChords < 0 || input.getNumBytesRemaining() < numOfChords * 9) return nullptr;
+    harmony->chords_.resize(numOfChords);
+    for (auto&& chord : harmony->chords_)
+    {
+        chord.startMSec_ = input.readFloat();
+        chord.root_ = input.readInt();
+        chord.isMinor_ = input.readBool();
+        if (chord.root_ < kNoChord || kNumOfPitchClasses <= chord.root_) return nullptr;
+    }
+    
+    return harmony;
+}
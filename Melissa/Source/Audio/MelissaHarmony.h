@@ -0,0 +1,71 @@
+//
+//  MelissaHarmony.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaAnalyzer.h"
+
+// Key and chord timeline of the loaded song, estimated from the chroma (energy of each pitch class).
+// Only major and minor triads are told apart, which is what most songs are practiced with.
+class MelissaHarmony
+{
+public:
+    static constexpr int kNoChord = -1;
+    
+    struct Chord
+    {
+        float startMSec_;
+        int root_; // pitch class, C = 0. kNoChord if no chord is heard
+        bool isMinor_;
+    };
+    
+    // Builds the harmony in the analysis pipeline, or reads it from the analysis cache.
+    // onBuilt is called on the pipeline thread.
+    class Builder : public MelissaAnalyzer
+    {
+    public:
+        Builder(const std::function<void(std::shared_ptr<MelissaHarmony>)>& onBuilt);
+        
+        bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) override;
+        void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) override;
+        void finish() override;
+        
+    private:
+        std::vector<float> computeChroma() const;
+        
+        std::function<void(std::shared_ptr<MelissaHarmony>)> onBuilt_;
+        String fingerprint_;
+        size_t lengthInSamples_;
+        double decimatedSampleRate_;
+        size_t decimateBy_;
+        float decimateSum_;
+        size_t decimateCount_;
+        std::vector<float> decimated_;
+    };
+    
+    size_t getLengthInSamples() const { return lengthInSamples_; }
+    int getKeyRoot() const { return keyRoot_; }
+    bool isKeyMinor() const { return isKeyMinor_; }
+    const std::vector<Chord>& getChords() const { return chords_; }
+    
+    // Names transposed by the pitch control, e.g. "F#m"
+    static String getName(int root, bool isMinor, float semitone);
+    
+    // Serialization for the analysis cache. read() returns nullptr if the data is broken.
+    void write(OutputStream& output) const;
+    static std::shared_ptr<MelissaHarmony> read(InputStream& input);
+    
+private:
+    size_t lengthInSamples_ = 0;
+    int keyRoot_ = 0;
+    bool isKeyMinor_ = false;
+    std::vector<Chord> chords_;
+};
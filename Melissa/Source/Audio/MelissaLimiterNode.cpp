@@ -0,0 +1,106 @@
+//
+//  MelissaLimiterNode.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include <cmath>
+#include "MelissaLimiterNode.h"
+
+namespace
+{
+// The same ceiling as the loudness normalization leaves for the true peak
+constexpr float kCeilingDb = -1.f;
+constexpr double kLookAheadMSec = 1.5;
+constexpr double kReleaseMSec = 80.0;
+};
+
+MelissaLimiterNode::MelissaLimiterNode() :
+ceiling_(Decibels::decibelsToGain(kCeilingDb)),
+releaseCoef_(0.f),
+lookAheadLength_(0),
+delayLength_(0),
+sampleCount_(0),
+lastLimitedCount_(0),
+holdQueueFront_(0),
+holdQueueSize_(0),
+averageIndex_(0),
+averageSum_(0.0),
+envelope_(1.f)
+{
+}
+
+void MelissaLimiterNode::prepare(double sampleRate, size_t maxBlockLength)
+{
+    lookAheadLength_ = std::max<size_t>(static_cast<size_t>(kLookAheadMSec / 1000.0 * sampleRate), 2);
+    delayLength_ = lookAheadLength_ - 1;
+    releaseCoef_ = static_cast<float>(1.0 - std::exp(-1000.0 / (kReleaseMSec * sampleRate)));
+    
+    sampleCount_ = 0;
+    lastLimitedCount_ = 0;
+    holdQueue_.assign(lookAheadLength_ + 1, { 0, 1.f });
+    holdQueueFront_ = holdQueueSize_ = 0;
+    averageBuffer_.assign(lookAheadLength_, 1.f);
+    averageIndex_ = 0;
+    averageSum_ = static_cast<double>(lookAheadLength_);
+    envelope_ = 1.f;
+    
+    for (auto&& delayLine : delayLines_) delayLine.assign(delayLength_, 0.f);
+    gains_.resize(maxBlockLength);
+    work_.resize(delayLength_ + maxBlockLength);
+}
+
+void MelissaLimiterNode::ensureCapacity(size_t length)
+{
+    // The device may send a block longer than it said
+    if (gains_.size() < length) gains_.resize(length);
+    if (work_.size() < delayLength_ + length) work_.resize(delayLength_ + length);
+}
+
+void MelissaLimiterNode::computeGains(float* peaksToGains, size_t length)
+{
+    const size_t capacity = holdQueue_.size();
+    for (size_t iSample = 0; iSample < length; ++iSample, ++sampleCount_)
+    {
+        const float peak = peaksToGains[iSample];
+        if (ceiling_ < peak)
+        {
+            const float gain = ceiling_ / peak;
+            while (0 < holdQueueSize_ && gain <= holdQueue_[(holdQueueFront_ + holdQueueSize_ - 1) % capacity].gain_) --holdQueueSize_;
+            holdQueue_[(holdQueueFront_ + holdQueueSize_) % capacity] = { sampleCount_, gain };
+            ++holdQueueSize_;
+            lastLimitedCount_ = sampleCount_;
+        }
+        while (0 < holdQueueSize_ && holdQueue_[holdQueueFront_].sampleCount_ + lookAheadLength_ <= sampleCount_)
+        {
+            holdQueueFront_ = (holdQueueFront_ + 1) % capacity;
+            --holdQueueSize_;
+        }
+        const float heldGain = (holdQueueSize_ == 0) ? 1.f : holdQueue_[holdQueueFront_].gain_;
+        
+        averageSum_ += heldGain - averageBuffer_[averageIndex_];
+        averageBuffer_[averageIndex_] = heldGain;
+        averageIndex_ = (averageIndex_ + 1) % lookAheadLength_;
+        const float averageGain = static_cast<float>(averageSum_ / lookAheadLength_);
+        
+        envelope_ = (averageGain < envelope_) ? averageGain : envelope_ + (averageGain - envelope_) * releaseCoef_;
+        peaksToGains[iSample] = envelope_;
+    }
+    
+    // Back to the exact idle state, so that the next quiet blocks skip this
+    if (lastLimitedCount_ + 2 * lookAheadLength_ <= sampleCount_)
+    {
+        averageSum_ = static_cast<double>(lookAheadLength_);
+        if (0.9999f < envelope_) envelope_ = 1.f;
+    }
+}
+
+void MelissaLimiterNode::delay(float* data, std::vector<float>& delayLine, size_t length)
+{
+    float* work = work_.data();
+    FloatVectorOperations::copy(work, delayLine.data(), static_cast<int>(delayLength_));
+    FloatVectorOperations::copy(work + delayLength_, data, static_cast<int>(length));
+    FloatVectorOperations::copy(data, work, static_cast<int>(length));
+    FloatVectorOperations::copy(delayLine.data(), work + length, static_cast<int>(delayLength_));
+}
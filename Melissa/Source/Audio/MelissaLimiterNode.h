@@ -0,0 +1,99 @@
+//
+//  MelissaLimiterNode.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaDSPNode.h"
+
+// Look-ahead peak limiter at the end of the output stage, so that a boosted EQ or volume doesn't clip.
+// The gain is the minimum of the required gains over the look-ahead, smoothed by a moving average of the same length,
+// so it has fully come down when the peak leaves the delay line. Then it is released slowly.
+// While nothing is limited, a block is only delayed.
+class MelissaLimiterNode : public MelissaDSPNodeBase<MelissaLimiterNode>
+{
+public:
+    MelissaLimiterNode();
+    
+    // Not real-time safe
+    void prepare(double sampleRate, size_t maxBlockLength);
+    
+    size_t getLatencyInSamples() const { return delayLength_; }
+    
+    template <size_t kNumOfChannels>
+    void processBlock(float* const channels[], size_t length)
+    {
+        if (lookAheadLength_ == 0) return;
+        ensureCapacity(length);
+        
+        // Peak of the channels per sample
+        const int numOfSamples = static_cast<int>(length);
+        float* gains = gains_.data();
+        FloatVectorOperations::abs(gains, channels[0], numOfSamples);
+        for (size_t chIndex = 1; chIndex < kNumOfChannels; ++chIndex)
+        {
+            FloatVectorOperations::abs(work_.data(), channels[chIndex], numOfSamples);
+            FloatVectorOperations::max(gains, gains, work_.data(), numOfSamples);
+        }
+        
+        const bool shouldLimit = !isIdle() || ceiling_ < FloatVectorOperations::findMaximum(gains, numOfSamples);
+        if (shouldLimit)
+        {
+            computeGains(gains, length);
+        }
+        else
+        {
+            sampleCount_ += length;
+        }
+        
+        for (size_t chIndex = 0; chIndex < kNumOfChannels; ++chIndex)
+        {
+            delay(channels[chIndex], delayLines_[chIndex], length);
+            if (shouldLimit) FloatVectorOperations::multiply(channels[chIndex], gains, numOfSamples);
+        }
+    }
+    
+private:
+    static constexpr size_t kMaxNumOfChannels = 2;
+    
+    bool isIdle() const { return envelope_ == 1.f && lastLimitedCount_ + 2 * lookAheadLength_ <= sampleCount_; }
+    void ensureCapacity(size_t length);
+    
+    // Replaces the peaks with the gains
+    void computeGains(float* peaksToGains, size_t length);
+    void delay(float* data, std::vector<float>& delayLine, size_t length);
+    
+    float ceiling_;
+    float releaseCoef_;
+    size_t lookAheadLength_;
+    size_t delayLength_;
+    uint64 sampleCount_;
+    uint64 lastLimitedCount_;
+    
+    // Minimum of the required gains over the look-ahead, as a monotonic queue in a ring buffer.
+    // A gain of 1 is never queued, and an empty queue means 1.
+    struct HeldGain
+    {
+        uint64 sampleCount_;
+        float gain_;
+    };
+    std::vector<HeldGain> holdQueue_;
+    size_t holdQueueFront_;
+    size_t holdQueueSize_;
+    
+    // Moving average of the held gains
+    std::vector<float> averageBuffer_;
+    size_t averageIndex_;
+    double averageSum_;
+    
+    float envelope_;
+    
+    std::vector<float> delayLines_[kMaxNumOfChannels];
+    std::vector<float> gains_;
+    std::vector<float> work_;
+};
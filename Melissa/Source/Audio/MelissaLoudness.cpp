@@ -0,0 +1,310 @@
+//
+//  MelissaLoudness.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include <array>
+#include <cmath>
+#include <vector>
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaAnalyzer.h"
+#include "MelissaLoudness.h"
+#include "MelissaStemProvider.h"
+
+MelissaLoudness MelissaLoudness::instance_;
+
+namespace
+{
+// Gating blocks of 400 ms overlapping by 75 %, summed from 100 ms steps
+constexpr double kStepMSec = 100.0;
+constexpr size_t kNumOfStepsPerBlock = 4;
+constexpr double kAbsoluteGateLufs = -70.0;
+constexpr double kRelativeGateLu = -10.0;
+
+// The normalization never pushes the true peak over this, and stays in a sensible range
+constexpr float kMaxTruePeakDb = -1.f;
+constexpr float kMinGainDb = -24.f;
+constexpr float kMaxGainDb = 12.f;
+
+// True peak from 4x oversampling by a polyphase windowed-sinc interpolator
+constexpr size_t kOversampling = 4;
+constexpr size_t kNumOfTapsPerPhase = 12;
+
+double getLoudness(double power) { return -0.691 + 10.0 * std::log10(power); }
+
+const std::array<std::array<float, kNumOfTapsPerPhase>, kOversampling>& getTruePeakTaps()
+{
+    static const auto taps = []()
+    {
+        std::array<std::array<float, kNumOfTapsPerPhase>, kOversampling> phaseTaps;
+        constexpr size_t numOfTaps = kOversampling * kNumOfTapsPerPhase;
+        constexpr double center = (numOfTaps - 1) / 2.0;
+        for (size_t tapIndex = 0; tapIndex < numOfTaps; ++tapIndex)
+        {
+            const double x = (tapIndex - center) / kOversampling;
+            const double sinc = (x == 0.0) ? 1.0 : std::sin(MathConstants<double>::pi * x) / (MathConstants<double>::pi * x);
+            const double window = 0.5 - 0.5 * std::cos(2.0 * MathConstants<double>::pi * (tapIndex + 0.5) / numOfTaps);
+            phaseTaps[tapIndex % kOversampling][tapIndex / kOversampling] = static_cast<float>(sinc * window);
+        }
+        return phaseTaps;
+    }();
+    return taps;
+}
+
+// Transposed direct form II, run over a whole block at once
+struct Biquad
+{
+    double b0_ = 1.0, b1_ = 0.0, b2_ = 0.0, a1_ = 0.0, a2_ = 0.0;
+    double z1_ = 0.0, z2_ = 0.0;
+    
+    void process(float* data, size_t length)
+    {
+        double z1 = z1_, z2 = z2_;
+        for (size_t sampleIndex = 0; sampleIndex < length; ++sampleIndex)
+        {
+            const double x = data[sampleIndex];
+            const double y = b0_ * x + z1;
+            z1 = b1_ * x - a1_ * y + z2;
+            z2 = b2_ * x - a2_ * y;
+            data[sampleIndex] = static_cast<float>(y);
+        }
+        z1_ = z1;
+        z2_ = z2;
+    }
+};
+};
+
+class MelissaLoudness::PartAnalyzer : public MelissaAnalyzer
+{
+public:
+    PartAnalyzer(StemType part) : part_(part), stepLength_(0), stepPosition_(0), stepSum_(0.0), peak_(0.f) { }
+    
+    StemType getPart() const override { return part_; }
+    
+    bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) override
+    {
+        if (bufferLength == 0 || sampleRate <= 0.0) return false;
+        
+        std::map<StemType, MelissaAnalysisCache::Loudness> loudnesses;
+        if (MelissaAnalysisCache::getInstance()->readLoudness(fingerprint, loudnesses) && loudnesses.find(part_) != loudnesses.end())
+        {
+            MelissaLoudness::getInstance()->partMeasured(fingerprint, part_, loudnesses[part_], false);
+            return false;
+        }
+        
+        fingerprint_ = fingerprint;
+        for (auto&& channel : channels_) channel.setSampleRate(sampleRate);
+        stepLength_ = std::max(static_cast<size_t>(std::round(sampleRate * kStepMSec / 1000.0)), static_cast<size_t>(1));
+        stepPowers_.reserve(bufferLength / stepLength_ + 1);
+        return true;
+    }
+    
+    void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) override
+    {
+        for (size_t ch = 0; ch < kNumOfChs; ++ch)
+        {
+            const float* data = block.getReadPointer(static_cast<int>(ch));
+            peak_ = std::max(peak_, channels_[ch].measureTruePeak(data, length));
+            
+            weighted_[ch].resize(length);
+            std::copy(data, data + length, weighted_[ch].begin());
+            channels_[ch].shelf_.process(weighted_[ch].data(), length);
+            channels_[ch].highPass_.process(weighted_[ch].data(), length);
+        }
+        
+        // Mean square of both channels (weighted 1.0 each) per 100 ms step
+        for (size_t index = 0; index < length;)
+        {
+            const size_t stepLength = std::min(stepLength_ - stepPosition_, length - index);
+            float sum = 0.f;
+            for (size_t ch = 0; ch < kNumOfChs; ++ch)
+            {
+                const float* weighted = weighted_[ch].data() + index;
+                for (size_t sampleIndex = 0; sampleIndex < stepLength; ++sampleIndex) sum += weighted[sampleIndex] * weighted[sampleIndex];
+            }
+            stepSum_ += sum;
+            stepPosition_ += stepLength;
+            index += stepLength;
+            
+            if (stepPosition_ == stepLength_)
+            {
+                stepPowers_.emplace_back(stepSum_ / stepLength_);
+                stepSum_ = 0.0;
+                stepPosition_ = 0;
+            }
+        }
+    }
+    
+    void finish() override
+    {
+        std::vector<double> blockPowers;
+        for (size_t stepIndex = 0; stepIndex + kNumOfStepsPerBlock <= stepPowers_.size(); ++stepIndex)
+        {
+            double power = 0.0;
+            for (size_t offset = 0; offset < kNumOfStepsPerBlock; ++offset) power += stepPowers_[stepIndex + offset];
+            blockPowers.emplace_back(power / kNumOfStepsPerBlock);
+        }
+        
+        auto getGatedPower = [&](double gateLufs)
+        {
+            double sum = 0.0;
+            size_t count = 0;
+            for (auto&& power : blockPowers)
+            {
+                if (power <= 0.0 || getLoudness(power) <= gateLufs) continue;
+                sum += power;
+                ++count;
+            }
+            return (count == 0) ? 0.0 : sum / count;
+        };
+        
+        MelissaAnalysisCache::Loudness loudness;
+        loudness.integratedLufs_ = static_cast<float>(kAbsoluteGateLufs);
+        const double absoluteGatedPower = getGatedPower(kAbsoluteGateLufs);
+        if (0.0 < absoluteGatedPower)
+        {
+            const double relativeGatedPower = getGatedPower(getLoudness(absoluteGatedPower) + kRelativeGateLu);
+            if (0.0 < relativeGatedPower) loudness.integratedLufs_ = static_cast<float>(getLoudness(relativeGatedPower));
+        }
+        loudness.truePeakDb_ = Decibels::gainToDecibels(peak_);
+        
+        MelissaLoudness::getInstance()->partMeasured(fingerprint_, part_, loudness, true);
+    }
+    
+private:
+    static constexpr size_t kNumOfChs = 2;
+    
+    struct Channel
+    {
+        // K-weighting of BS.1770, derived for any sample rate
+        void setSampleRate(double sampleRate)
+        {
+            {
+                const double k = std::tan(MathConstants<double>::pi * 1681.974450955533 / sampleRate);
+                const double q = 0.7071752369554196;
+                const double vh = std::pow(10.0, 3.999843853973347 / 20.0);
+                const double vb = std::pow(vh, 0.4996667741545416);
+                const double a0 = 1.0 + k / q + k * k;
+                shelf_.b0_ = (vh + vb * k / q + k * k) / a0;
+                shelf_.b1_ = 2.0 * (k * k - vh) / a0;
+                shelf_.b2_ = (vh - vb * k / q + k * k) / a0;
+                shelf_.a1_ = 2.0 * (k * k - 1.0) / a0;
+                shelf_.a2_ = (1.0 - k / q + k * k) / a0;
+            }
+            {
+                const double k = std::tan(MathConstants<double>::pi * 38.13547087602444 / sampleRate);
+                const double q = 0.5003270373238773;
+                const double a0 = 1.0 + k / q + k * k;
+                highPass_.b0_ = 1.0;
+                highPass_.b1_ = -2.0;
+                highPass_.b2_ = 1.0;
+                highPass_.a1_ = 2.0 * (k * k - 1.0) / a0;
+                highPass_.a2_ = (1.0 - k / q + k * k) / a0;
+            }
+        }
+        
+        float measureTruePeak(const float* data, size_t length)
+        {
+            // The last samples of the previous block come first, so that the interpolation is seamless
+            constexpr size_t historyLength = kNumOfTapsPerPhase - 1;
+            extended_.resize(historyLength + length);
+            std::copy(history_.begin(), history_.end(), extended_.begin());
+            std::copy(data, data + length, extended_.begin() + historyLength);
+            
+            const auto& taps = getTruePeakTaps();
+            float peak = 0.f;
+            for (size_t sampleIndex = 0; sampleIndex < length; ++sampleIndex)
+            {
+                const float* x = extended_.data() + sampleIndex;
+                peak = std::max(peak, std::abs(x[historyLength]));
+                for (auto&& phaseTaps : taps)
+                {
+                    float y = 0.f;
+                    for (size_t tapIndex = 0; tapIndex < kNumOfTapsPerPhase; ++tapIndex) y += phaseTaps[tapIndex] * x[historyLength - tapIndex];
+                    peak = std::max(peak, std::abs(y));
+                }
+            }
+            
+            std::copy(extended_.end() - historyLength, extended_.end(), history_.begin());
+            return peak;
+        }
+        
+        Biquad shelf_, highPass_;
+        std::array<float, kNumOfTapsPerPhase - 1> history_ {};
+        std::vector<float> extended_;
+    };
+    
+    StemType part_;
+    String fingerprint_;
+    Channel channels_[kNumOfChs];
+    std::vector<float> weighted_[kNumOfChs];
+    size_t stepLength_, stepPosition_;
+    double stepSum_;
+    std::vector<double> stepPowers_;
+    float peak_;
+};
+
+MelissaLoudness::MelissaLoudness() :
+enabled_(true),
+targetLufs_(-14.f)
+{
+    for (auto&& gain : gains_) gain = 1.f;
+}
+
+void MelissaLoudness::setup(bool enabled, float targetLufs)
+{
+    const ScopedLock sl(lock_);
+    enabled_ = enabled;
+    targetLufs_ = targetLufs;
+    for (int part = kStemType_All; part < kNumStemTypes; ++part) updateGain(static_cast<StemType>(part));
+}
+
+float MelissaLoudness::getNormalizationGain(StemType part) const
+{
+    if (part < kStemType_All || kNumStemTypes <= part) return 1.f;
+    return gains_[part + 1];
+}
+
+void MelissaLoudness::songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate)
+{
+    {
+        const ScopedLock sl(lock_);
+        fingerprint_ = MelissaAnalysisCache::getInstance()->getFingerprint();
+        loudnesses_.clear();
+        for (auto&& gain : gains_) gain = 1.f;
+    }
+    if (bufferLength == 0) return;
+    
+    auto pipeline = MelissaAnalysisPipeline::getInstance();
+    pipeline->request(std::make_shared<PartAnalyzer>(kStemType_All));
+    if (MelissaStemProvider::getInstance()->getStemProviderStatus() == kStemProviderStatus_Available)
+    {
+        for (int part = 0; part < kNumStemTypes; ++part) pipeline->request(std::make_shared<PartAnalyzer>(static_cast<StemType>(part)));
+    }
+}
+
+void MelissaLoudness::partMeasured(const String& fingerprint, StemType part, const MelissaAnalysisCache::Loudness& loudness, bool shouldWriteCache)
+{
+    // Ignore the result for the previous song
+    const ScopedLock sl(lock_);
+    if (fingerprint != fingerprint_) return;
+    
+    // The parts measured so far are written together, as they share a chunk
+    loudnesses_[part] = loudness;
+    if (shouldWriteCache) MelissaAnalysisCache::getInstance()->writeLoudness(fingerprint, loudnesses_);
+    updateGain(part);
+}
+
+void MelissaLoudness::updateGain(StemType part)
+{
+    float gain = 1.f;
+    const auto loudness = loudnesses_.find(part);
+    if (enabled_ && loudness != loudnesses_.end() && kAbsoluteGateLufs < loudness->second.integratedLufs_)
+    {
+        const float gainDb = std::min(targetLufs_ - loudness->second.integratedLufs_, kMaxTruePeakDb - loudness->second.truePeakDb_);
+        gain = Decibels::decibelsToGain(jlimit(kMinGainDb, kMaxGainDb, gainDb));
+    }
+    gains_[part + 1] = gain;
+}
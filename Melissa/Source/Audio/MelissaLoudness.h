@@ -0,0 +1,56 @@
+//
+//  MelissaLoudness.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaAnalysisCache.h"
+#include "MelissaDataSource.h"
+#include "MelissaDefinitions.h"
+
+// Integrated loudness (EBU R128 / ITU-R BS.1770) and true peak of the song and of each stem,
+// turned into the gain which brings each of them to the same loudness when played.
+// The parts are measured in the analysis pipeline and cached with the other analyses.
+class MelissaLoudness : public MelissaDataSourceListener
+{
+public:
+    void setup(bool enabled, float targetLufs);
+    
+    // Safe to call from the audio thread. 1 while the part is being measured.
+    float getNormalizationGain(StemType part) const;
+    
+    // MelissaDataSourceListener
+    void songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate) override;
+    
+    // Singleton
+    static MelissaLoudness* getInstance() { return &instance_; }
+    MelissaLoudness(const MelissaLoudness&) = delete;
+    MelissaLoudness& operator=(const MelissaLoudness&) = delete;
+    MelissaLoudness(MelissaLoudness&&) = delete;
+    MelissaLoudness& operator=(MelissaLoudness&&) = delete;
+    
+private:
+    // Singleton
+    MelissaLoudness();
+    ~MelissaLoudness() {}
+    static MelissaLoudness instance_;
+    
+    class PartAnalyzer;
+    void partMeasured(const String& fingerprint, StemType part, const MelissaAnalysisCache::Loudness& loudness, bool shouldWriteCache);
+    void updateGain(StemType part);
+    
+    CriticalSection lock_;
+    String fingerprint_;
+    std::map<StemType, MelissaAnalysisCache::Loudness> loudnesses_;
+    bool enabled_;
+    float targetLufs_;
+    
+    // Indexed by part + 1, as kStemType_All is -1
+    std::atomic<float> gains_[kNumStemTypes + 1];
+};
@@ -5,86 +5,375 @@
 //  Copyright(c) 2020 Masaki Ono
 //
 
+#include <algorithm>
 #include <cmath>
 #include "MelissaDefinitions.h"
 #include "MelissaMetronome.h"
 #include "MelissaModel.h"
 
+namespace
+{
+// A larger step than this between two samples is a seek or a loop
+constexpr float kMaxContinuousStepMSec = 100.f;
+
+// After a seek or a loop, a beat starting within this is still clicked
+constexpr float kBeatStartToleranceMSec = 5.f;
+
+// The beep is a saw of the pitch, which decays to silence in its length
+constexpr double kAccentPitch = 1760.0;
+constexpr double kBeatPitch = 880.0;
+constexpr double kBeepLengthMSec = 50.0;
+constexpr double kBeepAttackMSec = 0.5;
+
+// Part of the Nyquist frequency the click sounds are limited to
+constexpr double kClickBandwidth = 0.9;
+
+constexpr float kSecondaryAccentGain = 0.6f;
+constexpr float kSubdivisionGain = 0.5f;
+
+// A click file is used for all the clicks, and is quieter on the beats which aren't accented
+constexpr float kClickFileLowGain = 0.5f;
+constexpr double kMaxClickFileLengthSec = 2.0;
+constexpr double kClickFileFadeOutMSec = 5.0;
+constexpr int kNumOfLowPassStages = 2;
+
+// Latency of LagrangeInterpolator and then some
+constexpr size_t kInterpolatorPadding = 8;
+
+int floorMod(int numerator, int denominator)
+{
+    const int remainder = numerator % denominator;
+    return (remainder < 0) ? remainder + denominator : remainder;
+}
+
+// Band-limited saw, the sum of its harmonics below the Nyquist frequency
+std::vector<float> renderBeep(double sampleRate, double pitch)
+{
+    const size_t length = static_cast<size_t>(kBeepLengthMSec / 1000.0 * sampleRate);
+    const size_t attackLength = std::max<size_t>(static_cast<size_t>(kBeepAttackMSec / 1000.0 * sampleRate), 1);
+    const int numOfHarmonics = std::max(static_cast<int>(kClickBandwidth * sampleRate / 2.0 / pitch), 1);
+    
+    std::vector<float> beep(length, 0.f);
+    for (int harmonic = 1; harmonic <= numOfHarmonics; ++harmonic)
+    {
+        const double omega = 2.0 * M_PI * pitch * harmonic / sampleRate;
+        const double amplitude = 2.0 / (M_PI * harmonic);
+        for (size_t iSample = 0; iSample < length; ++iSample) beep[iSample] += static_cast<float>(amplitude * std::sin(omega * iSample));
+    }
+    
+    // A short fade in, so that the beep doesn't start with a step
+    for (size_t iSample = 0; iSample < length; ++iSample)
+    {
+        const double attack = (iSample < attackLength) ? 0.5 - 0.5 * std::cos(M_PI * iSample / attackLength) : 1.0;
+        beep[iSample] *= static_cast<float>(attack * (1.0 - static_cast<double>(iSample) / length));
+    }
+    return beep;
+}
+
+std::vector<float> resampleClickFile(const AudioBuffer<float>& clickFile, double clickFileSampleRate, double sampleRate)
+{
+    const int inputLength = clickFile.getNumSamples();
+    const float* clickFileData = clickFile.getReadPointer(0);
+    std::vector<float> output;
+    if (clickFileSampleRate == sampleRate)
+    {
+        output.assign(clickFileData, clickFileData + inputLength);
+    }
+    else
+    {
+        std::vector<float> input(clickFileData, clickFileData + inputLength);
+        input.resize(inputLength + kInterpolatorPadding, 0.f);
+        
+        const double ratio = clickFileSampleRate / sampleRate;
+        if (1.0 < ratio)
+        {
+            // Band-limited below the Nyquist frequency of the output first
+            for (int iStage = 0; iStage < kNumOfLowPassStages; ++iStage)
+            {
+                IIRFilter lowPass;
+                lowPass.setCoefficients(IIRCoefficients::makeLowPass(clickFileSampleRate, kClickBandwidth * sampleRate / 2.0));
+                lowPass.processSamples(input.data(), static_cast<int>(input.size()));
+            }
+        }
+        
+        output.resize(static_cast<size_t>(inputLength / ratio));
+        LagrangeInterpolator interpolator;
+        interpolator.process(ratio, input.data(), output.data(), static_cast<int>(output.size()));
+    }
+    
+    // The file may have been cut at the maximum length
+    const size_t fadeOutLength = std::min(output.size(), static_cast<size_t>(kClickFileFadeOutMSec / 1000.0 * sampleRate));
+    const size_t fadeOutStart = output.size() - fadeOutLength;
+    for (size_t iSample = 0; iSample < fadeOutLength; ++iSample)
+    {
+        output[fadeOutStart + iSample] *= 1.f - static_cast<float>(iSample + 1) / fadeOutLength;
+    }
+    return output;
+}
+};
+
 MelissaMetronome::MelissaMetronome() :
 isMusicPlaying_(false),
 sampleRate_(1),
 volumeBalance_(0.5f),
-timeMSec_(0),
-timeMSecDecimal_(0.f)
+tempoMapCursor_(0),
+numOfVoices_(0),
+clickFileSampleRate_(0.0)
 {
+    formatManager_.registerBasicFormats();
     MelissaModel::getInstance()->addListener(this);
+    MelissaDataSource::getInstance()->addListener(this);
+    updateTempoMap();
+}
+
+MelissaMetronome::~MelissaMetronome()
+{
+    MelissaModel::getInstance()->removeListener(this);
+    MelissaDataSource::getInstance()->removeListener(this);
 }
 
 void MelissaMetronome::render(float* bufferToRender[], size_t numOfChannels, const std::vector<float>& timeIndicesMSec, size_t bufferLength)
 {
-    if (metronome_.bpm_ < kBpmMin) return;
-    const auto playingSpeed = MelissaModel::getInstance()->getPlayingSpeed();
+    if (clickSoundsHandoff_.update(clickSounds_)) numOfVoices_ = 0;
+    if (tempoGridHandoff_.update(tempoGrid_))
+    {
+        // The beats up to now on the new map, so that the beats between aren't all clicked at once
+        tempoMapCursor_ = 0;
+        metronome_.prevBeatCount_ = tempoGrid_->tempoMap_.getBeatCount(metronome_.prevTimeMSec_, tempoMapCursor_);
+    }
+    if (bufferLength == 0) return;
     
-    for (int iSample = 0; iSample < bufferLength; ++iSample)
+    if (tempoGrid_ != nullptr && (kBpmMin <= metronome_.bpm_ || tempoGrid_->hasBeatGrid_))
     {
         if (isMusicPlaying_)
         {
-            timeMSec_ = static_cast<int>(timeIndicesMSec[iSample]);
+            // The beat is taken from the song time, so it stays on the grid after loops and speed changes.
+            // A loop or the next song jumps back in the block, which is then scheduled in parts.
+            const float* timeIndices = timeIndicesMSec.data();
+            size_t offset = 0;
+            while (offset < bufferLength)
+            {
+                size_t length = bufferLength - offset;
+                if (timeIndices[bufferLength - 1] < timeIndices[offset])
+                {
+                    auto jump = std::adjacent_find(timeIndices + offset, timeIndices + bufferLength, [](float timeMSec, float nextTimeMSec)
+                    {
+                        return nextTimeMSec < timeMSec || timeMSec + kMaxContinuousStepMSec < nextTimeMSec;
+                    });
+                    if (jump != timeIndices + bufferLength) length = static_cast<size_t>(jump - (timeIndices + offset)) + 1;
+                }
+                scheduleClicks(timeIndices, offset, length);
+                offset += length;
+            }
         }
         else
         {
-            const float timeMSecToAdvance = (playingSpeed / 100.f) / sampleRate_ * 1000.f;
-            timeMSecDecimal_ += timeMSecToAdvance;
-            
-            const int timeMSecNumerator = static_cast<int>(timeMSecDecimal_);
-            timeMSecDecimal_ -= timeMSecNumerator;
-            
-            timeMSec_ += timeMSecNumerator;
+            scheduleFreeRunningClicks(bufferLength);
         }
-        
-        metronome_.osc_ += 2.f / (sampleRate_ / metronome_.pitch_);
-        if (metronome_.osc_ > 1.f) metronome_.osc_ = -1.f;
-        
-        const auto metronomeOsc = metronome_.osc_ * metronome_.amp_ * metronome_.volume_ * (metronome_.on_ ? 1.f : 0.f) * volumeBalance_;
+    }
+    
+    mixClicks(bufferToRender, numOfChannels, bufferLength);
+}
 
-        if (numOfChannels == 1)
-        {
-            bufferToRender[0][iSample] += metronomeOsc;
-        }
-        else if (numOfChannels == 2)
-        {
-            bufferToRender[0][iSample] += metronomeOsc;
-            bufferToRender[1][iSample] += metronomeOsc;
-        }
+void MelissaMetronome::scheduleClicks(const float* timeIndicesMSec, size_t offset, size_t length)
+{
+    const double firstTimeMSec = timeIndicesMSec[offset];
+    const double lastTimeMSec = timeIndicesMSec[offset + length - 1];
+    if (firstTimeMSec < metronome_.prevTimeMSec_ || metronome_.prevTimeMSec_ + kMaxContinuousStepMSec < firstTimeMSec)
+    {
+        metronome_.prevBeatCount_ = tempoGrid_->tempoMap_.getBeatCount(firstTimeMSec - kBeatStartToleranceMSec, tempoMapCursor_);
+    }
+    const double lastBeatCount = tempoGrid_->tempoMap_.getBeatCount(lastTimeMSec, tempoMapCursor_);
+    
+    // The time indices are increasing here, so the sample of a click is found by a binary search
+    const int subdivision = metronome_.subdivision_;
+    const auto firstTick = static_cast<int64>(std::floor(metronome_.prevBeatCount_ * subdivision)) + 1;
+    const auto lastTick = static_cast<int64>(std::floor(lastBeatCount * subdivision));
+    const float* begin = timeIndicesMSec + offset;
+    const float* end = begin + length;
+    for (int64 tick = firstTick; tick <= lastTick; ++tick)
+    {
+        const double tickTimeMSec = tempoGrid_->tempoMap_.getTimeMSec(static_cast<double>(tick) / subdivision);
+        const auto position = std::lower_bound(begin, end, tickTimeMSec) - begin;
+        triggerClick(tick, subdivision, offset + std::min<size_t>(position, length - 1));
+    }
+    
+    metronome_.prevBeatCount_ = lastBeatCount;
+    metronome_.prevTimeMSec_ = lastTimeMSec;
+}
+
+void MelissaMetronome::scheduleFreeRunningClicks(size_t length)
+{
+    const double stepMSec = (MelissaModel::getInstance()->getPlayingSpeed() / 100.0) / sampleRate_ * 1000.0;
+    if (stepMSec <= 0.0) return;
+    
+    // The n-th sample of the block is at prevTimeMSec_ + (n + 1) * stepMSec
+    const double lastTimeMSec = metronome_.prevTimeMSec_ + stepMSec * length;
+    const double lastBeatCount = tempoGrid_->tempoMap_.getBeatCount(lastTimeMSec, tempoMapCursor_);
+    
+    const int subdivision = metronome_.subdivision_;
+    const auto firstTick = static_cast<int64>(std::floor(metronome_.prevBeatCount_ * subdivision)) + 1;
+    const auto lastTick = static_cast<int64>(std::floor(lastBeatCount * subdivision));
+    for (int64 tick = firstTick; tick <= lastTick; ++tick)
+    {
+        const double tickTimeMSec = tempoGrid_->tempoMap_.getTimeMSec(static_cast<double>(tick) / subdivision);
+        const double position = std::ceil((tickTimeMSec - metronome_.prevTimeMSec_) / stepMSec) - 1.0;
+        triggerClick(tick, subdivision, static_cast<size_t>(jlimit(0.0, static_cast<double>(length - 1), position)));
+    }
+    
+    metronome_.prevBeatCount_ = lastBeatCount;
+    metronome_.prevTimeMSec_ = lastTimeMSec;
+}
 
-        const int beatSection = (timeMSec_ - metronome_.beatPositionMSec_) / ((60.f / metronome_.bpm_) * 1000.f);
-        if (metronome_.accent_ != 0 && (beatSection / metronome_.accent_ != metronome_.prevBeatSection_ / metronome_.accent_))
+void MelissaMetronome::triggerClick(int64 tick, int subdivision, size_t offset)
+{
+    if (!metronome_.on_) return;
+    
+    Voice voice = { kClickSound_Low, 1.f, 0, offset };
+    if (tick % subdivision != 0)
+    {
+        voice.gain_ = kSubdivisionGain;
+    }
+    else if (metronome_.accent_ != 0)
+    {
+        const auto beat = static_cast<int>(tick / subdivision);
+        const int accent = metronome_.accent_;
+        const int positionInBar = floorMod(beat - tempoGrid_->tempoMap_.getDownbeatCount(), accent);
+        switch (metronome_.accentPattern_.load())
         {
-            metronome_.amp_ = 1.f;
-            metronome_.pitch_ = 880 * 2;
+            case kAccentPattern_Downbeat:
+                if (positionInBar == 0) voice.sound_ = kClickSound_High;
+                break;
+            case kAccentPattern_DownbeatAndMiddle:
+                if (positionInBar == 0)
+                {
+                    voice.sound_ = kClickSound_High;
+                }
+                else if (4 <= accent && accent % 2 == 0 && positionInBar == accent / 2)
+                {
+                    voice.sound_ = kClickSound_High;
+                    voice.gain_ = kSecondaryAccentGain;
+                }
+                break;
+            case kAccentPattern_Backbeat:
+                if (positionInBar % 2 == 1) voice.sound_ = kClickSound_High;
+                break;
+            default:
+                break;
         }
-        else if (beatSection != metronome_.prevBeatSection_)
+    }
+    
+    // The oldest click gives way if too many overlap
+    if (numOfVoices_ == kMaxNumOfVoices)
+    {
+        std::move(voices_ + 1, voices_ + kMaxNumOfVoices, voices_);
+        --numOfVoices_;
+    }
+    voices_[numOfVoices_++] = voice;
+}
+
+void MelissaMetronome::mixClicks(float* bufferToRender[], size_t numOfChannels, size_t length)
+{
+    if (clickSounds_ == nullptr)
+    {
+        numOfVoices_ = 0;
+        return;
+    }
+    
+    const float volume = metronome_.volume_ * volumeBalance_;
+    size_t numOfActiveVoices = 0;
+    for (size_t voiceIndex = 0; voiceIndex < numOfVoices_; ++voiceIndex)
+    {
+        auto voice = voices_[voiceIndex];
+        const auto& sound = (*clickSounds_)[voice.sound_];
+        if (voice.position_ < sound.size() && voice.offset_ < length)
         {
-            metronome_.amp_ = 1.f;
-            metronome_.pitch_ = 880;
+            const size_t mixLength = std::min(length - voice.offset_, sound.size() - voice.position_);
+            for (size_t chIndex = 0; chIndex < numOfChannels; ++chIndex)
+            {
+                FloatVectorOperations::addWithMultiply(bufferToRender[chIndex] + voice.offset_, sound.data() + voice.position_, voice.gain_ * volume, static_cast<int>(mixLength));
+            }
+            voice.position_ += mixLength;
         }
-        metronome_.prevBeatSection_ = beatSection;
         
-        if (metronome_.amp_ > 0.f)
-        {
-            metronome_.amp_ -= 1.f / static_cast<float>(sampleRate_) * 20.f;
-        }
-        else if (metronome_.amp_ < 0.f)
-        {
-            metronome_.amp_ = 0.f;
-        }
+        voice.offset_ = 0;
+        if (voice.position_ < sound.size()) voices_[numOfActiveVoices++] = voice;
+    }
+    numOfVoices_ = numOfActiveVoices;
+}
+
+void MelissaMetronome::setOutputSampleRate(int32_t sampleRate)
+{
+    const ScopedLock sl(clickFileLock_);
+    sampleRate_ = sampleRate;
+    
+    auto clickSounds = std::make_unique<ClickSounds>();
+    renderClickSounds(*clickSounds, clickFile_, clickFileSampleRate_, sampleRate);
+    clickSoundsHandoff_.publish(std::move(clickSounds));
+}
+
+void MelissaMetronome::setSubdivision(int subdivision)
+{
+    metronome_.subdivision_ = jlimit(1, kMaxSubdivision, subdivision);
+}
+
+void MelissaMetronome::setAccentPattern(AccentPattern accentPattern)
+{
+    metronome_.accentPattern_ = accentPattern;
+}
+
+bool MelissaMetronome::setClickFile(const String& filePath)
+{
+    AudioBuffer<float> clickFile;
+    double clickFileSampleRate = 0.0;
+    
+    std::unique_ptr<AudioFormatReader> reader;
+    if (File::isAbsolutePath(filePath)) reader.reset(formatManager_.createReaderFor(File(filePath)));
+    if (reader != nullptr && 0.0 < reader->sampleRate && 0 < reader->lengthInSamples)
+    {
+        // Mixed down to mono
+        const auto length = static_cast<int>(std::min<int64>(reader->lengthInSamples, static_cast<int64>(kMaxClickFileLengthSec * reader->sampleRate)));
+        const auto numOfChannels = static_cast<int>(reader->numChannels);
+        AudioBuffer<float> buffer(numOfChannels, length);
+        reader->read(&buffer, 0, length, 0, true, true);
+        
+        clickFile.setSize(1, length);
+        clickFile.clear();
+        for (int chIndex = 0; chIndex < numOfChannels; ++chIndex) clickFile.addFrom(0, 0, buffer, chIndex, 0, length, 1.f / numOfChannels);
+        clickFileSampleRate = reader->sampleRate;
+    }
+    
+    {
+        // The sample rate can't change meanwhile, as setOutputSampleRate() renders under the same lock
+        const ScopedLock sl(clickFileLock_);
+        std::swap(clickFile_, clickFile);
+        clickFileSampleRate_ = clickFileSampleRate;
+        
+        auto clickSounds = std::make_unique<ClickSounds>();
+        renderClickSounds(*clickSounds, clickFile_, clickFileSampleRate_, sampleRate_);
+        clickSoundsHandoff_.publish(std::move(clickSounds));
+    }
+    
+    return filePath.isEmpty() || 0 < clickFileSampleRate;
+}
+
+void MelissaMetronome::renderClickSounds(ClickSounds& clickSounds, const AudioBuffer<float>& clickFile, double clickFileSampleRate, int32_t sampleRate) const
+{
+    if (clickFile.getNumSamples() == 0 || clickFileSampleRate <= 0.0)
+    {
+        clickSounds[kClickSound_High] = renderBeep(sampleRate, kAccentPitch);
+        clickSounds[kClickSound_Low] = renderBeep(sampleRate, kBeatPitch);
+        return;
     }
+    
+    clickSounds[kClickSound_High] = resampleClickFile(clickFile, clickFileSampleRate, sampleRate);
+    clickSounds[kClickSound_Low] = clickSounds[kClickSound_High];
+    FloatVectorOperations::multiply(clickSounds[kClickSound_Low].data(), kClickFileLowGain, static_cast<int>(clickSounds[kClickSound_Low].size()));
 }
 
 void MelissaMetronome::playbackStatusChanged(PlaybackStatus status)
 {
     isMusicPlaying_ = (status == kPlaybackStatus_Playing);
-    timeMSecDecimal_ = 0.f;
 }
 
 void MelissaMetronome::metronomeSwitchChanged(bool on)
@@ -95,11 +384,13 @@ void MelissaMetronome::metronomeSwitchChanged(bool on)
 void MelissaMetronome::bpmChanged(float bpm)
 {
     metronome_.bpm_ = bpm;
+    updateTempoMap();
 }
 
 void MelissaMetronome::beatPositionChanged(float beatPositionMSec)
 {
     metronome_.beatPositionMSec_ = beatPositionMSec;
+    updateTempoMap();
 }
 
 void MelissaMetronome::accentChanged(int accent)
@@ -123,3 +414,31 @@ void MelissaMetronome::musicMetronomeBalanceChanged(float balance)
         volumeBalance_ = 1.f;
     }
 }
+
+void MelissaMetronome::songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate)
+{
+    updateTempoMap();
+}
+
+void MelissaMetronome::beatsUpdated()
+{
+    updateTempoMap();
+}
+
+void MelissaMetronome::updateTempoMap()
+{
+    std::vector<MelissaDataSource::Song::Beat> beats;
+    MelissaDataSource::getInstance()->getBeats(beats);
+    
+    const bool hasBeatGrid = (2 <= beats.size());
+    std::unique_ptr<TempoGrid> tempoGrid;
+    if (hasBeatGrid)
+    {
+        tempoGrid = std::make_unique<TempoGrid>(MelissaTempoMap(beats), true);
+    }
+    else
+    {
+        tempoGrid = std::make_unique<TempoGrid>(MelissaTempoMap(std::max(metronome_.bpm_, static_cast<float>(kBpmMin)), metronome_.beatPositionMSec_), false);
+    }
+    tempoGridHandoff_.publish(std::move(tempoGrid));
+}
@@ -7,16 +7,44 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <vector>
 #include <memory>
+#include "MelissaDataSource.h"
 #include "MelissaModelListener.h"
+#include "MelissaTempoMap.h"
 
-class MelissaMetronome : public MelissaModelListener
+// The clicks are scheduled per block: the beats (and subdivisions) inside the block are found on the tempo map,
+// and each starts at its exact sample. They are mixed from the click sounds rendered beforehand, so between the clicks
+// a block costs only the two beat lookups at its ends.
+class MelissaMetronome : public MelissaModelListener,
+                         public MelissaDataSourceListener
 {
 public:
+    enum AccentPattern
+    {
+        kAccentPattern_Downbeat,
+        kAccentPattern_DownbeatAndMiddle,
+        kAccentPattern_Backbeat,
+        kNumOfAccentPatterns
+    };
+    static constexpr int kMaxSubdivision = 4;
+    
     MelissaMetronome();
+    ~MelissaMetronome();
     void render(float* bufferToRender[], size_t numOfChannels, const std::vector<float>& timeIndicesMSec, size_t bufferLength);
-    void setOutputSampleRate(int32_t sampleRate) { sampleRate_ = sampleRate; };
+    
+    // Not real-time safe. The click sounds are rendered for the sample rate, and render() picks them up.
+    void setOutputSampleRate(int32_t sampleRate);
+    
+    // Message thread. Clicks per beat (1 - kMaxSubdivision) and which beats of the bar are accented.
+    void setSubdivision(int subdivision);
+    void setAccentPattern(AccentPattern accentPattern);
+    
+    // Message thread. A short audio file used as the click instead of the built-in beep. An empty path or a file
+    // which can't be read restores the beep. Returns false if the file can't be read.
+    bool setClickFile(const String& filePath);
     
     // MelissaModelListener
     void playbackStatusChanged(PlaybackStatus status) override;
@@ -27,27 +55,122 @@ public:
     void metronomeVolumeChanged(float volume) override;
     void musicMetronomeBalanceChanged(float balance) override;
     
+    // MelissaDataSourceListener
+    void songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate) override;
+    void beatsUpdated() override;
+    
 private:
+    // Hands an object over to the audio thread without a lock. The audio thread never deletes: the object it replaces
+    // is retired, and deleted by the next publish() (or the destructor).
+    template <typename T>
+    class Handoff
+    {
+    public:
+        Handoff() : pending_(nullptr), retired_(nullptr) { }
+        ~Handoff()
+        {
+            delete pending_.exchange(nullptr);
+            delete retired_.exchange(nullptr);
+        }
+        
+        // Calls must not overlap. An object which hasn't been picked up yet is replaced.
+        void publish(std::unique_ptr<T> object)
+        {
+            delete retired_.exchange(nullptr);
+            delete pending_.exchange(object.release());
+        }
+        
+        // Audio thread. Returns true if current has been replaced with the object published last.
+        bool update(std::unique_ptr<T>& current)
+        {
+            // The replaced object waits for the one retired before to be deleted
+            if (pending_.load() == nullptr || retired_.load() != nullptr) return false;
+            T* object = pending_.exchange(nullptr);
+            if (object == nullptr) return false;
+            retired_.store(current.release());
+            current.reset(object);
+            return true;
+        }
+        
+    private:
+        std::atomic<T*> pending_;
+        std::atomic<T*> retired_;
+    };
+    
+    // The beat grid of the song if detected, otherwise the constant tempo of bpm and beat position.
+    // Message thread, render() picks it up.
+    void updateTempoMap();
+    
+    struct TempoGrid
+    {
+        TempoGrid(const MelissaTempoMap& tempoMap, bool hasBeatGrid) : tempoMap_(tempoMap), hasBeatGrid_(hasBeatGrid) { }
+        MelissaTempoMap tempoMap_;
+        bool hasBeatGrid_;
+    };
+    
+    enum ClickSound
+    {
+        kClickSound_High,
+        kClickSound_Low,
+        kNumOfClickSounds
+    };
+    typedef std::array<std::vector<float>, kNumOfClickSounds> ClickSounds;
+    
+    // The beep, or the click file resampled to the output sample rate
+    void renderClickSounds(ClickSounds& clickSounds, const AudioBuffer<float>& clickFile, double clickFileSampleRate, int32_t sampleRate) const;
+    
+    // Triggers the clicks after prevBeatCount_ up to the last sample. The time indices are continuous here.
+    void scheduleClicks(const float* timeIndicesMSec, size_t offset, size_t length);
+    
+    // While the music is stopped, the metronome goes on from where it was at the playing speed
+    void scheduleFreeRunningClicks(size_t length);
+    void triggerClick(int64 tick, int subdivision, size_t offset);
+    void mixClicks(float* bufferToRender[], size_t numOfChannels, size_t length);
+    
     struct Metronome
     {
-        Metronome() : on_(false), volume_(1.f), beatPositionMSec_(0.f), bpm_(120.f), accent_(4), prevBeatSection_(0), prevAccentBeatSection_(0), amp_(0.f), osc_(-1.f), pitch_(880) { }
+        Metronome() : on_(false), volume_(1.f), beatPositionMSec_(0.f), bpm_(120.f), accent_(4), subdivision_(1), accentPattern_(kAccentPattern_Downbeat), prevBeatCount_(0.0), prevTimeMSec_(0.0) { }
         bool on_;
         float volume_;
         float beatPositionMSec_;
         float bpm_;
         int accent_;
-        int prevBeatSection_;
-        int prevAccentBeatSection_;
+        std::atomic<int> subdivision_;
+        std::atomic<int> accentPattern_;
         
-        // for beep
-        float amp_;
-        float osc_;
-        float pitch_;
+        // Beat count and song time of the last sample rendered
+        double prevBeatCount_;
+        double prevTimeMSec_;
     } metronome_;
     
     bool isMusicPlaying_;
-    int32_t sampleRate_;
+    std::atomic<int32_t> sampleRate_;
     float volumeBalance_;
-    uint32_t timeMSec_;
-    float timeMSecDecimal_;
+    
+    // Owned by the audio thread, and replaced through tempoGridHandoff_
+    std::unique_ptr<TempoGrid> tempoGrid_;
+    Handoff<TempoGrid> tempoGridHandoff_;
+    size_t tempoMapCursor_;
+    
+    // A click being played. offset_ is where it starts in the current block.
+    struct Voice
+    {
+        ClickSound sound_;
+        float gain_;
+        size_t position_;
+        size_t offset_;
+    };
+    static constexpr size_t kMaxNumOfVoices = 4;
+    Voice voices_[kMaxNumOfVoices];
+    size_t numOfVoices_;
+    
+    // Owned by the audio thread, and replaced through clickSoundsHandoff_
+    std::unique_ptr<ClickSounds> clickSounds_;
+    Handoff<ClickSounds> clickSoundsHandoff_;
+    
+    // The click sounds are rendered under clickFileLock_, which render() never takes
+    AudioBuffer<float> clickFile_;
+    double clickFileSampleRate_;
+    CriticalSection clickFileLock_;
+    AudioFormatManager formatManager_;
 };
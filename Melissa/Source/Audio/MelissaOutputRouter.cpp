@@ -0,0 +1,158 @@
+//
+//  MelissaOutputRouter.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaOutputRouter.h"
+
+MelissaOutputRouter MelissaOutputRouter::instance_;
+
+namespace
+{
+constexpr float kMainVolumeRampMSec = 20.f;
+};
+
+MelissaOutputRouter::OutputStage::OutputStage() :
+mainVolumeNode_(kMainVolumeRampMSec)
+{
+    chain_.addNode(&mainVolumeNode_);
+    chain_.addNode(&limiterNode_);
+}
+
+MelissaOutputRouter::MelissaOutputRouter() :
+shouldUpdateMatrix_(true),
+matrixNumOfDeviceChannels_(0)
+{
+    for (auto&& outputChannel : outputChannels_) outputChannel = 0;
+    for (auto&& outputStage : outputStages_) outputStage = std::make_unique<OutputStage>();
+    
+    for (size_t sourceIndex = 0; sourceIndex < kNumOfSources; ++sourceIndex)
+    {
+        for (size_t chIndex = 0; chIndex < kNumOfBusChannels; ++chIndex) busPointers_[sourceIndex][chIndex] = nullptr;
+    }
+}
+
+void MelissaOutputRouter::setup(int musicOutputChannel, int metronomeOutputChannel)
+{
+    setOutputChannel(kSource_Music, musicOutputChannel);
+    setOutputChannel(kSource_Metronome, metronomeOutputChannel);
+}
+
+void MelissaOutputRouter::setOutputChannel(Source source, int outputChannel)
+{
+    if (source < 0 || kNumOfSources <= source) return;
+    
+    // Pairs only
+    outputChannels_[source] = jlimit(0, static_cast<int>(kMaxNumOfOutputChannels) - 2, outputChannel) / 2 * 2;
+    shouldUpdateMatrix_ = true;
+}
+
+void MelissaOutputRouter::prepare(double sampleRate, size_t maxBlockLength)
+{
+    for (auto&& bus : buses_)
+    {
+        for (auto&& channel : bus) channel.assign(maxBlockLength, 0.f);
+    }
+    for (auto&& outputStage : outputStages_)
+    {
+        outputStage->mainVolumeNode_.setSampleRate(sampleRate);
+        outputStage->limiterNode_.prepare(sampleRate, maxBlockLength);
+    }
+}
+
+size_t MelissaOutputRouter::getPairIndex(Source source, size_t numOfDeviceChannels) const
+{
+    // A pair which the device doesn't have falls back to the first one
+    const auto outputChannel = static_cast<size_t>(outputChannels_[source].load());
+    return (outputChannel < numOfDeviceChannels) ? outputChannel / 2 : 0;
+}
+
+bool MelissaOutputRouter::isDirect(size_t numOfDeviceChannels) const
+{
+    if (numOfDeviceChannels <= 2) return true;
+    
+    for (int sourceIndex = 0; sourceIndex < kNumOfSources; ++sourceIndex)
+    {
+        if (getPairIndex(static_cast<Source>(sourceIndex), numOfDeviceChannels) != 0) return false;
+    }
+    return true;
+}
+
+float** MelissaOutputRouter::getBus(Source source, size_t length)
+{
+    for (size_t chIndex = 0; chIndex < kNumOfBusChannels; ++chIndex)
+    {
+        auto& channel = buses_[source][chIndex];
+        if (channel.size() < length) channel.resize(length);
+        FloatVectorOperations::clear(channel.data(), static_cast<int>(length));
+        busPointers_[source][chIndex] = channel.data();
+    }
+    return busPointers_[source];
+}
+
+void MelissaOutputRouter::updateMatrix(size_t numOfDeviceChannels)
+{
+    matrixNumOfDeviceChannels_ = numOfDeviceChannels;
+    std::fill(&matrix_[0][0][0], &matrix_[0][0][0] + kNumOfSources * kNumOfBusChannels * kMaxNumOfOutputChannels, 0.f);
+    std::fill(isPairUsed_, isPairUsed_ + kMaxNumOfPairs, false);
+    
+    for (int sourceIndex = 0; sourceIndex < kNumOfSources; ++sourceIndex)
+    {
+        const size_t pairIndex = getPairIndex(static_cast<Source>(sourceIndex), numOfDeviceChannels);
+        const size_t left = pairIndex * 2;
+        const size_t right = left + 1;
+        matrix_[sourceIndex][0][left] = 1.f;
+        
+        // The last pair of an odd number of channels is mono, and is mixed down as the engine does
+        matrix_[sourceIndex][1][(right < numOfDeviceChannels) ? right : left] = 1.f;
+        isPairUsed_[pairIndex] = true;
+    }
+}
+
+void MelissaOutputRouter::route(float* const deviceChannels[], size_t numOfDeviceChannels, size_t length)
+{
+    numOfDeviceChannels = std::min(numOfDeviceChannels, kMaxNumOfOutputChannels);
+    if (shouldUpdateMatrix_.exchange(false) || matrixNumOfDeviceChannels_ != numOfDeviceChannels) updateMatrix(numOfDeviceChannels);
+    
+    const int numOfSamples = static_cast<int>(length);
+    for (size_t sourceIndex = 0; sourceIndex < kNumOfSources; ++sourceIndex)
+    {
+        for (size_t busChIndex = 0; busChIndex < kNumOfBusChannels; ++busChIndex)
+        {
+            const float* bus = busPointers_[sourceIndex][busChIndex];
+            if (bus == nullptr) continue;
+            
+            for (size_t deviceChIndex = 0; deviceChIndex < numOfDeviceChannels; ++deviceChIndex)
+            {
+                const float gain = matrix_[sourceIndex][busChIndex][deviceChIndex];
+                if (gain == 1.f)
+                {
+                    FloatVectorOperations::add(deviceChannels[deviceChIndex], bus, numOfSamples);
+                }
+                else if (gain != 0.f)
+                {
+                    FloatVectorOperations::addWithMultiply(deviceChannels[deviceChIndex], bus, gain, numOfSamples);
+                }
+            }
+        }
+    }
+}
+
+void MelissaOutputRouter::processOutputStages(float* const deviceChannels[], size_t numOfDeviceChannels, size_t length, float mainVolume)
+{
+    numOfDeviceChannels = std::min(numOfDeviceChannels, kMaxNumOfOutputChannels);
+    const bool isDirectOutput = isDirect(numOfDeviceChannels);
+    for (size_t pairIndex = 0; pairIndex < kMaxNumOfPairs; ++pairIndex)
+    {
+        const size_t left = pairIndex * 2;
+        if (numOfDeviceChannels <= left) break;
+        if (isDirectOutput ? (pairIndex != 0) : !isPairUsed_[pairIndex]) continue;
+        
+        const size_t numOfChannels = std::min<size_t>(numOfDeviceChannels - left, 2);
+        auto& outputStage = outputStages_[pairIndex];
+        outputStage->mainVolumeNode_.setGain(mainVolume);
+        outputStage->chain_.process(deviceChannels + left, numOfChannels, length);
+    }
+}
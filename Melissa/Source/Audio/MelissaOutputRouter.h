@@ -0,0 +1,90 @@
+//
+//  MelissaOutputRouter.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaDSPNode.h"
+#include "MelissaLimiterNode.h"
+
+// Sends the music and the metronome to the device output channels, e.g. the click only to the headphones of a 4 channel interface.
+// Each source goes to a pair of the active output channels. When all the sources go to the first pair, they are rendered
+// into the device buffer directly as before. Otherwise they are rendered into their buses and added through the routing matrix.
+// Each pair in use has its own output stage (main volume and limiter).
+class MelissaOutputRouter
+{
+public:
+    enum Source
+    {
+        kSource_Music,
+        kSource_Metronome,
+        kNumOfSources
+    };
+    static constexpr size_t kMaxNumOfOutputChannels = 8;
+    
+    // Message thread. The output channel is the first channel of the pair (0, 2, 4...).
+    void setup(int musicOutputChannel, int metronomeOutputChannel);
+    void setOutputChannel(Source source, int outputChannel);
+    int getOutputChannel(Source source) const { return outputChannels_[source]; }
+    
+    // Audio thread, not real-time safe
+    void prepare(double sampleRate, size_t maxBlockLength);
+    
+    // Audio thread
+    bool isDirect(size_t numOfDeviceChannels) const;
+    
+    // Cleared stereo bus of the source to render into
+    float** getBus(Source source, size_t length);
+    
+    // Adds the buses into the device channels, which have been cleared
+    void route(float* const deviceChannels[], size_t numOfDeviceChannels, size_t length);
+    
+    void processOutputStages(float* const deviceChannels[], size_t numOfDeviceChannels, size_t length, float mainVolume);
+    
+    // Singleton
+    static MelissaOutputRouter* getInstance() { return &instance_; }
+    MelissaOutputRouter(const MelissaOutputRouter&) = delete;
+    MelissaOutputRouter& operator=(const MelissaOutputRouter&) = delete;
+    MelissaOutputRouter(MelissaOutputRouter&&) = delete;
+    MelissaOutputRouter& operator=(MelissaOutputRouter&&) = delete;
+    
+private:
+    // Singleton
+    MelissaOutputRouter();
+    ~MelissaOutputRouter() {}
+    static MelissaOutputRouter instance_;
+    
+    static constexpr size_t kNumOfBusChannels = 2;
+    static constexpr size_t kMaxNumOfPairs = kMaxNumOfOutputChannels / 2;
+    
+    // The first channel of the pair the source goes to, with the device channels of now
+    size_t getPairIndex(Source source, size_t numOfDeviceChannels) const;
+    void updateMatrix(size_t numOfDeviceChannels);
+    
+    std::atomic<int> outputChannels_[kNumOfSources];
+    std::atomic<bool> shouldUpdateMatrix_;
+    
+    // Audio thread
+    size_t matrixNumOfDeviceChannels_;
+    float matrix_[kNumOfSources][kNumOfBusChannels][kMaxNumOfOutputChannels];
+    bool isPairUsed_[kMaxNumOfPairs];
+    std::vector<float> buses_[kNumOfSources][kNumOfBusChannels];
+    float* busPointers_[kNumOfSources][kNumOfBusChannels];
+    
+    struct OutputStage
+    {
+        OutputStage();
+        
+        MelissaGainNode mainVolumeNode_;
+        MelissaLimiterNode limiterNode_;
+        MelissaDSPChain chain_;
+    };
+    std::unique_ptr<OutputStage> outputStages_[kMaxNumOfPairs];
+};
@@ -0,0 +1,224 @@
+//
+//  MelissaPitchContour.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaAnalysisCache.h"
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaPitchContour.h"
+
+namespace
+{
+// Tracked on a signal decimated to about 11 kHz, from 60 Hz to 1 kHz, every 128 samples
+constexpr int kDecimatedSampleRate = 11025;
+constexpr float kMinFrequency = 60.f;
+constexpr float kMaxFrequency = 1000.f;
+constexpr size_t kHopLength = 128;
+
+// YIN: the first dip of the cumulative mean normalized difference under the threshold is the period
+constexpr float kThreshold = 0.15f;
+constexpr double kSilencePower = 1e-5; // -50 dBFS
+
+// Jumps of a frame are removed by the median of 5 frames, and voiced runs shorter than 60 ms are dropped
+constexpr size_t kMedianRadius = 2;
+constexpr float kMinVoicedMSec = 60.f;
+};
+
+MelissaPitchContour::Builder::Builder(StemType part, const std::function<void(std::shared_ptr<MelissaPitchContour>)>& onBuilt) :
+part_(part),
+onBuilt_(onBuilt),
+lengthInSamples_(0),
+decimatedSampleRate_(0.0),
+decimateBy_(1),
+decimateSum_(0.f),
+decimateCount_(0)
+{
+}
+
+bool MelissaPitchContour::Builder::prepare(const String& fingerprint, double sampleRate, size_t bufferLength)
+{
+    if (bufferLength == 0) return false;
+    
+    auto cachedContour = MelissaAnalysisCache::getInstance()->readPitchContour(fingerprint, part_);
+    if (cachedContour != nullptr)
+    {
+        onBuilt_(cachedContour);
+        return false;
+    }
+    
+    fingerprint_ = fingerprint;
+    lengthInSamples_ = bufferLength;
+    decimateBy_ = std::max<size_t>(static_cast<size_t>(std::round(sampleRate / kDecimatedSampleRate)), 1);
+    decimatedSampleRate_ = sampleRate / decimateBy_;
+    decimated_.reserve(bufferLength / decimateBy_ + 1);
+    return true;
+}
+
+void MelissaPitchContour::Builder::process(const AudioSampleBuffer& block, size_t startIndex, size_t length)
+{
+    const float* l = block.getReadPointer(0);
+    const float* r = block.getReadPointer(1);
+    for (size_t sampleIndex = 0; sampleIndex < length; ++sampleIndex)
+    {
+        decimateSum_ += l[sampleIndex] + r[sampleIndex];
+        if (++decimateCount_ == decimateBy_)
+        {
+            decimated_.emplace_back(decimateSum_ / (2 * decimateBy_));
+            decimateSum_ = 0.f;
+            decimateCount_ = 0;
+        }
+    }
+}
+
+void MelissaPitchContour::Builder::finish()
+{
+    auto contour = std::make_shared<MelissaPitchContour>();
+    contour->lengthInSamples_ = lengthInSamples_;
+    contour->part_ = part_;
+    contour->frameMSec_ = static_cast<float>(kHopLength * 1000.0 / decimatedSampleRate_);
+    track(contour->notes_);
+    if (isCancelled()) return;
+    
+    MelissaAnalysisCache::getInstance()->writePitchContour(fingerprint_, *contour);
+    onBuilt_(contour);
+}
+
+void MelissaPitchContour::Builder::track(std::vector<float>& notes) const
+{
+    // The window is as long as the longest period
+    const size_t minTau = static_cast<size_t>(decimatedSampleRate_ / kMaxFrequency);
+    const size_t maxTau = static_cast<size_t>(std::ceil(decimatedSampleRate_ / kMinFrequency));
+    const size_t windowLength = maxTau;
+    const size_t numOfSamples = decimated_.size();
+    if (numOfSamples < windowLength + maxTau + 1) return;
+    const size_t numOfFrames = (numOfSamples - windowLength - maxTau - 1) / kHopLength + 1;
+    notes.assign(numOfFrames, kUnvoiced);
+    
+    // Energy of any window from the running sum of squares
+    std::vector<double> sumOfSquares(numOfSamples + 1, 0.0);
+    for (size_t sampleIndex = 0; sampleIndex < numOfSamples; ++sampleIndex)
+    {
+        sumOfSquares[sampleIndex + 1] = sumOfSquares[sampleIndex] + decimated_[sampleIndex] * decimated_[sampleIndex];
+    }
+    auto getEnergy = [&](size_t startIndex) { return sumOfSquares[startIndex + windowLength] - sumOfSquares[startIndex]; };
+    
+    std::vector<float> correlation(maxTau + 1);
+    std::vector<float> difference(maxTau + 1);
+    for (size_t frameIndex = 0; frameIndex < numOfFrames; ++frameIndex)
+    {
+        if (frameIndex % 1024 == 0 && isCancelled()) return;
+        
+        const size_t startIndex = frameIndex * kHopLength;
+        const double energy = getEnergy(startIndex);
+        if (energy < kSilencePower * windowLength) continue;
+        
+        // d(tau) = e(0) + e(tau) - 2 r(tau), where r(tau) for all the taus is a sum of vector multiply-adds
+        const float* x = decimated_.data() + startIndex;
+        std::fill(correlation.begin(), correlation.end(), 0.f);
+        for (size_t sampleIndex = 0; sampleIndex < windowLength; ++sampleIndex)
+        {
+            FloatVectorOperations::addWithMultiply(correlation.data(), x + sampleIndex, x[sampleIndex], static_cast<int>(maxTau + 1));
+        }
+        
+        // Cumulative mean normalized difference
+        difference[0] = 1.f;
+        double runningSum = 0.0;
+        for (size_t tau = 1; tau <= maxTau; ++tau)
+        {
+            const double d = std::max(energy + getEnergy(startIndex + tau) - 2.0 * correlation[tau], 0.0);
+            runningSum += d;
+            difference[tau] = (runningSum <= 0.0) ? 1.f : static_cast<float>(d * tau / runningSum);
+        }
+        
+        size_t tau = minTau;
+        while (tau < maxTau && kThreshold <= difference[tau]) ++tau;
+        if (tau == maxTau) continue;
+        while (tau + 1 < maxTau && difference[tau + 1] < difference[tau]) ++tau;
+        
+        // Parabolic interpolation around the dip
+        float refinedTau = static_cast<float>(tau);
+        if (minTau < tau)
+        {
+            const float prev = difference[tau - 1], current = difference[tau], next = difference[tau + 1];
+            const float denominator = prev - 2.f * current + next;
+            if (0.f < denominator) refinedTau += 0.5f * (prev - next) / denominator;
+        }
+        
+        const double frequency = decimatedSampleRate_ / refinedTau;
+        notes[frameIndex] = static_cast<float>(69.0 + 12.0 * std::log2(frequency / 440.0));
+    }
+    
+    // Median of the voiced neighbours, which removes octave jumps of single frames
+    std::vector<float> filtered(notes);
+    std::vector<float> neighbours;
+    for (size_t frameIndex = 0; frameIndex < numOfFrames; ++frameIndex)
+    {
+        if (notes[frameIndex] == kUnvoiced) continue;
+        
+        neighbours.clear();
+        const size_t first = (frameIndex < kMedianRadius) ? 0 : frameIndex - kMedianRadius;
+        const size_t last = std::min(frameIndex + kMedianRadius, numOfFrames - 1);
+        for (size_t neighbourIndex = first; neighbourIndex <= last; ++neighbourIndex)
+        {
+            if (notes[neighbourIndex] != kUnvoiced) neighbours.emplace_back(notes[neighbourIndex]);
+        }
+        std::nth_element(neighbours.begin(), neighbours.begin() + neighbours.size() / 2, neighbours.end());
+        filtered[frameIndex] = neighbours[neighbours.size() / 2];
+    }
+    
+    const size_t minVoicedFrames = static_cast<size_t>(kMinVoicedMSec / (kHopLength * 1000.0 / decimatedSampleRate_)) + 1;
+    for (size_t runStart = 0; runStart < numOfFrames;)
+    {
+        size_t runEnd = runStart;
+        while (runEnd < numOfFrames && (filtered[runEnd] != kUnvoiced) == (filtered[runStart] != kUnvoiced)) ++runEnd;
+        if (filtered[runStart] != kUnvoiced && runEnd - runStart < minVoicedFrames)
+        {
+            std::fill(filtered.begin() + runStart, filtered.begin() + runEnd, kUnvoiced);
+        }
+        runStart = runEnd;
+    }
+    
+    notes.swap(filtered);
+}
+
+StemType MelissaPitchContour::getMelodyPart(StemType playPart)
+{
+    switch (playPart)
+    {
+        case kStemType_Vocals:
+        case kStemType_Piano:
+        case kStemType_Bass:
+        case kStemType_Others:
+            return playPart;
+        default:
+            return kStemType_Vocals;
+    }
+}
+
+void MelissaPitchContour::write(OutputStream& output) const
+{
+    output.writeInt64(static_cast<int64>(lengthInSamples_));
+    output.writeInt(part_);
+    output.writeFloat(frameMSec_);
+    output.writeInt(static_cast<int>(notes_.size()));
+    output.write(notes_.data(), notes_.size() * sizeof(float));
+}
+
+std::shared_ptr<MelissaPitchContour> MelissaPitchContour::read(InputStream& input)
+{
+    auto contour = std::make_shared<MelissaPitchContour>();
+    contour->lengthInSamples_ = static_cast<size_t>(input.readInt64());
+    const int part = input.readInt();
+    contour->frameMSec_ = input.readFloat();
+    if (part < 0 || kNumStemTypes <= part || contour->frameMSec_ <= 0.f) return nullptr;
+    contour->part_ = static_cast<StemType>(part);
+    
+    const int numOfFrames = input.readInt();
+    if (numOfFrames < 0 || input.getNumBytesRemaining() < numOfFrames * static_cast<int64>(sizeof(float))) return nullptr;
+    contour->notes_.resize(numOfFrames);
+    input.read(contour->notes_.data(), numOfFrames * sizeof(float));
+    
+    return contour;
+}
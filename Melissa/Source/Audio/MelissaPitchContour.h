@@ -0,0 +1,69 @@
+//
+//  MelissaPitchContour.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaAnalyzer.h"
+#include "MelissaDefinitions.h"
+
+// Pitch of the melody of a stem every 10 ms or so, tracked by YIN.
+// Only one pitch is tracked at a time, so the stem should carry a single line (e.g. vocals, bass).
+class MelissaPitchContour
+{
+public:
+    static constexpr float kUnvoiced = 0.f;
+    
+    // Builds the contour in the analysis pipeline, or reads it from the analysis cache.
+    // onBuilt is called on the pipeline thread.
+    class Builder : public MelissaAnalyzer
+    {
+    public:
+        Builder(StemType part, const std::function<void(std::shared_ptr<MelissaPitchContour>)>& onBuilt);
+        
+        StemType getPart() const override { return part_; }
+        bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) override;
+        void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) override;
+        void finish() override;
+        
+    private:
+        void track(std::vector<float>& notes) const;
+        
+        StemType part_;
+        std::function<void(std::shared_ptr<MelissaPitchContour>)> onBuilt_;
+        String fingerprint_;
+        size_t lengthInSamples_;
+        double decimatedSampleRate_;
+        size_t decimateBy_;
+        float decimateSum_;
+        size_t decimateCount_;
+        std::vector<float> decimated_;
+    };
+    
+    // The vocals, unless another stem which may carry a melody is being played
+    static StemType getMelodyPart(StemType playPart);
+    
+    size_t getLengthInSamples() const { return lengthInSamples_; }
+    StemType getPart() const { return part_; }
+    float getFrameMSec() const { return frameMSec_; }
+    
+    // MIDI note number (with the fraction) of each frame, or kUnvoiced
+    const std::vector<float>& getNotes() const { return notes_; }
+    
+    // Serialization for the analysis cache. read() returns nullptr if the data is broken.
+    void write(OutputStream& output) const;
+    static std::shared_ptr<MelissaPitchContour> read(InputStream& input);
+    
+private:
+    size_t lengthInSamples_ = 0;
+    StemType part_ = kStemType_Vocals;
+    float frameMSec_ = 0.f;
+    std::vector<float> notes_;
+};
@@ -0,0 +1,156 @@
+//
+//  MelissaPreviewPlayer.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaPreviewPlayer.h"
+
+namespace
+{
+constexpr float kPreviewLengthSec = 15.f;
+constexpr float kPreviewFadeSec = 0.02f;
+constexpr float kPreviewVolume = 0.8f;
+constexpr int kPreviewReadAheadSize = 32768;
+
+// Songs longer than this start from the middle, which is usually more telling than the intro
+constexpr double kPreviewFromMiddleSec = 60.0;
+}
+
+MelissaPreviewPlayer MelissaPreviewPlayer::instance_;
+
+MelissaPreviewPlayer::MelissaPreviewPlayer() :
+readAheadThread_("MelissaPreviewReadAheadThread"),
+isPrepared_(false),
+isPreviewing_(false),
+renderedLength_(0),
+previewLength_(0),
+fadeLength_(0)
+{
+    formatManager_.registerBasicFormats();
+}
+
+MelissaPreviewPlayer::~MelissaPreviewPlayer()
+{
+    releaseSource();
+    readAheadThread_.stopThread(1000);
+}
+
+void MelissaPreviewPlayer::setOutputSampleRate(double sampleRate, int samplesPerBlockExpected)
+{
+    stop();
+
+    previewBuffer_.setSize(2, samplesPerBlockExpected * 2);
+    transportSource_.prepareToPlay(samplesPerBlockExpected, sampleRate);
+
+    previewLength_ = static_cast<size_t>(kPreviewLengthSec * sampleRate);
+    fadeLength_ = static_cast<size_t>(kPreviewFadeSec * sampleRate);
+    isPrepared_ = true;
+}
+
+void MelissaPreviewPlayer::releaseResources()
+{
+    stop();
+    transportSource_.releaseResources();
+    isPrepared_ = false;
+}
+
+void MelissaPreviewPlayer::preview(const File& file)
+{
+    if (!isPrepared_ || !file.existsAsFile()) return;
+    if (isPreviewing_ && file == previewFile_) return;
+
+    auto reader = formatManager_.createReaderFor(file);
+    if (reader == nullptr)
+    {
+        stop();
+        return;
+    }
+
+    const double sampleRate = reader->sampleRate;
+    const auto lengthInSamples = reader->lengthInSamples;
+    auto newSource = std::make_unique<AudioFormatReaderSource>(reader, true);
+    if (lengthInSamples > kPreviewFromMiddleSec * sampleRate)
+    {
+        newSource->setNextReadPosition(lengthInSamples / 2);
+    }
+
+    if (!readAheadThread_.isThreadRunning()) readAheadThread_.startThread();
+
+    {
+        // The audio thread skips the preview while the source is being replaced
+        const ScopedLock sl(lock_);
+        isPreviewing_ = false;
+        transportSource_.setSource(newSource.get(), kPreviewReadAheadSize, &readAheadThread_, sampleRate, 2);
+        transportSource_.setGain(kPreviewVolume);
+        readerSource_ = std::move(newSource);
+        previewFile_ = file;
+        renderedLength_ = 0;
+        transportSource_.start();
+        isPreviewing_ = true;
+    }
+}
+
+void MelissaPreviewPlayer::stop()
+{
+    if (!isPreviewing_ && readerSource_ == nullptr) return;
+
+    const ScopedLock sl(lock_);
+    isPreviewing_ = false;
+    releaseSource();
+}
+
+void MelissaPreviewPlayer::render(float* bufferToRender[], size_t numOfChannels, size_t bufferLength)
+{
+    if (!isPreviewing_) return;
+
+    const ScopedTryLock sl(lock_);
+    if (!sl.isLocked() || !isPreviewing_) return;
+
+    if (previewBuffer_.getNumSamples() < static_cast<int>(bufferLength))
+    {
+        // Should not happen as long as the host respects samplesPerBlockExpected
+        previewBuffer_.setSize(2, static_cast<int>(bufferLength), false, false, true);
+    }
+
+    const int numSamples = static_cast<int>(bufferLength);
+    transportSource_.getNextAudioBlock(AudioSourceChannelInfo(&previewBuffer_, 0, numSamples));
+
+    // Short fade in / out at both ends of the preview
+    auto envelope = [&](size_t pos)
+    {
+        if (pos >= previewLength_) return 0.f;
+        const float in  = std::min(1.f, static_cast<float>(pos) / fadeLength_);
+        const float out = std::min(1.f, static_cast<float>(previewLength_ - pos) / fadeLength_);
+        return std::min(in, out);
+    };
+    previewBuffer_.applyGainRamp(0, numSamples, envelope(renderedLength_), envelope(renderedLength_ + bufferLength));
+    renderedLength_ += bufferLength;
+
+    if (numOfChannels == 1)
+    {
+        FloatVectorOperations::addWithMultiply(bufferToRender[0], previewBuffer_.getReadPointer(0), 0.5f, numSamples);
+        FloatVectorOperations::addWithMultiply(bufferToRender[0], previewBuffer_.getReadPointer(1), 0.5f, numSamples);
+    }
+    else
+    {
+        for (size_t ch = 0; ch < numOfChannels; ++ch)
+        {
+            FloatVectorOperations::add(bufferToRender[ch], previewBuffer_.getReadPointer(static_cast<int>(ch % 2)), numSamples);
+        }
+    }
+
+    if (renderedLength_ >= previewLength_ || transportSource_.hasStreamFinished())
+    {
+        // Released from the message thread on the next preview() / stop()
+        isPreviewing_ = false;
+    }
+}
+
+void MelissaPreviewPlayer::releaseSource()
+{
+    transportSource_.setSource(nullptr);
+    readerSource_ = nullptr;
+    previewFile_ = File();
+}
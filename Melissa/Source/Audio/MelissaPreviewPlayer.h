@@ -0,0 +1,59 @@
+//
+//  MelissaPreviewPlayer.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include "../JuceLibraryCode/JuceHeader.h"
+
+// Lightweight voice used to audition files from the browser / playlist / history
+// without replacing the loaded song. The file is streamed from disk via a
+// read-ahead thread, so nothing is decoded in full and no song state is touched.
+class MelissaPreviewPlayer
+{
+public:
+    void setOutputSampleRate(double sampleRate, int samplesPerBlockExpected);
+    void releaseResources();
+
+    // Call from the message thread
+    void preview(const File& file);
+    void stop();
+    bool isPreviewing() const { return isPreviewing_; }
+
+    // Call from the audio thread. The preview is added to the buffer.
+    void render(float* bufferToRender[], size_t numOfChannels, size_t bufferLength);
+
+    // Singleton
+    static MelissaPreviewPlayer* getInstance() { return &instance_; }
+    MelissaPreviewPlayer(const MelissaPreviewPlayer&) = delete;
+    MelissaPreviewPlayer& operator=(const MelissaPreviewPlayer&) = delete;
+    MelissaPreviewPlayer(MelissaPreviewPlayer&&) = delete;
+    MelissaPreviewPlayer& operator=(MelissaPreviewPlayer&&) = delete;
+
+private:
+    // Singleton
+    MelissaPreviewPlayer();
+    ~MelissaPreviewPlayer();
+    static MelissaPreviewPlayer instance_;
+
+    void releaseSource();
+
+    AudioFormatManager formatManager_;
+    TimeSliceThread readAheadThread_;
+    AudioTransportSource transportSource_;
+    std::unique_ptr<AudioFormatReaderSource> readerSource_;
+    AudioSampleBuffer previewBuffer_;
+    CriticalSection lock_;
+
+    File previewFile_;
+    bool isPrepared_;
+    std::atomic<bool> isPreviewing_;
+    size_t renderedLength_;
+    size_t previewLength_;
+    size_t fadeLength_;
+};
@@ -0,0 +1,244 @@
+//
+//  MelissaSnapIndex.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include <limits>
+#include <numeric>
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaAnalyzer.h"
+#include "MelissaSnapIndex.h"
+
+MelissaSnapIndex MelissaSnapIndex::instance_;
+
+namespace
+{
+constexpr size_t kOnsetFrameLength = 512;
+
+// An onset is a peak of the onset function above the local mean, and apart from the previous one
+constexpr int kPeakRadius = 3;
+constexpr int kMeanRadius = 16;
+constexpr float kThresholdRatio = 1.5f;
+constexpr float kThresholdOffset = 0.1f;
+constexpr float kMinOnsetIntervalMSec = 50.f;
+
+// The quietest zero crossing of each slot, as the offset in the slot
+constexpr size_t kZeroCrossingSlotLength = 64;
+constexpr uint8 kNoZeroCrossing = 0xff;
+constexpr float kZeroCrossingRangeMSec = 5.f;
+
+size_t getDistance(size_t a, size_t b) { return (a < b) ? (b - a) : (a - b); }
+};
+
+class MelissaSnapIndex::Builder : public MelissaAnalyzer
+{
+public:
+    Builder() : sampleRate_(0.0), prevSample_(0.f), prevEnergy_(0.f) { }
+    
+    bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) override
+    {
+        if (bufferLength == 0) return false;
+        
+        MelissaAnalysisCache::Transients transients;
+        if (MelissaAnalysisCache::getInstance()->readTransients(fingerprint, transients))
+        {
+            MelissaSnapIndex::getInstance()->transientsBuilt(fingerprint, transients);
+            return false;
+        }
+        
+        fingerprint_ = fingerprint;
+        sampleRate_ = sampleRate;
+        onsetFunction_.reserve(bufferLength / kOnsetFrameLength + 1);
+        transients_.zeroCrossings_.reserve(bufferLength / kZeroCrossingSlotLength + 1);
+        return true;
+    }
+    
+    void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) override
+    {
+        mono_.resize(length);
+        FloatVectorOperations::add(mono_.data(), block.getReadPointer(0), block.getReadPointer(1), static_cast<int>(length));
+        FloatVectorOperations::multiply(mono_.data(), 0.5f, static_cast<int>(length));
+        
+        // Rise of the log energy of the first difference, which weights the transients
+        for (size_t frameIndex = 0; frameIndex < length; frameIndex += kOnsetFrameLength)
+        {
+            const size_t frameLength = std::min(kOnsetFrameLength, length - frameIndex);
+            float energy = 0.f;
+            float prevSample = (frameIndex == 0) ? prevSample_ : mono_[frameIndex - 1];
+            for (size_t sampleIndex = frameIndex; sampleIndex < frameIndex + frameLength; ++sampleIndex)
+            {
+                const float diff = mono_[sampleIndex] - prevSample;
+                energy += diff * diff;
+                prevSample = mono_[sampleIndex];
+            }
+            
+            energy = std::log1p(1000.f * energy);
+            onsetFunction_.emplace_back(std::max(energy - prevEnergy_, 0.f));
+            prevEnergy_ = energy;
+        }
+        
+        // The blocks are multiples of the slot length, except for the last one
+        for (size_t slotStartIndex = 0; slotStartIndex < length; slotStartIndex += kZeroCrossingSlotLength)
+        {
+            uint8 offset = kNoZeroCrossing;
+            float minStep = std::numeric_limits<float>::max();
+            const size_t slotLength = std::min(kZeroCrossingSlotLength, length - slotStartIndex);
+            float prevSample = (slotStartIndex == 0) ? prevSample_ : mono_[slotStartIndex - 1];
+            for (size_t sampleIndex = 0; sampleIndex < slotLength; ++sampleIndex)
+            {
+                const float sample = mono_[slotStartIndex + sampleIndex];
+                if ((prevSample < 0.f) != (sample < 0.f) && std::abs(sample - prevSample) < minStep)
+                {
+                    minStep = std::abs(sample - prevSample);
+                    offset = static_cast<uint8>(sampleIndex);
+                }
+                prevSample = sample;
+            }
+            transients_.zeroCrossings_.emplace_back(offset);
+        }
+        
+        prevSample_ = mono_[length - 1];
+    }
+    
+    void finish() override
+    {
+        const int numOfFrames = static_cast<int>(onsetFunction_.size());
+        const int minInterval = static_cast<int>(kMinOnsetIntervalMSec / 1000.0 * sampleRate_ / kOnsetFrameLength);
+        int prevOnsetFrame = -minInterval - 1;
+        for (int frameIndex = 1; frameIndex < numOfFrames; ++frameIndex)
+        {
+            const float value = onsetFunction_[frameIndex];
+            if (value <= 0.f || frameIndex - prevOnsetFrame <= minInterval) continue;
+            
+            const auto peakBegin = onsetFunction_.begin() + std::max(frameIndex - kPeakRadius, 0);
+            const auto peakEnd = onsetFunction_.begin() + std::min(frameIndex + kPeakRadius + 1, numOfFrames);
+            if (*std::max_element(peakBegin, peakEnd) != value) continue;
+            
+            const int meanFirst = std::max(frameIndex - kMeanRadius, 0);
+            const int meanLast = std::min(frameIndex + kMeanRadius, numOfFrames - 1);
+            const float mean = std::accumulate(onsetFunction_.begin() + meanFirst, onsetFunction_.begin() + meanLast + 1, 0.f) / (meanLast - meanFirst + 1);
+            if (value < mean * kThresholdRatio + kThresholdOffset) continue;
+            
+            // The attack is somewhere in the frame, so the start of the frame is never late
+            transients_.onsets_.emplace_back(static_cast<uint32>(frameIndex * kOnsetFrameLength));
+            prevOnsetFrame = frameIndex;
+        }
+        
+        MelissaAnalysisCache::getInstance()->writeTransients(fingerprint_, transients_);
+        MelissaSnapIndex::getInstance()->transientsBuilt(fingerprint_, transients_);
+    }
+    
+private:
+    String fingerprint_;
+    double sampleRate_;
+    std::vector<float> mono_;
+    float prevSample_;
+    float prevEnergy_;
+    std::vector<float> onsetFunction_;
+    MelissaAnalysisCache::Transients transients_;
+};
+
+MelissaSnapIndex::MelissaSnapIndex() :
+sampleRate_(0.0),
+bufferLength_(0)
+{
+}
+
+float MelissaSnapIndex::snapRatio(float ratio, float rangeMSec) const
+{
+    const ScopedLock sl(lock_);
+    if (bufferLength_ == 0) return ratio;
+    
+    const auto position = std::min(static_cast<size_t>(std::clamp(ratio, 0.f, 1.f) * bufferLength_), bufferLength_ - 1);
+    const auto range = static_cast<size_t>(rangeMSec / 1000.0 * sampleRate_);
+    const size_t snappedPosition = snap(position, range);
+    if (snappedPosition == position) return ratio;
+    
+    return static_cast<float>(static_cast<double>(snappedPosition) / bufferLength_);
+}
+
+void MelissaSnapIndex::songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate)
+{
+    {
+        const ScopedLock sl(lock_);
+        fingerprint_ = MelissaAnalysisCache::getInstance()->getFingerprint();
+        sampleRate_ = sampleRate;
+        bufferLength_ = bufferLength;
+        transients_.onsets_.clear();
+        transients_.zeroCrossings_.clear();
+    }
+    beatsUpdated();
+    
+    MelissaAnalysisPipeline::getInstance()->request(std::make_shared<Builder>());
+}
+
+void MelissaSnapIndex::beatsUpdated()
+{
+    std::vector<MelissaDataSource::Song::Beat> beats;
+    MelissaDataSource::getInstance()->getBeats(beats);
+    
+    // The beats are sorted by the data source
+    const ScopedLock sl(lock_);
+    beats_.clear();
+    for (auto&& beat : beats) beats_.emplace_back(static_cast<size_t>(std::max(beat.positionMSec_, 0.f) / 1000.0 * sampleRate_));
+}
+
+void MelissaSnapIndex::transientsBuilt(const String& fingerprint, MelissaAnalysisCache::Transients& transients)
+{
+    // Ignore the result for the previous song
+    const ScopedLock sl(lock_);
+    if (fingerprint != fingerprint_) return;
+    std::swap(transients_, transients);
+}
+
+size_t MelissaSnapIndex::snap(size_t position, size_t range) const
+{
+    size_t target = position;
+    size_t minDistance = range + 1;
+    auto findNearest = [&](const auto& positions)
+    {
+        auto next = std::lower_bound(positions.begin(), positions.end(), position);
+        if (next != positions.end() && getDistance(*next, position) < minDistance)
+        {
+            target = *next;
+            minDistance = getDistance(*next, position);
+        }
+        if (next != positions.begin() && getDistance(*(next - 1), position) < minDistance)
+        {
+            target = *(next - 1);
+            minDistance = getDistance(*(next - 1), position);
+        }
+    };
+    findNearest(transients_.onsets_);
+    findNearest(beats_);
+    
+    return findZeroCrossing(target, static_cast<size_t>(kZeroCrossingRangeMSec / 1000.0 * sampleRate_));
+}
+
+size_t MelissaSnapIndex::findZeroCrossing(size_t position, size_t range) const
+{
+    const auto& zeroCrossings = transients_.zeroCrossings_;
+    const size_t slotIndex = position / kZeroCrossingSlotLength;
+    if (slotIndex >= zeroCrossings.size()) return position;
+    
+    size_t nearestPosition = position;
+    size_t minDistance = range + 1;
+    const size_t numOfSlots = range / kZeroCrossingSlotLength + 1;
+    const size_t firstSlotIndex = (slotIndex < numOfSlots) ? 0 : slotIndex - numOfSlots;
+    const size_t lastSlotIndex = std::min(slotIndex + numOfSlots, zeroCrossings.size() - 1);
+    for (size_t index = firstSlotIndex; index <= lastSlotIndex; ++index)
+    {
+        if (zeroCrossings[index] == kNoZeroCrossing) continue;
+        
+        const size_t zeroCrossing = index * kZeroCrossingSlotLength + zeroCrossings[index];
+        if (getDistance(zeroCrossing, position) < minDistance)
+        {
+            nearestPosition = zeroCrossing;
+            minDistance = getDistance(zeroCrossing, position);
+        }
+    }
+    
+    return nearestPosition;
+}
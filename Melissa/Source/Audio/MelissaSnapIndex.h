@@ -0,0 +1,56 @@
+//
+//  MelissaSnapIndex.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaAnalysisCache.h"
+#include "MelissaDataSource.h"
+
+// Moves loop points and markers to the nearest onset or beat, then to the nearest zero crossing,
+// so that a loop neither starts late nor clicks.
+// The onsets and zero crossings of each song are indexed once in the analysis pipeline.
+// A query is a binary search plus a few slot lookups, cheap enough for every mouse drag event.
+class MelissaSnapIndex : public MelissaDataSourceListener
+{
+public:
+    static constexpr float kDefaultSnapRangeMSec = 60.f;
+    
+    // Returns ratio as is while the index is being built, or if nothing is in range
+    float snapRatio(float ratio, float rangeMSec = kDefaultSnapRangeMSec) const;
+    
+    // MelissaDataSourceListener
+    void songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate) override;
+    void beatsUpdated() override;
+    
+    // Singleton
+    static MelissaSnapIndex* getInstance() { return &instance_; }
+    MelissaSnapIndex(const MelissaSnapIndex&) = delete;
+    MelissaSnapIndex& operator=(const MelissaSnapIndex&) = delete;
+    MelissaSnapIndex(MelissaSnapIndex&&) = delete;
+    MelissaSnapIndex& operator=(MelissaSnapIndex&&) = delete;
+    
+private:
+    // Singleton
+    MelissaSnapIndex();
+    ~MelissaSnapIndex() {}
+    static MelissaSnapIndex instance_;
+    
+    class Builder;
+    void transientsBuilt(const String& fingerprint, MelissaAnalysisCache::Transients& transients);
+    
+    size_t snap(size_t position, size_t range) const;
+    size_t findZeroCrossing(size_t position, size_t range) const;
+    
+    CriticalSection lock_;
+    String fingerprint_;
+    double sampleRate_;
+    size_t bufferLength_;
+    MelissaAnalysisCache::Transients transients_;
+    std::vector<size_t> beats_; // in samples
+};
@@ -0,0 +1,58 @@
+//
+//  MelissaSpectrogram.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaDataSource.h"
+#include "MelissaSpectrogram.h"
+
+namespace
+{
+constexpr float kLowestFreq = 40.f;
+constexpr float kHighestFreq = 16000.f;
+constexpr float kMinDecibels = -80.f;
+};
+
+MelissaSpectrogram::MelissaSpectrogram(double sampleRate) :
+fft_(kFFTOrder),
+window_(kFFTSize, dsp::WindowingFunction<float>::hann, false),
+readBuffer_(2, kFFTSize),
+fftBuffer_(kFFTSize * 2)
+{
+    const float highestFreq = std::min(kHighestFreq, static_cast<float>(sampleRate / 2));
+    const float binsPerHz = kFFTSize / static_cast<float>(sampleRate);
+    bandBins_.resize(kNumOfBands);
+    for (int bandIndex = 0; bandIndex < kNumOfBands; ++bandIndex)
+    {
+        const float freq0 = kLowestFreq * std::pow(highestFreq / kLowestFreq, bandIndex / static_cast<float>(kNumOfBands));
+        const float freq1 = kLowestFreq * std::pow(highestFreq / kLowestFreq, (bandIndex + 1) / static_cast<float>(kNumOfBands));
+        const int firstBin = static_cast<int>(freq0 * binsPerHz);
+        const int lastBin = std::max(static_cast<int>(freq1 * binsPerHz), firstBin + 1);
+        bandBins_[bandIndex] = { std::min(firstBin, kFFTSize / 2 - 1), std::min(lastBin, kFFTSize / 2) };
+    }
+}
+
+void MelissaSpectrogram::compute(MelissaDataSource* dataSource, StemType playPart, size_t centerIndex, float* bands)
+{
+    const size_t startIndex = (centerIndex < kFFTSize / 2) ? 0 : centerIndex - kFFTSize / 2;
+    dataSource->readBufferBlock(readBuffer_, startIndex, playPart);
+
+    // mono, windowed
+    float* data = fftBuffer_.data();
+    FloatVectorOperations::add(data, readBuffer_.getReadPointer(0), readBuffer_.getReadPointer(1), kFFTSize);
+    FloatVectorOperations::multiply(data, 0.5f, kFFTSize);
+    window_.multiplyWithWindowingTable(data, kFFTSize);
+    fft_.performFrequencyOnlyForwardTransform(data, true);
+
+    // A full scale sine gives kFFTSize / 4 with the hann window
+    FloatVectorOperations::multiply(data, 4.f / kFFTSize, kFFTSize / 2);
+    for (int bandIndex = 0; bandIndex < kNumOfBands; ++bandIndex)
+    {
+        const auto [firstBin, lastBin] = bandBins_[bandIndex];
+        const float magnitude = FloatVectorOperations::findMaximum(data + firstBin, lastBin - firstBin);
+        const float decibels = Decibels::gainToDecibels(magnitude, kMinDecibels);
+        bands[bandIndex] = 1.f - decibels / kMinDecibels;
+    }
+}
@@ -0,0 +1,38 @@
+//
+//  MelissaSpectrogram.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaDefinitions.h"
+
+class MelissaDataSource;
+
+// Short-time spectrum of the loaded song on a log-frequency axis.
+// Not thread safe, use one instance per thread.
+class MelissaSpectrogram
+{
+public:
+    static constexpr int kFFTOrder = 11;
+    static constexpr int kFFTSize = 1 << kFFTOrder;
+    static constexpr int kNumOfBands = 128;
+
+    MelissaSpectrogram(double sampleRate);
+
+    // Levels (0 - 1) of the window centred on centerIndex. bands[0] is the lowest band.
+    void compute(MelissaDataSource* dataSource, StemType playPart, size_t centerIndex, float* bands);
+
+private:
+    dsp::FFT fft_;
+    dsp::WindowingFunction<float> window_;
+    AudioSampleBuffer readBuffer_;
+    std::vector<float> fftBuffer_;
+
+    // [first, last) FFT bin of each band
+    std::vector<std::pair<int, int>> bandBins_;
+};
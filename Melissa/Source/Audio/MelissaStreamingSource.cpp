@@ -0,0 +1,217 @@
+//
+//  MelissaStreamingSource.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaStemProvider.h"
+#include "MelissaStreamingSource.h"
+
+namespace
+{
+// Blocks kept resident from the playhead (about 16 sec at 48kHz) and from the loop start
+constexpr size_t kNumOfAheadBlocks = 24;
+constexpr size_t kNumOfLoopBlocks = 8;
+
+// The engine processes 4096 samples at once
+constexpr size_t kReadyLength = 8192;
+
+std::unique_ptr<AudioFormatReader> createReader(AudioFormatManager& formatManager, const File& file)
+{
+    // WAV and AIFF are memory-mapped so that the OS takes care of the paging
+    if (auto format = formatManager.findFormatForFileExtension(file.getFileExtension()))
+    {
+        std::unique_ptr<MemoryMappedAudioFormatReader> mappedReader(format->createMemoryMappedReader(file));
+        if (mappedReader != nullptr && mappedReader->mapEntireFile()) return mappedReader;
+    }
+
+    return std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(file));
+}
+}
+
+std::unique_ptr<MelissaStreamingSource> MelissaStreamingSource::create(const File& file, const std::map<std::string, File>& stemFiles)
+{
+    AudioFormatManager formatManager;
+    formatManager.registerBasicFormats();
+
+    std::unique_ptr<MelissaStreamingSource> source(new MelissaStreamingSource());
+    source->readers_[0] = createReader(formatManager, file);
+    source->analysisReaders_[0] = createReader(formatManager, file);
+    if (source->readers_[0] == nullptr || source->analysisReaders_[0] == nullptr) return nullptr;
+
+    source->sampleRate_ = source->readers_[0]->sampleRate;
+    source->lengthInSamples_ = static_cast<size_t>(source->readers_[0]->lengthInSamples);
+
+    if (stemFiles.size() == kNumStemTypes)
+    {
+        source->hasStems_ = true;
+        for (int stemTypeIndex = 0; stemTypeIndex < kNumStemTypes; ++stemTypeIndex)
+        {
+            const auto stemFile = stemFiles.find(MelissaStemProvider::partNames_[stemTypeIndex]);
+            if (stemFile == stemFiles.end())
+            {
+                source->hasStems_ = false;
+                break;
+            }
+
+            source->readers_[stemTypeIndex + 1] = createReader(formatManager, stemFile->second);
+            source->analysisReaders_[stemTypeIndex + 1] = createReader(formatManager, stemFile->second);
+            if (source->readers_[stemTypeIndex + 1] == nullptr || source->analysisReaders_[stemTypeIndex + 1] == nullptr)
+            {
+                source->hasStems_ = false;
+                break;
+            }
+        }
+
+        if (!source->hasStems_)
+        {
+            for (size_t partIndex = 1; partIndex < kNumOfParts; ++partIndex)
+            {
+                source->readers_[partIndex] = nullptr;
+                source->analysisReaders_[partIndex] = nullptr;
+            }
+        }
+    }
+
+    source->startThread();
+    return source;
+}
+
+MelissaStreamingSource::MelissaStreamingSource() :
+Thread("MelissaStreamingThread"),
+sampleRate_(0.0),
+lengthInSamples_(0),
+hasStems_(false),
+slots_(std::make_unique<Slot[]>(kNumOfSlots)),
+readIndex_(0),
+loopStartIndex_(0),
+playPart_(kStemType_All)
+{
+}
+
+MelissaStreamingSource::~MelissaStreamingSource()
+{
+    stopThread(2000);
+}
+
+float MelissaStreamingSource::readSample(size_t ch, size_t index, StemType playPart) const
+{
+    if (lengthInSamples_ <= index) return 0.f;
+
+    const size_t block = index / kBlockSize;
+    const int64_t key = makeKey(block, playPart);
+    const auto& slot = slots_[block % kNumOfSlots];
+    if (slot.key_.load(std::memory_order_acquire) != key) return 0.f;
+
+    const float value = slot.data_[ch < 2 ? ch : 0][index % kBlockSize];
+
+    // The slot might have been refilled while reading
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (slot.key_.load(std::memory_order_relaxed) == key) ? value : 0.f;
+}
+
+bool MelissaStreamingSource::setReadPosition(size_t readIndex, size_t loopStartIndex, StemType playPart, int timeoutMSec)
+{
+    const bool positionChanged = (readIndex_ / kBlockSize != readIndex / kBlockSize) || (loopStartIndex_ != loopStartIndex) || (playPart_ != playPart);
+    readIndex_ = readIndex;
+    loopStartIndex_ = loopStartIndex;
+    playPart_ = playPart;
+    if (positionChanged) notify();
+
+    const size_t lastIndex = std::min(readIndex + kReadyLength, lengthInSamples_) - 1;
+    auto isReady = [&]() { return readIndex >= lengthInSamples_ || (isResident(readIndex, playPart) && isResident(lastIndex, playPart)); };
+
+    const auto timeout = Time::getMillisecondCounter() + timeoutMSec;
+    while (!isReady())
+    {
+        const int remaining = static_cast<int>(timeout - Time::getMillisecondCounter());
+        if (remaining <= 0 || !blockLoaded_.wait(remaining)) return isReady();
+    }
+
+    return true;
+}
+
+void MelissaStreamingSource::read(AudioSampleBuffer& dest, size_t startIndex, StemType playPart)
+{
+    const ScopedLock sl(analysisLock_);
+
+    auto reader = analysisReaders_[playPart + 1].get();
+    if (reader == nullptr || dest.getNumChannels() < 2)
+    {
+        dest.clear();
+        return;
+    }
+    reader->read(&dest, 0, dest.getNumSamples(), static_cast<int64>(startIndex), true, true);
+}
+
+bool MelissaStreamingSource::isResident(size_t index, StemType playPart) const
+{
+    const size_t block = index / kBlockSize;
+    return slots_[block % kNumOfSlots].key_.load(std::memory_order_acquire) == makeKey(block, playPart);
+}
+
+bool MelissaStreamingSource::fillNextBlock()
+{
+    // Blocks are direct-mapped to slots. When two wanted blocks share a slot,
+    // the one closer to the playhead wins.
+    const StemType playPart = static_cast<StemType>(playPart_.load());
+    const size_t playBlock = readIndex_ / kBlockSize;
+    const size_t loopBlock = loopStartIndex_ / kBlockSize;
+    const size_t numOfBlocks = (lengthInSamples_ + kBlockSize - 1) / kBlockSize;
+
+    size_t wantedBlocks[kNumOfAheadBlocks + kNumOfLoopBlocks + 1];
+    size_t numOfWantedBlocks = 0;
+    for (size_t blockIndex = 0; blockIndex < kNumOfAheadBlocks; ++blockIndex) wantedBlocks[numOfWantedBlocks++] = playBlock + blockIndex;
+    if (0 < playBlock) wantedBlocks[numOfWantedBlocks++] = playBlock - 1;
+    for (size_t blockIndex = 0; blockIndex < kNumOfLoopBlocks; ++blockIndex) wantedBlocks[numOfWantedBlocks++] = loopBlock + blockIndex;
+
+    bool claimed[kNumOfSlots] = {};
+    for (size_t wantedIndex = 0; wantedIndex < numOfWantedBlocks; ++wantedIndex)
+    {
+        const size_t block = wantedBlocks[wantedIndex];
+        if (numOfBlocks <= block) continue;
+
+        const size_t slotIndex = block % kNumOfSlots;
+        if (claimed[slotIndex]) continue;
+        claimed[slotIndex] = true;
+
+        if (slots_[slotIndex].key_.load(std::memory_order_acquire) != makeKey(block, playPart))
+        {
+            fillBlock(block, playPart);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void MelissaStreamingSource::fillBlock(size_t block, StemType playPart)
+{
+    auto& slot = slots_[block % kNumOfSlots];
+    slot.key_.store(-1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const size_t startIndex = block * kBlockSize;
+    const int numOfSamples = static_cast<int>(std::min(kBlockSize, lengthInSamples_ - startIndex));
+    float* channels[] = { slot.data_[0], slot.data_[1] };
+    AudioSampleBuffer buffer(channels, 2, static_cast<int>(kBlockSize));
+    buffer.clear();
+
+    auto reader = readers_[playPart + 1].get();
+    if (reader != nullptr)
+    {
+        reader->read(&buffer, 0, numOfSamples, static_cast<int64>(startIndex), true, true);
+    }
+
+    slot.key_.store(makeKey(block, playPart), std::memory_order_release);
+    blockLoaded_.signal();
+}
+
+void MelissaStreamingSource::run()
+{
+    while (!threadShouldExit())
+    {
+        if (!fillNextBlock()) wait(100);
+    }
+}
@@ -0,0 +1,74 @@
+//
+//  MelissaStreamingSource.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaDefinitions.h"
+
+// Plays long files without decoding them into memory.
+// Only a fixed number of blocks around the playhead and the loop start are kept resident,
+// so the memory usage doesn't depend on the length of the file.
+class MelissaStreamingSource : private Thread
+{
+public:
+    // Returns nullptr if the file can't be read
+    static std::unique_ptr<MelissaStreamingSource> create(const File& file, const std::map<std::string, File>& stemFiles);
+    ~MelissaStreamingSource();
+
+    double getSampleRate() const { return sampleRate_; }
+    size_t getLengthInSamples() const { return lengthInSamples_; }
+    bool hasStems() const { return hasStems_; }
+
+    // Never blocks. Returns 0 for the samples which are not resident yet.
+    float readSample(size_t ch, size_t index, StemType playPart) const;
+
+    // Moves the resident window. Returns true if the samples at readIndex are resident (waits up to timeoutMSec)
+    bool setReadPosition(size_t readIndex, size_t loopStartIndex, StemType playPart, int timeoutMSec);
+
+    // Blocking read for analysis. This doesn't affect the resident window.
+    void read(AudioSampleBuffer& dest, size_t startIndex, StemType playPart);
+
+private:
+    MelissaStreamingSource();
+
+    static constexpr size_t kBlockSize = 32768;
+    static constexpr size_t kNumOfSlots = 64;
+    static constexpr size_t kNumOfParts = kNumStemTypes + 1;
+
+    struct Slot
+    {
+        Slot() : key_(-1) {}
+        std::atomic<int64_t> key_;
+        float data_[2][kBlockSize];
+    };
+
+    static int64_t makeKey(size_t block, StemType playPart) { return static_cast<int64_t>(block) * kNumOfParts + (playPart + 1); }
+    bool isResident(size_t index, StemType playPart) const;
+    bool fillNextBlock();
+    void fillBlock(size_t block, StemType playPart);
+
+    void run() override;
+
+    double sampleRate_;
+    size_t lengthInSamples_;
+    bool hasStems_;
+
+    // readers_ is used only by the streaming thread, analysisReaders_ by read()
+    std::unique_ptr<AudioFormatReader> readers_[kNumOfParts];
+    std::unique_ptr<AudioFormatReader> analysisReaders_[kNumOfParts];
+    CriticalSection analysisLock_;
+
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<size_t> readIndex_;
+    std::atomic<size_t> loopStartIndex_;
+    std::atomic<int> playPart_;
+    WaitableEvent blockLoaded_;
+};
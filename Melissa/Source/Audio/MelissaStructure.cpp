@@ -0,0 +1,465 @@
+//
+//  MelissaStructure.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include <atomic>
+#include <numeric>
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaAnalyzer.h"
+#include "MelissaStructure.h"
+
+MelissaStructure MelissaStructure::instance_;
+
+namespace
+{
+// Frames of about 370 ms every 93 ms, on a signal decimated to about 11 kHz
+constexpr int kDecimatedSampleRate = 11025;
+constexpr int kFrameOrder = 12;
+constexpr int kFrameLength = 1 << kFrameOrder;
+constexpr int kHopLength = kFrameLength / 4;
+constexpr float kSilenceEnergy = 1.f;
+
+// Features of a frame: chroma (65 Hz - 2.1 kHz) followed by MFCC without c0 (65 Hz - 5 kHz).
+// Each half is scaled to the norm of sqrt(0.5), so a dot product is the mean of the two cosine similarities.
+constexpr int kNumOfChroma = 12;
+constexpr float kMinChromaFrequency = 65.f;
+constexpr float kMaxChromaFrequency = 2100.f;
+constexpr int kNumOfMelBands = 40;
+constexpr int kNumOfMfcc = 13;
+constexpr float kMinMelFrequency = 65.f;
+constexpr float kMaxMelFrequency = 5000.f;
+constexpr int kNumOfDimensions = kNumOfChroma + kNumOfMfcc;
+
+// Frames are shared between the workers by chunks
+constexpr int kChunkLength = 32;
+constexpr int kMaxNumOfWorkers = 8;
+
+// Beats are the units of the segmentation. Without a beat grid, the song is cut every 500 ms.
+constexpr int kMinNumOfBeats = 32;
+constexpr float kUnitMSecWithoutBeats = 500.f;
+
+// The self-similarity matrix is computed by tiles which fit in the cache
+constexpr int kTileLength = 64;
+
+// Checkerboard kernel of 16 units on each side, and sections of at least 8 units
+constexpr int kKernelRadius = 16;
+constexpr int kMinSectionLength = 8;
+
+// Sections are alike if they are more similar than most pairs of units
+constexpr float kSameGroupMargin = 0.5f;
+constexpr int kMaxAlignmentShift = 2;
+
+float toMel(float frequency) { return 2595.f * std::log10(1.f + frequency / 700.f); }
+float fromMel(float mel) { return 700.f * (std::pow(10.f, mel / 2595.f) - 1.f); }
+
+void normalize(float* features)
+{
+    for (auto&& part : { std::make_pair(0, kNumOfChroma), std::make_pair(kNumOfChroma, kNumOfMfcc) })
+    {
+        float* values = features + part.first;
+        const float norm = std::sqrt(std::inner_product(values, values + part.second, values, 0.f));
+        if (norm <= 0.f) std::fill(values, values + part.second, 0.f);
+        else FloatVectorOperations::multiply(values, std::sqrt(0.5f) / norm, part.second);
+    }
+}
+};
+
+class MelissaStructure::Builder : public MelissaAnalyzer
+{
+public:
+    Builder() : decimatedSampleRate_(0.0), decimateBy_(1), decimateSum_(0.f), decimateCount_(0) { }
+    
+    bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) override
+    {
+        if (bufferLength == 0) return false;
+        
+        MelissaAnalysisCache::StructureFeatures features;
+        if (MelissaAnalysisCache::getInstance()->readStructureFeatures(fingerprint, features) && features.numOfDimensions_ == kNumOfDimensions)
+        {
+            MelissaStructure::getInstance()->featuresBuilt(fingerprint, features);
+            return false;
+        }
+        
+        fingerprint_ = fingerprint;
+        decimateBy_ = std::max<size_t>(static_cast<size_t>(std::round(sampleRate / kDecimatedSampleRate)), 1);
+        decimatedSampleRate_ = sampleRate / decimateBy_;
+        decimated_.reserve(bufferLength / decimateBy_ + 1);
+        return true;
+    }
+    
+    void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) override
+    {
+        const float* l = block.getReadPointer(0);
+        const float* r = block.getReadPointer(1);
+        for (size_t sampleIndex = 0; sampleIndex < length; ++sampleIndex)
+        {
+            decimateSum_ += l[sampleIndex] + r[sampleIndex];
+            if (++decimateCount_ == decimateBy_)
+            {
+                decimated_.emplace_back(decimateSum_ / (2 * decimateBy_));
+                decimateSum_ = 0.f;
+                decimateCount_ = 0;
+            }
+        }
+    }
+    
+    void finish() override
+    {
+        MelissaAnalysisCache::StructureFeatures features;
+        features.frameMSec_ = static_cast<float>(kHopLength * 1000.0 / decimatedSampleRate_);
+        features.numOfDimensions_ = kNumOfDimensions;
+        computeFeatures(features.values_);
+        if (isCancelled()) return;
+        
+        MelissaAnalysisCache::getInstance()->writeStructureFeatures(fingerprint_, features);
+        MelissaStructure::getInstance()->featuresBuilt(fingerprint_, features);
+    }
+    
+private:
+    void computeFeatures(std::vector<float>& features) const
+    {
+        const int numOfSamples = static_cast<int>(decimated_.size());
+        const int numOfFrames = (numOfSamples + kHopLength - 1) / kHopLength;
+        features.assign(numOfFrames * kNumOfDimensions, 0.f);
+        if (numOfFrames == 0) return;
+        
+        // Pitch class and triangular mel filters of each FFT bin
+        constexpr int numOfBins = kFrameLength / 2 + 1;
+        auto getFrequency = [&](int bin) { return static_cast<float>(bin * decimatedSampleRate_ / kFrameLength); };
+        std::vector<int> pitchClasses(numOfBins, -1);
+        std::vector<std::vector<std::pair<int, float>>> melWeights(numOfBins);
+        const float minMel = toMel(kMinMelFrequency);
+        const float melStep = (toMel(std::min(kMaxMelFrequency, static_cast<float>(decimatedSampleRate_ / 2.0))) - minMel) / (kNumOfMelBands + 1);
+        for (int bin = 1; bin < numOfBins; ++bin)
+        {
+            const float frequency = getFrequency(bin);
+            if (kMinChromaFrequency <= frequency && frequency <= kMaxChromaFrequency)
+            {
+                pitchClasses[bin] = static_cast<int>(std::round(69.0 + 12.0 * std::log2(frequency / 440.0))) % kNumOfChroma;
+            }
+            
+            const float position = (toMel(frequency) - minMel) / melStep;
+            const int band = static_cast<int>(std::floor(position));
+            const float fraction = position - band;
+            if (0 <= band - 1 && band - 1 < kNumOfMelBands) melWeights[bin].emplace_back(band - 1, 1.f - fraction);
+            if (0 <= band && band < kNumOfMelBands) melWeights[bin].emplace_back(band, fraction);
+        }
+        
+        float dct[kNumOfMfcc][kNumOfMelBands];
+        for (int coefIndex = 0; coefIndex < kNumOfMfcc; ++coefIndex)
+        {
+            for (int band = 0; band < kNumOfMelBands; ++band)
+            {
+                dct[coefIndex][band] = std::cos(MathConstants<float>::pi * (coefIndex + 1) * (band + 0.5f) / kNumOfMelBands);
+            }
+        }
+        
+        std::vector<float> window(kFrameLength);
+        dsp::WindowingFunction<float>::fillWindowingTables(window.data(), kFrameLength, dsp::WindowingFunction<float>::hann, false);
+        
+        const int numOfChunks = (numOfFrames + kChunkLength - 1) / kChunkLength;
+        const int numOfWorkers = jlimit(1, kMaxNumOfWorkers, std::min(SystemStats::getNumCpus(), numOfChunks));
+        std::atomic<int> nextChunkIndex(0);
+        std::atomic<int> numOfRemainingWorkers(numOfWorkers);
+        WaitableEvent finished;
+        
+        auto computeChunks = [&]()
+        {
+            dsp::FFT fft(kFrameOrder);
+            std::vector<float> buffer(kFrameLength * 2);
+            
+            for (int chunkIndex = nextChunkIndex++; chunkIndex < numOfChunks && !isCancelled(); chunkIndex = nextChunkIndex++)
+            {
+                const int lastFrameIndex = std::min((chunkIndex + 1) * kChunkLength, numOfFrames);
+                for (int frameIndex = chunkIndex * kChunkLength; frameIndex < lastFrameIndex; ++frameIndex)
+                {
+                    const int startIndex = frameIndex * kHopLength;
+                    const int length = std::min(kFrameLength, numOfSamples - startIndex);
+                    std::fill(buffer.begin(), buffer.end(), 0.f);
+                    FloatVectorOperations::multiply(buffer.data(), decimated_.data() + startIndex, window.data(), length);
+                    fft.performFrequencyOnlyForwardTransform(buffer.data(), true);
+                    
+                    float* frameFeatures = features.data() + frameIndex * kNumOfDimensions;
+                    float melEnergies[kNumOfMelBands] = {};
+                    float energy = 0.f;
+                    for (int bin = 1; bin < numOfBins; ++bin)
+                    {
+                        const float power = buffer[bin] * buffer[bin];
+                        energy += power;
+                        if (0 <= pitchClasses[bin]) frameFeatures[pitchClasses[bin]] += power;
+                        for (auto&& weight : melWeights[bin]) melEnergies[weight.first] += power * weight.second;
+                    }
+                    if (energy < kSilenceEnergy)
+                    {
+                        std::fill(frameFeatures, frameFeatures + kNumOfDimensions, 0.f);
+                        continue;
+                    }
+                    
+                    for (int pitchClass = 0; pitchClass < kNumOfChroma; ++pitchClass) frameFeatures[pitchClass] = std::sqrt(frameFeatures[pitchClass]);
+                    for (auto&& melEnergy : melEnergies) melEnergy = std::log(melEnergy + 1e-3f);
+                    for (int coefIndex = 0; coefIndex < kNumOfMfcc; ++coefIndex)
+                    {
+                        frameFeatures[kNumOfChroma + coefIndex] = std::inner_product(melEnergies, melEnergies + kNumOfMelBands, dct[coefIndex], 0.f);
+                    }
+                    normalize(frameFeatures);
+                }
+            }
+            
+            if (--numOfRemainingWorkers == 0) finished.signal();
+        };
+        
+        ThreadPool threadPool(std::max(numOfWorkers - 1, 1));
+        for (int workerIndex = 1; workerIndex < numOfWorkers; ++workerIndex) threadPool.addJob(computeChunks);
+        computeChunks();
+        finished.wait();
+    }
+    
+    String fingerprint_;
+    double decimatedSampleRate_;
+    size_t decimateBy_;
+    float decimateSum_;
+    size_t decimateCount_;
+    std::vector<float> decimated_;
+};
+
+MelissaStructure::MelissaStructure() :
+lengthMSec_(0.f)
+{
+    features_.frameMSec_ = 0.f;
+    features_.numOfDimensions_ = kNumOfDimensions;
+}
+
+std::vector<MelissaStructure::Section> MelissaStructure::getSections() const
+{
+    const ScopedLock sl(lock_);
+    return sections_;
+}
+
+void MelissaStructure::songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate)
+{
+    {
+        const ScopedLock sl(lock_);
+        fingerprint_ = MelissaAnalysisCache::getInstance()->getFingerprint();
+        lengthMSec_ = (sampleRate == 0) ? 0.f : static_cast<float>(bufferLength * 1000.0 / sampleRate);
+        features_.values_.clear();
+        sections_.clear();
+    }
+    beatsUpdated();
+    
+    MelissaAnalysisPipeline::getInstance()->request(std::make_shared<Builder>());
+}
+
+void MelissaStructure::beatsUpdated()
+{
+    std::vector<MelissaDataSource::Song::Beat> beats;
+    MelissaDataSource::getInstance()->getBeats(beats);
+    
+    {
+        const ScopedLock sl(lock_);
+        beatsMSec_.clear();
+        for (auto&& beat : beats) beatsMSec_.emplace_back(beat.positionMSec_);
+    }
+    updateSections();
+}
+
+void MelissaStructure::featuresBuilt(const String& fingerprint, MelissaAnalysisCache::StructureFeatures& features)
+{
+    {
+        // Ignore the result for the previous song
+        const ScopedLock sl(lock_);
+        if (fingerprint != fingerprint_) return;
+        std::swap(features_, features);
+    }
+    updateSections();
+}
+
+void MelissaStructure::updateSections()
+{
+    // Segmented out of the lock, as it takes a few tens of milliseconds on a long song
+    MelissaAnalysisCache::StructureFeatures features;
+    std::vector<float> beatsMSec;
+    float lengthMSec;
+    String fingerprint;
+    {
+        const ScopedLock sl(lock_);
+        if (features_.values_.empty()) return;
+        features = features_;
+        beatsMSec = beatsMSec_;
+        lengthMSec = lengthMSec_;
+        fingerprint = fingerprint_;
+    }
+    
+    auto sections = segment(features, beatsMSec, lengthMSec);
+    
+    const ScopedLock sl(lock_);
+    if (fingerprint == fingerprint_) std::swap(sections_, sections);
+}
+
+std::vector<MelissaStructure::Section> MelissaStructure::segment(const MelissaAnalysisCache::StructureFeatures& features, const std::vector<float>& beatsMSec, float lengthMSec)
+{
+    std::vector<Section> sections;
+    const int numOfFrames = static_cast<int>(features.values_.size() / kNumOfDimensions);
+    if (numOfFrames == 0 || features.frameMSec_ <= 0.f || lengthMSec <= 0.f) return sections;
+    
+    // Units: the beats, or a fixed grid if the beats are not known
+    std::vector<float> bounds { 0.f };
+    if (kMinNumOfBeats <= static_cast<int>(beatsMSec.size()))
+    {
+        for (auto&& beatMSec : beatsMSec)
+        {
+            if (bounds.back() < beatMSec && beatMSec < lengthMSec) bounds.emplace_back(beatMSec);
+        }
+    }
+    else
+    {
+        for (float unitMSec = kUnitMSecWithoutBeats; unitMSec < lengthMSec; unitMSec += kUnitMSecWithoutBeats) bounds.emplace_back(unitMSec);
+    }
+    bounds.emplace_back(lengthMSec);
+    
+    const int numOfUnits = static_cast<int>(bounds.size()) - 1;
+    if (numOfUnits < kMinSectionLength * 2) return sections;
+    
+    // Mean features of the frames centered in each unit
+    std::vector<float> units(numOfUnits * kNumOfDimensions, 0.f);
+    const float frameCenterMSec = kFrameLength / 2.f / kHopLength * features.frameMSec_;
+    for (int unitIndex = 0; unitIndex < numOfUnits; ++unitIndex)
+    {
+        auto getFrameIndex = [&](float positionMSec) { return jlimit(0, numOfFrames, static_cast<int>(std::ceil((positionMSec - frameCenterMSec) / features.frameMSec_))); };
+        int firstFrameIndex = getFrameIndex(bounds[unitIndex]);
+        int lastFrameIndex = getFrameIndex(bounds[unitIndex + 1]);
+        if (lastFrameIndex <= firstFrameIndex)
+        {
+            // Shorter than a hop: the nearest frame
+            firstFrameIndex = std::min(firstFrameIndex, numOfFrames - 1);
+            lastFrameIndex = firstFrameIndex + 1;
+        }
+        
+        float* unit = units.data() + unitIndex * kNumOfDimensions;
+        for (int frameIndex = firstFrameIndex; frameIndex < lastFrameIndex; ++frameIndex)
+        {
+            FloatVectorOperations::add(unit, features.values_.data() + frameIndex * kNumOfDimensions, kNumOfDimensions);
+        }
+        normalize(unit);
+    }
+    
+    // Self-similarity matrix, tile by tile, and mirrored as it is symmetric
+    std::vector<float> similarities(numOfUnits * numOfUnits);
+    auto getSimilarity = [&](int i, int j) { return similarities[i * numOfUnits + j]; };
+    for (int tileRow = 0; tileRow < numOfUnits; tileRow += kTileLength)
+    {
+        for (int tileColumn = tileRow; tileColumn < numOfUnits; tileColumn += kTileLength)
+        {
+            const int lastRow = std::min(tileRow + kTileLength, numOfUnits);
+            const int lastColumn = std::min(tileColumn + kTileLength, numOfUnits);
+            for (int i = tileRow; i < lastRow; ++i)
+            {
+                const float* x = units.data() + i * kNumOfDimensions;
+                for (int j = std::max(tileColumn, i); j < lastColumn; ++j)
+                {
+                    const float* y = units.data() + j * kNumOfDimensions;
+                    float dot = 0.f;
+                    for (int dimension = 0; dimension < kNumOfDimensions; ++dimension) dot += x[dimension] * y[dimension];
+                    similarities[i * numOfUnits + j] = similarities[j * numOfUnits + i] = dot;
+                }
+            }
+        }
+    }
+    
+    // Novelty: correlation of a Gaussian tapered checkerboard kernel along the diagonal.
+    // It is high where the units are alike within each side and unlike across the center.
+    constexpr int kernelLength = kKernelRadius * 2;
+    std::vector<float> kernel(kernelLength * kernelLength);
+    for (int a = -kKernelRadius; a < kKernelRadius; ++a)
+    {
+        for (int b = -kKernelRadius; b < kKernelRadius; ++b)
+        {
+            const float taper = std::exp(-0.5f * ((a + 0.5f) * (a + 0.5f) + (b + 0.5f) * (b + 0.5f)) / (kKernelRadius * kKernelRadius / 4.f));
+            kernel[(a + kKernelRadius) * kernelLength + (b + kKernelRadius)] = ((a < 0) == (b < 0)) ? taper : -taper;
+        }
+    }
+    
+    std::vector<float> novelty(numOfUnits, 0.f);
+    for (int center = 0; center < numOfUnits; ++center)
+    {
+        const int first = std::max(center - kKernelRadius, 0);
+        const int last = std::min(center + kKernelRadius, numOfUnits);
+        for (int i = first; i < last; ++i)
+        {
+            const float* kernelRow = kernel.data() + (i - center + kKernelRadius) * kernelLength;
+            const float* similarityRow = similarities.data() + i * numOfUnits;
+            for (int j = first; j < last; ++j) novelty[center] += kernelRow[j - center + kKernelRadius] * similarityRow[j];
+        }
+    }
+    
+    // Boundaries: peaks above the mean novelty, apart from each other
+    const float meanNovelty = std::accumulate(novelty.begin(), novelty.end(), 0.f) / numOfUnits;
+    std::vector<int> starts { 0 };
+    for (int unitIndex = kMinSectionLength; unitIndex <= numOfUnits - kMinSectionLength; ++unitIndex)
+    {
+        if (novelty[unitIndex] <= meanNovelty) continue;
+        const auto peakBegin = novelty.begin() + std::max(unitIndex - kMinSectionLength, 0);
+        const auto peakEnd = novelty.begin() + std::min(unitIndex + kMinSectionLength + 1, numOfUnits);
+        if (*std::max_element(peakBegin, peakEnd) != novelty[unitIndex]) continue;
+        if (unitIndex - starts.back() < kMinSectionLength) continue;
+        starts.emplace_back(unitIndex);
+    }
+    starts.emplace_back(numOfUnits);
+    
+    // Groups: a section joins the most similar earlier group, if its diagonal (the same progression
+    // played again) is clearly more similar than the median pair of units
+    std::vector<float> sortedSimilarities(similarities);
+    std::nth_element(sortedSimilarities.begin(), sortedSimilarities.begin() + sortedSimilarities.size() / 2, sortedSimilarities.end());
+    const float median = sortedSimilarities[sortedSimilarities.size() / 2];
+    const float sameGroupThreshold = median + (1.f - median) * kSameGroupMargin;
+    
+    auto getSectionSimilarity = [&](int p, int q)
+    {
+        const int length = std::min(starts[p + 1] - starts[p], starts[q + 1] - starts[q]);
+        float maxSimilarity = -1.f;
+        for (int shift = -kMaxAlignmentShift; shift <= kMaxAlignmentShift; ++shift)
+        {
+            float sum = 0.f;
+            int count = 0;
+            for (int offset = 0; offset < length; ++offset)
+            {
+                const int j = starts[q] + offset + shift;
+                if (j < 0 || numOfUnits <= j) continue;
+                sum += getSimilarity(starts[p] + offset, j);
+                ++count;
+            }
+            if (0 < count) maxSimilarity = std::max(maxSimilarity, sum / count);
+        }
+        return maxSimilarity;
+    };
+    
+    const int numOfSections = static_cast<int>(starts.size()) - 1;
+    std::vector<int> groups(numOfSections, -1);
+    std::vector<int> numOfSectionsInGroups;
+    for (int sectionIndex = 0; sectionIndex < numOfSections; ++sectionIndex)
+    {
+        float maxSimilarity = sameGroupThreshold;
+        for (int prevIndex = 0; prevIndex < sectionIndex; ++prevIndex)
+        {
+            const float similarity = getSectionSimilarity(sectionIndex, prevIndex);
+            if (maxSimilarity < similarity)
+            {
+                maxSimilarity = similarity;
+                groups[sectionIndex] = groups[prevIndex];
+            }
+        }
+        if (groups[sectionIndex] < 0)
+        {
+            groups[sectionIndex] = static_cast<int>(numOfSectionsInGroups.size());
+            numOfSectionsInGroups.emplace_back(0);
+        }
+        
+        const int group = groups[sectionIndex];
+        const String letter = String::charToString(static_cast<juce_wchar>('A' + std::min(group, 25)));
+        sections.push_back({ bounds[starts[sectionIndex]] / lengthMSec, bounds[starts[sectionIndex + 1]] / lengthMSec, letter + String(++numOfSectionsInGroups[group]), group });
+    }
+    
+    return sections;
+}
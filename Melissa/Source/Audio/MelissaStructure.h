@@ -0,0 +1,61 @@
+//
+//  MelissaStructure.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaAnalysisCache.h"
+#include "MelissaDataSource.h"
+
+// Sections of the loaded song (intro, verse, chorus, ...), suggested as markers and practice list entries.
+// The timbre (MFCC) and harmony (chroma) of each beat are compared with every other beat, and the
+// sections start where the self-similarity changes. Repeated sections share a letter, e.g. A1 B1 A2.
+class MelissaStructure : public MelissaDataSourceListener
+{
+public:
+    struct Section
+    {
+        float startRatio_;
+        float endRatio_;
+        String name_;
+        int group_; // sections of the same group sound alike
+    };
+    
+    // Empty while the song is being analyzed, or if it is too short to be segmented
+    std::vector<Section> getSections() const;
+    
+    // MelissaDataSourceListener
+    void songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate) override;
+    void beatsUpdated() override;
+    
+    // Singleton
+    static MelissaStructure* getInstance() { return &instance_; }
+    MelissaStructure(const MelissaStructure&) = delete;
+    MelissaStructure& operator=(const MelissaStructure&) = delete;
+    MelissaStructure(MelissaStructure&&) = delete;
+    MelissaStructure& operator=(MelissaStructure&&) = delete;
+    
+private:
+    // Singleton
+    MelissaStructure();
+    ~MelissaStructure() {}
+    static MelissaStructure instance_;
+    
+    class Builder;
+    void featuresBuilt(const String& fingerprint, MelissaAnalysisCache::StructureFeatures& features);
+    void updateSections();
+    
+    static std::vector<Section> segment(const MelissaAnalysisCache::StructureFeatures& features, const std::vector<float>& beatsMSec, float lengthMSec);
+    
+    CriticalSection lock_;
+    String fingerprint_;
+    float lengthMSec_;
+    MelissaAnalysisCache::StructureFeatures features_;
+    std::vector<float> beatsMSec_;
+    std::vector<Section> sections_;
+};
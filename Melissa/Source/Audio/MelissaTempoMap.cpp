@@ -0,0 +1,82 @@
+//
+//  MelissaTempoMap.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaTempoMap.h"
+
+MelissaTempoMap::MelissaTempoMap(float bpm, float beatPositionMSec) :
+beatTimesMSec_(1, beatPositionMSec),
+firstPeriodMSec_(60000.0 / bpm),
+lastPeriodMSec_(60000.0 / bpm),
+downbeatCount_(0)
+{
+}
+
+MelissaTempoMap::MelissaTempoMap(const std::vector<MelissaDataSource::Song::Beat>& beats) :
+firstPeriodMSec_(500.0),
+lastPeriodMSec_(500.0),
+downbeatCount_(0)
+{
+    beatTimesMSec_.reserve(beats.size());
+    for (auto&& beat : beats)
+    {
+        if (!beatTimesMSec_.empty() && beat.positionMSec_ <= beatTimesMSec_.back()) continue;
+        if (beat.isDownbeat_ && downbeatCount_ == 0) downbeatCount_ = static_cast<int>(beatTimesMSec_.size());
+        beatTimesMSec_.emplace_back(beat.positionMSec_);
+    }
+
+    // Before the first beat and after the last one, the tempo of the edge continues
+    const size_t numOfBeats = beatTimesMSec_.size();
+    if (numOfBeats == 0) beatTimesMSec_.emplace_back(0.0);
+    if (numOfBeats < 2) return;
+    firstPeriodMSec_ = beatTimesMSec_[1] - beatTimesMSec_[0];
+    lastPeriodMSec_ = beatTimesMSec_[numOfBeats - 1] - beatTimesMSec_[numOfBeats - 2];
+}
+
+double MelissaTempoMap::getBeatCount(double timeMSec, size_t& cursor) const
+{
+    const size_t numOfBeats = beatTimesMSec_.size();
+    if (timeMSec < beatTimesMSec_.front())
+    {
+        cursor = 0;
+        return (timeMSec - beatTimesMSec_.front()) / firstPeriodMSec_;
+    }
+    if (beatTimesMSec_.back() <= timeMSec)
+    {
+        cursor = numOfBeats - 1;
+        return (numOfBeats - 1) + (timeMSec - beatTimesMSec_.back()) / lastPeriodMSec_;
+    }
+
+    // Usually in the same segment or the next one. Otherwise (seek, loop) search it.
+    if (numOfBeats - 1 <= cursor || timeMSec < beatTimesMSec_[cursor])
+    {
+        cursor = std::upper_bound(beatTimesMSec_.begin(), beatTimesMSec_.end(), timeMSec) - beatTimesMSec_.begin() - 1;
+    }
+    else if (beatTimesMSec_[cursor + 1] <= timeMSec)
+    {
+        ++cursor;
+        if (beatTimesMSec_[cursor + 1] <= timeMSec)
+        {
+            cursor = std::upper_bound(beatTimesMSec_.begin(), beatTimesMSec_.end(), timeMSec) - beatTimesMSec_.begin() - 1;
+        }
+    }
+
+    const double t0 = beatTimesMSec_[cursor];
+    const double t1 = beatTimesMSec_[cursor + 1];
+    return cursor + (timeMSec - t0) / (t1 - t0);
+}
+
+double MelissaTempoMap::getTimeMSec(double beatCount) const
+{
+    const size_t numOfBeats = beatTimesMSec_.size();
+    if (beatCount < 0.0) return beatTimesMSec_.front() + beatCount * firstPeriodMSec_;
+    if (numOfBeats - 1 <= beatCount) return beatTimesMSec_.back() + (beatCount - (numOfBeats - 1)) * lastPeriodMSec_;
+
+    const size_t beatIndex = static_cast<size_t>(beatCount);
+    const double t0 = beatTimesMSec_[beatIndex];
+    const double t1 = beatTimesMSec_[beatIndex + 1];
+    return t0 + (beatCount - beatIndex) * (t1 - t0);
+}
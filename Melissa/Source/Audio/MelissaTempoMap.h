@@ -0,0 +1,37 @@
+//
+//  MelissaTempoMap.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <vector>
+#include "MelissaDataSource.h"
+
+// Song time (msec) to beat count. The beat count is an integer on each beat and
+// linear between them, so the tempo may change at every beat.
+class MelissaTempoMap
+{
+public:
+    // Constant tempo
+    MelissaTempoMap(float bpm, float beatPositionMSec);
+
+    // A breakpoint on each beat of the grid
+    MelissaTempoMap(const std::vector<MelissaDataSource::Song::Beat>& beats);
+
+    // cursor is the segment used last time. Consecutive times are looked up in O(1).
+    double getBeatCount(double timeMSec, size_t& cursor) const;
+
+    // Inverse of getBeatCount()
+    double getTimeMSec(double beatCount) const;
+
+    // Beat count of a downbeat, which gives the phase of the bars
+    int getDownbeatCount() const { return downbeatCount_; }
+
+private:
+    std::vector<double> beatTimesMSec_;
+    double firstPeriodMSec_, lastPeriodMSec_;
+    int downbeatCount_;
+};
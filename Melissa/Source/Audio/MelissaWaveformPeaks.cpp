@@ -0,0 +1,166 @@
+//
+//  MelissaWaveformPeaks.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaAnalysisCache.h"
+#include "MelissaWaveformPeaks.h"
+
+bool MelissaWaveformPeaks::Builder::prepare(const String& fingerprint, double sampleRate, size_t bufferLength)
+{
+    if (bufferLength == 0) return false;
+
+    auto cachedPeaks = MelissaAnalysisCache::getInstance()->readPeaks(fingerprint);
+    if (cachedPeaks != nullptr)
+    {
+        onBuilt_(cachedPeaks);
+        return false;
+    }
+
+    fingerprint_ = fingerprint;
+    peaks_ = std::make_shared<MelissaWaveformPeaks>();
+    peaks_->lengthInSamples_ = bufferLength;
+    peaks_->levels_[0].reserve((bufferLength + kBinSizes[0] - 1) / kBinSizes[0]);
+
+    return true;
+}
+
+void MelissaWaveformPeaks::Builder::process(const AudioSampleBuffer& block, size_t startIndex, size_t length)
+{
+    // The finest level is computed from the samples. The blocks are multiples of the bin size.
+    constexpr size_t binSize = kBinSizes[0];
+    auto& finestBins = peaks_->levels_[0];
+    float squares[binSize];
+    for (size_t binStartIndex = 0; binStartIndex < length; binStartIndex += binSize)
+    {
+        const int numOfSamples = static_cast<int>(std::min(binSize, length - binStartIndex));
+        const float* l = block.getReadPointer(0, static_cast<int>(binStartIndex));
+        const float* r = block.getReadPointer(1, static_cast<int>(binStartIndex));
+
+        const auto rangeL = FloatVectorOperations::findMinAndMax(l, numOfSamples);
+        const auto rangeR = FloatVectorOperations::findMinAndMax(r, numOfSamples);
+        FloatVectorOperations::multiply(squares, l, l, numOfSamples);
+        FloatVectorOperations::addWithMultiply(squares, r, r, numOfSamples);
+
+        float sumOfSquares = 0.f;
+        for (int sampleIndex = 0; sampleIndex < numOfSamples; ++sampleIndex) sumOfSquares += squares[sampleIndex];
+
+        finestBins.push_back({ std::min(rangeL.getStart(), rangeR.getStart()), std::max(rangeL.getEnd(), rangeR.getEnd()), sumOfSquares / numOfSamples });
+    }
+}
+
+void MelissaWaveformPeaks::Builder::finish()
+{
+    // The coarser levels are merged from the level below
+    for (size_t levelIndex = 1; levelIndex < kNumOfLevels; ++levelIndex)
+    {
+        const auto& srcBins = peaks_->levels_[levelIndex - 1];
+        auto& bins = peaks_->levels_[levelIndex];
+        const size_t ratio = kBinSizes[levelIndex] / kBinSizes[levelIndex - 1];
+        bins.reserve((srcBins.size() + ratio - 1) / ratio);
+
+        for (size_t srcIndex = 0; srcIndex < srcBins.size(); srcIndex += ratio)
+        {
+            const size_t numOfSrcBins = std::min(ratio, srcBins.size() - srcIndex);
+            Bin bin = srcBins[srcIndex];
+            for (size_t i = 1; i < numOfSrcBins; ++i)
+            {
+                bin.min_ = std::min(bin.min_, srcBins[srcIndex + i].min_);
+                bin.max_ = std::max(bin.max_, srcBins[srcIndex + i].max_);
+                bin.meanSquare_ += srcBins[srcIndex + i].meanSquare_;
+            }
+            bin.meanSquare_ /= numOfSrcBins;
+            bins.push_back(bin);
+        }
+    }
+
+    MelissaAnalysisCache::getInstance()->writePeaks(fingerprint_, *peaks_);
+    onBuilt_(peaks_);
+}
+
+MelissaWaveformPeaks::Bin MelissaWaveformPeaks::getBin(size_t startIndex, size_t endIndex) const
+{
+    endIndex = std::min(endIndex, lengthInSamples_);
+    if (endIndex <= startIndex) return { 0.f, 0.f, 0.f };
+
+    // Start from the coarsest level whose bins still fit in the range
+    size_t levelIndex = 0;
+    while (levelIndex + 1 < kNumOfLevels && kBinSizes[levelIndex + 1] <= endIndex - startIndex) ++levelIndex;
+
+    Bin bin = { 0.f, 0.f, 0.f };
+    double sumOfSquares = 0.0;
+    size_t numOfSamples = 0;
+    accumulate(levelIndex, startIndex, endIndex, bin, sumOfSquares, numOfSamples);
+    if (numOfSamples == 0) return { 0.f, 0.f, 0.f };
+
+    bin.meanSquare_ = static_cast<float>(sumOfSquares / numOfSamples);
+    return bin;
+}
+
+void MelissaWaveformPeaks::accumulate(size_t levelIndex, size_t startIndex, size_t endIndex, Bin& bin, double& sumOfSquares, size_t& numOfSamples) const
+{
+    const auto& bins = levels_[levelIndex];
+    const size_t binSize = kBinSizes[levelIndex];
+
+    // The finest level has nothing below it, so its partly covered bins are used as they are
+    size_t firstBin = startIndex / binSize;
+    size_t lastBin = std::min((endIndex + binSize - 1) / binSize, bins.size());
+    if (0 < levelIndex)
+    {
+        firstBin = (startIndex + binSize - 1) / binSize;
+        // The last bin of the song is shorter, it is covered if the range reaches the end
+        lastBin = (endIndex == lengthInSamples_) ? bins.size() : endIndex / binSize;
+        if (lastBin <= firstBin)
+        {
+            accumulate(levelIndex - 1, startIndex, endIndex, bin, sumOfSquares, numOfSamples);
+            return;
+        }
+        if (startIndex < firstBin * binSize) accumulate(levelIndex - 1, startIndex, firstBin * binSize, bin, sumOfSquares, numOfSamples);
+    }
+
+    for (size_t binIndex = firstBin; binIndex < lastBin; ++binIndex)
+    {
+        const size_t binStartIndex = binIndex * binSize;
+        const size_t binEndIndex = std::min(binStartIndex + binSize, lengthInSamples_);
+        const size_t numOfCoveredSamples = std::min(binEndIndex, endIndex) - std::max(binStartIndex, startIndex);
+
+        const auto& src = bins[binIndex];
+        bin.min_ = (numOfSamples == 0) ? src.min_ : std::min(bin.min_, src.min_);
+        bin.max_ = (numOfSamples == 0) ? src.max_ : std::max(bin.max_, src.max_);
+        sumOfSquares += static_cast<double>(src.meanSquare_) * numOfCoveredSamples;
+        numOfSamples += numOfCoveredSamples;
+    }
+
+    if (0 < levelIndex && lastBin * binSize < endIndex) accumulate(levelIndex - 1, lastBin * binSize, endIndex, bin, sumOfSquares, numOfSamples);
+}
+
+void MelissaWaveformPeaks::write(OutputStream& output) const
+{
+    output.writeInt64(static_cast<int64>(lengthInSamples_));
+    for (auto&& bins : levels_)
+    {
+        output.writeInt64(static_cast<int64>(bins.size()));
+        output.write(bins.data(), bins.size() * sizeof(Bin));
+    }
+}
+
+std::shared_ptr<MelissaWaveformPeaks> MelissaWaveformPeaks::read(InputStream& input)
+{
+    auto peaks = std::make_shared<MelissaWaveformPeaks>();
+    peaks->lengthInSamples_ = static_cast<size_t>(input.readInt64());
+    for (size_t levelIndex = 0; levelIndex < kNumOfLevels; ++levelIndex)
+    {
+        // Each level has exactly as many bins as the length needs
+        const int64 numOfBins = input.readInt64();
+        if (numOfBins != static_cast<int64>((peaks->lengthInSamples_ + kBinSizes[levelIndex] - 1) / kBinSizes[levelIndex])) return nullptr;
+        if (input.getNumBytesRemaining() < numOfBins * static_cast<int64>(sizeof(Bin))) return nullptr;
+
+        auto& bins = peaks->levels_[levelIndex];
+        bins.resize(static_cast<size_t>(numOfBins));
+        input.read(bins.data(), static_cast<int>(numOfBins * sizeof(Bin)));
+    }
+
+    return peaks;
+}
@@ -0,0 +1,63 @@
+//
+//  MelissaWaveformPeaks.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaAnalyzer.h"
+
+// Min / max / RMS of the loaded song at several resolutions.
+// It is built once per song, then any range can be summarized in a few bin lookups.
+class MelissaWaveformPeaks
+{
+public:
+    struct Bin
+    {
+        float min_;
+        float max_;
+        float meanSquare_; // mean of (l * l + r * r)
+    };
+
+    static constexpr size_t kNumOfLevels = 3;
+    static constexpr size_t kBinSizes[kNumOfLevels] = { 256, 4096, 65536 };
+
+    // Builds the peaks in the analysis pipeline, or reads them from the analysis cache.
+    // onBuilt is called on the pipeline thread.
+    class Builder : public MelissaAnalyzer
+    {
+    public:
+        Builder(const std::function<void(std::shared_ptr<MelissaWaveformPeaks>)>& onBuilt) : onBuilt_(onBuilt) { }
+
+        bool prepare(const String& fingerprint, double sampleRate, size_t bufferLength) override;
+        void process(const AudioSampleBuffer& block, size_t startIndex, size_t length) override;
+        void finish() override;
+
+    private:
+        std::function<void(std::shared_ptr<MelissaWaveformPeaks>)> onBuilt_;
+        String fingerprint_;
+        std::shared_ptr<MelissaWaveformPeaks> peaks_;
+    };
+
+    size_t getLengthInSamples() const { return lengthInSamples_; }
+
+    // Summary of the samples in [startIndex, endIndex)
+    Bin getBin(size_t startIndex, size_t endIndex) const;
+
+    // Serialization for the analysis cache. read() returns nullptr if the data is broken.
+    void write(OutputStream& output) const;
+    static std::shared_ptr<MelissaWaveformPeaks> read(InputStream& input);
+
+private:
+    // Adds [startIndex, endIndex) to bin. Whole bins of the level are used where they fit, the edges come from the finer levels.
+    void accumulate(size_t levelIndex, size_t startIndex, size_t endIndex, Bin& bin, double& sumOfSquares, size_t& numOfSamples) const;
+
+    size_t lengthInSamples_ = 0;
+    std::vector<Bin> levels_[kNumOfLevels];
+};
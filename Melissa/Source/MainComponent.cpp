@@ -8,11 +8,15 @@
 #include <sstream>
 #include "MainComponent.h"
 #include "MelissaAboutComponent.h"
+#include "MelissaAnalysisPipeline.h"
 #include "MelissaBPMSettingComponent.h"
 #include "MelissaDefinitions.h"
 #include "MelissaInputDialog.h"
+#include "MelissaLoudness.h"
 #include "MelissaOptionDialog.h"
 #include "MelissaShortcutComponent.h"
+#include "MelissaSnapIndex.h"
+#include "MelissaStructure.h"
 #include "MelissaUISettings.h"
 #include "MelissaUtility.h"
 #include <float.h>
@@ -44,6 +48,14 @@ enum
     kMenuID_Tutorial,
     kMenuID_TwitterShare,
     kMenuID_FileOpen = 2000,
+    kMenuID_MusicOutput = 3000,
+    kMenuID_MetronomeOutput = 3100,
+    kMenuID_MetronomeSubdivision = 3200,
+    kMenuID_MetronomeAccentPattern = 3300,
+    kMenuID_MetronomeClickBeep = 3400,
+    kMenuID_MetronomeClickFile,
+    kMenuID_EqBand = 3500,
+    kMenuID_EqType = 3600,
 };
 
 class MainComponent::HeaderComponent : public Component
@@ -152,6 +164,9 @@ MainComponent::MainComponent() : Thread("MelissaProcessThread"), mainVolume_(1.f
     dataSource_ = MelissaDataSource::getInstance();
     dataSource_->setMelissaAudioEngine(audioEngine_.get());
     dataSource_->addListener(this);
+    dataSource_->addListener(MelissaSnapIndex::getInstance());
+    dataSource_->addListener(MelissaLoudness::getInstance());
+    dataSource_->addListener(MelissaStructure::getInstance());
     
     deviceManager.initialise(0, 2, XmlDocument::parse(dataSource_->global_.device_).get(), true);
     deviceManager.addMidiInputDeviceCallback("", this);
@@ -168,12 +183,15 @@ MainComponent::MainComponent() : Thread("MelissaProcessThread"), mainVolume_(1.f
         isFirstLaunch = true;
     }
     dataSource_->loadSettingsFile(settingsFile_);
+    audioEngine_->setCrossfadeMSec(dataSource_->global_.crossfadeMSec_);
+    metronome_->setSubdivision(dataSource_->global_.metronomeSubdivision_);
+    metronome_->setAccentPattern(static_cast<MelissaMetronome::AccentPattern>(jlimit(0, MelissaMetronome::kNumOfAccentPatterns - 1, dataSource_->global_.metronomeAccentPattern_)));
+    metronome_->setClickFile(dataSource_->global_.metronomeClickFile_);
     
     bpmDetector_ = std::make_unique<MelissaBPMDetector>();
-    analyzedBpm_ = -1.f;
     bpmAnalyzeFinished_ = true;
     shouldInitializeBpmDetector_ = false;
-    shouldUpdateBpm_ = false;
+    shouldReanalyzeBpm_ = false;
     
     MelissaUISettings::isDarkMode = dataSource_->getUITheme() == "System_Dark";
     
@@ -250,6 +268,7 @@ MainComponent::MainComponent() : Thread("MelissaProcessThread"), mainVolume_(1.f
     uiState_ = dataSource_->getPreviousUIState();
     updateFileChooserTab(static_cast<FileChooserTab>(uiState_.selectedFileBrowserTab_));
     playlistComponent_->select(uiState_.selectedPlaylist_);
+    waveformComponent_->setViewMode(static_cast<MelissaWaveformControlComponent::ViewMode>(uiState_.waveformViewMode_));
     
     if (isFirstLaunch)
     {
@@ -409,6 +428,57 @@ void MainComponent::createUI()
         menu.addItem(kMenuID_Preferences, TRANS("audio_midi_settings"));
         menu.addItem(kMenuID_Shortcut, TRANS("shortcut_settings"));
         
+        // Output pairs of the active channels of the device
+        auto device = deviceManager.getCurrentAudioDevice();
+        const int numOfOutputChannels = (device == nullptr) ? 2 : device->getActiveOutputChannels().countNumberOfSetBits();
+        auto router = MelissaOutputRouter::getInstance();
+        PopupMenu musicOutputMenu, metronomeOutputMenu;
+        for (int outputChannel = 0; outputChannel < static_cast<int>(MelissaOutputRouter::kMaxNumOfOutputChannels); outputChannel += 2)
+        {
+            const auto name = String(outputChannel + 1) + " / " + String(outputChannel + 2);
+            const bool isAvailable = outputChannel < numOfOutputChannels;
+            musicOutputMenu.addItem(kMenuID_MusicOutput + outputChannel, name, isAvailable, router->getOutputChannel(MelissaOutputRouter::kSource_Music) == outputChannel);
+            metronomeOutputMenu.addItem(kMenuID_MetronomeOutput + outputChannel, name, isAvailable, router->getOutputChannel(MelissaOutputRouter::kSource_Metronome) == outputChannel);
+        }
+        menu.addSubMenu(TRANS("music_output"), musicOutputMenu);
+        menu.addSubMenu(TRANS("metronome_output"), metronomeOutputMenu);
+        
+        PopupMenu metronomeSoundMenu;
+        const auto& global = dataSource_->global_;
+        metronomeSoundMenu.addSectionHeader(TRANS("metronome_subdivision"));
+        const String subdivisionNames[] = { TRANS("subdivision_none"), TRANS("subdivision_eighth"), TRANS("subdivision_triplet"), TRANS("subdivision_sixteenth") };
+        for (int subdivision = 1; subdivision <= MelissaMetronome::kMaxSubdivision; ++subdivision)
+        {
+            metronomeSoundMenu.addItem(kMenuID_MetronomeSubdivision + subdivision, subdivisionNames[subdivision - 1], true, global.metronomeSubdivision_ == subdivision);
+        }
+        metronomeSoundMenu.addSectionHeader(TRANS("metronome_accent_pattern"));
+        const String accentPatternNames[] = { TRANS("accent_pattern_downbeat"), TRANS("accent_pattern_downbeat_and_middle"), TRANS("accent_pattern_backbeat") };
+        for (int accentPattern = 0; accentPattern < MelissaMetronome::kNumOfAccentPatterns; ++accentPattern)
+        {
+            metronomeSoundMenu.addItem(kMenuID_MetronomeAccentPattern + accentPattern, accentPatternNames[accentPattern], true, global.metronomeAccentPattern_ == accentPattern);
+        }
+        metronomeSoundMenu.addSectionHeader(TRANS("metronome_click"));
+        metronomeSoundMenu.addItem(kMenuID_MetronomeClickBeep, TRANS("click_beep"), true, global.metronomeClickFile_.isEmpty());
+        const auto clickFileName = global.metronomeClickFile_.isEmpty() ? TRANS("click_select_file") : File(global.metronomeClickFile_).getFileName();
+        metronomeSoundMenu.addItem(kMenuID_MetronomeClickFile, clickFileName, true, global.metronomeClickFile_.isNotEmpty());
+        menu.addSubMenu(TRANS("metronome_sound"), metronomeSoundMenu);
+        
+        PopupMenu eqMenu;
+        const auto selectedBand = model_->getEqSelectedBand();
+        eqMenu.addSectionHeader(TRANS("eq_band"));
+        for (size_t band = 0; band < kEqNumOfBands; ++band)
+        {
+            const auto name = String(band + 1) + " (" + String(static_cast<int>(model_->getEqFreq(band))) + " Hz)";
+            eqMenu.addItem(kMenuID_EqBand + static_cast<int>(band), name, true, band == selectedBand);
+        }
+        eqMenu.addSectionHeader(TRANS("eq_type"));
+        const String eqTypeNames[] = { TRANS("eq_type_peak"), TRANS("eq_type_low_shelf"), TRANS("eq_type_high_shelf"), TRANS("eq_type_high_pass"), TRANS("eq_type_low_pass") };
+        for (int type = 0; type < kNumOfEqTypes; ++type)
+        {
+            eqMenu.addItem(kMenuID_EqType + type, eqTypeNames[type], true, model_->getEqType(selectedBand) == type);
+        }
+        menu.addSubMenu(TRANS("eq_settings"), eqMenu);
+        
         PopupMenu uiThemeMenu;
         const auto uiTheme = dataSource_->getUITheme();
         uiThemeMenu.addItem(kMenuID_UITheme_Dark, TRANS("ui_theme_dark"), true, uiTheme == "System_Dark");
@@ -491,6 +561,43 @@ void MainComponent::createUI()
             {
                 settingsFile_.revealToUser();
             }
+            else if (kMenuID_MusicOutput <= result && result < kMenuID_MusicOutput + static_cast<int>(MelissaOutputRouter::kMaxNumOfOutputChannels))
+            {
+                dataSource_->global_.musicOutputChannel_ = result - kMenuID_MusicOutput;
+                MelissaOutputRouter::getInstance()->setOutputChannel(MelissaOutputRouter::kSource_Music, result - kMenuID_MusicOutput);
+            }
+            else if (kMenuID_MetronomeOutput <= result && result < kMenuID_MetronomeOutput + static_cast<int>(MelissaOutputRouter::kMaxNumOfOutputChannels))
+            {
+                dataSource_->global_.metronomeOutputChannel_ = result - kMenuID_MetronomeOutput;
+                MelissaOutputRouter::getInstance()->setOutputChannel(MelissaOutputRouter::kSource_Metronome, result - kMenuID_MetronomeOutput);
+            }
+            else if (kMenuID_MetronomeSubdivision < result && result <= kMenuID_MetronomeSubdivision + MelissaMetronome::kMaxSubdivision)
+            {
+                dataSource_->global_.metronomeSubdivision_ = result - kMenuID_MetronomeSubdivision;
+                metronome_->setSubdivision(result - kMenuID_MetronomeSubdivision);
+            }
+            else if (kMenuID_MetronomeAccentPattern <= result && result < kMenuID_MetronomeAccentPattern + MelissaMetronome::kNumOfAccentPatterns)
+            {
+                dataSource_->global_.metronomeAccentPattern_ = result - kMenuID_MetronomeAccentPattern;
+                metronome_->setAccentPattern(static_cast<MelissaMetronome::AccentPattern>(result - kMenuID_MetronomeAccentPattern));
+            }
+            else if (result == kMenuID_MetronomeClickBeep)
+            {
+                dataSource_->global_.metronomeClickFile_ = "";
+                metronome_->setClickFile("");
+            }
+            else if (result == kMenuID_MetronomeClickFile)
+            {
+                showClickFileChooser();
+            }
+            else if (kMenuID_EqBand <= result && result < kMenuID_EqBand + static_cast<int>(kEqNumOfBands))
+            {
+                model_->setEqSelectedBand(result - kMenuID_EqBand);
+            }
+            else if (kMenuID_EqType <= result && result < kMenuID_EqType + kNumOfEqTypes)
+            {
+                model_->setEqType(model_->getEqSelectedBand(), static_cast<EqType>(result - kMenuID_EqType));
+            }
         });
     };
     menuButton_->setBudgeVisibility(MelissaUpdateChecker::getUpdateStatus() == MelissaUpdateChecker::kUpdateStatus_UpdateExists);
@@ -629,7 +736,7 @@ void MainComponent::createUI()
             }
             else if (event == MelissaIncDecButton::kEvent_Func)
             {
-                model_->setLoopAPosMSec(model_->getPlayingPosMSec());
+                model_->setLoopAPosRatio(MelissaSnapIndex::getInstance()->snapRatio(model_->getPlayingPosRatio()));
             }
             else
             {
@@ -651,7 +758,7 @@ void MainComponent::createUI()
             }
             else if (event == MelissaIncDecButton::kEvent_Func)
             {
-                model_->setLoopBPosMSec(model_->getPlayingPosMSec());
+                model_->setLoopBPosRatio(MelissaSnapIndex::getInstance()->snapRatio(model_->getPlayingPosRatio()));
             }
             else
             {
@@ -862,6 +969,7 @@ void MainComponent::createUI()
             else
             {
                 const int sign = (event == MelissaIncDecButton::kEvent_Inc) ? 1 : -1;
+                dataSource_->setBeats({});
                 model_->setBpm(std::clamp<int>(model_->getBpm() + sign, kBpmMin, kBpmMax));
             }
         };
@@ -876,11 +984,13 @@ void MainComponent::createUI()
             }
             else if (event == MelissaIncDecButton::kEvent_Func)
             {
+                dataSource_->setBeats({});
                 model_->setBeatPositionMSec(model_->getPlayingPosMSec());
             }
             else
             {
                 const int sign = (event == MelissaIncDecButton::kEvent_Inc) ? 1 : -1;
+                dataSource_->setBeats({});
                 model_->setBeatPositionMSec(model_->getBeatPositionMSec() + sign * 100);
             }
         };
@@ -915,7 +1025,8 @@ void MainComponent::createUI()
         };
         section->addAndMakeVisible(eqSwitchButton_.get());
         
-        for (size_t bandIndex = 0; bandIndex < kNumOfEqBands; ++bandIndex)
+        // The knobs edit the band selected from the menu
+        for (size_t bandIndex = 0; bandIndex < kNumOfEqBandKnobs; ++bandIndex)
         {
             auto freqKnob = std::make_unique<Slider>();
             freqKnob->setTooltip(TRANS("eq_freq"));
@@ -925,7 +1036,7 @@ void MainComponent::createUI()
             freqKnob->onValueChange = [&, bandIndex]()
             {
                 auto value = eqFreqKnobs_[bandIndex]->getValue();
-                model_->setEqFreq(0, 20 * std::pow(1000, value));
+                model_->setEqFreq(model_->getEqSelectedBand(), 20 * std::pow(1000, value));
             };
             section->addAndMakeVisible(freqKnob.get());
             eqFreqKnobs_[bandIndex] = std::move(freqKnob);
@@ -938,7 +1049,7 @@ void MainComponent::createUI()
             qKnob->onValueChange = [&, bandIndex]()
             {
                 auto value = eqQKnobs_[bandIndex]->getValue();
-                model_->setEqQ(0, value);
+                model_->setEqQ(model_->getEqSelectedBand(), value);
             };
             section->addAndMakeVisible(qKnob.get());
             eqQKnobs_[bandIndex] = std::move(qKnob);
@@ -951,7 +1062,7 @@ void MainComponent::createUI()
             gainKnob->onValueChange = [&, bandIndex]()
             {
                 auto value = eqGainKnobs_[bandIndex]->getValue();
-                model_->setEqGain(0, value);
+                model_->setEqGain(model_->getEqSelectedBand(), value);
             };
             section->addAndMakeVisible(gainKnob.get());
             eqGainKnobs_[bandIndex] = std::move(gainKnob);
@@ -959,7 +1070,7 @@ void MainComponent::createUI()
         
         constexpr int numOfControls = 3;
         const static String labelTitles[] = { "Freq", "Gain", "Q" };
-        for (size_t labelIndex = 0; labelIndex < kNumOfEqBands * numOfControls; ++labelIndex)
+        for (size_t labelIndex = 0; labelIndex < kNumOfEqBandKnobs * numOfControls; ++labelIndex)
         {
             auto l = std::make_unique<Label>();
             l->setFont(dataSource_->getFont(MelissaDataSource::Global::kFontSize_Sub));
@@ -1145,7 +1256,7 @@ void MainComponent::createUI()
     addMarkerButton_->onClick = [this]()
     {
         markerListToggleButton_->setToggleState(true, sendNotification);
-        dataSource_->addDefaultMarker(model_->getPlayingPosRatio());
+        dataSource_->addDefaultMarker(MelissaSnapIndex::getInstance()->snapRatio(model_->getPlayingPosRatio()));
     };
     listComponent_->addAndMakeVisible(addMarkerButton_.get());
 
@@ -1216,10 +1327,27 @@ void MainComponent::showFileChooser()
     });
 }
 
+void MainComponent::showClickFileChooser()
+{
+    fileChooser_ = std::make_unique<FileChooser>(TRANS("choose_click_file"), File::getCurrentWorkingDirectory(), "*.wav;*.aif;*.aiff;*.flac;*.ogg", true);
+    fileChooser_->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectFiles, [&, this] (const FileChooser& chooser) {
+        auto fileUrl = chooser.getURLResult();
+        if (fileUrl.isLocalFile())
+        {
+            // A file which can't be read leaves the beep
+            const auto filePath = fileUrl.getLocalFile().getFullPathName();
+            dataSource_->global_.metronomeClickFile_ = metronome_->setClickFile(filePath) ? filePath : "";
+        }
+    });
+}
+
 void MainComponent::prepareToPlay(int samplesPerBlockExpected, double sampleRate)
 {
-    audioEngine_->setOutputSampleRate(sampleRate);
+    timeIndicesMSec_.resize(samplesPerBlockExpected);
+    audioEngine_->setOutputSampleRate(sampleRate, samplesPerBlockExpected);
     metronome_->setOutputSampleRate(sampleRate);
+    MelissaPreviewPlayer::getInstance()->setOutputSampleRate(sampleRate, samplesPerBlockExpected);
+    MelissaOutputRouter::getInstance()->prepare(sampleRate, samplesPerBlockExpected);
 }
 
 void MainComponent::getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill)
@@ -1231,43 +1359,33 @@ void MainComponent::getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill
     }
     bufferToFill.clearActiveBufferRegion();
     
-    const size_t numOfChannels = bufferToFill.buffer->getNumChannels();
+    const size_t numOfChannels = std::min<size_t>(bufferToFill.buffer->getNumChannels(), MelissaOutputRouter::kMaxNumOfOutputChannels);
+    if (numOfChannels == 0) return;
+    
+    float* deviceChannels[MelissaOutputRouter::kMaxNumOfOutputChannels];
+    for (size_t chIndex = 0; chIndex < numOfChannels; ++chIndex) deviceChannels[chIndex] = bufferToFill.buffer->getWritePointer(static_cast<int>(chIndex));
     
-    if (numOfChannels == 1)
+    const bool isMusicPlaying = model_->getPlaybackStatus() == kPlaybackStatus_Playing && !prepareingNextSong_;
+    auto router = MelissaOutputRouter::getInstance();
+    if (router->isDirect(numOfChannels))
     {
-        float* buffer[] = { bufferToFill.buffer->getWritePointer(0) };
-        if (model_->getPlaybackStatus() == kPlaybackStatus_Playing && !prepareingNextSong_)
-        {
-            audioEngine_->render(buffer, numOfChannels, timeIndicesMSec_, bufferToFill.numSamples);
-        }
-        metronome_->render(buffer, numOfChannels, timeIndicesMSec_, bufferToFill.numSamples);
-        
-        for (int sampleIndex = 0; sampleIndex < numSamples; ++sampleIndex)
-        {
-            buffer[0][sampleIndex] *= mainVolume_;
-        }
-    }
-    else if (numOfChannels == 2)
-    {
-        float* buffer[] = { bufferToFill.buffer->getWritePointer(0), bufferToFill.buffer->getWritePointer(1) };
-        if (model_->getPlaybackStatus() == kPlaybackStatus_Playing && !prepareingNextSong_)
-        {
-            audioEngine_->render(buffer, numOfChannels, timeIndicesMSec_, bufferToFill.numSamples);
-        }
-        metronome_->render(buffer, numOfChannels, timeIndicesMSec_, bufferToFill.numSamples);
-        for (int sampleIndex = 0; sampleIndex < numSamples; ++sampleIndex)
-        {
-            buffer[0][sampleIndex] *= mainVolume_;
-            buffer[1][sampleIndex] *= mainVolume_;
-        }
+        // Everything goes to the first pair, so it is rendered into the device buffer as it is
+        const size_t numOfMainChannels = std::min<size_t>(numOfChannels, 2);
+        float* buffer[] = { deviceChannels[0], deviceChannels[numOfMainChannels - 1] };
+        if (isMusicPlaying) audioEngine_->render(buffer, numOfMainChannels, timeIndicesMSec_, bufferToFill.numSamples);
+        metronome_->render(buffer, numOfMainChannels, timeIndicesMSec_, bufferToFill.numSamples);
+        MelissaPreviewPlayer::getInstance()->render(buffer, numOfMainChannels, bufferToFill.numSamples);
     }
     else
     {
-        jassertfalse;
+        auto musicBus = router->getBus(MelissaOutputRouter::kSource_Music, numSamples);
+        if (isMusicPlaying) audioEngine_->render(musicBus, 2, timeIndicesMSec_, bufferToFill.numSamples);
+        MelissaPreviewPlayer::getInstance()->render(musicBus, 2, bufferToFill.numSamples);
+        metronome_->render(router->getBus(MelissaOutputRouter::kSource_Metronome, numSamples), 2, timeIndicesMSec_, bufferToFill.numSamples);
+        router->route(deviceChannels, numOfChannels, numSamples);
     }
     
-
-        
+    router->processOutputStages(deviceChannels, numOfChannels, numSamples, mainVolume_);
 }
 
 void MainComponent::releaseResources()
@@ -1276,6 +1394,7 @@ void MainComponent::releaseResources()
     // restarted due to a setting change.
     
     // For more details, see the help for AudioProcessor::releaseResources()
+    MelissaPreviewPlayer::getInstance()->releaseResources();
 }
 
 void MainComponent::paint(Graphics& g)
@@ -1444,11 +1563,11 @@ void MainComponent::resized()
         
         constexpr int knobSize = 42;
         const int y = 30 + (section->getHeight() - 30) / 2 - knobSize / 2 - 8;
-        const int interval = (section->getWidth() - knobSize * kNumOfEqBands * 3) / (kNumOfEqBands * 3 + 1);
+        const int interval = (section->getWidth() - knobSize * kNumOfEqBandKnobs * 3) / (kNumOfEqBandKnobs * 3 + 1);
         
         int x = interval;
         const int expandWidth = 40;
-        for (size_t bandIndex = 0; bandIndex < kNumOfEqBands; ++bandIndex)
+        for (size_t bandIndex = 0; bandIndex < kNumOfEqBandKnobs; ++bandIndex)
         {
             eqFreqKnobs_[bandIndex]->setBounds(x, y, knobSize, knobSize);
             knobLabels_[bandIndex * 3 + 0]->setBounds(x - expandWidth / 2, y + knobSize - 8, knobSize + expandWidth, 30);
@@ -1579,7 +1698,7 @@ bool MainComponent::keyPressed(const KeyPress &key, Component* originatingCompon
 
 void MainComponent::showAudioMidiSettingsDialog()
 {
-    auto component = std::make_shared<AudioDeviceSelectorComponent>(deviceManager, 0, 0, 0, 2, true, false, true, false);
+    auto component = std::make_shared<AudioDeviceSelectorComponent>(deviceManager, 0, 0, 0, static_cast<int>(MelissaOutputRouter::kMaxNumOfOutputChannels), true, false, true, false);
     component->setSize(getWidth() * 0.6f, getHeight() * 0.8f);
     MelissaModalDialog::show(std::dynamic_pointer_cast<Component>(component), TRANS("audio_midi_settings"));
 }
@@ -1656,12 +1775,42 @@ void MainComponent::closeTutorial()
 
 void MainComponent::songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate)
 {
+    MelissaPreviewPlayer::getInstance()->stop();
     memoTextEditor_->setText(dataSource_->getMemo());
     auto parentDir = File(filePath).getParentDirectory();
     parentDir.setAsCurrentWorkingDirectory();
     fileBrowserComponent_->setRoot(parentDir);
     
+    bpmDetector_->cancel();
     shouldInitializeBpmDetector_ = true;
+    
+    if (shouldReanalyzeBpm_)
+    {
+        // The song has been reloaded with new stems. Analyze the rhythm again on them after
+        // the song state is restored, unless the BPM has been set by hand (which clears the grid).
+        shouldReanalyzeBpm_ = false;
+        MessageManager::callAsync([&]() {
+            std::vector<MelissaDataSource::Song::Beat> beats;
+            dataSource_->getBeats(beats);
+            if (beats.empty() && model_->getBpm() != kBpmMeasureFailed) return;
+            shouldInitializeBpmDetector_ = true;
+            bpmAnalyzeFinished_ = false;
+        });
+    }
+    
+    harmony_ = nullptr;
+    waveformComponent_->setHarmony(nullptr);
+    updateKeyLabel();
+    Component::SafePointer<MainComponent> safeThis(this);
+    MelissaAnalysisPipeline::getInstance()->request(std::make_shared<MelissaHarmony::Builder>([safeThis](std::shared_ptr<MelissaHarmony> harmony) {
+        MessageManager::callAsync([safeThis, harmony]() {
+            // Ignore the result for the previous song
+            if (safeThis == nullptr || harmony->getLengthInSamples() != MelissaDataSource::getInstance()->getBufferLength()) return;
+            safeThis->harmony_ = harmony;
+            safeThis->waveformComponent_->setHarmony(harmony);
+            safeThis->updateKeyLabel();
+        });
+    }));
 }
 
 void MainComponent::fileLoadStatusChanged(FileLoadStatus status, const String& filePath)
@@ -1682,8 +1831,20 @@ void MainComponent::fileLoadStatusChanged(FileLoadStatus status, const String& f
     }
 }
 
+void MainComponent::selectionChanged()
+{
+    if (fileBrowserComponent_->getNumSelectedFiles() == 0) return;
+    
+    const auto file = fileBrowserComponent_->getSelectedFile(0);
+    if (file.existsAsFile())
+    {
+        MelissaPreviewPlayer::getInstance()->preview(file);
+    }
+}
+
 void MainComponent::fileDoubleClicked(const File& file)
 {
+    MelissaPreviewPlayer::getInstance()->stop();
     dataSource_->loadFileAsync(file);
 }
 
@@ -1739,16 +1900,6 @@ void MainComponent::run()
             {
                 audioEngine_->process();
             }
-            else if (!bpmAnalyzeFinished_)
-            {
-                if (shouldInitializeBpmDetector_)
-                {
-                    bpmDetector_->initialize(dataSource_->getSampleRate(), dataSource_->getBufferLength());
-                    shouldInitializeBpmDetector_ = false;
-                }
-                bpmDetector_->process(&bpmAnalyzeFinished_, &analyzedBpm_);
-                if (bpmAnalyzeFinished_) shouldUpdateBpm_ = true;
-            }
             else
             {
                 wait(100);
@@ -1775,7 +1926,8 @@ void MainComponent::exitSignalSent()
     
     const int selectedFileBrowserTab = (fileBrowserComponent_->isVisible()) ? 0 : (playlistComponent_->isVisible() ? 1 : 2);
     const int selectedPlaylist = playlistComponent_->getSelected();
-    dataSource_->saveUIState({selectedFileBrowserTab, selectedPlaylist});
+    const int waveformViewMode = static_cast<int>(waveformComponent_->getViewMode());
+    dataSource_->saveUIState({selectedFileBrowserTab, selectedPlaylist, waveformViewMode});
     
     dataSource_->saveSettingsFile();
     dataSource_->disposeBuffer();
@@ -1805,6 +1957,9 @@ void MainComponent::timerCallback()
             {
                 const auto songName = File(nextSongFilePath).getFileNameWithoutExtension();
                 fileNameLabel_->setText("Next ... \"" + songName + "\"", dontSendNotification);
+                
+                // decode the next song in background so that it starts without a gap
+                dataSource_->prefetchFileAsync(nextSongFilePath);
             }
             nextFileNameShown_ = true;
         }
@@ -1816,10 +1971,25 @@ void MainComponent::timerCallback()
         nextFileNameShown_ = false;
     }
     
-    if (shouldUpdateBpm_)
+    if (!bpmAnalyzeFinished_ && dataSource_->isFileLoaded())
     {
-        model_->setBpm((analyzedBpm_ == 0) ? kBpmMeasureFailed : analyzedBpm_);
-        shouldUpdateBpm_ = false;
+        // The analysis runs in the analysis pipeline, this only starts it and collects the result.
+        // It is started here, after the song state (e.g. accent) has been restored.
+        if (shouldInitializeBpmDetector_)
+        {
+            bpmDetector_->start(model_->getAccent());
+            shouldInitializeBpmDetector_ = false;
+        }
+        else if (bpmDetector_->isFinished())
+        {
+            const float bpm = bpmDetector_->getBpm();
+            model_->setBpm((bpm == 0) ? kBpmMeasureFailed : bpm);
+            
+            const auto beats = bpmDetector_->getBeats();
+            dataSource_->setBeats(beats);
+            auto downbeat = std::find_if(beats.begin(), beats.end(), [](const auto& beat) { return beat.isDownbeat_; });
+            if (downbeat != beats.end()) model_->setBeatPositionMSec(downbeat->positionMSec_);
+        }
     }
 }
 
@@ -1871,6 +2041,16 @@ void MainComponent::updateListMemoTab(ListMemoTab tab)
     memoTextEditor_->setVisible(tab == kListMemoTab_Memo);
 }
 
+void MainComponent::updateKeyLabel()
+{
+    if (labels_[kLabel_Pitch] == nullptr) return;
+    
+    // The key follows the pitch control, e.g. "Pitch (Key: Am)"
+    String text = labelInfo_[kLabel_Pitch].first;
+    if (harmony_ != nullptr) text += " (Key: " + MelissaHarmony::getName(harmony_->getKeyRoot(), harmony_->isKeyMinor(), model_->getPitch()) + ")";
+    labels_[kLabel_Pitch]->setText(text, dontSendNotification);
+}
+
 void MainComponent::prev()
 {
     if (model_ == nullptr) return;
@@ -2009,6 +2189,14 @@ String MainComponent::getNextSongFilePath()
     return File(nextFilePathToLoad).existsAsFile() ? nextFilePathToLoad : "";
 }
 
+void MainComponent::playbackStatusChanged(PlaybackStatus status)
+{
+    if (status == kPlaybackStatus_Playing)
+    {
+        MelissaPreviewPlayer::getInstance()->stop();
+    }
+}
+
 void MainComponent::musicVolumeChanged(float volume)
 {
     musicVolumeSlider_->setValue(volume);
@@ -2020,6 +2208,7 @@ void MainComponent::musicVolumeChanged(float volume)
 void MainComponent::pitchChanged(float semitone)
 {
     pitchButton_->setText(MelissaUtility::getFormattedPitch(semitone));
+    updateKeyLabel();
 }
 
 void MainComponent::speedChanged(int speed)
@@ -2040,6 +2229,7 @@ void MainComponent::stemProviderResultReported(StemProviderResult result)
     if (result == kStemProviderResult_Success)
     {
         popupMessage_->show(TRANS("stem_success"));
+        shouldReanalyzeBpm_ = true;
     }
     else if (result == kStemProviderResult_FailedToReadSourceFile)
     {
@@ -2157,21 +2347,44 @@ void MainComponent::eqSwitchChanged(bool on)
 
 void MainComponent::eqFreqChanged(size_t band, float freq)
 {
+    // Only the selected band has knobs
+    if (band != model_->getEqSelectedBand()) return;
+    
     const float quantizedValue = std::log10(freq / 20.f) / 3.f; //log10(1000.f);
-    eqFreqKnobs_[band]->setValue(quantizedValue, dontSendNotification);
-    knobLabels_[0]->setText(String::formatted("%d Hz", static_cast<int>(freq)), dontSendNotification);
+    eqFreqKnobs_[EqBandMid1]->setValue(quantizedValue, dontSendNotification);
+    knobLabels_[EqBandMid1 * 3 + 0]->setText(String::formatted("%d Hz", static_cast<int>(freq)), dontSendNotification);
 }
 
 void MainComponent::eqGainChanged(size_t band, float gain)
 {
-    eqGainKnobs_[band]->setValue(gain, dontSendNotification);
-    knobLabels_[1]->setText(String::formatted("%+2.1f dB", gain), dontSendNotification);
+    if (band != model_->getEqSelectedBand()) return;
+    
+    eqGainKnobs_[EqBandMid1]->setValue(gain, dontSendNotification);
+    knobLabels_[EqBandMid1 * 3 + 1]->setText(String::formatted("%+2.1f dB", gain), dontSendNotification);
 }
 
 void MainComponent::eqQChanged(size_t band, float q)
 {
-    eqQKnobs_[band]->setValue(q, dontSendNotification);
-    knobLabels_[2]->setText(String::formatted("Q:%1.2f", q), dontSendNotification);
+    if (band != model_->getEqSelectedBand()) return;
+    
+    eqQKnobs_[EqBandMid1]->setValue(q, dontSendNotification);
+    knobLabels_[EqBandMid1 * 3 + 2]->setText(String::formatted("Q:%1.2f", q), dontSendNotification);
+}
+
+void MainComponent::eqTypeChanged(size_t band, EqType type)
+{
+    if (band != model_->getEqSelectedBand()) return;
+    
+    // High pass and low pass filters have no gain
+    eqGainKnobs_[EqBandMid1]->setEnabled(type != kEqType_HighPass && type != kEqType_LowPass);
+}
+
+void MainComponent::eqSelectedBandChanged(size_t band)
+{
+    eqFreqChanged(band, model_->getEqFreq(band));
+    eqGainChanged(band, model_->getEqGain(band));
+    eqQChanged(band, model_->getEqQ(band));
+    eqTypeChanged(band, model_->getEqType(band));
 }
 
 void MainComponent::mainVolumeChanged(float mainVolume)
@@ -16,6 +16,7 @@
 #include "MelissaButtons.h"
 #include "MelissaDataSource.h"
 #include "MelissaFileListBox.h"
+#include "MelissaHarmony.h"
 #include "MelissaHost.h"
 #include "MelissaIncDecButton.h"
 #include "MelissaLookAndFeel.h"
@@ -23,6 +24,7 @@
 #include "MelissaShortcutManager.h"
 #include "MelissaStemProvider.h"
 #include "MelissaPopupMessageComponent.h"
+#include "MelissaPreviewPlayer.h"
 #include "MelissaStemControlComponent.h"
 
 #if defined(ENABLE_SPEED_TRAINING)
@@ -34,6 +36,7 @@
 #include "MelissaMetronome.h"
 #include "MelissaModalDialog.h"
 #include "MelissaModel.h"
+#include "MelissaOutputRouter.h"
 #include "MelissaPlaylistComponent.h"
 #include "MelissaPracticeTableListBox.h"
 #include "MelissaMarkerListBox.h"
@@ -88,6 +91,7 @@ public:
     
     void createUI();
     void showFileChooser();
+    void showClickFileChooser();
     
     // AudioAppComponent
     void prepareToPlay(int samplesPerBlockExpected, double sampleRate) override;
@@ -104,7 +108,7 @@ public:
     void filesDropped(const StringArray& files, int x, int y) override;
     
     // FileBrowserListener
-    void selectionChanged() override {};
+    void selectionChanged() override;
     void fileClicked(const File& file, const MouseEvent& e) override {}
     void fileDoubleClicked(const File& file) override;
     void browserRootChanged(const File& newRoot) override;
@@ -140,6 +144,7 @@ public:
     void updateSpeedModeTab(SpeedModeTab tab);
     void updateFileChooserTab(FileChooserTab tab);
     void updateListMemoTab(ListMemoTab tab);
+    void updateKeyLabel();
     
     void prev();
     void next();
@@ -161,10 +166,10 @@ private:
     MelissaModel* model_;
     MelissaDataSource* dataSource_;
     std::unique_ptr<MelissaBPMDetector> bpmDetector_;
-    float analyzedBpm_;
     bool bpmAnalyzeFinished_;
     bool shouldInitializeBpmDetector_;
-    bool shouldUpdateBpm_;
+    bool shouldReanalyzeBpm_;
+    std::shared_ptr<MelissaHarmony> harmony_;
     MelissaDataSource::Previous::UIState uiState_;
     
     std::shared_ptr<AudioSampleBuffer> audioSampleBuf_;
@@ -271,15 +276,15 @@ private:
     enum EqBand
     {
         EqBandMid1,
-        kNumOfEqBands
+        kNumOfEqBandKnobs
     };
     std::unique_ptr<ToggleButton> eqSwitchButton_;
-    std::unique_ptr<Slider> eqFreqKnobs_[kNumOfEqBands];
-    std::unique_ptr<Slider> eqQKnobs_[kNumOfEqBands];
-    std::unique_ptr<Slider> eqGainKnobs_[kNumOfEqBands];
+    std::unique_ptr<Slider> eqFreqKnobs_[kNumOfEqBandKnobs];
+    std::unique_ptr<Slider> eqQKnobs_[kNumOfEqBandKnobs];
+    std::unique_ptr<Slider> eqGainKnobs_[kNumOfEqBandKnobs];
     class QIconComponent;
     std::unique_ptr<QIconComponent> qIconComponents_[2];
-    std::unique_ptr<Label> knobLabels_[kNumOfEqBands * 3];
+    std::unique_ptr<Label> knobLabels_[kNumOfEqBandKnobs * 3];
     
     std::unique_ptr<ToggleButton> browseToggleButton_;
     std::unique_ptr<ToggleButton> playlistToggleButton_;
@@ -378,6 +383,7 @@ private:
     String getNextSongFilePath();
     
     // MelissaModelListener
+    void playbackStatusChanged(PlaybackStatus status) override;
     void musicVolumeChanged(float volume) override;
     void pitchChanged(float semitone) override;
     void speedChanged(int speed) override;
@@ -408,6 +414,8 @@ private:
     void eqFreqChanged(size_t band, float freq) override;
     void eqGainChanged(size_t band, float gain) override;
     void eqQChanged(size_t band, float q) override;
+    void eqTypeChanged(size_t band, EqType type) override;
+    void eqSelectedBandChanged(size_t band) override;
     void mainVolumeChanged(float mainVolume) override;
     
     // MelissaMarkerListener
@@ -0,0 +1,419 @@
+//
+//  MelissaAnalysisCache.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaAnalysisCache.h"
+#include "MelissaHarmony.h"
+#include "MelissaPitchContour.h"
+#include "MelissaWaveformPeaks.h"
+
+MelissaAnalysisCache MelissaAnalysisCache::instance_;
+
+namespace
+{
+const String kCacheFileExtension = ".analysis";
+const char kMagic[] = { 'M', 'L', 'A', 'C' };
+
+// Increment when the layout of a chunk changes. The caches of the other versions are ignored.
+constexpr int kVersion = 1;
+
+constexpr int kFingerprintLength = 32;
+constexpr int kHeaderSize = sizeof(kMagic) + sizeof(int32) + kFingerprintLength;
+constexpr int kMaxNumOfCacheFiles = 200;
+
+// Blocks of samples hashed to identify a song
+constexpr int kNumOfFingerprintBlocks = 64;
+constexpr int kFingerprintBlockLength = 256;
+};
+
+void MelissaAnalysisCache::setup(const File& cacheDir)
+{
+    const ScopedLock sl(lock_);
+    cacheDir_ = cacheDir;
+}
+
+void MelissaAnalysisCache::open(MelissaDataSource* dataSource)
+{
+    // The length and blocks of samples spread over the song are hashed,
+    // which is much cheaper than hashing the whole song and enough to tell songs apart
+    const size_t bufferLength = dataSource->getBufferLength();
+    String fingerprint;
+    if (0 < bufferLength)
+    {
+        MemoryOutputStream stream;
+        stream.writeDouble(dataSource->getSampleRate());
+        stream.writeInt64(static_cast<int64>(bufferLength));
+
+        AudioSampleBuffer block(2, kFingerprintBlockLength);
+        for (int blockIndex = 0; blockIndex < kNumOfFingerprintBlocks; ++blockIndex)
+        {
+            dataSource->readBufferBlock(block, bufferLength * blockIndex / kNumOfFingerprintBlocks, kStemType_All);
+            for (int ch = 0; ch < 2; ++ch) stream.write(block.getReadPointer(ch), kFingerprintBlockLength * sizeof(float));
+        }
+        fingerprint = MD5(stream.getData(), stream.getDataSize()).toHexString();
+    }
+
+    const ScopedLock sl(lock_);
+    fingerprint_ = fingerprint;
+    isOpen_ = true;
+    mapCacheFile();
+    if (mappedFile_ != nullptr) getCacheFile(fingerprint_).setLastAccessTime(Time::getCurrentTime());
+}
+
+String MelissaAnalysisCache::getFingerprint() const
+{
+    if (!isOpen_) return {};
+    const ScopedLock sl(lock_);
+    return fingerprint_;
+}
+
+std::shared_ptr<MelissaWaveformPeaks> MelissaAnalysisCache::readPeaks(const String& fingerprint)
+{
+    MemoryBlock payload;
+    if (!readChunk(fingerprint, kChunkId_Peaks, payload)) return nullptr;
+
+    MemoryInputStream stream(payload, false);
+    return MelissaWaveformPeaks::read(stream);
+}
+
+void MelissaAnalysisCache::writePeaks(const String& fingerprint, const MelissaWaveformPeaks& peaks)
+{
+    MemoryOutputStream stream;
+    peaks.write(stream);
+    writeChunk(fingerprint, kChunkId_Peaks, stream.getMemoryBlock());
+}
+
+bool MelissaAnalysisCache::readRhythm(const String& fingerprint, Rhythm& rhythm)
+{
+    MemoryBlock payload;
+    if (!readChunk(fingerprint, kChunkId_Rhythm, payload)) return false;
+
+    MemoryInputStream stream(payload, false);
+    rhythm.bpm_ = stream.readFloat();
+    rhythm.beatsPerBar_ = stream.readInt();
+    rhythm.withStems_ = stream.readBool();
+    rhythm.analyzedPart_ = static_cast<StemType>(stream.readInt());
+
+    const int numOfBeats = stream.readInt();
+    if (numOfBeats < 0 || stream.getNumBytesRemaining() < numOfBeats * 9) return false;
+    rhythm.beats_.resize(numOfBeats);
+    for (auto&& beat : rhythm.beats_)
+    {
+        beat.positionMSec_ = stream.readFloat();
+        beat.confidence_ = stream.readFloat();
+        beat.isDownbeat_ = stream.readBool();
+    }
+
+    rhythm.onsetFrameMSec_ = stream.readFloat();
+    const int numOfOnsets = stream.readInt();
+    if (numOfOnsets < 0 || stream.getNumBytesRemaining() < numOfOnsets * static_cast<int64>(sizeof(float))) return false;
+    rhythm.onset_.resize(numOfOnsets);
+    stream.read(rhythm.onset_.data(), numOfOnsets * sizeof(float));
+
+    return true;
+}
+
+void MelissaAnalysisCache::writeRhythm(const String& fingerprint, const Rhythm& rhythm)
+{
+    MemoryOutputStream stream;
+    stream.writeFloat(rhythm.bpm_);
+    stream.writeInt(rhythm.beatsPerBar_);
+    stream.writeBool(rhythm.withStems_);
+    stream.writeInt(static_cast<int>(rhythm.analyzedPart_));
+
+    stream.writeInt(static_cast<int>(rhythm.beats_.size()));
+    for (auto&& beat : rhythm.beats_)
+    {
+        stream.writeFloat(beat.positionMSec_);
+        stream.writeFloat(beat.confidence_);
+        stream.writeBool(beat.isDownbeat_);
+    }
+
+    stream.writeFloat(rhythm.onsetFrameMSec_);
+    stream.writeInt(static_cast<int>(rhythm.onset_.size()));
+    stream.write(rhythm.onset_.data(), rhythm.onset_.size() * sizeof(float));
+
+    writeChunk(fingerprint, kChunkId_Rhythm, stream.getMemoryBlock());
+}
+
+bool MelissaAnalysisCache::readTransients(const String& fingerprint, Transients& transients)
+{
+    MemoryBlock payload;
+    if (!readChunk(fingerprint, kChunkId_Transients, payload)) return false;
+
+    MemoryInputStream stream(payload, false);
+    const int numOfOnsets = stream.readInt();
+    if (numOfOnsets < 0 || stream.getNumBytesRemaining() < numOfOnsets * static_cast<int64>(sizeof(uint32))) return false;
+    transients.onsets_.resize(numOfOnsets);
+    stream.read(transients.onsets_.data(), numOfOnsets * sizeof(uint32));
+
+    const int numOfSlots = stream.readInt();
+    if (numOfSlots < 0 || stream.getNumBytesRemaining() < numOfSlots) return false;
+    transients.zeroCrossings_.resize(numOfSlots);
+    stream.read(transients.zeroCrossings_.data(), numOfSlots);
+
+    return true;
+}
+
+void MelissaAnalysisCache::writeTransients(const String& fingerprint, const Transients& transients)
+{
+    MemoryOutputStream stream;
+    stream.writeInt(static_cast<int>(transients.onsets_.size()));
+    stream.write(transients.onsets_.data(), transients.onsets_.size() * sizeof(uint32));
+    stream.writeInt(static_cast<int>(transients.zeroCrossings_.size()));
+    stream.write(transients.zeroCrossings_.data(), transients.zeroCrossings_.size());
+
+    writeChunk(fingerprint, kChunkId_Transients, stream.getMemoryBlock());
+}
+
+std::shared_ptr<MelissaHarmony> MelissaAnalysisCache::readHarmony(const String& fingerprint)
+{
+    MemoryBlock payload;
+    if (!readChunk(fingerprint, kChunkId_Harmony, payload)) return nullptr;
+
+    MemoryInputStream stream(payload, false);
+    return MelissaHarmony::read(stream);
+}
+
+void MelissaAnalysisCache::writeHarmony(const String& fingerprint, const MelissaHarmony& harmony)
+{
+    MemoryOutputStream stream;
+    harmony.write(stream);
+    writeChunk(fingerprint, kChunkId_Harmony, stream.getMemoryBlock());
+}
+
+bool MelissaAnalysisCache::readLoudness(const String& fingerprint, std::map<StemType, Loudness>& loudnesses)
+{
+    MemoryBlock payload;
+    if (!readChunk(fingerprint, kChunkId_Loudness, payload)) return false;
+
+    MemoryInputStream stream(payload, false);
+    const int numOfParts = stream.readInt();
+    if (numOfParts < 0 || stream.getNumBytesRemaining() < numOfParts * static_cast<int64>(sizeof(int32) + sizeof(float) * 2)) return false;
+
+    loudnesses.clear();
+    for (int partIndex = 0; partIndex < numOfParts; ++partIndex)
+    {
+        const int part = stream.readInt();
+        Loudness loudness;
+        loudness.integratedLufs_ = stream.readFloat();
+        loudness.truePeakDb_ = stream.readFloat();
+        if (kStemType_All <= part && part < kNumStemTypes) loudnesses[static_cast<StemType>(part)] = loudness;
+    }
+
+    return true;
+}
+
+void MelissaAnalysisCache::writeLoudness(const String& fingerprint, const std::map<StemType, Loudness>& loudnesses)
+{
+    MemoryOutputStream stream;
+    stream.writeInt(static_cast<int>(loudnesses.size()));
+    for (auto&& loudness : loudnesses)
+    {
+        stream.writeInt(loudness.first);
+        stream.writeFloat(loudness.second.integratedLufs_);
+        stream.writeFloat(loudness.second.truePeakDb_);
+    }
+
+    writeChunk(fingerprint, kChunkId_Loudness, stream.getMemoryBlock());
+}
+
+bool MelissaAnalysisCache::readStructureFeatures(const String& fingerprint, StructureFeatures& features)
+{
+    MemoryBlock payload;
+    if (!readChunk(fingerprint, kChunkId_StructureFeatures, payload)) return false;
+
+    MemoryInputStream stream(payload, false);
+    features.frameMSec_ = stream.readFloat();
+    features.numOfDimensions_ = stream.readInt();
+    const int numOfValues = stream.readInt();
+    if (features.frameMSec_ <= 0.f || features.numOfDimensions_ <= 0 || numOfValues < 0 || numOfValues % features.numOfDimensions_ != 0) return false;
+    if (stream.getNumBytesRemaining() < numOfValues * static_cast<int64>(sizeof(float))) return false;
+    features.values_.resize(numOfValues);
+    stream.read(features.values_.data(), numOfValues * sizeof(float));
+
+    return true;
+}
+
+void MelissaAnalysisCache::writeStructureFeatures(const String& fingerprint, const StructureFeatures& features)
+{
+    MemoryOutputStream stream;
+    stream.writeFloat(features.frameMSec_);
+    stream.writeInt(features.numOfDimensions_);
+    stream.writeInt(static_cast<int>(features.values_.size()));
+    stream.write(features.values_.data(), features.values_.size() * sizeof(float));
+
+    writeChunk(fingerprint, kChunkId_StructureFeatures, stream.getMemoryBlock());
+}
+
+std::shared_ptr<MelissaPitchContour> MelissaAnalysisCache::readPitchContour(const String& fingerprint, StemType part)
+{
+    // The contours of the parts follow each other: part (int32), size (int32), contour ...
+    MemoryBlock payload;
+    if (!readChunk(fingerprint, kChunkId_PitchContours, payload)) return nullptr;
+
+    MemoryInputStream stream(payload, false);
+    while (8 <= stream.getNumBytesRemaining())
+    {
+        const int contourPart = stream.readInt();
+        const int size = stream.readInt();
+        if (size < 0 || stream.getNumBytesRemaining() < size) return nullptr;
+        if (contourPart == part)
+        {
+            MemoryInputStream contourStream(static_cast<const char*>(payload.getData()) + stream.getPosition(), size, false);
+            return MelissaPitchContour::read(contourStream);
+        }
+        stream.skipNextBytes(size);
+    }
+
+    return nullptr;
+}
+
+void MelissaAnalysisCache::writePitchContour(const String& fingerprint, const MelissaPitchContour& contour)
+{
+    // The contours of the other parts are kept
+    MemoryOutputStream stream;
+    MemoryBlock payload;
+    if (readChunk(fingerprint, kChunkId_PitchContours, payload))
+    {
+        MemoryInputStream oldStream(payload, false);
+        while (8 <= oldStream.getNumBytesRemaining())
+        {
+            const int part = oldStream.readInt();
+            const int size = oldStream.readInt();
+            if (size < 0 || oldStream.getNumBytesRemaining() < size) break;
+            if (part != contour.getPart())
+            {
+                stream.writeInt(part);
+                stream.writeInt(size);
+                stream.write(static_cast<const char*>(payload.getData()) + oldStream.getPosition(), size);
+            }
+            oldStream.skipNextBytes(size);
+        }
+    }
+
+    MemoryOutputStream contourStream;
+    contour.write(contourStream);
+    stream.writeInt(contour.getPart());
+    stream.writeInt(static_cast<int>(contourStream.getDataSize()));
+    stream.write(contourStream.getData(), contourStream.getDataSize());
+
+    writeChunk(fingerprint, kChunkId_PitchContours, stream.getMemoryBlock());
+}
+
+File MelissaAnalysisCache::getCacheFile(const String& fingerprint) const
+{
+    return cacheDir_.getChildFile(fingerprint + kCacheFileExtension);
+}
+
+void MelissaAnalysisCache::mapCacheFile()
+{
+    mappedFile_ = nullptr;
+    if (fingerprint_.isEmpty() || cacheDir_ == File()) return;
+
+    const auto file = getCacheFile(fingerprint_);
+    if (!file.existsAsFile()) return;
+
+    auto mappedFile = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+    const auto data = static_cast<const char*>(mappedFile->getData());
+    if (data == nullptr || mappedFile->getSize() < kHeaderSize) return;
+
+    // A file of another version (or a broken one) is treated as no cache, and is overwritten later
+    if (std::memcmp(data, kMagic, sizeof(kMagic)) != 0 ||
+        static_cast<int>(ByteOrder::littleEndianInt(data + sizeof(kMagic))) != kVersion ||
+        String(data + sizeof(kMagic) + sizeof(int32), kFingerprintLength) != fingerprint_)
+    {
+        return;
+    }
+
+    mappedFile_ = std::move(mappedFile);
+}
+
+void MelissaAnalysisCache::visitChunks(const std::function<void(int id, const char* payload, size_t size)>& visitor) const
+{
+    if (mappedFile_ == nullptr) return;
+
+    const auto data = static_cast<const char*>(mappedFile_->getData());
+    MemoryInputStream stream(data, mappedFile_->getSize(), false);
+    stream.setPosition(kHeaderSize);
+    while (8 <= stream.getNumBytesRemaining())
+    {
+        const int id = stream.readInt();
+        const int size = stream.readInt();
+        if (size < 0 || stream.getNumBytesRemaining() < size) break;
+
+        visitor(id, data + stream.getPosition(), static_cast<size_t>(size));
+        stream.skipNextBytes(size);
+    }
+}
+
+bool MelissaAnalysisCache::readChunk(const String& fingerprint, ChunkId id, MemoryBlock& payload) const
+{
+    const ScopedLock sl(lock_);
+    if (!isOpen_ || fingerprint.isEmpty() || fingerprint != fingerprint_) return false;
+
+    bool found = false;
+    visitChunks([&](int chunkId, const char* chunkPayload, size_t size)
+    {
+        if (chunkId != id) return;
+        payload.replaceAll(chunkPayload, size);
+        found = true;
+    });
+
+    return found;
+}
+
+void MelissaAnalysisCache::writeChunk(const String& fingerprint, ChunkId id, const MemoryBlock& payload)
+{
+    const ScopedLock sl(lock_);
+    if (!isOpen_ || fingerprint.isEmpty() || fingerprint != fingerprint_ || cacheDir_ == File()) return;
+    if (!cacheDir_.createDirectory()) return;
+
+    std::map<int, MemoryBlock> chunks;
+    visitChunks([&](int chunkId, const char* chunkPayload, size_t size) { chunks[chunkId] = MemoryBlock(chunkPayload, size); });
+    chunks[id] = payload;
+    const auto file = getCacheFile(fingerprint_);
+    const bool isNewFile = !file.existsAsFile();
+
+    // The file is unmapped before being replaced, and is never mapped half-written
+    mappedFile_ = nullptr;
+    TemporaryFile tempFile(file);
+    {
+        FileOutputStream stream(tempFile.getFile());
+        if (!stream.openedOk())
+        {
+            mapCacheFile();
+            return;
+        }
+
+        stream.write(kMagic, sizeof(kMagic));
+        stream.writeInt(kVersion);
+        stream.write(fingerprint_.toRawUTF8(), kFingerprintLength);
+        for (auto&& chunk : chunks)
+        {
+            stream.writeInt(chunk.first);
+            stream.writeInt(static_cast<int>(chunk.second.getSize()));
+            stream.write(chunk.second.getData(), chunk.second.getSize());
+        }
+    }
+    tempFile.overwriteTargetFileWithTemporary();
+    mapCacheFile();
+
+    if (isNewFile) removeLeastRecentlyUsed();
+}
+
+void MelissaAnalysisCache::removeLeastRecentlyUsed()
+{
+    auto files = cacheDir_.findChildFiles(File::findFiles, false, "*" + kCacheFileExtension);
+    if (files.size() <= kMaxNumOfCacheFiles) return;
+
+    std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.getLastAccessTime() < b.getLastAccessTime(); });
+    const auto currentFile = getCacheFile(fingerprint_);
+    for (int fileIndex = 0; fileIndex < files.size() - kMaxNumOfCacheFiles; ++fileIndex)
+    {
+        if (files[fileIndex] != currentFile) files[fileIndex].deleteFile();
+    }
+}
@@ -0,0 +1,130 @@
+//
+//  MelissaAnalysisCache.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "MelissaDataSource.h"
+#include "MelissaDefinitions.h"
+
+class MelissaHarmony;
+class MelissaPitchContour;
+class MelissaWaveformPeaks;
+
+// Keeps the results of the analyses of each song on the disk, so that reopening a song
+// (even after it has been renamed or moved) shows them without analyzing it again.
+// The file of the current song is memory-mapped once when the song is opened.
+//
+// <cache dir>/<fingerprint>.analysis
+//   header : "MLAC", version (int32), fingerprint (32 chars)
+//   chunks : id (int32), size (int32), payload ...
+class MelissaAnalysisCache
+{
+public:
+    enum ChunkId
+    {
+        kChunkId_Peaks = 1,
+        kChunkId_Rhythm,
+        kChunkId_Transients,
+        kChunkId_Harmony,
+        kChunkId_Loudness,
+        kChunkId_StructureFeatures,
+        kChunkId_PitchContours,
+    };
+
+    struct Rhythm
+    {
+        float bpm_;
+        std::vector<MelissaDataSource::Song::Beat> beats_;
+        int beatsPerBar_;
+        bool withStems_; // stems were available when analyzed
+        StemType analyzedPart_;
+
+        // Onset envelope of the full mix
+        std::vector<float> onset_;
+        float onsetFrameMSec_;
+    };
+
+    struct Transients
+    {
+        std::vector<uint32> onsets_; // in samples, sorted
+        std::vector<uint8> zeroCrossings_;
+    };
+
+    struct Loudness
+    {
+        float integratedLufs_;
+        float truePeakDb_;
+    };
+
+    struct StructureFeatures
+    {
+        float frameMSec_;
+        int numOfDimensions_;
+        std::vector<float> values_; // numOfDimensions_ per frame
+    };
+
+    void setup(const File& cacheDir);
+
+    // Identifies the song currently loaded in the data source and maps its cache
+    void open(MelissaDataSource* dataSource);
+    String getFingerprint() const;
+
+    // Lock-free, called from the audio process thread before the buffer is replaced by the next song.
+    // Nothing is read or written until the next open(), so that no result mixing the two songs is stored.
+    void close() { isOpen_ = false; }
+
+    // Only the current song is read and written, the others are ignored
+    std::shared_ptr<MelissaWaveformPeaks> readPeaks(const String& fingerprint);
+    void writePeaks(const String& fingerprint, const MelissaWaveformPeaks& peaks);
+    bool readRhythm(const String& fingerprint, Rhythm& rhythm);
+    void writeRhythm(const String& fingerprint, const Rhythm& rhythm);
+    bool readTransients(const String& fingerprint, Transients& transients);
+    void writeTransients(const String& fingerprint, const Transients& transients);
+    std::shared_ptr<MelissaHarmony> readHarmony(const String& fingerprint);
+    void writeHarmony(const String& fingerprint, const MelissaHarmony& harmony);
+    bool readLoudness(const String& fingerprint, std::map<StemType, Loudness>& loudnesses);
+    void writeLoudness(const String& fingerprint, const std::map<StemType, Loudness>& loudnesses);
+    bool readStructureFeatures(const String& fingerprint, StructureFeatures& features);
+    void writeStructureFeatures(const String& fingerprint, const StructureFeatures& features);
+    std::shared_ptr<MelissaPitchContour> readPitchContour(const String& fingerprint, StemType part);
+    void writePitchContour(const String& fingerprint, const MelissaPitchContour& contour);
+
+    // Singleton
+    static MelissaAnalysisCache* getInstance() { return &instance_; }
+    MelissaAnalysisCache(const MelissaAnalysisCache&) = delete;
+    MelissaAnalysisCache& operator=(const MelissaAnalysisCache&) = delete;
+    MelissaAnalysisCache(MelissaAnalysisCache&&) = delete;
+    MelissaAnalysisCache& operator=(MelissaAnalysisCache&&) = delete;
+
+private:
+    // Singleton
+    MelissaAnalysisCache() : isOpen_(false) {}
+    ~MelissaAnalysisCache() {}
+    static MelissaAnalysisCache instance_;
+
+    File getCacheFile(const String& fingerprint) const;
+    void mapCacheFile();
+
+    // Chunks of the mapped file
+    void visitChunks(const std::function<void(int id, const char* payload, size_t size)>& visitor) const;
+    bool readChunk(const String& fingerprint, ChunkId id, MemoryBlock& payload) const;
+    void writeChunk(const String& fingerprint, ChunkId id, const MemoryBlock& payload);
+
+    void removeLeastRecentlyUsed();
+
+    CriticalSection lock_;
+    File cacheDir_;
+    String fingerprint_;
+    std::atomic<bool> isOpen_;
+    std::unique_ptr<MemoryMappedFile> mappedFile_;
+};
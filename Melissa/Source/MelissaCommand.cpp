@@ -8,6 +8,7 @@
 #include "MelissaCommand.h"
 #include "MelissaDefinitions.h"
 #include "MelissaModelListener.h"
+#include "MelissaSnapIndex.h"
 #include "MelissaUtility.h"
 
 MelissaCommand MelissaCommand::instance_;
@@ -81,11 +82,11 @@ MelissaCommand::MelissaCommand()
     };
     commands_["SetLoopStart"] = [&](float value)
     {
-        if (value == 1.f) model_->setLoopAPosRatio(model_->getPlayingPosRatio());
+        if (value == 1.f) model_->setLoopAPosRatio(MelissaSnapIndex::getInstance()->snapRatio(model_->getPlayingPosRatio()));
     };
     commands_["SetLoopEnd"] = [&](float value)
     {
-        if (value == 1.f) model_->setLoopBPosRatio(model_->getPlayingPosRatio());
+        if (value == 1.f) model_->setLoopBPosRatio(MelissaSnapIndex::getInstance()->snapRatio(model_->getPlayingPosRatio()));
     };
     commands_["SetLoopStartValue"] = [&](float value)
     {
@@ -155,7 +156,11 @@ MelissaCommand::MelissaCommand()
     };
     commands_["SetAccentPosition"] = [&](float value)
     {
-        if (value == 1.f) model_->setBeatPositionMSec(model_->getPlayingPosRatio());
+        if (value == 1.f)
+        {
+            dataSource_->setBeats({});
+            model_->setBeatPositionMSec(model_->getPlayingPosMSec());
+        }
     };
 
     // EQ
@@ -165,15 +170,23 @@ MelissaCommand::MelissaCommand()
     };
     commands_["SetEqFreqValue"] = [&](float value)
     {
-        model_->setEqFreq(0, 20 * std::pow(1000, value));
+        model_->setEqFreq(model_->getEqSelectedBand(), 20 * std::pow(1000, value));
     };
     commands_["SetEqGainValue"] = [&](float value)
     {
-        model_->setEqGain(0, value * (kEqGainMax - kEqGainMin) + kEqGainMin);
+        model_->setEqGain(model_->getEqSelectedBand(), value * (kEqGainMax - kEqGainMin) + kEqGainMin);
     };
     commands_["SetEqQValue"] = [&](float value)
     {
-        model_->setEqQ(0, value * (kEqQMax - kEqQMin) + kEqQMin);
+        model_->setEqQ(model_->getEqSelectedBand(), value * (kEqQMax - kEqQMin) + kEqQMin);
+    };
+    commands_["SetEqBandValue"] = [&](float value)
+    {
+        model_->setEqSelectedBand(static_cast<size_t>(std::round(value * (kEqNumOfBands - 1))));
+    };
+    commands_["SetEqTypeValue"] = [&](float value)
+    {
+        model_->setEqType(model_->getEqSelectedBand(), static_cast<EqType>(std::round(value * (kNumOfEqTypes - 1))));
     };
 
     // Output
@@ -267,7 +280,7 @@ MelissaCommand::MelissaCommand()
     };
     commands_["AddMarker"] = [&](float value)
     {
-        if (value == 1.f) dataSource_->addDefaultMarker(model_->getPlayingPosRatio());
+        if (value == 1.f) dataSource_->addDefaultMarker(MelissaSnapIndex::getInstance()->snapRatio(model_->getPlayingPosRatio()));
     };
     commands_["SelectMarker_0"] = [&](float value)
     {
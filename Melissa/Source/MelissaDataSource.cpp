@@ -5,24 +5,316 @@
 //  Copyright(c) 2020 Masaki Ono
 //
 
+#include <atomic>
+#include <mutex>
 #include "AppConfig.h"
+#include "MelissaAnalysisCache.h"
+#include "MelissaAnalysisPipeline.h"
 #include "MelissaDataSource.h"
+#include "MelissaDecodeCache.h"
+#include "MelissaLoudness.h"
+#include "MelissaOutputRouter.h"
 #include "MelissaStemProvider.h"
 #include "MelissaUISettings.h"
 
 enum
 {
     kMaxSizeOfHistoryList = 40,
+    
+    // Files longer than this are streamed from the disk instead of being decoded into memory
+    kStreamingThresholdSec = 20 * 60,
+    
+    // Seekable files are decoded in parallel, split into ranges of at least this length
+    kMinDecodeRangeLength = 1 << 19,
+    kMaxNumOfDecodeRanges = 16,
+    
+    // A decoding can be cancelled between the chunks of this length
+    kDecodeChunkLength = 1 << 16,
 };
 
 MelissaDataSource MelissaDataSource::instance_;
 
+// "eq_0_freq", "eq_0_gain" and "eq_0_q" are the keys of the single band EQ of the older versions
+static void readEqBands(const var& obj, MelissaDataSource::EqBands& eqBands)
+{
+    for (size_t band = 0; band < kEqNumOfBands; ++band)
+    {
+        const String prefix = "eq_" + String(band) + "_";
+        auto& eqBand = eqBands[band];
+        eqBand.freq_ = obj.getProperty(prefix + "freq", eqBand.freq_);
+        eqBand.gain_ = obj.getProperty(prefix + "gain", eqBand.gain_);
+        eqBand.q_    = obj.getProperty(prefix + "q",    eqBand.q_);
+        const int type = obj.getProperty(prefix + "type", eqBand.type_);
+        eqBand.type_ = static_cast<EqType>(type);
+    }
+}
+
+static void writeEqBands(DynamicObject* obj, const MelissaDataSource::EqBands& eqBands)
+{
+    for (size_t band = 0; band < kEqNumOfBands; ++band)
+    {
+        const String prefix = "eq_" + String(band) + "_";
+        obj->setProperty(prefix + "freq", eqBands[band].freq_);
+        obj->setProperty(prefix + "gain", eqBands[band].gain_);
+        obj->setProperty(prefix + "q",    eqBands[band].q_);
+        obj->setProperty(prefix + "type", eqBands[band].type_);
+    }
+}
+
+MelissaDataSource::EqBands MelissaDataSource::getDefaultEqBands()
+{
+    EqBands eqBands;
+    for (size_t band = 0; band < kEqNumOfBands; ++band) eqBands[band] = { kEqDefaultFreqs[band], 0.f, 1.f, kEqType_Peak };
+    return eqBands;
+}
+
+static float readAudioSampleBuffer(const AudioSampleBuffer* buffer, size_t ch, size_t index)
+{
+    if (buffer == nullptr) return 0.f;
+    
+    const int numOfChs   = buffer->getNumChannels();
+    const int bufferSize = buffer->getNumSamples();
+    
+    if (2 <= ch || numOfChs <= ch) ch = 0;
+    if (bufferSize <= index) return 0.f;
+    
+    return buffer->getSample(static_cast<int>(ch), static_cast<int>(index));
+}
+
+static void readAudioSampleBufferBlock(const AudioSampleBuffer* source, AudioSampleBuffer& dest, size_t startIndex)
+{
+    dest.clear();
+    if (source == nullptr || source->getNumSamples() <= startIndex) return;
+    
+    const int numSamples = std::min(dest.getNumSamples(), source->getNumSamples() - static_cast<int>(startIndex));
+    for (int ch = 0; ch < dest.getNumChannels(); ++ch)
+    {
+        dest.copyFrom(ch, 0, *source, std::min(ch, source->getNumChannels() - 1), static_cast<int>(startIndex), numSamples);
+    }
+}
+
+static bool isRangeDecodable(const File& file)
+{
+    // Formats whose readers can seek to an exact sample cheaply
+    return file.hasFileExtension("wav;wave;aif;aiff;flac");
+}
+
+static bool readInChunks(AudioFormatReader& reader, AudioSampleBuffer& dest, int startIndex, int length, const std::function<bool()>& shouldCancel)
+{
+    for (int offset = 0; offset < length; offset += kDecodeChunkLength)
+    {
+        if (shouldCancel != nullptr && shouldCancel()) return false;
+        const int chunkLength = std::min(static_cast<int>(kDecodeChunkLength), length - offset);
+        reader.read(&dest, startIndex + offset, chunkLength, startIndex + offset, true, true);
+    }
+    return true;
+}
+
+static bool decodeAudioFile(AudioFormatManager& formatManager, const File& file, AudioFormatReader& reader, AudioSampleBuffer& dest, const std::function<bool()>& shouldCancel)
+{
+    const int lengthInSamples = dest.getNumSamples();
+    const int numOfRanges = isRangeDecodable(file) ? jlimit(1, static_cast<int>(kMaxNumOfDecodeRanges), std::min(SystemStats::getNumCpus(), lengthInSamples / kMinDecodeRangeLength)) : 1;
+    if (numOfRanges <= 1) return readInChunks(reader, dest, 0, lengthInSamples, shouldCancel);
+    
+    // Each range is decoded by its own reader, directly into its part of the destination buffer
+    std::vector<std::unique_ptr<AudioFormatReader>> rangeReaders;
+    for (int rangeIndex = 1; rangeIndex < numOfRanges; ++rangeIndex)
+    {
+        auto rangeReader = std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(file));
+        if (rangeReader == nullptr || rangeReader->lengthInSamples != reader.lengthInSamples) break;
+        rangeReaders.emplace_back(std::move(rangeReader));
+    }
+    
+    if (static_cast<int>(rangeReaders.size()) + 1 < numOfRanges)
+    {
+        // fall back to the sequential decoding
+        return readInChunks(reader, dest, 0, lengthInSamples, shouldCancel);
+    }
+    
+    const int rangeLength = (lengthInSamples + numOfRanges - 1) / numOfRanges;
+    std::atomic<int> numOfRemainingRanges(numOfRanges);
+    std::atomic<bool> isCancelled(false);
+    WaitableEvent finished;
+    ThreadPool threadPool(numOfRanges - 1);
+    
+    // Every range stops at its next chunk once one of them has been cancelled, so that this returns soon
+    auto decodeRange = [&](AudioFormatReader* rangeReader, int rangeIndex)
+    {
+        auto shouldCancelRange = [&]() { return isCancelled || (shouldCancel != nullptr && shouldCancel()); };
+        const int startIndex = rangeIndex * rangeLength;
+        const int length = std::min(rangeLength, lengthInSamples - startIndex);
+        if (0 < length && !readInChunks(*rangeReader, dest, startIndex, length, shouldCancelRange)) isCancelled = true;
+        if (--numOfRemainingRanges == 0) finished.signal();
+    };
+    
+    for (int rangeIndex = 1; rangeIndex < numOfRanges; ++rangeIndex)
+    {
+        auto rangeReader = rangeReaders[rangeIndex - 1].get();
+        threadPool.addJob([&decodeRange, rangeReader, rangeIndex]() { decodeRange(rangeReader, rangeIndex); });
+    }
+    decodeRange(&reader, 0);
+    
+    finished.wait();
+    return !isCancelled;
+}
+
+// Decodes the next song in the background. A prefetch which has been cancelled or replaced isn't joined, as the decoding
+// may be in the middle of a chunk. It stops at the next chunk, and its result is dropped as its generation is old.
+class MelissaDataSource::FilePrefetcher : public Thread
+{
+public:
+    FilePrefetcher() : Thread("MelissaFilePrefetchThread"), semitone_(0.f), speed_(100), generation_(0), isRequested_(false), hasNewRequest_(false), isReady_(false) {}
+    
+    ~FilePrefetcher()
+    {
+        cancel();
+        
+        // The decoding stops at its next chunk, so it is waited for without a time out
+        stopThread(-1);
+    }
+    
+    void prefetch(const File& file, float semitone, int speed)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (isRequested_ && file == file_ && semitone == semitone_ && speed == speed_) return;
+            
+            ++generation_;
+            file_ = file;
+            semitone_ = semitone;
+            speed_ = speed;
+            isRequested_ = true;
+            hasNewRequest_ = true;
+            isReady_ = false;
+            audioData_ = nullptr;
+        }
+        
+        if (!isThreadRunning()) startThread();
+        notify();
+    }
+    
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++generation_;
+        isRequested_ = false;
+        hasNewRequest_ = false;
+        isReady_ = false;
+        audioData_ = nullptr;
+    }
+    
+    bool isReady() const { return isReady_; }
+    
+    double getSampleRate()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return isReady_ ? audioData_->sampleRate_ : 0.0;
+    }
+    
+    void readBlock(AudioSampleBuffer& dest, size_t startIndex)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!isReady_)
+        {
+            dest.clear();
+            return;
+        }
+        if (audioData_->streamingSource_ != nullptr)
+        {
+            // Never blocks, the samples which are not resident yet are silent
+            for (int ch = 0; ch < dest.getNumChannels(); ++ch)
+            {
+                auto data = dest.getWritePointer(ch);
+                for (int index = 0; index < dest.getNumSamples(); ++index) data[index] = audioData_->streamingSource_->readSample(ch, startIndex + index, kStemType_All);
+            }
+            return;
+        }
+        readAudioSampleBufferBlock(audioData_->originalAudioSampleBuf_.get(), dest, startIndex);
+    }
+    
+    // Returns nullptr if nothing has been prefetched, or if the prefetched file is not the specified one
+    std::unique_ptr<AudioData> take(const File& file = File())
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!isReady_) return nullptr;
+        if (file != File() && file != audioData_->file_) return nullptr;
+        
+        isReady_ = false;
+        isRequested_ = false;
+        return std::move(audioData_);
+    }
+    
+private:
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            File file;
+            float semitone = 0.f;
+            int speed = 100;
+            uint32 generation = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (hasNewRequest_)
+                {
+                    file = file_;
+                    semitone = semitone_;
+                    speed = speed_;
+                    generation = generation_;
+                    hasNewRequest_ = false;
+                }
+            }
+            if (file == File())
+            {
+                wait(-1);
+                continue;
+            }
+            
+            auto isStale = [this, generation]() { return threadShouldExit() || generation_ != generation; };
+            
+            File originalFile;
+            std::map<std::string, File> stemFiles;
+            MelissaStemProvider::getInstance()->getStemFiles(file, originalFile, stemFiles);
+            if (!originalFile.existsAsFile()) originalFile = file;
+            
+            auto audioData = std::make_unique<AudioData>();
+            const bool isRead = readAudioData(originalFile, stemFiles, *audioData, isStale);
+            audioData->semitone_ = semitone;
+            audioData->speed_ = speed;
+            
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (isStale()) continue;
+            if (isRead)
+            {
+                audioData_ = std::move(audioData);
+                isReady_ = true;
+            }
+            else
+            {
+                isRequested_ = false;
+            }
+        }
+    }
+    
+    File file_;
+    float semitone_;
+    int speed_;
+    std::mutex mutex_;
+    std::atomic<uint32> generation_;
+    bool isRequested_;
+    bool hasNewRequest_;
+    std::atomic<bool> isReady_;
+    std::unique_ptr<AudioData> audioData_;
+};
+
 MelissaDataSource::MelissaDataSource() :
 model_(MelissaModel::getInstance()),
 sampleRate_(0.f),
 currentSongFilePath_(""),
 wasPlaying_(false)
 {
+    filePrefetcher_ = std::make_unique<FilePrefetcher>();
+    
     // Default shortcuts
     defaultShortcut_["spacebar"] = "StartStop";
     defaultShortcut_[","] = "Back";
@@ -75,6 +367,16 @@ void MelissaDataSource::loadSettingsFile(const File& file)
         if (g->hasProperty("height"))   global_.height_   = g->getProperty("height");
         if (g->hasProperty("device"))   global_.device_   = g->getProperty("device");
         if (g->hasProperty("playmode")) global_.playMode_ = g->getProperty("playmode");
+        if (g->hasProperty("crossfade_msec")) global_.crossfadeMSec_ = g->getProperty("crossfade_msec");
+        if (g->hasProperty("decode_cache"))   global_.decodeCache_ = g->getProperty("decode_cache");
+        if (g->hasProperty("decode_cache_size_mb")) global_.decodeCacheSizeMB_ = g->getProperty("decode_cache_size_mb");
+        if (g->hasProperty("loudness_normalization"))  global_.loudnessNormalization_ = g->getProperty("loudness_normalization");
+        if (g->hasProperty("loudness_target_lufs"))    global_.loudnessTargetLufs_ = g->getProperty("loudness_target_lufs");
+        if (g->hasProperty("music_output_channel"))     global_.musicOutputChannel_ = g->getProperty("music_output_channel");
+        if (g->hasProperty("metronome_output_channel")) global_.metronomeOutputChannel_ = g->getProperty("metronome_output_channel");
+        if (g->hasProperty("metronome_subdivision"))    global_.metronomeSubdivision_ = g->getProperty("metronome_subdivision");
+        if (g->hasProperty("metronome_accent_pattern")) global_.metronomeAccentPattern_ = g->getProperty("metronome_accent_pattern");
+        if (g->hasProperty("metronome_click_file"))     global_.metronomeClickFile_ = g->getProperty("metronome_click_file");
         
         bool shortcutRegistered = false;
         if (g->hasProperty("shortcut"))
@@ -124,15 +426,14 @@ void MelissaDataSource::loadSettingsFile(const File& file)
         if (p->hasProperty("speed_inc_goal"))  previous_.speedIncGoal_  = p->getProperty("speed_inc_goal");
         
         if (p->hasProperty("eq_sw"))     previous_.eqSw_   = p->getProperty("eq_sw");
-        if (p->hasProperty("eq_0_freq")) previous_.eqFreq_ = p->getProperty("eq_0_freq");
-        if (p->hasProperty("eq_0_gain")) previous_.eqGain_ = p->getProperty("eq_0_gain");
-        if (p->hasProperty("eq_0_q"))    previous_.eqQ_    = p->getProperty("eq_0_q");
+        readEqBands(settings["previous"], previous_.eqBands_);
         
         if (p->hasProperty("ui_state"))
         {
             auto uiState = p->getProperty("ui_state");
             if (uiState.hasProperty("browser_tab")) previous_.uiState_.selectedFileBrowserTab_ = uiState.getProperty("browser_tab", 0);
             if (uiState.hasProperty("playlist")) previous_.uiState_.selectedPlaylist_ = uiState.getProperty("playlist", 0);
+            if (uiState.hasProperty("waveform_view")) previous_.uiState_.waveformViewMode_ = uiState.getProperty("waveform_view", 0);
         }
     }
     
@@ -192,9 +493,7 @@ void MelissaDataSource::loadSettingsFile(const File& file)
                 song.accent_           = obj->getProperty("accent");
                 song.beatPositionMSec_ = obj->getProperty("beat_position");
                 song.eqSw_             = obj->getProperty("eq_sw");
-                song.eqFreq_           = obj->getProperty("eq_0_freq");
-                song.eqGain_           = obj->getProperty("eq_0_gain");
-                song.eqQ_              = obj->getProperty("eq_0_q");
+                readEqBands(s, song.eqBands_);
                 song.memo_             = obj->getProperty("memo");
                 for (auto l : *(obj->getProperty("list").getArray()))
                 {
@@ -242,6 +541,18 @@ void MelissaDataSource::loadSettingsFile(const File& file)
                     }
                     std::sort(song.markers_.begin(), song.markers_.end(), [](auto const& lhs, auto const& rhs) { return lhs.position_ < rhs.position_; });
                 }
+                if (obj->hasProperty("beats"))
+                {
+                    for (auto b : *(obj->getProperty("beats").getArray()))
+                    {
+                        Song::Beat beat;
+                        beat.positionMSec_ = b.getProperty("position", 0.f);
+                        beat.confidence_   = b.getProperty("confidence", 0.f);
+                        beat.isDownbeat_   = b.getProperty("downbeat", false);
+                        song.beats_.emplace_back(beat);
+                    }
+                    std::sort(song.beats_.begin(), song.beats_.end(), [](auto const& lhs, auto const& rhs) { return lhs.positionMSec_ < rhs.positionMSec_; });
+                }
                 songs_.emplace_back(song);
             }
         }
@@ -258,6 +569,12 @@ void MelissaDataSource::validateSettings()
         playlists_.emplace_back(playlist);
     }
     for (auto&& l : listeners_) l->playlistUpdated(0);
+    
+    if (global_.decodeCacheSizeMB_ < 0) global_.decodeCacheSizeMB_ = 0;
+    MelissaDecodeCache::getInstance()->setup(settingsFile_.getParentDirectory().getChildFile("DecodeCache"), global_.decodeCache_, global_.decodeCacheSizeMB_);
+    MelissaLoudness::getInstance()->setup(global_.loudnessNormalization_, global_.loudnessTargetLufs_);
+    MelissaOutputRouter::getInstance()->setup(global_.musicOutputChannel_, global_.metronomeOutputChannel_);
+    MelissaAnalysisCache::getInstance()->setup(settingsFile_.getParentDirectory().getChildFile("AnalysisCache"));
 }
 
 void MelissaDataSource::saveSettingsFile()
@@ -271,6 +588,16 @@ void MelissaDataSource::saveSettingsFile()
     global->setProperty("height",   global_.height_);
     global->setProperty("device",   global_.device_);
     global->setProperty("playmode", global_.playMode_);
+    global->setProperty("crossfade_msec", global_.crossfadeMSec_);
+    global->setProperty("decode_cache", global_.decodeCache_);
+    global->setProperty("decode_cache_size_mb", global_.decodeCacheSizeMB_);
+    global->setProperty("loudness_normalization", global_.loudnessNormalization_);
+    global->setProperty("loudness_target_lufs", global_.loudnessTargetLufs_);
+    global->setProperty("music_output_channel", global_.musicOutputChannel_);
+    global->setProperty("metronome_output_channel", global_.metronomeOutputChannel_);
+    global->setProperty("metronome_subdivision", global_.metronomeSubdivision_);
+    global->setProperty("metronome_accent_pattern", global_.metronomeAccentPattern_);
+    global->setProperty("metronome_click_file", global_.metronomeClickFile_);
     auto shortcut = new DynamicObject();
     {
         for (auto&& s : global_.shortcut_)
@@ -310,13 +637,14 @@ void MelissaDataSource::saveSettingsFile()
 #endif
     
     previous->setProperty("eq_sw",     model_->getEqSwitch());
-    previous->setProperty("eq_0_freq", model_->getEqFreq(0));
-    previous->setProperty("eq_0_gain", model_->getEqGain(0));
-    previous->setProperty("eq_0_q",    model_->getEqQ(0));
+    EqBands eqBands;
+    getEqBandsFromModel(eqBands);
+    writeEqBands(previous, eqBands);
     
     auto uiState = new DynamicObject();
     uiState->setProperty("browser_tab", previous_.uiState_.selectedFileBrowserTab_);
     uiState->setProperty("playlist",    previous_.uiState_.selectedPlaylist_);
+    uiState->setProperty("waveform_view", previous_.uiState_.waveformViewMode_);
     previous->setProperty("ui_state", uiState);
     
     settings->setProperty("previous", previous);
@@ -354,9 +682,7 @@ void MelissaDataSource::saveSettingsFile()
         obj->setProperty("accent",           song.accent_);
         obj->setProperty("beat_position",    song.beatPositionMSec_);
         obj->setProperty("eq_sw",            song.eqSw_);
-        obj->setProperty("eq_0_freq",        song.eqFreq_);
-        obj->setProperty("eq_0_gain",        song.eqGain_);
-        obj->setProperty("eq_0_q",           song.eqQ_);
+        writeEqBands(obj, song.eqBands_);
         obj->setProperty("memo",             song.memo_);
         
         Array<var> list;
@@ -404,6 +730,18 @@ void MelissaDataSource::saveSettingsFile()
             marker.add(obj);
         }
         obj->setProperty("marker", marker);
+        
+        Array<var> beats;
+        for (auto&& b : song.beats_)
+        {
+            auto obj = new DynamicObject();
+            obj->setProperty("position", b.positionMSec_);
+            obj->setProperty("confidence", b.confidence_);
+            obj->setProperty("downbeat", b.isDownbeat_);
+            
+            beats.add(obj);
+        }
+        obj->setProperty("beats", beats);
        
         songs.add(obj);
     }
@@ -498,31 +836,37 @@ void MelissaDataSource::loadFileAsync(const File& file, std::function<void()> fu
 
 float MelissaDataSource::readBuffer(size_t ch, size_t index, StemType playPart)
 {
+    if (streamingSource_ != nullptr) return streamingSource_->readSample(ch, index, playPart);
     if (originalAudioSampleBuf_ == nullptr) return 0.f;
     
-    const int numOfChs   = originalAudioSampleBuf_->getNumChannels();
-    const int bufferSize = originalAudioSampleBuf_->getNumSamples();
-    
-    if (2 <= ch || numOfChs <= ch) ch = 0;
-    if (bufferSize <= index) return 0.f;
-    
     if (playPart == kStemType_All)
     {
-        return originalAudioSampleBuf_->getSample(static_cast<int>(ch), static_cast<int>(index));
+        return readAudioSampleBuffer(originalAudioSampleBuf_.get(), ch, index);
     }
     else if (playPart < kNumStemTypes)
     {
-        if (stemAudioSampleBuf_[playPart] != nullptr && index < stemAudioSampleBuf_[playPart]->getNumSamples())
+        if (index < originalAudioSampleBuf_->getNumSamples())
         {
-            return stemAudioSampleBuf_[playPart]->getSample(static_cast<int>(ch), static_cast<int>(index));
+            return readAudioSampleBuffer(stemAudioSampleBuf_[playPart].get(), ch, index);
         }
     }
     
     return 0.f;
 }
 
+size_t MelissaDataSource::getBufferLength() const
+{
+    if (streamingSource_ != nullptr) return streamingSource_->getLengthInSamples();
+    return (originalAudioSampleBuf_ == nullptr ? 0 : originalAudioSampleBuf_->getNumSamples());
+}
+
 void MelissaDataSource::disposeBuffer()
 {
+    filePrefetcher_->cancel();
+    
+    const ScopedLock sl(bufferLock_);
+    streamingSource_ = nullptr;
+    
     if (originalAudioSampleBuf_ == nullptr) return;
     originalAudioSampleBuf_->clear();
     originalAudioSampleBuf_ = nullptr;
@@ -537,6 +881,88 @@ void MelissaDataSource::disposeBuffer()
     }
 }
 
+bool MelissaDataSource::prepareBuffer(size_t readIndex, size_t loopStartIndex, StemType playPart)
+{
+    // Called from the audio process thread before reading. Decoded files are always ready.
+    if (streamingSource_ == nullptr) return true;
+    return streamingSource_->setReadPosition(readIndex, loopStartIndex, playPart, 20);
+}
+
+void MelissaDataSource::readBufferBlock(AudioSampleBuffer& dest, size_t startIndex, StemType playPart)
+{
+    const ScopedLock sl(bufferLock_);
+    if (streamingSource_ != nullptr)
+    {
+        streamingSource_->read(dest, startIndex, playPart);
+        return;
+    }
+    
+    const auto source = (playPart == kStemType_All) ? originalAudioSampleBuf_.get() : (playPart < kNumStemTypes ? stemAudioSampleBuf_[playPart].get() : nullptr);
+    readAudioSampleBufferBlock(source, dest, startIndex);
+}
+
+void MelissaDataSource::prefetchFileAsync(const File& file)
+{
+    if (!file.existsAsFile() || file.getFullPathName() == currentSongFilePath_) return;
+    
+    // The song state isn't accessible from the audio process thread
+    float semitone = 0.f;
+    int speed = 100;
+    for (auto&& song : songs_)
+    {
+        if (song.filePath_ == file.getFullPathName())
+        {
+            semitone = song.pitch_;
+            speed = song.speed_;
+            break;
+        }
+    }
+    filePrefetcher_->prefetch(file, semitone, speed);
+}
+
+void MelissaDataSource::cancelPrefetch()
+{
+    filePrefetcher_->cancel();
+}
+
+bool MelissaDataSource::isPrefetchedFileReady() const
+{
+    return filePrefetcher_->isReady();
+}
+
+double MelissaDataSource::getPrefetchedSampleRate() const
+{
+    return filePrefetcher_->getSampleRate();
+}
+
+void MelissaDataSource::readPrefetchedBlock(AudioSampleBuffer& dest, size_t startIndex)
+{
+    filePrefetcher_->readBlock(dest, startIndex);
+}
+
+bool MelissaDataSource::switchToPrefetchedFile(float& semitone, int& speed)
+{
+    // Called from the audio process thread when the current song reaches its end
+    auto audioData = filePrefetcher_->take();
+    if (audioData == nullptr) return false;
+    
+    semitone = audioData->semitone_;
+    speed = audioData->speed_;
+    const auto file = audioData->file_;
+    const auto stemFiles = audioData->hasStems_ ? audioData->stemFiles_ : std::map<std::string, File>();
+    
+    // The analyses of this song must neither read the next one nor store their results until the cache is reopened
+    MelissaAnalysisPipeline::getInstance()->cancel();
+    MelissaAnalysisCache::getInstance()->close();
+    applyAudioData(*audioData);
+    
+    MessageManager::callAsync([this, file, stemFiles]() {
+        commitPrefetchedFile(file, stemFiles);
+    });
+    
+    return true;
+}
+
 void MelissaDataSource::setDefaultShortcut(const String& eventName)
 {
     if (defaultShortcut_.find(eventName) == defaultShortcut_.end())
@@ -641,9 +1067,7 @@ void MelissaDataSource::restorePreviousState()
         model_->setSpeedIncGoal(previous_.speedIncGoal_);
 #endif
         model_->setEqSwitch(previous_.eqSw_);
-        model_->setEqFreq(0, previous_.eqFreq_);
-        model_->setEqGain(0, previous_.eqGain_);
-        model_->setEqQ(0, previous_.eqQ_);
+        setEqBandsToModel(previous_.eqBands_);
     });
 }
 
@@ -741,9 +1165,7 @@ void MelissaDataSource::saveSongState()
 #endif
             
             song.eqSw_             = model_->getEqSwitch();
-            song.eqFreq_           = model_->getEqFreq(0);
-            song.eqGain_           = model_->getEqGain(0);
-            song.eqQ_              = model_->getEqQ(0);
+            getEqBandsFromModel(song.eqBands_);
             return;
         }
     }
@@ -810,6 +1232,11 @@ size_t MelissaDataSource::getNumPracticeList() const
 }
 
 void MelissaDataSource::addPracticeList(const String& name)
+{
+    addPracticeList(name, model_->getLoopAPosRatio(), model_->getLoopBPosRatio());
+}
+
+void MelissaDataSource::addPracticeList(const String& name, float aRatio, float bRatio)
 {
     if (currentSongFilePath_.isEmpty()) return;
     
@@ -819,8 +1246,8 @@ void MelissaDataSource::addPracticeList(const String& name)
         {
             Song::PracticeList plist;
             plist.name_   = name;
-            plist.aRatio_ = model_->getLoopAPosRatio();
-            plist.bRatio_ = model_->getLoopBPosRatio();
+            plist.aRatio_ = aRatio;
+            plist.bRatio_ = bRatio;
 
 #if !defined(SAVE_ONLY_LOOP_AND_SPEED_IN_PRACTICE_LIST)
             plist.outputMode_      = model_->getOutputMode();
@@ -1014,6 +1441,33 @@ void MelissaDataSource::removeMarker(size_t index)
     }
 }
 
+void MelissaDataSource::getBeats(std::vector<Song::Beat>& beats) const
+{
+    beats.clear();
+    for (auto&& song : songs_)
+    {
+        if (song.filePath_ == currentSongFilePath_)
+        {
+            beats = song.beats_;
+            return;
+        }
+    }
+}
+
+void MelissaDataSource::setBeats(const std::vector<Song::Beat>& beats)
+{
+    for (auto&& song : songs_)
+    {
+        if (song.filePath_ == currentSongFilePath_)
+        {
+            song.beats_ = beats;
+            std::sort(song.beats_.begin(), song.beats_.end(), [](auto const& lhs, auto const& rhs) { return lhs.positionMSec_ < rhs.positionMSec_; });
+            for (auto&& l : listeners_) l->beatsUpdated();
+            return;
+        }
+    }
+}
+
 void MelissaDataSource::overwriteMarker(size_t index, const Song::Marker& marker)
 {
     for (auto&& song : songs_)
@@ -1030,69 +1484,85 @@ void MelissaDataSource::overwriteMarker(size_t index, const Song::Marker& marker
     }
 }
 
-void MelissaDataSource::handleAsyncUpdate()
+bool MelissaDataSource::readAudioData(const File& file, const std::map<std::string, File>& stemFiles, AudioData& audioData, const std::function<bool()>& shouldCancel)
 {
-    // load file asynchronously
-    
-    saveSongState();
-    
     AudioFormatManager formatManager;
     formatManager.registerBasicFormats();
     
-    File originalFile;
-    std::map<std::string, File> stemFiles;
+    auto reader = std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(file));
+    if (reader == nullptr) return false;
+    
+    audioData.file_ = file;
+    audioData.sampleRate_ = reader->sampleRate;
+    audioData.stemFiles_ = stemFiles;
     
-    auto reader = std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(fileToload_));
-    if (reader == nullptr)
+    // long file (streamed from the disk)
+    if (reader->lengthInSamples > kStreamingThresholdSec * reader->sampleRate)
     {
-        for (auto&& l : listeners_) l->fileLoadStatusChanged(kFileLoadStatus_Failed, fileToload_.getFullPathName());
-        return;
+        audioData.streamingSource_ = MelissaStreamingSource::create(file, stemFiles);
+        audioData.hasStems_ = (audioData.streamingSource_ != nullptr && audioData.streamingSource_->hasStems());
+        return audioData.streamingSource_ != nullptr;
     }
     
-    // read audio data from reader
-    
-    // original file
+    // original file (compressed files are read from the decode cache if possible)
     const int lengthInSamples = static_cast<int>(reader->lengthInSamples);
-    originalAudioSampleBuf_ = std::make_unique<AudioSampleBuffer>(2, lengthInSamples);
-    reader->read(originalAudioSampleBuf_.get(), 0, lengthInSamples, 0, true, true);
-    sampleRate_ = reader->sampleRate;
+    audioData.originalAudioSampleBuf_ = std::make_unique<AudioSampleBuffer>(2, lengthInSamples);
+    auto decodeCache = MelissaDecodeCache::getInstance();
+    auto cachedReader = decodeCache->createReader(file);
+    if (cachedReader != nullptr && cachedReader->lengthInSamples == reader->lengthInSamples)
+    {
+        if (!readInChunks(*cachedReader, *audioData.originalAudioSampleBuf_, 0, lengthInSamples, shouldCancel)) return false;
+    }
+    else
+    {
+        if (!decodeAudioFile(formatManager, file, *reader, *audioData.originalAudioSampleBuf_, shouldCancel)) return false;
+        decodeCache->store(file, *audioData.originalAudioSampleBuf_, audioData.sampleRate_);
+    }
     
     // stem files
-    if (stemFiles_.size() == kNumStemTypes)
+    audioData.hasStems_ = false;
+    if (stemFiles.size() == kNumStemTypes)
     {
+        audioData.hasStems_ = true;
         for (int stemTypeIndex = 0; stemTypeIndex < kNumStemTypes; ++stemTypeIndex)
         {
             const auto stemName = MelissaStemProvider::partNames_[stemTypeIndex];
-            auto readerForStem = std::unique_ptr<AudioFormatReader>(formatManager.createReaderFor(stemFiles_[stemName]));
+            const auto stemFile = stemFiles.find(stemName);
+            auto readerForStem = std::unique_ptr<AudioFormatReader>(stemFile == stemFiles.end() ? nullptr : formatManager.createReaderFor(stemFile->second));
             if (readerForStem == nullptr)
             {
-                stemFiles_.clear();
-                MelissaStemProvider::getInstance()->failedToReadPreparedStems();
+                audioData.hasStems_ = false;
+                for (auto&& stemBuf : audioData.stemAudioSampleBuf_) stemBuf = nullptr;
                 break;
             }
             
             const int lengthInSamples = static_cast<int>(readerForStem->lengthInSamples);
-            stemAudioSampleBuf_[stemTypeIndex] = std::make_unique<AudioSampleBuffer>(2, lengthInSamples);
-            readerForStem->read(stemAudioSampleBuf_[stemTypeIndex].get(), 0, lengthInSamples, 0, true, true);
+            audioData.stemAudioSampleBuf_[stemTypeIndex] = std::make_unique<AudioSampleBuffer>(2, lengthInSamples);
+            if (!decodeAudioFile(formatManager, stemFile->second, *readerForStem, *audioData.stemAudioSampleBuf_[stemTypeIndex], shouldCancel)) return false;
         }
     }
     
-    currentSongFilePath_ = fileToload_.getFullPathName();
-    audioEngine_->updateBuffer();
-    
-    for (auto&& l : listeners_)
+    return true;
+}
+
+void MelissaDataSource::applyAudioData(AudioData& audioData)
+{
+    const ScopedLock sl(bufferLock_);
+    sampleRate_ = audioData.sampleRate_;
+    originalAudioSampleBuf_ = std::move(audioData.originalAudioSampleBuf_);
+    streamingSource_ = std::move(audioData.streamingSource_);
+    for (int stemTypeIndex = 0; stemTypeIndex < kNumStemTypes; ++stemTypeIndex)
     {
-        l->fileLoadStatusChanged(kFileLoadStatus_Success, currentSongFilePath_);
-        l->songChanged(currentSongFilePath_, lengthInSamples, sampleRate_);
-        l->markerUpdated();
+        stemAudioSampleBuf_[stemTypeIndex] = std::move(audioData.stemAudioSampleBuf_[stemTypeIndex]);
     }
-    
-    bool found = false;
+}
+
+void MelissaDataSource::restoreSongState()
+{
     for (auto&& song : songs_)
     {
         if (song.filePath_ == currentSongFilePath_)
         {
-            found = true;
             model_->setPitch(song.pitch_);
             model_->setOutputMode(song.outputMode_);
             model_->setMusicVolume(song.musicVolume_);
@@ -1113,38 +1583,131 @@ void MelissaDataSource::handleAsyncUpdate()
 #endif
             
             model_->setEqSwitch(song.eqSw_);
-            model_->setEqFreq(0, song.eqFreq_);
-            model_->setEqGain(0, song.eqGain_);
-            model_->setEqQ(0, song.eqQ_);
+            setEqBandsToModel(song.eqBands_);
+            return;
         }
     }
-    if (!found)
-    {
-        model_->setPitch(0);
-        model_->setOutputMode(kOutputMode_LR);
-        model_->setMusicVolume(1.f);
-        model_->setMetronomeVolume(1.f);
-        model_->setMusicMetronomeBalance(0.5f);
-        model_->setMetronomeSwitch(false);
-        model_->setBpm(kBpmShouldMeasure);
-        model_->setAccent(4);
-        model_->setBeatPositionMSec(0.f);
-        
-        model_->setSpeed(100);
+    
+    model_->setPitch(0);
+    model_->setOutputMode(kOutputMode_LR);
+    model_->setMusicVolume(1.f);
+    model_->setMetronomeVolume(1.f);
+    model_->setMusicMetronomeBalance(0.5f);
+    model_->setMetronomeSwitch(false);
+    model_->setBpm(kBpmShouldMeasure);
+    model_->setAccent(4);
+    model_->setBeatPositionMSec(0.f);
+    
+    model_->setSpeed(100);
 #if defined(ENABLE_SPEED_TRAINING)
-        model_->setSpeedMode(kSpeedMode_Basic);
-        model_->setSpeedIncStart(75);
-        model_->setSpeedIncValue(1);
-        model_->setSpeedIncPer(10);
-        model_->setSpeedIncGoal(100);
+    model_->setSpeedMode(kSpeedMode_Basic);
+    model_->setSpeedIncStart(75);
+    model_->setSpeedIncValue(1);
+    model_->setSpeedIncPer(10);
+    model_->setSpeedIncGoal(100);
 #endif
-        
-        model_->setEqSwitch(false);
-        model_->setEqFreq(0, 500);
-        model_->setEqGain(0, 0.f);
-        model_->setEqQ(0, 7.f);
+    
+    model_->setEqSwitch(false);
+    setEqBandsToModel(getDefaultEqBands());
+}
+
+void MelissaDataSource::setEqBandsToModel(const EqBands& eqBands)
+{
+    for (size_t band = 0; band < kEqNumOfBands; ++band)
+    {
+        model_->setEqType(band, eqBands[band].type_);
+        model_->setEqFreq(band, eqBands[band].freq_);
+        model_->setEqGain(band, eqBands[band].gain_);
+        model_->setEqQ(band, eqBands[band].q_);
+    }
+}
+
+void MelissaDataSource::getEqBandsFromModel(EqBands& eqBands)
+{
+    for (size_t band = 0; band < kEqNumOfBands; ++band)
+    {
+        eqBands[band] = { model_->getEqFreq(band), model_->getEqGain(band), model_->getEqQ(band), model_->getEqType(band) };
+    }
+}
+
+void MelissaDataSource::commitPrefetchedFile(const File& file, const std::map<std::string, File>& stemFiles)
+{
+    // The audio engine has already switched to the prefetched buffer.
+    // Only the song state is updated here so that the playback is not interrupted.
+    
+    // The analyses were cancelled at the switch, this also drops the ones requested since
+    saveSongState();
+    MelissaAnalysisPipeline::getInstance()->cancel();
+    
+    fileToload_ = file;
+    stemFiles_ = stemFiles;
+    MelissaStemProvider::getInstance()->setStemsPrepared(stemFiles_.size() == kNumStemTypes);
+    
+    currentSongFilePath_ = file.getFullPathName();
+    const size_t lengthInSamples = getBufferLength();
+    MelissaAnalysisCache::getInstance()->open(this);
+    
+    for (auto&& l : listeners_)
+    {
+        l->fileLoadStatusChanged(kFileLoadStatus_Success, currentSongFilePath_);
+        l->songChanged(currentSongFilePath_, lengthInSamples, sampleRate_);
+        l->markerUpdated();
     }
-    model_->setLengthMSec(lengthInSamples / reader->sampleRate * 1000.f);
+    
+    restoreSongState();
+    model_->setLengthMSec(lengthInSamples / sampleRate_ * 1000.f);
+    model_->setLoopPosRatio(0.f, 1.f);
+    model_->setPlayPart(kStemType_All);
+    
+    addToHistory(currentSongFilePath_);
+    saveSongState();
+}
+
+void MelissaDataSource::handleAsyncUpdate()
+{
+    // load file asynchronously
+    
+    saveSongState();
+    
+    // The analyses of the previous song are dropped. A running one may still read a block of the new song, but never finishes.
+    MelissaAnalysisPipeline::getInstance()->cancel();
+    
+    // use the prefetched data if available
+    auto audioData = filePrefetcher_->take(fileToload_);
+    filePrefetcher_->cancel();
+    
+    if (audioData == nullptr)
+    {
+        audioData = std::make_unique<AudioData>();
+        if (!readAudioData(fileToload_, stemFiles_, *audioData))
+        {
+            for (auto&& l : listeners_) l->fileLoadStatusChanged(kFileLoadStatus_Failed, fileToload_.getFullPathName());
+            return;
+        }
+    }
+    
+    if (stemFiles_.size() == kNumStemTypes && !audioData->hasStems_)
+    {
+        stemFiles_.clear();
+        MelissaStemProvider::getInstance()->failedToReadPreparedStems();
+    }
+    
+    applyAudioData(*audioData);
+    const size_t lengthInSamples = getBufferLength();
+    
+    currentSongFilePath_ = fileToload_.getFullPathName();
+    audioEngine_->updateBuffer();
+    MelissaAnalysisCache::getInstance()->open(this);
+    
+    for (auto&& l : listeners_)
+    {
+        l->fileLoadStatusChanged(kFileLoadStatus_Success, currentSongFilePath_);
+        l->songChanged(currentSongFilePath_, lengthInSamples, sampleRate_);
+        l->markerUpdated();
+    }
+    
+    restoreSongState();
+    model_->setLengthMSec(lengthInSamples / sampleRate_ * 1000.f);
     model_->setLoopPosRatio(0.f, 1.f);
     model_->setPlayingPosRatio(0.f);
     model_->setPlayPart(kStemType_All);
@@ -7,10 +7,13 @@
 
 #pragma once
 
+#include <array>
+#include <functional>
 #include "../JuceLibraryCode/JuceHeader.h"
 #include "MelissaAudioEngine.h"
 #include "MelissaDefinitions.h"
 #include "MelissaModel.h"
+#include "MelissaStreamingSource.h"
 
 #define SAVE_ONLY_LOOP_AND_SPEED_IN_PRACTICE_LIST
 
@@ -31,6 +34,7 @@ public:
     virtual void playlistUpdated(size_t index) { }
     virtual void practiceListUpdated() { }
     virtual void markerUpdated() { }
+    virtual void beatsUpdated() { }
     virtual void fileLoadStatusChanged(FileLoadStatus status, const String& filePath) { }
     virtual void shortcutUpdated() { }
     virtual void colourChanged(const Colour& mainColour, const Colour& subColour, const Colour& accentColour, const Colour& textColour, const Colour& waveformColour) { }
@@ -42,6 +46,16 @@ class MelissaDataSource : public AsyncUpdater
 public:
     typedef Array<String> FilePathList;
     
+    struct EqBand
+    {
+        float freq_;
+        float gain_;
+        float q_;
+        EqType type_;
+    };
+    typedef std::array<EqBand, kEqNumOfBands> EqBands;
+    static EqBands getDefaultEqBands();
+    
     struct Global
     {
         String version_;
@@ -53,6 +67,16 @@ public:
         std::map<String, String> shortcut_;
         String uiTheme_;
         String fontName_;
+        int crossfadeMSec_;
+        bool decodeCache_;
+        int decodeCacheSizeMB_;
+        bool loudnessNormalization_;
+        float loudnessTargetLufs_;
+        int musicOutputChannel_;
+        int metronomeOutputChannel_;
+        int metronomeSubdivision_;
+        int metronomeAccentPattern_;
+        String metronomeClickFile_;
         enum FontSize
         {
             kFontSize_Large,
@@ -62,7 +86,7 @@ public:
             kNumFontSizes
         };
         
-        Global() : version_(ProjectInfo::versionString), width_(1400), height_(860), uiTheme_("System_Dark")
+        Global() : version_(ProjectInfo::versionString), width_(1400), height_(860), uiTheme_("System_Dark"), crossfadeMSec_(0), decodeCache_(true), decodeCacheSizeMB_(4096), loudnessNormalization_(true), loudnessTargetLufs_(-14.f), musicOutputChannel_(0), metronomeOutputChannel_(0), metronomeSubdivision_(1), metronomeAccentPattern_(0)
         {
             rootDir_ = File::getSpecialLocation(File::userMusicDirectory).getFullPathName();
         }
@@ -94,15 +118,14 @@ public:
         int speedIncGoal_;
         
         bool eqSw_;
-        float eqFreq_;
-        float eqGain_;
-        float eqQ_;
+        EqBands eqBands_;
         
         // ui state
         struct UIState
         {
             int selectedFileBrowserTab_;
             int selectedPlaylist_;
+            int waveformViewMode_;
         };
         UIState uiState_;
         
@@ -112,8 +135,8 @@ public:
         outputMode_(kOutputMode_LR), musicVolume_(1.f), metronomeVolume_(1.f), volumeBalance_(0.5f),
         /* metronomeSw_(false), */ bpm_(kBpmShouldMeasure), accent_(4), beatPositionMSec_(0.f),
         speedMode_(kSpeedMode_Basic), speed_(100), speedIncStart_(70), speedIncValue_(1), speedIncPer_(10), speedIncGoal_(100),
-        eqSw_(false), eqFreq_(500), eqGain_(0.f), eqQ_(1.f),
-        uiState_({0, 0})
+        eqSw_(false), eqBands_(getDefaultEqBands()),
+        uiState_({0, 0, 0})
         {}
     } previous_;
     
@@ -150,9 +173,7 @@ public:
         int speedIncGoal_;
         
         bool eqSw_;
-        float eqFreq_;
-        float eqGain_;
-        float eqQ_;
+        EqBands eqBands_;
         String memo_;
         
         struct PracticeList
@@ -203,10 +224,18 @@ public:
         };
         std::vector<Marker> markers_;
         
+        struct Beat
+        {
+            float positionMSec_;
+            float confidence_; // 0 - 1
+            bool isDownbeat_;
+        };
+        std::vector<Beat> beats_; // sorted by position
+        
         Song() : filePath_(""), pitch_(0.f), outputMode_(kOutputMode_LR), musicVolume_(1.f), metronomeVolume_(1.f), volumeBalance_(0.5f),
         metronomeSw_(false), bpm_(kBpmShouldMeasure), accent_(4), beatPositionMSec_(0.f),
         speedMode_(kSpeedMode_Basic), speed_(100), speedIncStart_(70), speedIncValue_(1), speedIncPer_(10), speedIncGoal_(100),
-        eqSw_(false), eqFreq_(500), eqGain_(0.f), eqQ_(1.f), memo_("") {}
+        eqSw_(false), eqBands_(getDefaultEqBands()), memo_("") {}
     };
     std::vector<Song> songs_;
     
@@ -225,15 +254,33 @@ public:
     String getFontName() const { return global_.fontName_; }
     Font getFont(Global::FontSize size) const;
     
-    bool isFileLoaded() const { return originalAudioSampleBuf_ != nullptr; }
+    bool isFileLoaded() const { return originalAudioSampleBuf_ != nullptr || streamingSource_ != nullptr; }
     static String getCompatibleFileExtensions();
     void loadFileAsync(const File& file, std::function<void()> functionToCallAfterFileLoad = nullptr);
     void loadFileAsync(const String& filePath, std::function<void()> functionToCallAfterFileLoad = nullptr) { loadFileAsync(File(filePath), functionToCallAfterFileLoad); }
     float readBuffer(size_t ch, size_t index, StemType playPart);
     double getSampleRate() const { return sampleRate_; }
-    size_t getBufferLength() const { return (originalAudioSampleBuf_ == nullptr ? 0 : originalAudioSampleBuf_->getNumSamples()); }
+    size_t getBufferLength() const;
     void disposeBuffer();
     
+    // Streaming (for long files which are not decoded into memory)
+    bool isStreaming() const { return streamingSource_ != nullptr; }
+    bool prepareBuffer(size_t readIndex, size_t loopStartIndex, StemType playPart);
+    void readBufferBlock(AudioSampleBuffer& dest, size_t startIndex, StemType playPart);
+    
+    // Prefetch (for gapless playback)
+    void prefetchFileAsync(const File& file);
+    void prefetchFileAsync(const String& filePath) { prefetchFileAsync(File(filePath)); }
+    void cancelPrefetch();
+    bool isPrefetchedFileReady() const;
+    double getPrefetchedSampleRate() const;
+    
+    // The prefetched buffer is locked for each call, so a span is read at once
+    void readPrefetchedBlock(AudioSampleBuffer& dest, size_t startIndex);
+    
+    // The saved pitch and speed of the next song are returned, so that the audio engine applies them at the switch
+    bool switchToPrefetchedFile(float& semitone, int& speed);
+    
     // Shortcut
     void setDefaultShortcut(const String& eventName);
     void setDefaultShortcuts(bool removeAll = false);
@@ -274,6 +321,7 @@ public:
     void getPracticeList(std::vector<Song::PracticeList>& list);
     size_t getNumPracticeList() const;
     void addPracticeList(const String& name);
+    void addPracticeList(const String& name, float aRatio, float bRatio);
     void removePracticeList(size_t index);
     void overwritePracticeList(size_t index, const String& name);
     void overwritePracticeList(size_t index, const Song::PracticeList& list);
@@ -286,6 +334,10 @@ public:
     void removeMarker(size_t index);
     void overwriteMarker(size_t index, const Song::Marker& marker);
     
+    // Beat grid
+    void getBeats(std::vector<Song::Beat>& beats) const;
+    void setBeats(const std::vector<Song::Beat>& beats);
+    
     // AsyncUpdater
     void handleAsyncUpdate() override;
     
@@ -305,6 +357,35 @@ private:
     // History
     void addToHistory(const String& filePath);
     
+    // Audio file
+    struct AudioData
+    {
+        File file_;
+        double sampleRate_;
+        std::map<std::string, File> stemFiles_;
+        bool hasStems_;
+        std::unique_ptr<AudioSampleBuffer> originalAudioSampleBuf_;
+        std::unique_ptr<AudioSampleBuffer> stemAudioSampleBuf_[kNumStemTypes];
+        std::unique_ptr<MelissaStreamingSource> streamingSource_;
+        
+        // Saved pitch and speed of the song (prefetch only)
+        float semitone_;
+        int speed_;
+        
+        AudioData() : sampleRate_(0.0), hasStems_(false), semitone_(0.f), speed_(100) {}
+    };
+    // shouldCancel is polled between the chunks of the decoding. Returns false if it has been cancelled.
+    static bool readAudioData(const File& file, const std::map<std::string, File>& stemFiles, AudioData& audioData, const std::function<bool()>& shouldCancel = nullptr);
+    void applyAudioData(AudioData& audioData);
+    void restoreSongState();
+    void setEqBandsToModel(const EqBands& eqBands);
+    void getEqBandsFromModel(EqBands& eqBands);
+    
+    // Prefetch
+    class FilePrefetcher;
+    std::unique_ptr<FilePrefetcher> filePrefetcher_;
+    void commitPrefetchedFile(const File& file, const std::map<std::string, File>& stemFiles);
+    
     MelissaAudioEngine* audioEngine_;
     MelissaModel* model_;
     double sampleRate_;
@@ -316,6 +397,8 @@ private:
     std::vector<MelissaDataSourceListener*> listeners_;
     std::unique_ptr<AudioSampleBuffer> originalAudioSampleBuf_;
     std::unique_ptr<AudioSampleBuffer> stemAudioSampleBuf_[kNumStemTypes];
+    std::unique_ptr<MelissaStreamingSource> streamingSource_;
+    CriticalSection bufferLock_; // guards the buffers against readBufferBlock() from the analysis threads
     bool wasPlaying_;
     std::map<String, String> defaultShortcut_;
 };
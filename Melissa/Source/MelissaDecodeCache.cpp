@@ -0,0 +1,166 @@
+//
+//  MelissaDecodeCache.cpp
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#include "MelissaDecodeCache.h"
+
+MelissaDecodeCache MelissaDecodeCache::instance_;
+
+static const String decodeInfoFileName = "decode_info.json";
+static const String decodedFileName = "decoded.wav";
+static constexpr int writeChunkLength = 1 << 16;
+
+MelissaDecodeCache::MelissaDecodeCache() :
+enabled_(false),
+sizeLimit_(0),
+writerThreadPool_(1)
+{
+}
+
+MelissaDecodeCache::~MelissaDecodeCache()
+{
+    // A write being interrupted leaves only its temporary file, which is deleted
+    writerThreadPool_.removeAllJobs(true, -1);
+}
+
+void MelissaDecodeCache::setup(const File& cacheDir, bool enabled, int sizeLimitMB)
+{
+    const ScopedLock sl(lock_);
+    cacheDir_ = cacheDir;
+    enabled_ = enabled;
+    sizeLimit_ = static_cast<int64>(sizeLimitMB) * 1024 * 1024;
+}
+
+bool MelissaDecodeCache::shouldCache(const File& file)
+{
+    // Uncompressed (or cheaply decodable) formats are read directly
+    return !file.hasFileExtension("wav;wave;aif;aiff;flac");
+}
+
+std::unique_ptr<MemoryMappedAudioFormatReader> MelissaDecodeCache::createReader(const File& file)
+{
+    const ScopedLock sl(lock_);
+    if (!enabled_ || !shouldCache(file)) return nullptr;
+
+    const auto dir = getCacheDir(file);
+    const auto decodedFile = dir.getChildFile(decodedFileName);
+    const auto infoFile = dir.getChildFile(decodeInfoFileName);
+    if (!decodedFile.existsAsFile() || !infoFile.existsAsFile()) return nullptr;
+
+    // The cache is valid only if the original file hasn't been changed
+    auto info = JSON::parse(infoFile);
+    if (info["original"].toString() != file.getFullPathName() ||
+        static_cast<int64>(info["size"]) != file.getSize() ||
+        static_cast<int64>(info["modified"]) != file.getLastModificationTime().toMilliseconds())
+    {
+        return nullptr;
+    }
+
+    WavAudioFormat wavFormat;
+    std::unique_ptr<MemoryMappedAudioFormatReader> reader(wavFormat.createMemoryMappedReader(decodedFile));
+    if (reader == nullptr || !reader->mapEntireFile()) return nullptr;
+
+    decodedFile.setLastAccessTime(Time::getCurrentTime());
+    return reader;
+}
+
+void MelissaDecodeCache::store(const File& file, const AudioSampleBuffer& buffer, double sampleRate)
+{
+    File dir;
+    {
+        const ScopedLock sl(lock_);
+        if (!enabled_ || !shouldCache(file) || cacheDir_ == File()) return;
+        if (sizeLimit_ < static_cast<int64>(buffer.getNumSamples()) * buffer.getNumChannels() * sizeof(float)) return;
+        if (pendingFilePaths_.contains(file.getFullPathName())) return;
+
+        dir = getCacheDir(file);
+        pendingFilePaths_.add(file.getFullPathName());
+    }
+
+    auto decodedBuffer = std::make_shared<AudioSampleBuffer>(buffer);
+    writerThreadPool_.addJob([this, file, dir, decodedBuffer, sampleRate]()
+    {
+        write(file, dir, *decodedBuffer, sampleRate);
+
+        const ScopedLock sl(lock_);
+        pendingFilePaths_.removeString(file.getFullPathName());
+    });
+}
+
+void MelissaDecodeCache::write(const File& file, const File& dir, const AudioSampleBuffer& buffer, double sampleRate)
+{
+    if (!dir.createDirectory()) return;
+
+    // Write to a temporary file first so that a half-written file is never mapped
+    const auto decodedFile = dir.getChildFile(decodedFileName);
+    TemporaryFile tempFile(decodedFile);
+    {
+        auto outputStream = std::make_unique<FileOutputStream>(tempFile.getFile());
+        if (!outputStream->openedOk()) return;
+
+        WavAudioFormat wavFormat;
+        std::unique_ptr<AudioFormatWriter> writer(wavFormat.createWriterFor(outputStream.get(), sampleRate, static_cast<unsigned int>(buffer.getNumChannels()), 32, {}, 0));
+        if (writer == nullptr) return;
+        outputStream.release();
+
+        // Written in chunks, so that quitting the app doesn't wait for the whole file
+        auto job = ThreadPoolJob::getCurrentThreadPoolJob();
+        for (int startIndex = 0; startIndex < buffer.getNumSamples(); startIndex += writeChunkLength)
+        {
+            if (job != nullptr && job->shouldExit()) return;
+            const int length = std::min(writeChunkLength, buffer.getNumSamples() - startIndex);
+            if (!writer->writeFromAudioSampleBuffer(buffer, startIndex, length)) return;
+        }
+    }
+
+    const ScopedLock sl(lock_);
+    if (!tempFile.overwriteTargetFileWithTemporary()) return;
+
+    auto info = new DynamicObject();
+    info->setProperty("original", file.getFullPathName());
+    info->setProperty("size", file.getSize());
+    info->setProperty("modified", file.getLastModificationTime().toMilliseconds());
+    dir.getChildFile(decodeInfoFileName).replaceWithText(JSON::toString(var(info)));
+
+    removeLeastRecentlyUsed(dir);
+}
+
+File MelissaDecodeCache::getCacheDir(const File& file) const
+{
+    // The full path is hashed so that files with the same name in different folders don't collide
+    const auto hash = MD5(file.getFullPathName().toUTF8()).toHexString().substring(0, 8);
+    return cacheDir_.getChildFile(File::createLegalFileName(file.getFileName()) + "_" + hash + "_decoded");
+}
+
+void MelissaDecodeCache::removeLeastRecentlyUsed(const File& dirToKeep)
+{
+    struct Entry
+    {
+        File dir_;
+        int64 size_;
+        Time lastAccessTime_;
+    };
+    std::vector<Entry> entries;
+    int64 totalSize = 0;
+
+    for (const auto& dir : cacheDir_.findChildFiles(File::findDirectories, false, "*_decoded"))
+    {
+        const auto decodedFile = dir.getChildFile(decodedFileName);
+        const int64 size = decodedFile.getSize();
+        entries.push_back({ dir, size, decodedFile.getLastAccessTime() });
+        totalSize += size;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.lastAccessTime_ < b.lastAccessTime_; });
+    for (auto&& entry : entries)
+    {
+        if (totalSize <= sizeLimit_) break;
+        if (entry.dir_ == dirToKeep) continue;
+
+        entry.dir_.deleteRecursively();
+        totalSize -= entry.size_;
+    }
+}
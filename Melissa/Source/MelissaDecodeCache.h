@@ -0,0 +1,56 @@
+//
+//  MelissaDecodeCache.h
+//  Melissa
+//
+//  Copyright(c) 2020 Masaki Ono
+//
+
+#pragma once
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+// Keeps decoded audio of compressed files (mp3, m4a, ...) on the disk as float WAV,
+// so that reopening a song is just a memory-mapping.
+//
+// <cache dir>/<file name>_<hash of the full path (8 digits)>_decoded/decode_info.json
+//                                                                    /decoded.wav
+class MelissaDecodeCache
+{
+public:
+    void setup(const File& cacheDir, bool enabled, int sizeLimitMB);
+    bool isEnabled() const { return enabled_; }
+
+    // Returns nullptr if there is no valid cache for the file
+    std::unique_ptr<MemoryMappedAudioFormatReader> createReader(const File& file);
+
+    // The buffer is copied and written on the writer thread, so that loading the song doesn't wait for the disk
+    void store(const File& file, const AudioSampleBuffer& buffer, double sampleRate);
+
+    static bool shouldCache(const File& file);
+
+    // Singleton
+    static MelissaDecodeCache* getInstance() { return &instance_; }
+    MelissaDecodeCache(const MelissaDecodeCache&) = delete;
+    MelissaDecodeCache& operator=(const MelissaDecodeCache&) = delete;
+    MelissaDecodeCache(MelissaDecodeCache&&) = delete;
+    MelissaDecodeCache& operator=(MelissaDecodeCache&&) = delete;
+
+private:
+    // Singleton
+    MelissaDecodeCache();
+    ~MelissaDecodeCache();
+    static MelissaDecodeCache instance_;
+
+    File getCacheDir(const File& file) const;
+    void write(const File& file, const File& dir, const AudioSampleBuffer& buffer, double sampleRate);
+    void removeLeastRecentlyUsed(const File& dirToKeep);
+
+    CriticalSection lock_;
+    File cacheDir_;
+    bool enabled_;
+    int64 sizeLimit_;
+
+    // The files being written, so that a song reopened meanwhile isn't stored twice
+    StringArray pendingFilePaths_;
+    ThreadPool writerThreadPool_;
+};
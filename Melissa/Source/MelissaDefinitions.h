@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <cstddef>
+
 static constexpr int kPitchMin = -24;
 static constexpr int kPitchMax = 24;
 
@@ -22,6 +24,10 @@ static constexpr int kEqGainMax = 24;
 static constexpr float kEqQMin = 0.1;
 static constexpr float kEqQMax = 2;
 
+static constexpr size_t kEqNumOfBands = 8;
+// A band at 0 dB is bypassed, so only the first one is heard until the others are raised
+static constexpr float kEqDefaultFreqs[kEqNumOfBands] = { 500, 60, 150, 300, 1000, 2500, 6000, 12000 };
+
 static constexpr int kBpmMin = 45;
 static constexpr int kBpmMax = 300;
 static constexpr int kBpmShouldMeasure = kBpmMin - 1;
@@ -246,22 +246,44 @@ void MelissaModel::setEqSwitch(bool on)
 
 void MelissaModel::setEqFreq(size_t band, float freq)
 {
-    eqFreq_ = freq = std::clamp<float>(freq, kEqFreqMin, kEqFreqMax);
+    if (kEqNumOfBands <= band) return;
+    
+    eqFreq_[band] = freq = std::clamp<float>(freq, kEqFreqMin, kEqFreqMax);
     for (auto&& l : listeners_) l->eqFreqChanged(band, freq);
 }
 
 void MelissaModel::setEqGain(size_t band, float gain)
 {
-    eqGain_ = gain = std::clamp<float>(gain, kEqGainMin, kEqGainMax);
+    if (kEqNumOfBands <= band) return;
+    
+    eqGain_[band] = gain = std::clamp<float>(gain, kEqGainMin, kEqGainMax);
     for (auto&& l : listeners_) l->eqGainChanged(band, gain);
 }
 
 void MelissaModel::setEqQ(size_t band, float eqQ)
 {
-    eqQ_ = eqQ = std::clamp<float>(eqQ, kEqQMin, kEqQMax);
+    if (kEqNumOfBands <= band) return;
+    
+    eqQ_[band] = eqQ = std::clamp<float>(eqQ, kEqQMin, kEqQMax);
     for (auto&& l : listeners_) l->eqQChanged(band, eqQ);
 }
 
+void MelissaModel::setEqType(size_t band, EqType type)
+{
+    if (kEqNumOfBands <= band || type < 0 || kNumOfEqTypes <= type) return;
+    
+    eqType_[band] = type;
+    for (auto&& l : listeners_) l->eqTypeChanged(band, type);
+}
+
+void MelissaModel::setEqSelectedBand(size_t band)
+{
+    if (kEqNumOfBands <= band) return;
+    
+    eqSelectedBand_ = band;
+    for (auto&& l : listeners_) l->eqSelectedBandChanged(band);
+}
+
 void MelissaModel::setPlayPart(StemType playPart)
 {
     const bool isAvailable = MelissaStemProvider::getInstance()->getStemProviderStatus() == kStemProviderStatus_Available;
@@ -306,6 +328,13 @@ MelissaModel* MelissaModel::getInstance()
 MelissaModel::MelissaModel() :
 playbackStatus_(kPlaybackStatus_Stop), playbackMode_(kPlaybackMode_LoopOneSong), metronomeSwitch_(false), lengthMSec_(-1), musicVolume_(1.f), metronomeVolume_(1.f), musicMetronomeBalance_(0.5f), semitone_(0),
 speed_(100), currentSpeed_(100), speedIncStart_(70), speedIncValue_(1), speedIncPer_(10), speedIncGoal_(100), aPosRatio_(0.f), bPosRatio_(1.f), playingPosRatio_(0.f),
-bpm_(-1), beatPositionMSec_(0.f), accent_(4), filePath_(""), outputMode_(kOutputMode_LR), eqSwitch_(false), eqFreq_(500), eqGain_(0.f), eqQ_(0.f)
+bpm_(-1), beatPositionMSec_(0.f), accent_(4), filePath_(""), outputMode_(kOutputMode_LR), eqSwitch_(false), eqSelectedBand_(0)
 {
+    for (size_t band = 0; band < kEqNumOfBands; ++band)
+    {
+        eqFreq_[band] = kEqDefaultFreqs[band];
+        eqGain_[band] = 0.f;
+        eqQ_[band] = 1.f;
+        eqType_[band] = kEqType_Peak;
+    }
 }
@@ -94,11 +94,15 @@ public:
     void  setEqSwitch(bool on);
     bool  getEqSwitch() { return eqSwitch_; }
     void  setEqFreq(size_t band, float freq);
-    float getEqFreq(size_t band) { return eqFreq_; }
+    float getEqFreq(size_t band) { return (band < kEqNumOfBands) ? eqFreq_[band] : 0.f; }
     void  setEqGain(size_t band, float gain);
-    float getEqGain(size_t band) { return eqGain_; }
+    float getEqGain(size_t band) { return (band < kEqNumOfBands) ? eqGain_[band] : 0.f; }
     void  setEqQ(size_t band, float eqQ);
-    float getEqQ(size_t band) { return eqQ_; }
+    float getEqQ(size_t band) { return (band < kEqNumOfBands) ? eqQ_[band] : 0.f; }
+    void  setEqType(size_t band, EqType type);
+    EqType getEqType(size_t band) { return (band < kEqNumOfBands) ? eqType_[band] : kEqType_Peak; }
+    void  setEqSelectedBand(size_t band);
+    size_t getEqSelectedBand() { return eqSelectedBand_; }
     
     // Part
     void setPlayPart(StemType playPart);
@@ -149,9 +153,11 @@ private:
     String filePath_;
     OutputMode outputMode_;
     bool eqSwitch_;
-    float eqFreq_;
-    float eqGain_;
-    float eqQ_;
+    float eqFreq_[kEqNumOfBands];
+    float eqGain_[kEqNumOfBands];
+    float eqQ_[kEqNumOfBands];
+    EqType eqType_[kEqNumOfBands];
+    size_t eqSelectedBand_;
     StemType playPart_;
     float mainVolume_;
     
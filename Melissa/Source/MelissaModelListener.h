@@ -32,6 +32,16 @@ enum OutputMode : int
     kNumOfOutputModes
 };
 
+enum EqType : int
+{
+    kEqType_Peak,
+    kEqType_LowShelf,
+    kEqType_HighShelf,
+    kEqType_HighPass,
+    kEqType_LowPass,
+    kNumOfEqTypes
+};
+
 enum SpeedMode : int
 {
     kSpeedMode_Basic,
@@ -71,6 +81,8 @@ public:
     virtual void eqFreqChanged(size_t band, float freq) {}
     virtual void eqGainChanged(size_t band, float gain) {}
     virtual void eqQChanged(size_t band, float q) {}
+    virtual void eqTypeChanged(size_t band, EqType type) {}
+    virtual void eqSelectedBandChanged(size_t band) {}
     virtual void playPartChanged(StemType playPart) {}
     virtual void mainVolumeChanged(float mainVolume) {}
 };
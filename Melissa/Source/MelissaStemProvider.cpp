@@ -86,7 +86,6 @@ void MelissaStemProvider::getStemFiles(const File& fileToOpen, File& originalFil
                 stemFiles[partName] = stemFile;
             }
             
-            status_ = kStemProviderStatus_Available;
             return;
         }
         catch (std::exception& e)
@@ -130,14 +129,12 @@ void MelissaStemProvider::prepareForLoadStems(const File& fileToOpen, File& orig
 {
     stemFiles.clear();
     getStemFiles(fileToOpen, originalFile, stemFiles);
-    if (stemFiles.size() == kNumStemTypes)
-    {
-        status_ = kStemProviderStatus_Available;
-    }
-    else
-    {
-        status_ = kStemProviderStatus_Ready;
-    }
+    setStemsPrepared(stemFiles.size() == kNumStemTypes);
+}
+
+void MelissaStemProvider::setStemsPrepared(bool available)
+{
+    status_ = available ? kStemProviderStatus_Available : kStemProviderStatus_Ready;
     
     MessageManager::callAsync([&]() {
         for (auto& l : listeners_) l->stemProviderStatusChanged(status_);
@@ -47,6 +47,7 @@ public:
     void failedToReadPreparedStems();
     
     void prepareForLoadStems(const File& fileToOpen, File& originalFile, std::map<std::string, File>& stemFiles);
+    void setStemsPrepared(bool available);
     void deleteStems();
     
     StemProviderStatus getStemProviderStatus() const { return status_; }
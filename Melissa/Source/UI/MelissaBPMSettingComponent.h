@@ -64,7 +64,11 @@ public:
         bpmEditor_->onReturnKey = [&]()
         {
             const auto bpm = bpmEditor_->getText().getIntValue();
-            if (kBpmMin <= bpm) model_->setBpm(bpm);
+            if (kBpmMin <= bpm)
+            {
+                MelissaDataSource::getInstance()->setBeats({});
+                model_->setBpm(bpm);
+            }
         };
         addAndMakeVisible(bpmEditor_.get());
         
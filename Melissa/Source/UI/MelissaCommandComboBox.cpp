@@ -112,6 +112,8 @@ static const TitleAndCommandList commandList[kNumOfCommandCategories] =
             { "SetEqFreqValue", kCommandType_Value },
             { "SetEqGainValue", kCommandType_Value },
             { "SetEqQValue", kCommandType_Value },
+            { "SetEqBandValue", kCommandType_Value },
+            { "SetEqTypeValue", kCommandType_Value },
         }
     },
     {
@@ -12,6 +12,7 @@
 #include "MelissaDataSource.h"
 #include "MelissaHost.h"
 #include "MelissaLookAndFeel.h"
+#include "MelissaPreviewPlayer.h"
 #include "MelissaUISettings.h"
 
 class MelissaFileListBox : public ListBox,
@@ -27,6 +28,7 @@ public:
     
     MelissaFileListBox(const String& componentName = "") :
     target_(kTarget_History),
+    shouldPreview_(true),
     dataSource_(MelissaDataSource::getInstance())
     {
         juce::ListBox(componentName, this);
@@ -91,9 +93,16 @@ public:
     
     void listBoxItemDoubleClicked(int row, const MouseEvent& e) override
     {
+        MelissaPreviewPlayer::getInstance()->stop();
         dataSource_->loadFileAsync(list_[row]);
     }
     
+    void selectedRowsChanged(int lastRowSelected) override
+    {
+        if (!shouldPreview_ || lastRowSelected < 0 || list_.size() <= lastRowSelected) return;
+        MelissaPreviewPlayer::getInstance()->preview(File(list_[lastRowSelected]));
+    }
+    
     void paintListBoxItem(int rowNumber, Graphics &g, int width, int height, bool rowIsSelected) override
     {
         const String fullPath = (rowNumber < list_.size()) ?  list_[rowNumber] : "";
@@ -119,7 +128,7 @@ public:
         
         const size_t index = static_cast<size_t>(target_);
         dataSource_->playlists_[index].list_.swap(fromIndex, toIndex);
-        selectRow(toIndex);
+        selectRowWithoutPreview(toIndex);
         
         updateList();
     }
@@ -143,7 +152,7 @@ public:
     {
         if (target_ != kTarget_History) return;
         updateList();
-        selectRow(0);
+        selectRowWithoutPreview(0);
     }
     
     void playlistUpdated(size_t index) override
@@ -152,8 +161,16 @@ public:
     }
     
 private:
+    void selectRowWithoutPreview(int row)
+    {
+        shouldPreview_ = false;
+        selectRow(row);
+        shouldPreview_ = true;
+    }
+    
     std::unique_ptr<PopupMenu> popupMenu_;
     Target target_;
+    bool shouldPreview_;
     MelissaDataSource* dataSource_;
     MelissaDataSource::FilePathList list_;
     MelissaLookAndFeel laf_;
@@ -6,13 +6,18 @@
 //
 
 #include "MelissaLoopRangeComponent.h"
+#include "MelissaSnapIndex.h"
 
 namespace
 {
 constexpr int kEdgeWidth = 4;
+
+// Snapping while dragging reaches this far, but never farther than the default range
+constexpr float kSnapRangePixels = 8.f;
 };
 
 MelissaLoopRangeComponent::MelissaLoopRangeComponent() :
+visibleStartRatio_(0.0), visibleEndRatio_(1.0),
 aRatio_(0.f), bRatio_(1.f),
 mouseClickXRatio_(0.f),
 mouseOnLoopStartEdge_(false), mouseOnLoopEndEdge_(false),
@@ -23,13 +28,18 @@ mouseStatus_(kMouseStatus_None)
     model_->addListener(this);
 }
 
+void MelissaLoopRangeComponent::setVisibleRange(double startRatio, double endRatio)
+{
+    visibleStartRatio_ = startRatio;
+    visibleEndRatio_ = endRatio;
+    repaint();
+}
+
 void MelissaLoopRangeComponent::paint(Graphics& g)
 {
-    const auto width = getWidth();
-    
-    auto rect = getLocalBounds();
-    rect.setX(aRatio_ * width);
-    rect.setWidth((bRatio_ - aRatio_) * width);
+    auto rect = getLocalBounds().toFloat();
+    rect.setLeft(getXOnRatio(aRatio_));
+    rect.setRight(getXOnRatio(bRatio_));
     
     g.setColour(MelissaUISettings::getAccentColour(0.2f));
     g.fillRect(rect);
@@ -52,7 +62,7 @@ void MelissaLoopRangeComponent::loopPosChanged(float aTimeMSec, float aRatio, fl
 
 void MelissaLoopRangeComponent::mouseDown(float xRatio, bool isLeft)
 {
-    const auto mousePoint = juce::Point<float>(xRatio * getWidth(), 0);
+    const auto mousePoint = juce::Point<float>(getXOnRatio(xRatio), 0);
     mouseOnLoopStartEdge_ = getLoopStartEdgeRect().contains(mousePoint);
     mouseOnLoopEndEdge_   = getLoopEndEdgeRect().contains(mousePoint);
     
@@ -84,7 +94,7 @@ void MelissaLoopRangeComponent::mouseUp(float xRatio)
 
 void MelissaLoopRangeComponent::mouseMove(float xRatio)
 {
-    const auto mousePoint = juce::Point<float>(xRatio * getWidth(), 0);
+    const auto mousePoint = juce::Point<float>(getXOnRatio(xRatio), 0);
     mouseOnLoopStartEdge_ = getLoopStartEdgeRect().contains(mousePoint);
     mouseOnLoopEndEdge_   = getLoopEndEdgeRect().contains(mousePoint);
     
@@ -93,7 +103,7 @@ void MelissaLoopRangeComponent::mouseMove(float xRatio)
 
 void MelissaLoopRangeComponent::mouseDrag(float xRatio)
 {
-    const auto mousePosRatio = std::clamp(xRatio, 0.f, 1.f);
+    const auto mousePosRatio = snapRatio(std::clamp(xRatio, 0.f, 1.f));
     
     if (mouseStatus_ == kMouseStatus_Range)
     {
@@ -146,17 +156,17 @@ void MelissaLoopRangeComponent::mouseDrag(float xRatio)
             mouseStatus_ = kMouseStatus_DraggingStart;
         }
     }
-    else if (abs(mouseClickXRatio_ - xRatio) * getWidth() > 4)
+    else if (abs(getXOnRatio(mouseClickXRatio_) - getXOnRatio(xRatio)) > 4)
     {
         mouseStatus_ = kMouseStatus_Range;
         if (xRatio >= mouseClickXRatio_)
         {
-            aRatio_ = mouseClickXRatio_;
+            aRatio_ = snapRatio(mouseClickXRatio_);
             draggingLoopStart_ = true;
         }
         else
         {
-            bRatio_ = mouseClickXRatio_;
+            bRatio_ = snapRatio(mouseClickXRatio_);
             draggingLoopStart_ = false;
         }
 
@@ -167,18 +177,29 @@ void MelissaLoopRangeComponent::mouseDrag(float xRatio)
 
 Rectangle<float> MelissaLoopRangeComponent::getLoopStartEdgeRect() const
 {
-    const auto width = getWidth();
-    auto rect = getLocalBounds();
+    auto rect = getLocalBounds().toFloat();
     auto leftEdge = rect.withWidth(kEdgeWidth);
-    leftEdge.setX(aRatio_ * width);
-    return leftEdge.toFloat();
+    leftEdge.setX(getXOnRatio(aRatio_));
+    return leftEdge;
 }
 
 Rectangle<float> MelissaLoopRangeComponent::getLoopEndEdgeRect() const
 {
-    const auto width = getWidth();
-    auto rect = getLocalBounds();
+    auto rect = getLocalBounds().toFloat();
     auto rightEdge = rect.withWidth(kEdgeWidth);
-    rightEdge.setX(bRatio_ * width - kEdgeWidth);
-    return rightEdge.toFloat();
+    rightEdge.setX(getXOnRatio(bRatio_) - kEdgeWidth);
+    return rightEdge;
+}
+
+float MelissaLoopRangeComponent::snapRatio(float ratio) const
+{
+    if (getWidth() == 0) return ratio;
+    
+    const float rangeMSec = static_cast<float>(kSnapRangePixels * (visibleEndRatio_ - visibleStartRatio_) / getWidth() * model_->getLengthMSec());
+    return MelissaSnapIndex::getInstance()->snapRatio(ratio, std::min(rangeMSec, MelissaSnapIndex::kDefaultSnapRangeMSec));
+}
+
+float MelissaLoopRangeComponent::getXOnRatio(float ratio) const
+{
+    return static_cast<float>((ratio - visibleStartRatio_) / (visibleEndRatio_ - visibleStartRatio_) * getWidth());
 }
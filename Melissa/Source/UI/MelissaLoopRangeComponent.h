@@ -21,6 +21,8 @@ class MelissaLoopRangeComponent : public Component,
 public:
     MelissaLoopRangeComponent();
     
+    void setVisibleRange(double startRatio, double endRatio);
+    
 private:
     // Component
     void paint(Graphics& g) override;
@@ -36,8 +38,11 @@ private:
     
     Rectangle<float> getLoopStartEdgeRect() const;
     Rectangle<float> getLoopEndEdgeRect() const;
+    float getXOnRatio(float ratio) const;
+    float snapRatio(float ratio) const;
     
     MelissaModel* model_;
+    double visibleStartRatio_, visibleEndRatio_;
     float aRatio_, bRatio_;
     float mouseClickXRatio_;
     bool mouseOnLoopStartEdge_, mouseOnLoopEndEdge_;
@@ -8,6 +8,13 @@
 #include <numeric>
 #include "MelissaDoubleClickEditLabel.h"
 #include "MelissaMarkerListBox.h"
+#include "MelissaStructure.h"
+
+enum
+{
+    kMenuId_Remove = 1,
+    kMenuId_AddSuggestedMarkers,
+};
 
 class MarkerColourLabel : public Component
 {
@@ -192,22 +199,34 @@ void MelissaMarkerListBox::cellClicked(int rowNumber, int columnId, const MouseE
     selectRow(rowNumber);
     if (e.mods.isRightButtonDown())
     {
-        enum
-        {
-            kMenuId_Remove = 1,
-        };
         popupMenu_->clear();
         popupMenu_->addItem(kMenuId_Remove, TRANS("remove"), true);
+        popupMenu_->addItem(kMenuId_AddSuggestedMarkers, TRANS("add_suggested_markers"), !MelissaStructure::getInstance()->getSections().empty());
         
         popupMenu_->showMenuAsync(PopupMenu::Options(), [&, rowNumber](int result) {
             if (result == kMenuId_Remove)
             {
                 dataSource_->removeMarker(rowNumber);
             }
+            else if (result == kMenuId_AddSuggestedMarkers)
+            {
+                addSuggestedMarkers();
+            }
         });
     }
 }
 
+void MelissaMarkerListBox::backgroundClicked(const MouseEvent& e)
+{
+    if (!e.mods.isRightButtonDown()) return;
+    
+    popupMenu_->clear();
+    popupMenu_->addItem(kMenuId_AddSuggestedMarkers, TRANS("add_suggested_markers"), !MelissaStructure::getInstance()->getSections().empty());
+    popupMenu_->showMenuAsync(PopupMenu::Options(), [&](int result) {
+        if (result == kMenuId_AddSuggestedMarkers) addSuggestedMarkers();
+    });
+}
+
 void MelissaMarkerListBox::cellDoubleClicked(int rowNumber, int columnId, const MouseEvent& e)
 {
 }
@@ -221,6 +240,22 @@ void MelissaMarkerListBox::labelTextChanged(Label* label)
     dataSource_->overwriteMarker(rowIndex, markers_[rowIndex]);
 }
 
+void MelissaMarkerListBox::addSuggestedMarkers()
+{
+    // Sections which sound alike share the colour
+    for (auto&& section : MelissaStructure::getInstance()->getSections())
+    {
+        MelissaDataSource::Song::Marker marker;
+        marker.position_ = section.startRatio_;
+        const Colour colour = Colour::fromRGB(255, 160, 160).withHue(std::fmod(section.group_ * 0.618f, 1.f));
+        marker.colourR_ = colour.getRed();
+        marker.colourG_ = colour.getGreen();
+        marker.colourB_ = colour.getBlue();
+        marker.memo_ = section.name_;
+        dataSource_->addMarker(marker);
+    }
+}
+
 void MelissaMarkerListBox::songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate)
 {
     totalLengthMSec_ = static_cast<float>(bufferLength) / sampleRate * 1000.f;
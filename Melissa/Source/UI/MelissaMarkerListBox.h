@@ -40,6 +40,7 @@ public:
     int  getColumnAutoSizeWidth(int columnId) override;
     void cellClicked(int rowNumber, int columnId, const MouseEvent& e) override;
     void cellDoubleClicked(int rowNumber, int columnId, const MouseEvent& e) override;
+    void backgroundClicked(const MouseEvent& e) override;
     
     // Label
     void labelTextChanged(Label* label) override;
@@ -49,6 +50,8 @@ public:
     void markerUpdated() override;
     
 private:
+    void addSuggestedMarkers();
+    
     MelissaLookAndFeel_SimpleTextEditor laf_;
     MelissaDataSource* dataSource_;
     std::vector<MelissaDataSource::Song::Marker> markers_;
@@ -8,6 +8,14 @@
 #include <numeric>
 #include "MelissaDoubleClickEditLabel.h"
 #include "MelissaPracticeTableListBox.h"
+#include "MelissaStructure.h"
+
+enum
+{
+    kMenuId_Remove = 1,
+    kMenuId_Overwrite,
+    kMenuId_AddSuggestedSections,
+};
 
 class LoopRangeComponent : public Component
 {
@@ -182,14 +190,10 @@ void MelissaPracticeTableListBox::cellClicked(int rowNumber, int columnId, const
     selectRow(rowNumber);
     if (e.mods.isRightButtonDown())
     {
-        enum
-        {
-            kMenuId_Remove = 1,
-            kMenuId_Overwrite,
-        };
         popupMenu_->clear();
         popupMenu_->addItem(kMenuId_Remove, TRANS("remove"), true);
         popupMenu_->addItem(kMenuId_Overwrite, TRANS("overwrite"), true);
+        popupMenu_->addItem(kMenuId_AddSuggestedSections, TRANS("add_suggested_practice_list"), !MelissaStructure::getInstance()->getSections().empty());
         
         popupMenu_->showMenuAsync(PopupMenu::Options(), [&, rowNumber](int result) {
             if (result == kMenuId_Remove)
@@ -200,6 +204,10 @@ void MelissaPracticeTableListBox::cellClicked(int rowNumber, int columnId, const
             {
                 dataSource_->overwritePracticeList(rowNumber, practiceList_[rowNumber].name_);
             }
+            else if (result == kMenuId_AddSuggestedSections)
+            {
+                addSuggestedSections();
+            }
         });
 
 
@@ -223,6 +231,25 @@ void MelissaPracticeTableListBox::cellDoubleClicked(int rowNumber, int columnId,
 #endif
 }
 
+void MelissaPracticeTableListBox::backgroundClicked(const MouseEvent& e)
+{
+    if (!e.mods.isRightButtonDown()) return;
+    
+    popupMenu_->clear();
+    popupMenu_->addItem(kMenuId_AddSuggestedSections, TRANS("add_suggested_practice_list"), !MelissaStructure::getInstance()->getSections().empty());
+    popupMenu_->showMenuAsync(PopupMenu::Options(), [&](int result) {
+        if (result == kMenuId_AddSuggestedSections) addSuggestedSections();
+    });
+}
+
+void MelissaPracticeTableListBox::addSuggestedSections()
+{
+    for (auto&& section : MelissaStructure::getInstance()->getSections())
+    {
+        dataSource_->addPracticeList(section.name_, section.startRatio_, section.endRatio_);
+    }
+}
+
 void MelissaPracticeTableListBox::selectedRowsChanged(int row)
 {
     selectedRow_ = row;
@@ -40,6 +40,7 @@ public:
     int  getColumnAutoSizeWidth(int columnId) override;
     void cellClicked(int rowNumber, int columnId, const MouseEvent& e) override;
     void cellDoubleClicked(int rowNumber, int columnId, const MouseEvent& e) override;
+    void backgroundClicked(const MouseEvent& e) override;
     void selectedRowsChanged(int row) override;
 
     
@@ -53,6 +54,8 @@ public:
     void moveSelected(int direction);
     
 private:
+    void addSuggestedSections();
+    
     MelissaLookAndFeel_SimpleTextEditor laf_;
     MelissaDataSource* dataSource_;
     std::vector<MelissaDataSource::Song::PracticeList> practiceList_;
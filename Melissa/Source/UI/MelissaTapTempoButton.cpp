@@ -5,6 +5,7 @@
 //  Copyright(c) 2020 Masaki Ono
 //
 
+#include "MelissaDataSource.h"
 #include "MelissaDefinitions.h"
 #include "MelissaModel.h"
 #include "MelissaTapTempoButton.h"
@@ -81,6 +82,7 @@ void MelissaTapTempoButton::mouseDown(const MouseEvent& event)
         
         float estimatedBpm = std::round(estimateBpm(measuredBpms_));
         if (shouldCorrect_) estimatedBpm /= speed;
+        MelissaDataSource::getInstance()->setBeats({});
         model->setBpm(static_cast<int>(estimatedBpm));
         startTimer(static_cast<int>(intervalMSec * 2));
     }
@@ -5,14 +5,18 @@
 //  Copyright(c) 2020 Masaki Ono
 //
 
+#include "MelissaAnalysisPipeline.h"
+#include "MelissaPitchContour.h"
+#include "MelissaSnapIndex.h"
+#include "MelissaSpectrogram.h"
+#include "MelissaStemProvider.h"
 #include "MelissaUISettings.h"
 #include "MelissaUtility.h"
 #include "MelissaWaveformControlComponent.h"
 
 class MelissaWaveformControlComponent::WaveformView : public Component,
                                                       public MelissaModelListener,
-                                                      public MelissaWaveformMouseEventListener,
-                                                      public Timer
+                                                      public MelissaWaveformMouseEventListener
 {
 public:
     WaveformView(MelissaWaveformControlComponent* parent) :
@@ -20,7 +24,13 @@ public:
     numOfStrip_(0),
     clickedStripIndex_(-1), loopAStripIndex_(-1), loopBStripIndex_(-1),
     currentMouseOnStripIndex_(-1),
-    playingPosRatio_(-1.f), loopAPosRatio_(0.f), loopBPosRatio_(1.f)
+    playingPosRatio_(-1.f), loopAPosRatio_(0.f), loopBPosRatio_(1.f),
+    visibleStartRatio_(0.0), visibleEndRatio_(1.0),
+    gridStartRatio_(0.0), stripLengthRatio_(0.0),
+    previewMax_(0.f),
+    isDetailed_(false),
+    isImageValid_(false),
+    imageScale_(1.f)
     {
         MelissaModel::getInstance()->addListener(this);
         
@@ -32,30 +42,33 @@ public:
     
     void resized() override
     {
+        previewMax_ = 0.f;
         update();
     }
     
     void paint(Graphics& g) override
     {
-        Colour colour = MelissaUISettings::getWaveformColour();
-        for (size_t iStrip = 0; iStrip < numOfStrip_; ++iStrip)
+        // The waveform is rendered only when something other than the playhead has changed
+        const float scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+        const Colour colour = MelissaUISettings::getWaveformColour();
+        if (!isImageValid_ || imageScale_ != scale || imageColour_ != colour)
         {
-            const int32_t height = previewBuffer_[iStrip] * getHeight();
-            const int32_t x = static_cast<int32_t>((waveformStripWidth_ + waveformStripInterval_) * iStrip);
-            
-            if (iStrip == static_cast<size_t>(playingPosRatio_ * numOfStrip_))
-            {
-                g.setColour(colour.withAlpha(1.f));
-            }
-            else if (loopAStripIndex_ != -1 && loopAStripIndex_ <= iStrip && iStrip <= loopBStripIndex_)
-            {
-                g.setColour(colour.withAlpha(0.6f));
-            }
-            else
-            {
-                g.setColour(colour.withAlpha(0.4f));
-            }
-            g.fillRect(x, getHeight() - height, waveformStripWidth_, height);
+            renderImage(scale, colour);
+        }
+        g.drawImageTransformed(image_, AffineTransform::scale(1.f / imageScale_).translated(static_cast<float>(-getScrollOffsetX()), 0.f));
+        
+        // Playhead
+        const auto playheadRect = getPlayheadRect(playingPosRatio_);
+        if (!g.clipRegionIntersects(playheadRect)) return;
+        g.setColour(colour);
+        if (isDetailed_)
+        {
+            g.fillRect(playheadRect);
+        }
+        else
+        {
+            const int32_t height = previewBuffer_[getStripIndexOnRatio(playingPosRatio_)] * getHeight();
+            g.fillRect(playheadRect.withTop(getHeight() - height));
         }
     }
     
@@ -79,100 +92,308 @@ public:
     {
         parent_->showTimeTooltip(xRatio);
         
+        const int32_t strip = getStripIndexOnRatio(xRatio);
+        if (isDetailed_ || strip < 0 || static_cast<int32_t>(previewBuffer_.size()) <= strip)
+        {
+            current_->setVisible(false);
+            return;
+        }
+        
         current_->setVisible(true);
-        size_t strip = static_cast<float>(xRatio * getWidth() / (waveformStripWidth_ + waveformStripInterval_));
         const int32_t height = previewBuffer_[strip] * getHeight();
-        const int32_t x = static_cast<int32_t>((waveformStripWidth_ + waveformStripInterval_) * strip);
-        current_->setBounds(x, getHeight() - height, waveformStripWidth_, height);
+        current_->setBounds(getStripX(strip), getHeight() - height, waveformStripWidth_, height);
     }
     
-    void timerCallback() override
+    void setPeaks(std::shared_ptr<MelissaWaveformPeaks> peaks)
     {
-        stopTimer();
-        update_();
+        peaks_ = peaks;
+        previewMax_ = 0.f;
+        update();
     }
     
-    void update(bool immediately = false)
+    void setVisibleRange(double startRatio, double endRatio)
     {
-        stopTimer();
-        
-        numOfStrip_ = static_cast<float>(getWidth() / (waveformStripWidth_ + waveformStripInterval_));
-        previewBuffer_.resize(numOfStrip_);
-        loopAStripIndex_ = loopAPosRatio_ * numOfStrip_;
-        loopBStripIndex_ = loopBPosRatio_ * numOfStrip_;
-        
-        if (immediately)
+        // Scrolling without zooming (e.g. following the playhead) moves the strips already rendered
+        const double length = visibleEndRatio_ - visibleStartRatio_;
+        const bool isScroll = !isDetailed_ && 0.f < previewMax_ && std::abs((endRatio - startRatio) - length) <= length * 1e-9;
+        visibleStartRatio_ = startRatio;
+        visibleEndRatio_ = endRatio;
+        if (isScroll)
         {
-            stopTimer();
-            update_();
+            scroll();
         }
         else
         {
-            startTimer(1000); // 1 sec delay
+            update();
         }
     }
     
-    void update_()
+    void update()
     {
-        auto dataSource = MelissaDataSource::getInstance();
-        const size_t bufferLength = dataSource->getBufferLength();
+        isImageValid_ = false;
+        numOfStrip_ = static_cast<float>(getWidth() / (waveformStripWidth_ + waveformStripInterval_));
+        gridStartRatio_ = visibleStartRatio_;
+        stripLengthRatio_ = (0 < numOfStrip_) ? (visibleEndRatio_ - visibleStartRatio_) / numOfStrip_ : 0.0;
+        
+        // Two more strips than fit in the view: the rest of the width, and the strip partly scrolled out on the left
+        previewBuffer_.resize(0 < numOfStrip_ ? numOfStrip_ + 2 : 0);
+        loopAStripIndex_ = getStripIndexOnRatio(loopAPosRatio_);
+        loopBStripIndex_ = getStripIndexOnRatio(loopBPosRatio_);
+        std::fill(previewBuffer_.begin(), previewBuffer_.end(), 0.f);
+        isDetailed_ = false;
         
-        if (numOfStrip_ <= 0 || bufferLength == 0 || previewBuffer_.size() == 0) return;
+        // The peaks are built in the background, so this only costs a few bin lookups per strip
+        if (numOfStrip_ <= 0 || peaks_ == nullptr)
+        {
+            repaint();
+            return;
+        }
         
-        float preview, previewMax = 0.f;
-        for (int32_t iStrip = 0; iStrip < numOfStrip_; ++iStrip)
+        const size_t bufferLength = peaks_->getLengthInSamples();
+        if (previewMax_ <= 0.f)
         {
-            preview = 0.f;
-            for (int32_t iBuffer = 0; iBuffer < bufferLength / numOfStrip_; ++iBuffer)
+            // Normalize with the whole song so that the level doesn't change while zooming
+            for (size_t iStrip = 0; iStrip < numOfStrip_; ++iStrip)
             {
-                const size_t bufIndex = iStrip * (bufferLength / numOfStrip_) + iBuffer;
-                if (bufIndex >= bufferLength) break;
-                const auto l = dataSource->readBuffer(0, bufIndex, kStemType_All);
-                const auto r = dataSource->readBuffer(1, bufIndex, kStemType_All);
-                preview += (l * l + r * r);
+                const float preview = peaks_->getBin(bufferLength * iStrip / numOfStrip_, bufferLength * (iStrip + 1) / numOfStrip_).meanSquare_;
+                previewMax_ = std::max(previewMax_, std::min(preview, 1.f));
             }
-            preview /= (bufferLength / numOfStrip_);
-            if (preview >= 1.f) preview = 1.f;
-            if (previewMax < preview) previewMax = preview;
-            previewBuffer_[iStrip] = preview;
         }
         
-        // normalize
-        for (int iPreviewBuffer = 0; iPreviewBuffer < previewBuffer_.size(); ++iPreviewBuffer)
+        const size_t startIndex = static_cast<size_t>(visibleStartRatio_ * bufferLength);
+        const size_t endIndex = std::min(static_cast<size_t>(std::ceil(visibleEndRatio_ * bufferLength)), bufferLength);
+        if (endIndex <= startIndex)
+        {
+            repaint();
+            return;
+        }
+        
+        // Closer than the finest bins, the samples themselves are drawn
+        const size_t visibleLength = endIndex - startIndex;
+        if (visibleLength < MelissaWaveformPeaks::kBinSizes[0] * numOfStrip_)
+        {
+            isDetailed_ = true;
+            detailBuffer_.setSize(2, static_cast<int>(visibleLength), false, false, true);
+            MelissaDataSource::getInstance()->readBufferBlock(detailBuffer_, startIndex, kStemType_All);
+            current_->setVisible(false);
+            repaint();
+            return;
+        }
+        
+        for (size_t iStrip = 0; iStrip < previewBuffer_.size(); ++iStrip) previewBuffer_[iStrip] = getPreview(iStrip);
+        
+        repaint();
+    }
+    
+    // The strips are on a grid which moves by whole strips, and the image is translated by the rest.
+    // Only the strips scrolled in are looked up and rendered.
+    void scroll()
+    {
+        const int numOfStripsInBuffer = static_cast<int>(previewBuffer_.size());
+        const int numOfShiftedStrips = static_cast<int>(std::floor((visibleStartRatio_ - gridStartRatio_) / stripLengthRatio_));
+        const int stripPitch = waveformStripWidth_ + waveformStripInterval_;
+        const float shiftInPixels = numOfShiftedStrips * stripPitch * imageScale_;
+        if (numOfStripsInBuffer <= std::abs(numOfShiftedStrips) || shiftInPixels != std::round(shiftInPixels))
+        {
+            update();
+            return;
+        }
+        if (numOfShiftedStrips == 0)
+        {
+            repaint();
+            return;
+        }
+        
+        gridStartRatio_ += stripLengthRatio_ * numOfShiftedStrips;
+        loopAStripIndex_ = getStripIndexOnRatio(loopAPosRatio_);
+        loopBStripIndex_ = getStripIndexOnRatio(loopBPosRatio_);
+        
+        int firstNewStrip = 0, endOfNewStrips = 0;
+        if (0 < numOfShiftedStrips)
+        {
+            std::move(previewBuffer_.begin() + numOfShiftedStrips, previewBuffer_.end(), previewBuffer_.begin());
+            firstNewStrip = numOfStripsInBuffer - numOfShiftedStrips;
+            endOfNewStrips = numOfStripsInBuffer;
+        }
+        else
         {
-            previewBuffer_[iPreviewBuffer] /= previewMax;
+            std::move_backward(previewBuffer_.begin(), previewBuffer_.end() + numOfShiftedStrips, previewBuffer_.end());
+            endOfNewStrips = -numOfShiftedStrips;
         }
+        for (int iStrip = firstNewStrip; iStrip < endOfNewStrips; ++iStrip) previewBuffer_[iStrip] = getPreview(iStrip);
         
+        if (isImageValid_)
+        {
+            const int shift = static_cast<int>(shiftInPixels);
+            const int width = image_.getWidth() - std::abs(shift);
+            image_.moveImageSection(std::max(-shift, 0), 0, std::max(shift, 0), 0, width, image_.getHeight());
+            
+            image_.clear({ roundToInt(firstNewStrip * stripPitch * imageScale_), 0, roundToInt((endOfNewStrips - firstNewStrip) * stripPitch * imageScale_), image_.getHeight() });
+            
+            Graphics g(image_);
+            g.addTransform(AffineTransform::scale(imageScale_));
+            paintStrips(g, imageColour_, firstNewStrip, endOfNewStrips);
+        }
         repaint();
     }
     
     void setPlayPosition(float ratio)
     {
         if (playingPosRatio_ == ratio) return;
+        
+        // Only the old and the new playhead are repainted
+        const auto prevRect = getPlayheadRect(playingPosRatio_);
         playingPosRatio_ = ratio;
-        repaint();
+        const auto rect = getPlayheadRect(playingPosRatio_);
+        if (rect == prevRect) return;
+        repaint(prevRect);
+        repaint(rect);
     }
     
     void setAPosition(float ratio)
     {
         loopAPosRatio_ = ratio;
-        loopAStripIndex_ = ratio * numOfStrip_;
+        loopAStripIndex_ = getStripIndexOnRatio(ratio);
+        isImageValid_ = false;
         repaint();
     }
     
     void setBPosition(float ratio)
     {
         loopBPosRatio_ = ratio;
-        loopBStripIndex_ = ratio * numOfStrip_;
+        loopBStripIndex_ = getStripIndexOnRatio(ratio);
+        isImageValid_ = false;
         repaint();
     }
     
 private:
+    void renderImage(float scale, const Colour& colour)
+    {
+        const int width = isDetailed_ ? getWidth() : std::max(getWidth(), static_cast<int>(previewBuffer_.size()) * (waveformStripWidth_ + waveformStripInterval_));
+        image_ = Image(Image::ARGB, std::max(roundToInt(width * scale), 1), std::max(roundToInt(getHeight() * scale), 1), true);
+        imageScale_ = scale;
+        imageColour_ = colour;
+        isImageValid_ = true;
+        
+        Graphics g(image_);
+        g.addTransform(AffineTransform::scale(scale));
+        if (isDetailed_)
+        {
+            paintSamples(g);
+            return;
+        }
+        paintStrips(g, colour, 0, static_cast<int32_t>(previewBuffer_.size()));
+    }
+    
+    // The strips are painted at their grid positions, the image is translated on paint()
+    void paintStrips(Graphics& g, const Colour& colour, int32_t firstStrip, int32_t endOfStrips)
+    {
+        for (int32_t iStrip = firstStrip; iStrip < endOfStrips; ++iStrip)
+        {
+            const int32_t height = previewBuffer_[iStrip] * getHeight();
+            const int32_t x = static_cast<int32_t>((waveformStripWidth_ + waveformStripInterval_) * iStrip);
+            
+            if (loopAStripIndex_ <= iStrip && iStrip <= loopBStripIndex_)
+            {
+                g.setColour(colour.withAlpha(0.6f));
+            }
+            else
+            {
+                g.setColour(colour.withAlpha(0.4f));
+            }
+            g.fillRect(x, getHeight() - height, waveformStripWidth_, height);
+        }
+    }
+    
     int32_t getStripIndexOnX(float x)
     {
         return x / (waveformStripWidth_ + waveformStripInterval_);
     }
     
+    int32_t getStripIndexOnRatio(double ratio) const
+    {
+        if (stripLengthRatio_ <= 0.0) return -1;
+        return static_cast<int32_t>(std::floor((ratio - gridStartRatio_) / stripLengthRatio_));
+    }
+    
+    // How far the strip grid is scrolled out on the left
+    int getScrollOffsetX() const
+    {
+        if (isDetailed_ || stripLengthRatio_ <= 0.0) return 0;
+        return roundToInt((visibleStartRatio_ - gridStartRatio_) / stripLengthRatio_ * (waveformStripWidth_ + waveformStripInterval_));
+    }
+    
+    int getStripX(int32_t strip) const
+    {
+        return (waveformStripWidth_ + waveformStripInterval_) * strip - getScrollOffsetX();
+    }
+    
+    float getPreview(size_t strip) const
+    {
+        const size_t bufferLength = peaks_->getLengthInSamples();
+        const double startRatio = gridStartRatio_ + stripLengthRatio_ * strip;
+        const size_t startIndex = static_cast<size_t>(std::clamp(startRatio, 0.0, 1.0) * bufferLength);
+        const size_t endIndex = static_cast<size_t>(std::clamp(startRatio + stripLengthRatio_, 0.0, 1.0) * bufferLength);
+        if (endIndex <= startIndex || previewMax_ <= 0.f) return 0.f;
+        return std::min(peaks_->getBin(startIndex, endIndex).meanSquare_ / previewMax_, 1.f);
+    }
+    
+    Rectangle<int> getPlayheadRect(float ratio) const
+    {
+        if (isDetailed_)
+        {
+            const int x = static_cast<int>((ratio - visibleStartRatio_) / (visibleEndRatio_ - visibleStartRatio_) * getWidth());
+            return { x - 1, 0, 2, getHeight() };
+        }
+        
+        const int32_t strip = getStripIndexOnRatio(ratio);
+        if (strip < 0 || static_cast<int32_t>(previewBuffer_.size()) <= strip) return {};
+        return { getStripX(strip), 0, waveformStripWidth_, getHeight() };
+    }
+    
+    void paintSamples(Graphics& g)
+    {
+        const int numOfSamples = detailBuffer_.getNumSamples();
+        const int width = getWidth();
+        if (numOfSamples == 0 || width == 0) return;
+        
+        const float* l = detailBuffer_.getReadPointer(0);
+        const float* r = detailBuffer_.getReadPointer(1);
+        const float centerY = getHeight() / 2.f;
+        const double samplesPerPixel = static_cast<double>(numOfSamples) / width;
+        
+        g.setColour(MelissaUISettings::getWaveformColour().withAlpha(0.6f));
+        if (samplesPerPixel >= 1.0)
+        {
+            // min / max of the samples on each pixel
+            for (int x = 0; x < width; ++x)
+            {
+                const int startIndex = static_cast<int>(x * samplesPerPixel);
+                const int length = std::max(static_cast<int>((x + 1) * samplesPerPixel) - startIndex, 1);
+                const auto rangeL = FloatVectorOperations::findMinAndMax(l + startIndex, std::min(length, numOfSamples - startIndex));
+                const auto rangeR = FloatVectorOperations::findMinAndMax(r + startIndex, std::min(length, numOfSamples - startIndex));
+                const float top = centerY * (1.f - std::max(rangeL.getEnd(), rangeR.getEnd()));
+                const float bottom = centerY * (1.f - std::min(rangeL.getStart(), rangeR.getStart()));
+                g.fillRect(static_cast<float>(x), top, 1.f, std::max(bottom - top, 1.f));
+            }
+        }
+        else
+        {
+            // Fewer samples than pixels, connect each sample
+            const float pixelsPerSample = static_cast<float>(1.0 / samplesPerPixel);
+            Path path;
+            for (int sampleIndex = 0; sampleIndex < numOfSamples; ++sampleIndex)
+            {
+                const float x = (sampleIndex + 0.5f) * pixelsPerSample;
+                const float y = centerY * (1.f - (l[sampleIndex] + r[sampleIndex]) / 2.f);
+                if (sampleIndex == 0) path.startNewSubPath(x, y);
+                else path.lineTo(x, y);
+                if (pixelsPerSample >= 6.f) g.fillEllipse(x - 2.f, y - 2.f, 4.f, 4.f);
+            }
+            g.strokePath(path, PathStrokeType(1.f));
+        }
+    }
+    
     // MelissaModelListener
     void loopPosChanged(float aTimeMSec, float aRatio, float bTimeMSec, float bRatio) override
     {
@@ -187,7 +408,482 @@ private:
     int32_t clickedStripIndex_, loopAStripIndex_, loopBStripIndex_;
     int32_t currentMouseOnStripIndex_;
     float playingPosRatio_, loopAPosRatio_, loopBPosRatio_;
+    double visibleStartRatio_, visibleEndRatio_;
+    
+    // Start of strip 0, and the length of a strip (both in ratio of the song)
+    double gridStartRatio_, stripLengthRatio_;
     std::vector<float> previewBuffer_;
+    float previewMax_;
+    std::shared_ptr<MelissaWaveformPeaks> peaks_;
+    
+    // Used instead of previewBuffer_ when zoomed in to the samples
+    bool isDetailed_;
+    AudioSampleBuffer detailBuffer_;
+    
+    // Everything but the playhead
+    Image image_;
+    bool isImageValid_;
+    float imageScale_;
+    Colour imageColour_;
+};
+
+class MelissaWaveformControlComponent::SpectrogramView : public Component,
+                                                         public MelissaModelListener
+{
+public:
+    SpectrogramView();
+    ~SpectrogramView();
+    
+    void paint(Graphics& g) override;
+    
+    void setPlayPosition(float ratio)
+    {
+        if (playingPosRatio_ == ratio) return;
+        
+        const auto prevRect = getPlayheadRect(playingPosRatio_);
+        playingPosRatio_ = ratio;
+        const auto rect = getPlayheadRect(playingPosRatio_);
+        if (rect == prevRect) return;
+        repaint(prevRect);
+        repaint(rect);
+    }
+    
+    void setVisibleRange(double startRatio, double endRatio)
+    {
+        visibleStartRatio_ = startRatio;
+        visibleEndRatio_ = endRatio;
+        repaint();
+    }
+    
+    void songChanged()
+    {
+        ++songId_;
+        tiles_.clear();
+        repaint();
+    }
+    
+private:
+    static constexpr int kTileWidth = 128;
+    static constexpr int kNumOfLevels = 16;
+    static constexpr size_t kMinHopSize = 64;
+    static constexpr size_t kMaxNumOfTiles = 256;
+    
+    static size_t getHopSize(int level) { return kMinHopSize << level; }
+    
+    // part, level, index
+    typedef std::tuple<int, int, int64> TileKey;
+    struct Tile
+    {
+        Image image_;
+        uint64 lastDrawCount_;
+    };
+    
+    class TileRenderer;
+    
+    Rectangle<int> getPlayheadRect(float ratio) const
+    {
+        const int x = static_cast<int>((ratio - visibleStartRatio_) / (visibleEndRatio_ - visibleStartRatio_) * getWidth());
+        return { x - 1, 0, 2, getHeight() };
+    }
+    
+    void tileRendered(int songId, const TileKey& key, const Image& image)
+    {
+        if (songId != songId_) return;
+        
+        // Drop the tile drawn least recently
+        if (kMaxNumOfTiles <= tiles_.size())
+        {
+            auto oldest = std::min_element(tiles_.begin(), tiles_.end(), [](const auto& a, const auto& b) { return a.second.lastDrawCount_ < b.second.lastDrawCount_; });
+            tiles_.erase(oldest);
+        }
+        tiles_[key] = { image, drawCount_ };
+        repaint();
+    }
+    
+    // MelissaModelListener
+    void playPartChanged(StemType playPart) override
+    {
+        playPart_ = playPart;
+        repaint();
+    }
+    
+    float playingPosRatio_;
+    double visibleStartRatio_, visibleEndRatio_;
+    int playPart_;
+    int songId_;
+    std::map<TileKey, Tile> tiles_;
+    uint64 drawCount_;
+    std::unique_ptr<TileRenderer> renderer_;
+};
+
+class MelissaWaveformControlComponent::SpectrogramView::TileRenderer : public Thread
+{
+public:
+    TileRenderer(SpectrogramView* view) :
+    Thread("MelissaSpectrogramThread"),
+    view_(view),
+    songId_(0),
+    spectrogramSampleRate_(0.0)
+    {
+        startThread();
+    }
+    
+    ~TileRenderer()
+    {
+        signalThreadShouldExit();
+        notify();
+        stopThread(4000);
+    }
+    
+    // Replaces the pending requests, so that only the tiles on the screen are rendered
+    void request(int songId, const std::vector<TileKey>& tiles)
+    {
+        const ScopedLock sl(lock_);
+        songId_ = songId;
+        requests_ = tiles;
+        if (!requests_.empty()) notify();
+    }
+    
+private:
+    void run() override
+    {
+        auto dataSource = MelissaDataSource::getInstance();
+        std::unique_ptr<MelissaSpectrogram> spectrogram;
+        float bands[MelissaSpectrogram::kNumOfBands];
+        
+        while (!threadShouldExit())
+        {
+            TileKey key;
+            int songId;
+            {
+                const ScopedLock sl(lock_);
+                if (requests_.empty())
+                {
+                    const ScopedUnlock sul(lock_);
+                    wait(-1);
+                    continue;
+                }
+                key = requests_.front();
+                requests_.erase(requests_.begin());
+                songId = songId_;
+            }
+            
+            const double sampleRate = dataSource->getSampleRate();
+            const size_t bufferLength = dataSource->getBufferLength();
+            if (sampleRate <= 0 || bufferLength == 0) continue;
+            if (spectrogram == nullptr || spectrogramSampleRate_ != sampleRate)
+            {
+                spectrogram = std::make_unique<MelissaSpectrogram>(sampleRate);
+                spectrogramSampleRate_ = sampleRate;
+            }
+            
+            const auto [part, level, tileIndex] = key;
+            const size_t hopSize = getHopSize(level);
+            const Colour colour = MelissaUISettings::getWaveformColour();
+            Image image(Image::ARGB, kTileWidth, MelissaSpectrogram::kNumOfBands, true, SoftwareImageType());
+            {
+                Image::BitmapData bitmap(image, Image::BitmapData::writeOnly);
+                for (int x = 0; x < kTileWidth; ++x)
+                {
+                    if (threadShouldExit()) return;
+                    
+                    const size_t centerIndex = (static_cast<size_t>(tileIndex) * kTileWidth + x) * hopSize + hopSize / 2;
+                    if (bufferLength <= centerIndex) break;
+                    
+                    spectrogram->compute(dataSource, static_cast<StemType>(part), centerIndex, bands);
+                    for (int bandIndex = 0; bandIndex < MelissaSpectrogram::kNumOfBands; ++bandIndex)
+                    {
+                        bitmap.setPixelColour(x, MelissaSpectrogram::kNumOfBands - 1 - bandIndex, colour.withAlpha(bands[bandIndex]));
+                    }
+                }
+            }
+            
+            auto view = view_;
+            MessageManager::callAsync([view, songId, key, image]() {
+                if (view != nullptr) view->tileRendered(songId, key, image);
+            });
+        }
+    }
+    
+    Component::SafePointer<SpectrogramView> view_;
+    CriticalSection lock_;
+    int songId_;
+    std::vector<TileKey> requests_;
+    double spectrogramSampleRate_;
+};
+
+MelissaWaveformControlComponent::SpectrogramView::SpectrogramView() :
+playingPosRatio_(-1.f),
+visibleStartRatio_(0.0), visibleEndRatio_(1.0),
+playPart_(MelissaModel::getInstance()->getPlayPart()),
+songId_(0),
+drawCount_(0)
+{
+    MelissaModel::getInstance()->addListener(this);
+    renderer_ = std::make_unique<TileRenderer>(this);
+}
+
+MelissaWaveformControlComponent::SpectrogramView::~SpectrogramView()
+{
+    // The renderer thread refers to this view, so it is stopped first
+    renderer_ = nullptr;
+    MelissaModel::getInstance()->removeListener(this);
+}
+
+void MelissaWaveformControlComponent::SpectrogramView::paint(Graphics& g)
+{
+    const size_t bufferLength = MelissaDataSource::getInstance()->getBufferLength();
+    if (bufferLength == 0 || getWidth() == 0) return;
+    
+    // Use the level whose columns are not narrower than a pixel
+    const double startIndex = visibleStartRatio_ * bufferLength;
+    const double samplesPerPixel = (visibleEndRatio_ - visibleStartRatio_) * bufferLength / getWidth();
+    int level = 0;
+    while (level + 1 < kNumOfLevels && getHopSize(level + 1) <= samplesPerPixel) ++level;
+    const double tileLength = static_cast<double>(getHopSize(level)) * kTileWidth;
+    
+    // Only cached tiles are drawn here, the others are requested to the renderer
+    std::vector<TileKey> missingTiles;
+    g.setImageResamplingQuality(Graphics::lowResamplingQuality);
+    const int64 firstTile = static_cast<int64>(startIndex / tileLength);
+    const int64 lastTile = static_cast<int64>(std::ceil(std::min(startIndex + samplesPerPixel * getWidth(), static_cast<double>(bufferLength)) / tileLength));
+    for (int64 tileIndex = firstTile; tileIndex < lastTile; ++tileIndex)
+    {
+        const TileKey key { playPart_, level, tileIndex };
+        auto tile = tiles_.find(key);
+        if (tile == tiles_.end())
+        {
+            missingTiles.emplace_back(key);
+            continue;
+        }
+        
+        const float x0 = static_cast<float>((tileIndex * tileLength - startIndex) / samplesPerPixel);
+        const float x1 = static_cast<float>(((tileIndex + 1) * tileLength - startIndex) / samplesPerPixel);
+        g.drawImage(tile->second.image_, Rectangle<float>(x0, 0.f, x1 - x0, static_cast<float>(getHeight())), RectanglePlacement::stretchToFit);
+        tile->second.lastDrawCount_ = ++drawCount_;
+    }
+    renderer_->request(songId_, missingTiles);
+    
+    g.setColour(MelissaUISettings::getWaveformColour());
+    g.fillRect(getPlayheadRect(playingPosRatio_));
+}
+
+// Chord names along the top of the waveform, transposed by the pitch control
+class MelissaWaveformControlComponent::ChordView : public Component,
+                                                   public MelissaModelListener
+{
+public:
+    ChordView() :
+    visibleStartRatio_(0.0), visibleEndRatio_(1.0)
+    {
+        setInterceptsMouseClicks(false, false);
+        MelissaModel::getInstance()->addListener(this);
+    }
+    
+    ~ChordView()
+    {
+        MelissaModel::getInstance()->removeListener(this);
+    }
+    
+    void paint(Graphics& g) override
+    {
+        const float lengthMSec = MelissaModel::getInstance()->getLengthMSec();
+        if (harmony_ == nullptr || lengthMSec <= 0.f) return;
+        
+        const auto& chords = harmony_->getChords();
+        const float semitone = MelissaModel::getInstance()->getPitch();
+        const double visibleLength = visibleEndRatio_ - visibleStartRatio_;
+        auto getX = [&](float positionMSec) { return static_cast<float>((positionMSec / lengthMSec - visibleStartRatio_) / visibleLength * getWidth()); };
+        
+        g.setFont(MelissaDataSource::getInstance()->getFont(MelissaDataSource::Global::kFontSize_Small));
+        for (size_t chordIndex = 0; chordIndex < chords.size(); ++chordIndex)
+        {
+            const auto& chord = chords[chordIndex];
+            const float x0 = getX(chord.startMSec_);
+            const float x1 = (chordIndex + 1 < chords.size()) ? getX(chords[chordIndex + 1].startMSec_) : getX(lengthMSec);
+            if (chord.root_ == MelissaHarmony::kNoChord || x1 < 0.f || getWidth() < x0) continue;
+            
+            // Skipped where the chords change faster than their names fit
+            const String name = MelissaHarmony::getName(chord.root_, chord.isMinor_, semitone);
+            const float textWidth = static_cast<float>(MelissaUtility::getStringSize(g.getCurrentFont(), name).first);
+            if (x1 - x0 < textWidth + 6.f) continue;
+            
+            g.setColour(MelissaUISettings::getTextColour(0.3f));
+            g.fillRect(x0, 0.f, 1.f, static_cast<float>(getHeight()));
+            g.setColour(MelissaUISettings::getTextColour(0.8f));
+            g.drawText(name, Rectangle<float>(std::max(x0, 0.f) + 3.f, 0.f, textWidth + 2.f, static_cast<float>(getHeight())), Justification::centredLeft, false);
+        }
+    }
+    
+    void setHarmony(std::shared_ptr<MelissaHarmony> harmony)
+    {
+        harmony_ = harmony;
+        repaint();
+    }
+    
+    void setVisibleRange(double startRatio, double endRatio)
+    {
+        visibleStartRatio_ = startRatio;
+        visibleEndRatio_ = endRatio;
+        repaint();
+    }
+    
+private:
+    // MelissaModelListener
+    void pitchChanged(float semitone) override
+    {
+        repaint();
+    }
+    
+    std::shared_ptr<MelissaHarmony> harmony_;
+    double visibleStartRatio_, visibleEndRatio_;
+};
+
+// Notes of the melody of the vocals (or of the stem being played) as a piano roll over the waveform
+class MelissaWaveformControlComponent::MelodyView : public Component,
+                                                    public MelissaModelListener
+{
+public:
+    MelodyView() :
+    part_(kStemType_Vocals), visibleStartRatio_(0.0), visibleEndRatio_(1.0), minNote_(0), maxNote_(0)
+    {
+        setInterceptsMouseClicks(false, false);
+        MelissaModel::getInstance()->addListener(this);
+    }
+    
+    ~MelodyView()
+    {
+        MelissaModel::getInstance()->removeListener(this);
+    }
+    
+    void songChanged()
+    {
+        setContour(nullptr);
+        part_ = MelissaPitchContour::getMelodyPart(MelissaModel::getInstance()->getPlayPart());
+        requestContour();
+    }
+    
+    void paint(Graphics& g) override
+    {
+        const float lengthMSec = MelissaModel::getInstance()->getLengthMSec();
+        if (notes_.empty() || lengthMSec <= 0.f) return;
+        
+        const double visibleLength = visibleEndRatio_ - visibleStartRatio_;
+        auto getX = [&](float positionMSec) { return static_cast<float>((positionMSec / lengthMSec - visibleStartRatio_) / visibleLength * getWidth()); };
+        const float noteHeight = static_cast<float>(getHeight()) / (maxNote_ - minNote_ + 1);
+        auto getY = [&](int note) { return (maxNote_ - note) * noteHeight; };
+        
+        // A line and a name for each C, following the pitch control
+        const int semitone = static_cast<int>(std::round(MelissaModel::getInstance()->getPitch()));
+        g.setFont(MelissaDataSource::getInstance()->getFont(MelissaDataSource::Global::kFontSize_Small));
+        for (int note = minNote_; note <= maxNote_; ++note)
+        {
+            const int transposedNote = note + semitone;
+            if (transposedNote % 12 != 0) continue;
+            
+            g.setColour(MelissaUISettings::getTextColour(0.15f));
+            g.fillRect(0.f, getY(note) + noteHeight - 1.f, static_cast<float>(getWidth()), 1.f);
+            g.setColour(MelissaUISettings::getTextColour(0.5f));
+            g.drawText("C" + String(transposedNote / 12 - 1), Rectangle<float>(2.f, getY(note) + noteHeight - 14.f, 30.f, 14.f), Justification::centredLeft, false);
+        }
+        
+        g.setColour(MelissaUISettings::getAccentColour(0.8f));
+        for (auto&& note : notes_)
+        {
+            const float x0 = getX(note.startMSec_);
+            const float x1 = getX(note.endMSec_);
+            if (x1 < 0.f || getWidth() < x0) continue;
+            g.fillRoundedRectangle(x0, getY(note.note_), std::max(x1 - x0, 1.f), noteHeight, std::min(noteHeight / 2.f, 2.f));
+        }
+    }
+    
+    void setVisibleRange(double startRatio, double endRatio)
+    {
+        visibleStartRatio_ = startRatio;
+        visibleEndRatio_ = endRatio;
+        repaint();
+    }
+    
+private:
+    // MelissaModelListener
+    void playPartChanged(StemType playPart) override
+    {
+        const auto part = MelissaPitchContour::getMelodyPart(playPart);
+        if (part == part_) return;
+        
+        part_ = part;
+        setContour(nullptr);
+        requestContour();
+    }
+    
+    void pitchChanged(float semitone) override
+    {
+        repaint();
+    }
+    
+    void requestContour()
+    {
+        if (MelissaStemProvider::getInstance()->getStemProviderStatus() != kStemProviderStatus_Available) return;
+        
+        Component::SafePointer<MelodyView> safeThis(this);
+        MelissaAnalysisPipeline::getInstance()->request(std::make_shared<MelissaPitchContour::Builder>(part_, [safeThis](std::shared_ptr<MelissaPitchContour> contour) {
+            MessageManager::callAsync([safeThis, contour]() {
+                // Ignore the result for the previous song or part
+                if (safeThis == nullptr || contour->getPart() != safeThis->part_ || contour->getLengthInSamples() != MelissaDataSource::getInstance()->getBufferLength()) return;
+                safeThis->setContour(contour);
+            });
+        }));
+    }
+    
+    void setContour(std::shared_ptr<MelissaPitchContour> contour)
+    {
+        // Frames of the same semitone are joined into a note
+        notes_.clear();
+        if (contour != nullptr)
+        {
+            const auto& frameNotes = contour->getNotes();
+            const float frameMSec = contour->getFrameMSec();
+            for (size_t frameIndex = 0; frameIndex < frameNotes.size(); ++frameIndex)
+            {
+                if (frameNotes[frameIndex] == MelissaPitchContour::kUnvoiced) continue;
+                
+                const int note = static_cast<int>(std::round(frameNotes[frameIndex]));
+                const float startMSec = frameIndex * frameMSec;
+                if (!notes_.empty() && notes_.back().note_ == note && notes_.back().endMSec_ == startMSec)
+                {
+                    notes_.back().endMSec_ = startMSec + frameMSec;
+                }
+                else
+                {
+                    notes_.push_back({ startMSec, startMSec + frameMSec, note });
+                }
+            }
+        }
+        
+        // At least an octave is shown, centered on the range of the melody
+        if (!notes_.empty())
+        {
+            const auto range = std::minmax_element(notes_.begin(), notes_.end(), [](const Note& lhs, const Note& rhs) { return lhs.note_ < rhs.note_; });
+            minNote_ = range.first->note_ - 1;
+            maxNote_ = range.second->note_ + 1;
+            const int margin = std::max(12 - (maxNote_ - minNote_), 0);
+            minNote_ -= margin / 2;
+            maxNote_ += margin - margin / 2;
+        }
+        repaint();
+    }
+    
+    struct Note
+    {
+        float startMSec_;
+        float endMSec_;
+        int note_;
+    };
+    
+    StemType part_;
+    std::vector<Note> notes_;
+    double visibleStartRatio_, visibleEndRatio_;
+    int minNote_, maxNote_;
 };
 
 class MelissaWaveformControlComponent::Marker : public Button
@@ -260,6 +956,8 @@ private:
 };
 
 MelissaWaveformControlComponent::MelissaWaveformControlComponent() :
+visibleStartRatio_(0.0), visibleEndRatio_(1.0),
+followPlayhead_(true),
 timeSec_(0),
 listener_(nullptr)
 {
@@ -268,6 +966,15 @@ listener_(nullptr)
     waveformView_ = std::make_unique<WaveformView>(this);
     addAndMakeVisible(waveformView_.get());
     
+    spectrogramView_ = std::make_unique<SpectrogramView>();
+    addChildComponent(spectrogramView_.get());
+    
+    chordView_ = std::make_unique<ChordView>();
+    addAndMakeVisible(chordView_.get());
+    
+    melodyView_ = std::make_unique<MelodyView>();
+    addAndMakeVisible(melodyView_.get());
+    
     markerBaseComponent_ = std::make_unique<Component>();
     markerBaseComponent_->setInterceptsMouseClicks(false, true);
     addAndMakeVisible(markerBaseComponent_.get());
@@ -286,13 +993,29 @@ listener_(nullptr)
     posTooltip_->setJustificationType(Justification::centred);
     posTooltip_->setFont(MelissaDataSource::getInstance()->getFont(MelissaDataSource::Global::kFontSize_Small));
     addChildComponent(posTooltip_.get());
+    
+    spectrogramButton_ = std::make_unique<ToggleButton>(TRANS("spectrogram"));
+    spectrogramButton_->setLookAndFeel(&toggleButtonLaf_);
+    spectrogramButton_->setClickingTogglesState(true);
+    spectrogramButton_->onClick = [this]()
+    {
+        setViewMode(spectrogramButton_->getToggleState() ? kViewMode_Spectrogram : kViewMode_Waveform);
+    };
+    addAndMakeVisible(spectrogramButton_.get());
 }
 
-MelissaWaveformControlComponent::~MelissaWaveformControlComponent() {}
+MelissaWaveformControlComponent::~MelissaWaveformControlComponent()
+{
+    spectrogramButton_->setLookAndFeel(nullptr);
+}
 
 void MelissaWaveformControlComponent::resized()
 {
     waveformView_->setBounds(20, 20, getWidth() - 20 * 2, getHeight() - 40);
+    spectrogramView_->setBounds(waveformView_->getBounds());
+    chordView_->setBounds(waveformView_->getBounds().withHeight(16));
+    melodyView_->setBounds(waveformView_->getBounds().withTrimmedTop(16));
+    spectrogramButton_->setBounds(getWidth() - 100, getHeight() - 18, 100, 18);
     markerBaseComponent_->setBounds(0, 0, getWidth(), getHeight());
     
     loopRangeComponent_->setBounds(waveformView_->getBounds());
@@ -304,9 +1027,119 @@ void MelissaWaveformControlComponent::resized()
     arrangeTimeLabels();
 }
 
+void MelissaWaveformControlComponent::mouseWheelMove(const MouseEvent& event, const MouseWheelDetails& wheel)
+{
+    // Vertical wheel zooms around the mouse, horizontal wheel (or shift + wheel) scrolls
+    const double length = visibleEndRatio_ - visibleStartRatio_;
+    if (std::abs(wheel.deltaY) < std::abs(wheel.deltaX) || event.mods.isShiftDown())
+    {
+        const float delta = (wheel.deltaX != 0.f) ? wheel.deltaX : wheel.deltaY;
+        setVisibleRange(visibleStartRatio_ - delta * length, visibleEndRatio_ - delta * length);
+    }
+    else
+    {
+        const auto viewEvent = event.getEventRelativeTo(waveformView_.get());
+        zoom(std::pow(2.0, wheel.deltaY * 4.0), viewEvent.position.x / waveformView_->getWidth());
+    }
+    
+    const float playingPosRatio = MelissaModel::getInstance()->getPlayingPosRatio();
+    followPlayhead_ = (visibleStartRatio_ <= playingPosRatio && playingPosRatio <= visibleEndRatio_);
+}
+
+void MelissaWaveformControlComponent::mouseMagnify(const MouseEvent& event, float scaleFactor)
+{
+    const auto viewEvent = event.getEventRelativeTo(waveformView_.get());
+    zoom(scaleFactor, viewEvent.position.x / waveformView_->getWidth());
+}
+
 void MelissaWaveformControlComponent::setPlayPosition(float ratio)
 {
     waveformView_->setPlayPosition(ratio);
+    spectrogramView_->setPlayPosition(ratio);
+}
+
+void MelissaWaveformControlComponent::setViewMode(ViewMode viewMode)
+{
+    waveformView_->setVisible(viewMode == kViewMode_Waveform);
+    spectrogramView_->setVisible(viewMode == kViewMode_Spectrogram);
+    spectrogramButton_->setToggleState(viewMode == kViewMode_Spectrogram, dontSendNotification);
+}
+
+MelissaWaveformControlComponent::ViewMode MelissaWaveformControlComponent::getViewMode() const
+{
+    return spectrogramView_->isVisible() ? kViewMode_Spectrogram : kViewMode_Waveform;
+}
+
+void MelissaWaveformControlComponent::setVisibleRange(double startRatio, double endRatio)
+{
+    const double length = std::clamp(endRatio - startRatio, getMinVisibleLength(), 1.0);
+    startRatio = std::clamp(startRatio, 0.0, 1.0 - length);
+    endRatio = startRatio + length;
+    if (startRatio == visibleStartRatio_ && endRatio == visibleEndRatio_) return;
+    
+    visibleStartRatio_ = startRatio;
+    visibleEndRatio_ = endRatio;
+    waveformView_->setVisibleRange(startRatio, endRatio);
+    spectrogramView_->setVisibleRange(startRatio, endRatio);
+    chordView_->setVisibleRange(startRatio, endRatio);
+    melodyView_->setVisibleRange(startRatio, endRatio);
+    loopRangeComponent_->setVisibleRange(startRatio, endRatio);
+    mouseEventComponent_->setVisibleRange(startRatio, endRatio);
+    arrangeMarkers();
+    arrangeTimeLabels();
+    
+    // Following the playhead needs more frequent updates than setPlayPosition()
+    if (length < 1.0)
+    {
+        if (!isTimerRunning()) startTimerHz(60);
+    }
+    else
+    {
+        stopTimer();
+    }
+}
+
+void MelissaWaveformControlComponent::zoom(double scale, double anchorXRatio)
+{
+    anchorXRatio = std::clamp(anchorXRatio, 0.0, 1.0);
+    const double length = visibleEndRatio_ - visibleStartRatio_;
+    const double anchorRatio = visibleStartRatio_ + length * anchorXRatio;
+    const double newLength = std::clamp(length / scale, getMinVisibleLength(), 1.0);
+    setVisibleRange(anchorRatio - newLength * anchorXRatio, anchorRatio + newLength * (1.0 - anchorXRatio));
+}
+
+void MelissaWaveformControlComponent::timerCallback()
+{
+    auto model = MelissaModel::getInstance();
+    if (model->getPlaybackStatus() != kPlaybackStatus_Playing) return;
+    
+    const float playingPosRatio = model->getPlayingPosRatio();
+    setPlayPosition(playingPosRatio);
+    if (!followPlayhead_) return;
+    
+    // Scroll continuously once the playhead reaches the center, and jump when it leaves the view (e.g. looped back)
+    const double length = visibleEndRatio_ - visibleStartRatio_;
+    if (playingPosRatio < visibleStartRatio_ || visibleEndRatio_ < playingPosRatio)
+    {
+        setVisibleRange(playingPosRatio - length * 0.1, playingPosRatio + length * 0.9);
+    }
+    else if (visibleStartRatio_ + length * 0.5 < playingPosRatio)
+    {
+        setVisibleRange(playingPosRatio - length * 0.5, playingPosRatio + length * 0.5);
+    }
+}
+
+double MelissaWaveformControlComponent::getMinVisibleLength() const
+{
+    // Up to 8 px per sample
+    const size_t bufferLength = MelissaDataSource::getInstance()->getBufferLength();
+    if (bufferLength == 0) return 1.0;
+    return std::min(std::max(waveformView_->getWidth() / 8.0, 16.0) / bufferLength, 1.0);
+}
+
+int MelissaWaveformControlComponent::getXOnRatio(double ratio) const
+{
+    return waveformView_->getX() + static_cast<int>(waveformView_->getWidth() * (ratio - visibleStartRatio_) / (visibleEndRatio_ - visibleStartRatio_));
 }
 
 void MelissaWaveformControlComponent::showTimeTooltip(float posRatio)
@@ -314,7 +1147,7 @@ void MelissaWaveformControlComponent::showTimeTooltip(float posRatio)
     posTooltip_->setText(timeSec_ != 0 ? MelissaUtility::getFormattedTimeMSec(timeSec_ * posRatio * 1000) : "-:--.-", dontSendNotification);
     posTooltip_->setSize(MelissaUtility::getStringSize(posTooltip_->getFont(), posTooltip_->getText()).first, 20);
     
-    const int32_t x = waveformView_->getX() + waveformView_->getWidth() * posRatio  - posTooltip_->getWidth() / 2;
+    const int32_t x = getXOnRatio(posRatio) - posTooltip_->getWidth() / 2;
     if (x != posTooltip_->getX())
     {
         posTooltip_->setTopLeftPosition(x, getHeight() - posTooltip_->getHeight());
@@ -323,7 +1156,7 @@ void MelissaWaveformControlComponent::showTimeTooltip(float posRatio)
         {
             const auto x0 = posTooltip_->getX();
             const auto x1 = posTooltip_->getRight();
-            l->setVisible(x1 < l->getX() || l->getRight() < x0);
+            l->setVisible(isTimeLabelInView(l.get()) && (x1 < l->getX() || l->getRight() < x0));
         }
         posTooltip_->setVisible(true);
     }
@@ -332,13 +1165,24 @@ void MelissaWaveformControlComponent::showTimeTooltip(float posRatio)
 void MelissaWaveformControlComponent::hideTimeTooltip()
 {
     posTooltip_->setVisible(false);
-    for (auto&& l : timeLabels_) l->setVisible(true);
+    for (auto&& l : timeLabels_) l->setVisible(isTimeLabelInView(l.get()));
 }
 
 void MelissaWaveformControlComponent::songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate)
 {
     timeSec_ = static_cast<float>(bufferLength) / sampleRate;
-    waveformView_->update(true);
+    waveformView_->setPeaks(nullptr);
+    spectrogramView_->songChanged();
+    melodyView_->songChanged();
+    followPlayhead_ = true;
+    setVisibleRange(0.0, 1.0);
+    
+    Component::SafePointer<MelissaWaveformControlComponent> safeThis(this);
+    MelissaAnalysisPipeline::getInstance()->request(std::make_shared<MelissaWaveformPeaks::Builder>([safeThis](std::shared_ptr<MelissaWaveformPeaks> peaks) {
+        MessageManager::callAsync([safeThis, peaks]() {
+            if (safeThis != nullptr) safeThis->peaksBuilt(peaks);
+        });
+    }));
     
     timeLabels_.clear();
     auto createLabel = [this](const String& text)
@@ -366,6 +1210,18 @@ void MelissaWaveformControlComponent::songChanged(const String& filePath, size_t
     arrangeTimeLabels();
 }
 
+void MelissaWaveformControlComponent::peaksBuilt(std::shared_ptr<MelissaWaveformPeaks> peaks)
+{
+    // Ignore the result for the previous song
+    if (peaks->getLengthInSamples() != MelissaDataSource::getInstance()->getBufferLength()) return;
+    waveformView_->setPeaks(peaks);
+}
+
+void MelissaWaveformControlComponent::setHarmony(std::shared_ptr<MelissaHarmony> harmony)
+{
+    chordView_->setHarmony(harmony);
+}
+
 void MelissaWaveformControlComponent::markerUpdated()
 {
     std::vector<MelissaDataSource::Song::Marker> markers;
@@ -394,17 +1250,22 @@ void MelissaWaveformControlComponent::markerUpdated()
 
 void MelissaWaveformControlComponent::mouseDown(float xRatio, bool isLeft)
 {
-    if (isLeft) return;
+    if (isLeft)
+    {
+        followPlayhead_ = true;
+        return;
+    }
     
-    MelissaDataSource::getInstance()->addDefaultMarker(xRatio);
+    MelissaDataSource::getInstance()->addDefaultMarker(MelissaSnapIndex::getInstance()->snapRatio(xRatio));
 }
 
 void MelissaWaveformControlComponent::arrangeMarkers() const
 {
     for (auto&& m : markers_)
     {
-        const int x = waveformView_->getX() + waveformView_->getWidth() * m->getPosition();
+        const int x = getXOnRatio(m->getPosition());
         m->setBounds(x - 4, 0, 8, getHeight() - 20);
+        m->setVisible(visibleStartRatio_ <= m->getPosition() && m->getPosition() <= visibleEndRatio_);
     }
 }
 
@@ -413,7 +1274,7 @@ void MelissaWaveformControlComponent::arrangeTimeLabels() const
     int minuteIndex = 0;
     for (auto&& l : timeLabels_)
     {
-        int x = waveformView_->getX() + waveformView_->getWidth() * (minuteIndex * 60.f / timeSec_)  - l->getWidth() / 2;
+        int x = getXOnRatio(minuteIndex * 60.f / timeSec_) - l->getWidth() / 2;
         /*
         if (minuteIndex == timeLabels_.size() - 1)
         {
@@ -422,6 +1283,13 @@ void MelissaWaveformControlComponent::arrangeTimeLabels() const
          */
         
         l->setTopLeftPosition(x, getHeight() - l->getHeight());
+        l->setVisible(isTimeLabelInView(l.get()));
         ++minuteIndex;
     }
 }
+
+bool MelissaWaveformControlComponent::isTimeLabelInView(const Label* label) const
+{
+    const int x = label->getBounds().getCentreX();
+    return waveformView_->getX() <= x && x <= waveformView_->getRight() && !label->getBounds().intersects(spectrogramButton_->getBounds());
+}
@@ -9,26 +9,46 @@
 
 #include "../JuceLibraryCode/JuceHeader.h"
 #include "MelissaDataSource.h"
+#include "MelissaHarmony.h"
 #include "MelissaLabel.h"
+#include "MelissaLookAndFeel.h"
 #include "MelissaLoopRangeComponent.h"
 #include "MelissaMarkerListener.h"
 #include "MelissaModel.h"
 #include "MelissaWaveformMouseEventComponent.h"
+#include "MelissaWaveformPeaks.h"
 
 class MelissaWaveformControlComponent : public Component,
                                         public MelissaDataSourceListener,
-                                        public MelissaWaveformMouseEventListener
+                                        public MelissaWaveformMouseEventListener,
+                                        private Timer
 {
 public:
     MelissaWaveformControlComponent();
     virtual ~MelissaWaveformControlComponent();
     
+    enum ViewMode
+    {
+        kViewMode_Waveform,
+        kViewMode_Spectrogram,
+    };
+    
     void resized() override;
+    void mouseWheelMove(const MouseEvent& event, const MouseWheelDetails& wheel) override;
+    void mouseMagnify(const MouseEvent& event, float scaleFactor) override;
     
     void setPlayPosition(float ratio);
+    void setViewMode(ViewMode viewMode);
+    ViewMode getViewMode() const;
+    
+    // Zoom / scroll. The range is a part of the song in ratio
+    void setVisibleRange(double startRatio, double endRatio);
+    void zoom(double scale, double anchorXRatio);
+
     void showTimeTooltip(float posRatio);
     void hideTimeTooltip();
     void setMarkerListener(MelissaMarkerListener* listener) { listener_ = listener; }
+    void setHarmony(std::shared_ptr<MelissaHarmony> harmony);
     
     // MelissaDataSourceListener
     void songChanged(const String& filePath, size_t bufferLength, int32_t sampleRate) override;
@@ -38,9 +58,30 @@ public:
     void mouseDown(float xRatio, bool isLeft) override;
     
 private:
+    // Timer
+    void timerCallback() override;
+    
+    double getMinVisibleLength() const;
+    int getXOnRatio(double ratio) const;
+    double visibleStartRatio_, visibleEndRatio_;
+    bool followPlayhead_;
+    
     class WaveformView;
     std::unique_ptr<WaveformView> waveformView_;
     
+    class SpectrogramView;
+    std::unique_ptr<SpectrogramView> spectrogramView_;
+    std::unique_ptr<ToggleButton> spectrogramButton_;
+    MelissaLookAndFeel_StemToggleButton toggleButtonLaf_;
+    
+    void peaksBuilt(std::shared_ptr<MelissaWaveformPeaks> peaks);
+    
+    class ChordView;
+    std::unique_ptr<ChordView> chordView_;
+    
+    class MelodyView;
+    std::unique_ptr<MelodyView> melodyView_;
+    
     class Marker;
     std::unique_ptr<Component> markerBaseComponent_;
     std::vector<std::unique_ptr<Marker>> markers_;
@@ -51,6 +92,7 @@ private:
     
     std::vector<std::unique_ptr<Label>> timeLabels_;
     void arrangeTimeLabels() const;
+    bool isTimeLabelInView(const Label* label) const;
     
     std::unique_ptr<Label> posTooltip_;
     float timeSec_;
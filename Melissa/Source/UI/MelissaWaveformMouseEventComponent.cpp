@@ -24,38 +24,50 @@ void MelissaWaveformMouseEventComponent::removeListener(MelissaWaveformMouseEven
     }
 }
 
+void MelissaWaveformMouseEventComponent::setVisibleRange(double startRatio, double endRatio)
+{
+    visibleStartRatio_ = startRatio;
+    visibleEndRatio_ = endRatio;
+}
+
+float MelissaWaveformMouseEventComponent::getXRatio(const MouseEvent& event) const
+{
+    const double xRatio = std::clamp(event.x / static_cast<double>(getWidth()), 0.0, 1.0);
+    return static_cast<float>(visibleStartRatio_ + (visibleEndRatio_ - visibleStartRatio_) * xRatio);
+}
+
 void MelissaWaveformMouseEventComponent::MelissaWaveformMouseEventComponent::mouseDown(const MouseEvent& event)
 {
-    const float xRatio = std::clamp(event.x / static_cast<float>(getWidth()), 0.f, 1.f);
+    const float xRatio = getXRatio(event);
     for (auto&& l : listeners_) l->mouseDown(xRatio, event.mods.isLeftButtonDown());
 }
 
 void MelissaWaveformMouseEventComponent::MelissaWaveformMouseEventComponent::mouseUp(const MouseEvent& event)
 {
-    const float xRatio = std::clamp(event.x / static_cast<float>(getWidth()), 0.f, 1.f);
+    const float xRatio = getXRatio(event);
     for (auto&& l : listeners_) l->mouseUp(xRatio);
 }
 
 void MelissaWaveformMouseEventComponent::MelissaWaveformMouseEventComponent::mouseMove(const MouseEvent& event)
 {
-    const float xRatio = std::clamp(event.x / static_cast<float>(getWidth()), 0.f, 1.f);
+    const float xRatio = getXRatio(event);
     for (auto&& l : listeners_) l->mouseMove(xRatio);
 }
 
 void MelissaWaveformMouseEventComponent::MelissaWaveformMouseEventComponent::mouseDrag(const MouseEvent& event)
 {
-    const float xRatio = std::clamp(event.x / static_cast<float>(getWidth()), 0.f, 1.f);
+    const float xRatio = getXRatio(event);
     for (auto&& l : listeners_) l->mouseDrag(xRatio);
 }
 
 void MelissaWaveformMouseEventComponent::mouseEnter(const MouseEvent& event)
 {
-    const float xRatio = std::clamp(event.x / static_cast<float>(getWidth()), 0.f, 1.f);
+    const float xRatio = getXRatio(event);
     for (auto&& l : listeners_) l->mouseEnter(xRatio);
 }
 
 void MelissaWaveformMouseEventComponent::mouseExit(const MouseEvent& event)
 {
-    const float xRatio = std::clamp(event.x / static_cast<float>(getWidth()), 0.f, 1.f);
+    const float xRatio = getXRatio(event);
     for (auto&& l : listeners_) l->mouseExit(xRatio);
 }
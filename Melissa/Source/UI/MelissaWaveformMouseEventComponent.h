@@ -26,11 +26,14 @@ public:
 class MelissaWaveformMouseEventComponent : public Component
 {
 public:
-    MelissaWaveformMouseEventComponent() {}
+    MelissaWaveformMouseEventComponent() : visibleStartRatio_(0.0), visibleEndRatio_(1.0) {}
     
     void addListener(MelissaWaveformMouseEventListener* listener);
     void removeListener(MelissaWaveformMouseEventListener* listener);
     
+    // The listeners receive the position in the song, not in this component
+    void setVisibleRange(double startRatio, double endRatio);
+    
     // Component
     void mouseDown(const MouseEvent& event) override;
     void mouseUp(const MouseEvent& event) override;
@@ -40,5 +43,8 @@ public:
     void mouseExit(const MouseEvent& event) override;
     
 private:
+    float getXRatio(const MouseEvent& event) const;
+    
     std::vector<MelissaWaveformMouseEventListener*> listeners_;
+    double visibleStartRatio_, visibleEndRatio_;
 };